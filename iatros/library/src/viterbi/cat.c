@@ -171,6 +171,8 @@ grammar_t * grammar_create_from_prefix(const grammar_t *base_grammar, const symb
 
   // copy all base grammar fields
   *grammar = *base_grammar;
+  grammar->block = NULL;
+  grammar->word_hash = NULL;
 
   grammar->vector = (state_grammar_t **) malloc(sizeof(state_grammar_t *));
   MEMTEST(grammar->vector);
@@ -326,6 +328,8 @@ grammar_t * grammar_create_conditioned_to_prefix(const grammar_t *base_grammar,
 
   // copy all base grammar fields
   *grammar = *base_grammar;
+  grammar->block = NULL;
+  grammar->word_hash = NULL;
 
   grammar->vector = (state_grammar_t **) malloc(sizeof(state_grammar_t *));
   MEMTEST(grammar->vector);
@@ -400,6 +404,8 @@ grammar_t * grammar_create_wordlist_from_prefix(const grammar_t *base_grammar, c
 
   // copy all base grammar fields
   *grammar = *base_grammar;
+  grammar->block = NULL;
+  grammar->word_hash = NULL;
 
   grammar->vector = (state_grammar_t **) malloc(sizeof(state_grammar_t *));
   MEMTEST(grammar->vector);
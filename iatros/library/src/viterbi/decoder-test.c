@@ -0,0 +1,515 @@
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <viterbi/viterbi.h>
+#include <viterbi/search.h>
+#include <viterbi/lattice.h>
+#include <viterbi/lex_tree.h>
+#include <viterbi/search_network.h>
+#include <viterbi/test_hmm.h>
+#include <viterbi/parsers/lex-parser/lex-driver.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define NUM_PHONEMES 60
+#define NUM_GAUSSIANS 4
+#define NUM_FEATURES 13
+#define NUM_WORDS 400
+/// number of bigram states of the n-gram grammar
+#define NUM_HISTORIES 10
+/// number of words of each sample
+#define SAMPLE_WORDS 6
+/// number of words of a sample long enough to collect the traces of the search network
+#define LONG_SAMPLE_WORDS 200
+/// number of samples decoded to compare two decoders
+#define NUM_SAMPLES 10
+/// seed of the random numbers of the decoder and of each test, so that the tests do not depend on each other
+#define TEST_SEED 1234
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float gaussian_noise() {
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/* Builds a grammar over the words of a decoder. The n-gram is a bigram with a unigram
+ * backoff state, whose single words can be expanded through a lexical tree. The finite-state
+ * grammar is a loop of all the words */
+static grammar_t *create_test_grammar(const decoder_t *decoder, bool is_ngram) {
+  grammar_t *grammar = grammar_create(decoder->lex, decoder->vocab);
+  grammar->start = grammar->pause = grammar->silence = VOCAB_NONE;
+  grammar->is_ngram = is_ngram;
+  grammar->end = VOCAB_NONE;
+  state_grammar_t *unigram = state_grammar_create();
+  grammar_append(grammar, unigram);
+  list_states_append(grammar->list_initial, unigram, 0);
+  list_states_append(grammar->list_end, unigram, 0);
+
+  char label[32];
+  if (!is_ngram) {
+    for (int w = 0; w < NUM_WORDS; w++) {
+      sprintf(label, "w%d", w);
+      state_grammar_append(unigram, extended_vocab_find_symbol(decoder->vocab, label),
+                           -log(NUM_WORDS) - (w % 7) * 0.1, unigram);
+    }
+    return grammar;
+  }
+
+  grammar->n = 2;
+  grammar->end = extended_vocab_find_symbol(decoder->vocab, "</s>");
+  state_grammar_t *histories[NUM_HISTORIES];
+  for (int h = 0; h < NUM_HISTORIES; h++) {
+    histories[h] = state_grammar_create();
+    grammar_append(grammar, histories[h]);
+    histories[h]->state_bo = unigram;
+    histories[h]->bo = -1;
+  }
+  for (int w = 0; w < NUM_WORDS; w++) {
+    sprintf(label, "w%d", w);
+    state_grammar_append(unigram, extended_vocab_find_symbol(decoder->vocab, label),
+                         -log(NUM_WORDS) - (w % 7) * 0.1, histories[w % NUM_HISTORIES]);
+  }
+  state_grammar_append(unigram, grammar->end, -2, unigram);
+  for (int h = 0; h < NUM_HISTORIES; h++) {
+    for (int k = 0; k < 30; k++) {
+      const int w = (h * 131 + k * 17) % NUM_WORDS;
+      sprintf(label, "w%d", w);
+      // the least probable ones are less probable than the backoff words
+      state_grammar_append(histories[h], extended_vocab_find_symbol(decoder->vocab, label), -3 - 0.2 * k, histories[w % NUM_HISTORIES]);
+    }
+    symbol_t name[2] = { (symbol_t) h, VOCAB_NONE };
+    state_grammar_set_name(histories[h], name);
+  }
+  return grammar;
+}
+
+/* Builds a decoder whose words have random pronunciations that share their first phonemes */
+static decoder_t *create_test_decoder(bool is_ngram) {
+  decoder_t *decoder = (decoder_t *) calloc(1, sizeof(decoder_t));
+  MEMTEST(decoder);
+  decoder->hmm = test_hmm_create(NUM_PHONEMES, NUM_GAUSSIANS, NUM_FEATURES, 3.0, false);
+  vocab_t *vocab = vocab_create(2 * NUM_WORDS, NULL);
+  decoder->vocab = extended_vocab_create(vocab, NULL, " ", NULL);
+  decoder->lex = lex_create(vocab, decoder->hmm);
+
+  char label[32];
+  for (int w = 0; w < NUM_WORDS; w++) {
+    sprintf(label, "w%d", w);
+    extended_vocab_insert_symbol(decoder->vocab, label, CATEGORY_NONE);
+    model_t *model = lex_model_create(label);
+    lex_append_model(decoder->lex, model);
+    const int length = 2 + rand() % 4;
+    lex_append_state(decoder->lex, model, 0);
+    model->initial = 0;
+    for (int k = 0; k < length; k++) {
+      const int phoneme = (k == 0) ? rand() % 6 : rand() % NUM_PHONEMES;
+      char phoneme_label[16];
+      sprintf(phoneme_label, "p%d", phoneme);
+      lex_append_state(decoder->lex, model, k + 1);
+      lex_append_edge(decoder->lex, model, phoneme_label, k, k + 1, 0);
+    }
+    model->end = length;
+  }
+  extended_vocab_insert_symbol(decoder->vocab, "</s>", CATEGORY_NONE);
+  // the final node of the lattices
+  extended_vocab_insert_symbol(decoder->vocab, "!NULL", CATEGORY_NONE);
+  decoder->grammar = create_test_grammar(decoder, is_ngram);
+
+  decoder->gsf = 10;
+  decoder->wip = -5;
+  decoder->gsf_in = decoder->gsf_out = 1;
+  decoder->histogram_pruning = 2000;
+  decoder->beam_pruning = 120;
+  decoder->pruning_engine = PE_HEAP;
+  decoder->do_acoustic_early_pruning = true;
+  decoder->frame_skip = 1;
+  decoder->emission_lookahead = 4;
+  decoder->search_threads = 1;
+  return decoder;
+}
+
+/* Draws the features of a sentence of random words. Each state of their phonemes
+ * emits one to three frames drawn from one of its gaussians */
+static features_t *create_test_sample(const decoder_t *decoder, int num_words) {
+  const hmm_t *hmm = decoder->hmm;
+  const packed_hmm_t *packed = hmm->packed;
+  features_t *features = (features_t *) calloc(1, sizeof(features_t));
+  MEMTEST(features);
+  features->type = FT_CC;
+  features->n_features = NUM_FEATURES;
+
+  for (int i = 0; i < num_words; i++) {
+    const model_t *model = decoder->lex->models[rand() % NUM_WORDS];
+    for (int k = 0; k < model->end; k++) {
+      const edge_t *edge = model->states[k]->edges[0];
+      for (int s = 0; s < 3; s++) {
+        const int state = hmm->phonemes[edge->phoneme]->states[s]->id;
+        const int g = packed->offsets[state] + rand() % (packed->offsets[state + 1] - packed->offsets[state]);
+        for (int n = 1 + rand() % 3; n > 0; n--) {
+          features_resize(features, features->n_vectors + 1);
+          float *frame = features->vector[features->n_vectors - 1];
+          for (int f = 0; f < NUM_FEATURES; f++) {
+            const size_t offset = (size_t) g * packed->stride + f;
+            frame[f] = packed->means[offset] + gaussian_noise() / sqrt(packed->inv_variances[offset]);
+          }
+        }
+      }
+    }
+  }
+  return features;
+}
+
+/* Decodes a sample and returns the number of times that the search and the lattice allocated memory */
+static int decode_allocations(search_t *search, const features_t *features, lattice_t *lattice) {
+  const int lattice_allocations = lattice->n_allocations;
+  search_clear(search);
+  lattice_clear(lattice);
+  decode(search, features, lattice);
+  return search->n_allocations + lattice->n_allocations - lattice_allocations;
+}
+
+/* Checks that a search does not allocate memory once it has decoded a sample as long as the
+ * next one, with and without the lexical tree and its look-ahead cache */
+static int test_allocations(decoder_t *decoder) {
+  srand(TEST_SEED);
+  features_t *samples[3];
+  for (int i = 0; i < 3; i++) samples[i] = create_test_sample(decoder, SAMPLE_WORDS);
+  int errors = 0;
+
+  for (int use_tree = 0; use_tree <= 1; use_tree++) {
+    decoder->lex_tree = use_tree ? lex_tree_create(decoder->lex, decoder->grammar) : NULL;
+    decoder->lm_lookahead_cache = use_tree ? 4 : 0;
+    search_t *search = search_create(decoder);
+    lattice_t *lattice = lattice_create(1, 1, decoder);
+    for (int i = 0; i < 3; i++) decode_allocations(search, samples[i], lattice);
+    // the first sample is decoded again, so it needs no memory
+    const int n_allocations = decode_allocations(search, samples[0], lattice);
+    printf("%-12s allocations in the second decoding of a sample: %d\n", use_tree ? "lexical tree" : "lexicon", n_allocations);
+    if (n_allocations != 0) errors++;
+    lattice_delete(lattice);
+    search_delete(search);
+    lex_tree_delete(decoder->lex_tree);
+    decoder->lex_tree = NULL;
+  }
+
+  for (int i = 0; i < 3; i++) features_delete(samples[i]);
+  return errors;
+}
+
+/* Decodes a sample and returns its best hypothesis as a string that must be freed */
+static char *decode_best(search_t *search, const features_t *features, lattice_t *lattice, float *score) {
+  search_clear(search);
+  lattice_clear(lattice);
+  decode(search, features, lattice);
+  symbol_t *symbols = NULL;
+  char *string = NULL;
+  *score = lattice_best_hyp(lattice, &symbols);
+  if (symbols != NULL) extended_vocab_symbols_to_string(symbols, search->decoder->vocab, &string);
+  free(symbols);
+  return (string != NULL) ? string : strdup("");
+}
+
+/* Checks that the search network finds the same best hypothesis and score as the decoder
+ * on the same finite-state grammar, and compares their speed. The last sample is long, so
+ * the search network collects its word traces while decoding it */
+static int test_search_network(decoder_t *decoder) {
+  srand(TEST_SEED);
+  grammar_delete(decoder->grammar);
+  decoder->grammar = create_test_grammar(decoder, false);
+  search_network_t *network = search_network_create(decoder);
+  search_network_decoder_t *network_decoder = search_network_decoder_create(network, decoder->hmm, decoder->beam_pruning);
+  search_t *search = search_create(decoder);
+  lattice_t *lattice = lattice_create(1, 1, decoder);
+  double search_time = 0, network_time = 0;
+  int errors = 0;
+
+  for (int i = 0; i < NUM_SAMPLES; i++) {
+    features_t *features = create_test_sample(decoder, (i < NUM_SAMPLES - 1) ? SAMPLE_WORDS : LONG_SAMPLE_WORDS);
+    double start = now();
+    float search_score;
+    char *search_best = decode_best(search, features, lattice, &search_score);
+    search_time += now() - start;
+
+    start = now();
+    int *labels, num_labels;
+    const float network_score = search_network_decode(network_decoder, features, &labels, &num_labels);
+    network_time += now() - start;
+    char *network_best = (char *) calloc(num_labels * 32 + 1, sizeof(char));
+    MEMTEST(network_best);
+    for (int l = 0; l < num_labels; l++) {
+      if (l > 0) strcat(network_best, " ");
+      strcat(network_best, network->labels[labels[l]]);
+    }
+
+    if (strcmp(search_best, network_best) != 0 || fabs(search_score - network_score) > 1e-4 * fabs(search_score)) {
+      printf("sample %d: decoder |%s| %g, search network |%s| %g\n", i, search_best, search_score, network_best, network_score);
+      errors++;
+    }
+    free(labels);
+    free(network_best);
+    free(search_best);
+    features_delete(features);
+  }
+  printf("search network: %d samples, decoder %.3f s, search network %.3f s\n", NUM_SAMPLES, search_time, network_time);
+
+  lattice_delete(lattice);
+  search_delete(search);
+  search_network_decoder_delete(network_decoder);
+  search_network_delete(network);
+  return errors;
+}
+
+/* Checks that two lattices have the same states and the same edges in the same order,
+ * including the states from which the final state cannot be reached */
+static bool lattices_equal(const lattice_t *a, const lattice_t *b) {
+  if (a->num_elements != b->num_elements) return false;
+  for (int i = 0; i < a->num_elements; i++) {
+    const lat_state_t *x = a->vector[i], *y = b->vector[i];
+    if (x->state != y->state || x->t != y->t || x->num_words != y->num_words) return false;
+    for (int j = 1; j <= x->num_words; j++) {
+      const lat_hyp_t *u = x->words[j], *v = y->words[j];
+      if (u->index != v->index || u->word != v->word || u->extended != v->extended
+          || memcmp(&u->probability, &v->probability, sizeof(probability_t)) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* Checks that the search threads produce the same lattices as a single thread,
+ * with and without the lexical tree */
+static int test_search_threads(decoder_t *decoder) {
+  srand(TEST_SEED);
+  features_t *samples[NUM_SAMPLES];
+  for (int i = 0; i < NUM_SAMPLES; i++) samples[i] = create_test_sample(decoder, SAMPLE_WORDS);
+  int errors = 0;
+
+  for (int use_tree = 0; use_tree <= 1; use_tree++) {
+    decoder->lex_tree = use_tree ? lex_tree_create(decoder->lex, decoder->grammar) : NULL;
+    decoder->lm_lookahead_cache = use_tree ? 4 : 0;
+    decoder->search_threads = 1;
+    search_t *search = search_create(decoder);
+    decoder->search_threads = 4;
+    search_t *threaded_search = search_create(decoder);
+    decoder->search_threads = 1;
+    lattice_t *lattice = lattice_create(4, 4, decoder), *threaded_lattice = lattice_create(4, 4, decoder);
+    int n_different = 0;
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+      decode_allocations(search, samples[i], lattice);
+      decode_allocations(threaded_search, samples[i], threaded_lattice);
+      if (!lattices_equal(lattice, threaded_lattice)) n_different++;
+    }
+    printf("%-12s lattices that change with 4 search threads: %d of %d\n", use_tree ? "lexical tree" : "lexicon", n_different, NUM_SAMPLES);
+    errors += n_different;
+    lattice_delete(threaded_lattice);
+    lattice_delete(lattice);
+    search_delete(threaded_search);
+    search_delete(search);
+    lex_tree_delete(decoder->lex_tree);
+    decoder->lex_tree = NULL;
+  }
+
+  for (int i = 0; i < NUM_SAMPLES; i++) features_delete(samples[i]);
+  return errors;
+}
+
+/* Decodes the same samples with the words of the backoff states expanded one after the other
+ * and merged with different admissions, and compares their best hypotheses and their speed.
+ * The merged words can expand more words, so their score cannot be worse */
+static int test_successor_cache(decoder_t *decoder) {
+  srand(TEST_SEED);
+  static const int admissions[] = { 0, 1, 2, 4 };
+  const int num_admissions = sizeof(admissions) / sizeof(admissions[0]);
+  features_t *samples[NUM_SAMPLES];
+  for (int i = 0; i < NUM_SAMPLES; i++) samples[i] = create_test_sample(decoder, SAMPLE_WORDS);
+  char *expected[NUM_SAMPLES];
+  float expected_score[NUM_SAMPLES];
+  int errors = 0;
+
+  for (int a = 0; a < num_admissions; a++) {
+    decoder->successor_cache = (admissions[a] > 0) ? 4 : 0;
+    decoder->successor_admission = (admissions[a] > 0) ? admissions[a] : 1;
+    search_t *search = search_create(decoder);
+    lattice_t *lattice = lattice_create(1, 1, decoder);
+    int n_different = 0, n_worse = 0;
+    const double start = now();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+      float score;
+      char *best = decode_best(search, samples[i], lattice, &score);
+      if (a == 0) {
+        expected[i] = best;
+        expected_score[i] = score;
+        continue;
+      }
+      if (strcmp(best, expected[i]) != 0) n_different++;
+      if (score < expected_score[i] - 1e-4 * fabs(expected_score[i])) n_worse++;
+      free(best);
+    }
+    const double time = now() - start;
+    if (a == 0) printf("backoff walk:                  %.3f s\n", time);
+    else {
+      printf("merged words, admission %d: %.3f s, %d merges, %d of %d hypotheses change, %d worse\n", admissions[a], time,
+             search->successors->num_misses, n_different, NUM_SAMPLES, n_worse);
+    }
+    errors += n_worse;
+    lattice_delete(lattice);
+    search_delete(search);
+  }
+  decoder->successor_cache = 0;
+  decoder->successor_admission = 1;
+
+  for (int i = 0; i < NUM_SAMPLES; i++) {
+    free(expected[i]);
+    features_delete(samples[i]);
+  }
+  return errors;
+}
+
+/* Freezes an n-gram with states of every size and finds every word of the vocab in every
+ * state. The dense states are found in the table of the grammar, the small ones linearly and
+ * the unigram by direct access, and all of them must find the first word that a linear
+ * search over the words of the state finds */
+static int test_word_search(decoder_t *decoder) {
+  srand(TEST_SEED);
+  grammar_t *grammar = create_test_grammar(decoder, true);
+  const vocab_t *vocab = grammar->vocab->extended;
+  for (int n = 0; n <= 40; n += 4) {
+    state_grammar_t *state = state_grammar_create();
+    grammar_append(grammar, state);
+    state->state_bo = grammar->vector[0];
+    for (int k = 0; k < n; k++) state_grammar_append(state, (n * 37 + k * 11) % NUM_WORDS, -2 - 0.1 * k, state);
+    // a repeated word, which must not hide the first one
+    if (n > 0) state_grammar_append(state, state->words[0].word, -1, state);
+  }
+  grammar_freeze(grammar);
+  grammar_build_word_hash(grammar, vocab);
+  for (int i = 0; i < grammar->num_states; i++) {
+    if (grammar->vector[i]->search.type == SS_NO_SEARCH) {
+      state_grammar_build_word_search_secondary(grammar->vector[i], vocab);
+    }
+  }
+
+  int num_states[MAX_SS] = { 0 }, errors = 0;
+  for (int i = 0; i < grammar->num_states; i++) {
+    state_grammar_t *state = grammar->vector[i];
+    num_states[state->search.type]++;
+    for (symbol_t w = 0; w < vocab->last; w++) {
+      words_state_t *expected = NULL;
+      for (int m = 0; m < state->num_words && expected == NULL; m++) {
+        if (state->words[m].word == w) expected = &state->words[m];
+      }
+      if (state_grammar_find_secondary(state, w) != expected) errors++;
+    }
+  }
+  printf("word search: %d states in the table, %d linear, %d direct, %d words not found as linearly\n",
+         num_states[SS_HASH_SECONDARY], num_states[SS_LINEAR_SEARCH_SECONDARY], num_states[SS_DIRECT_ACCESS_SECONDARY], errors);
+  if (num_states[SS_HASH_SECONDARY] == 0 || num_states[SS_LINEAR_SEARCH_SECONDARY] == 0
+      || num_states[SS_DIRECT_ACCESS_SECONDARY] == 0) {
+    errors++;
+  }
+  grammar_delete(grammar);
+  return errors;
+}
+
+/* Checks that two n-grams have the same states, words and initial and end states, and that
+ * their probabilities differ less than a tolerance */
+static bool grammars_equal(const grammar_t *a, const grammar_t *b, float tolerance) {
+  if (a->num_states != b->num_states || a->list_initial->num_elements != b->list_initial->num_elements
+      || a->list_end->num_elements != b->list_end->num_elements) {
+    return false;
+  }
+  for (int i = 0; i < a->num_states; i++) {
+    const state_grammar_t *x = a->vector[i], *y = b->vector[i];
+    if (x->num_words != y->num_words || state_grammar_get_index(x->state_bo) != state_grammar_get_index(y->state_bo)
+        || fabs(x->bo - y->bo) > tolerance) {
+      return false;
+    }
+    int n = 0;
+    do {
+      if (x->name[n] != y->name[n]) return false;
+    } while (x->name[n++] != VOCAB_NONE);
+    for (int m = 0; m < x->num_words; m++) {
+      if (x->words[m].word != y->words[m].word || x->words[m].state_next->num_state != y->words[m].state_next->num_state
+          || fabs(x->words[m].prob - y->words[m].prob) > tolerance) {
+        return false;
+      }
+    }
+  }
+  for (int l = 0; l < a->list_initial->num_elements; l++) {
+    if (a->list_initial->vector[l].state->num_state != b->list_initial->vector[l].state->num_state) return false;
+  }
+  for (int l = 0; l < a->list_end->num_elements; l++) {
+    if (a->list_end->vector[l].state->num_state != b->list_end->vector[l].state->num_state) return false;
+  }
+  return true;
+}
+
+/* Saves the n-gram of the decoder in binary format with every number of bits and loads it back.
+ * With floats, the loaded n-gram must be equal and produce the same lattices */
+static int test_binary_ngram(decoder_t *decoder) {
+  srand(TEST_SEED);
+  static const int bits[] = { 32, 16, 8 };
+  grammar_t *grammar = decoder->grammar;
+  int errors = 0;
+
+  for (size_t b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+    FILE *file = tmpfile();
+    CHECK_SYS_ERROR(file != NULL, "Couldn't create a temporary file\n");
+    grammar_write_binary_ngram(grammar, file, bits[b]);
+    rewind(file);
+    grammar_t *loaded = grammar_create(decoder->lex, decoder->vocab);
+    loaded->start = grammar->start;
+    loaded->end = grammar->end;
+    loaded->pause = grammar->pause;
+    loaded->silence = grammar->silence;
+    grammar_load(loaded, file, BINARY_NGRAM_GRAMMAR);
+    fclose(file);
+
+    // 8 bits leave 256 values for the probabilities of each order
+    const bool is_equal = grammars_equal(grammar, loaded, (bits[b] == 32) ? 0 : (bits[b] == 16) ? 1e-3 : 0.1);
+    int n_different = 0;
+    if (bits[b] == 32) {
+      features_t *features = create_test_sample(decoder, SAMPLE_WORDS);
+      search_t *search = search_create(decoder);
+      lattice_t *lattice = lattice_create(4, 4, decoder);
+      decode_allocations(search, features, lattice);
+      decoder->grammar = loaded;
+      search_t *loaded_search = search_create(decoder);
+      lattice_t *loaded_lattice = lattice_create(4, 4, decoder);
+      decode_allocations(loaded_search, features, loaded_lattice);
+      decoder->grammar = grammar;
+      if (!lattices_equal(lattice, loaded_lattice)) n_different++;
+      lattice_delete(loaded_lattice);
+      search_delete(loaded_search);
+      lattice_delete(lattice);
+      search_delete(search);
+      features_delete(features);
+    }
+    printf("binary n-gram, %2d bits: %s%s\n", bits[b], is_equal ? "loaded back" : "the loaded n-gram differs",
+           n_different ? ", the lattice changes" : "");
+    if (!is_equal) errors++;
+    errors += n_different;
+    grammar_delete(loaded);
+  }
+  return errors;
+}
+
+/* Tests the decoder on a synthetic task */
+int main (int UNUSED(argc), char *UNUSED(argv[])) {
+  srand(TEST_SEED);
+  decoder_t *decoder = create_test_decoder(true);
+  int errors = test_allocations(decoder);
+  errors += test_search_threads(decoder);
+  errors += test_successor_cache(decoder);
+  errors += test_binary_ngram(decoder);
+  errors += test_word_search(decoder);
+  errors += test_search_network(decoder);
+  decoder_delete(decoder);
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
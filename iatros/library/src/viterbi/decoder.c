@@ -117,6 +117,22 @@ decoder_t * decoder_create_from_args(const args_t *args) {
   decoder->do_acoustic_early_pruning = args_get_bool(args, DECODER_MODULE_NAME".do-acoustic-early-pruning", &error);
   decoder->histogram_pruning = args_get_float(args, DECODER_MODULE_NAME".histogram-pruning", &error);
   decoder->beam_pruning = args_get_float(args, DECODER_MODULE_NAME".beam", &error);
+  {
+    const char *pruning_str = args_get_string(args, DECODER_MODULE_NAME".pruning", &error);
+    decoder->pruning_engine = (error == ARG_OK) ? get_pruning_engine(pruning_str) : PE_HEAP;
+    REQUIRE(decoder->pruning_engine != MAX_PRUNING_ENGINE, "Unknown pruning engine '%s'", pruning_str);
+  }
+
+  decoder->adaptive_beam_hyps = args_get_int(args, DECODER_MODULE_NAME".adaptive-beam-hypotheses", &error);
+  if (error != ARG_OK) decoder->adaptive_beam_hyps = 0;
+  decoder->adaptive_beam_time = args_get_float(args, DECODER_MODULE_NAME".adaptive-beam-time", &error) / 1000.0;
+  if (error != ARG_OK) decoder->adaptive_beam_time = 0;
+  decoder->adaptive_beam_min = args_get_float(args, DECODER_MODULE_NAME".adaptive-beam-min", &error);
+  if (error != ARG_OK) decoder->adaptive_beam_min = 0;
+  decoder->adaptive_beam_max = args_get_float(args, DECODER_MODULE_NAME".adaptive-beam-max", &error);
+  if (error != ARG_OK) decoder->adaptive_beam_max = decoder->beam_pruning;
+  REQUIRE(decoder->adaptive_beam_hyps >= 0 && decoder->adaptive_beam_time >= 0, "The targets of the adaptive beam must not be negative");
+  REQUIRE(decoder->adaptive_beam_min <= decoder->adaptive_beam_max, "The minimum adaptive beam is greater than the maximum one");
 
   grammar_type_t grammar_type = NGRAM_GRAMMAR;
   {
@@ -172,6 +188,97 @@ decoder_t * decoder_create_from_args(const args_t *args) {
   hmm_load(decoder->hmm, file);
   smart_fclose(file);
 
+  {
+    const char *log_add_str = args_get_string(args, DECODER_MODULE_NAME".log-add", &error);
+    log_add_t log_add = get_log_add_type(log_add_str);
+    REQUIRE(error == ARG_OK && log_add != MAX_LOG_ADD_TYPE, "Unknown log-add type '%s'", log_add_str);
+    hmm_set_log_add(decoder->hmm, log_add);
+  }
+
+  {
+    int num_codewords = args_get_int(args, DECODER_MODULE_NAME".gaussian-selection-codebook", &error);
+    if (error == ARG_OK && num_codewords > 0) {
+      TRACE(1, "Building gaussian selection codebook...\n");
+      int shortlist_size = args_get_int(args, DECODER_MODULE_NAME".gaussian-selection-shortlist", &error);
+      float floor = args_get_float(args, DECODER_MODULE_NAME".gaussian-selection-floor", &error);
+      decoder->gaussian_selection = gaussian_selection_create(decoder->hmm->packed, num_codewords, shortlist_size, floor);
+    }
+  }
+
+  value = args_get_string(args, DECODER_MODULE_NAME".quantized-hmm", &error);
+  if (error == ARG_OK && value != NULL) {
+    file = smart_fopen(value, "r");
+    CHECK_SYS_ERROR(file != NULL, "Couldn't open quantized hmm file '%s'\n", value);
+    decoder->quantized_hmm = quantized_hmm_load(file);
+    smart_fclose(file);
+    const packed_hmm_t *packed = decoder->hmm->packed;
+    REQUIRE(decoder->quantized_hmm->num_states == packed->num_states
+            && decoder->quantized_hmm->num_features == packed->num_features
+            && memcmp(decoder->quantized_hmm->offsets, packed->offsets, (packed->num_states + 1) * sizeof(int)) == 0,
+            "The quantized hmm '%s' does not match the HMM models", value);
+  }
+  else {
+    const char *quantization_str = args_get_string(args, DECODER_MODULE_NAME".quantization", &error);
+    quantization_t quantization = (error == ARG_OK) ? get_quantization_type(quantization_str) : QT_NONE;
+    REQUIRE(quantization != MAX_QUANTIZATION_TYPE, "Unknown quantization type '%s'", quantization_str);
+    if (quantization != QT_NONE) {
+      TRACE(1, "Quantizing HMM models...\n");
+      decoder->quantized_hmm = quantized_hmm_create(decoder->hmm->packed, quantization);
+    }
+  }
+  REQUIRE(decoder->quantized_hmm == NULL || decoder->gaussian_selection == NULL,
+          "Quantized models cannot be combined with gaussian selection");
+  if (decoder->quantized_hmm != NULL) {
+    // the search only reads the quantized gaussians
+    const size_t released = hmm_release_gaussians(decoder->hmm);
+    TRACE(1, "Quantized gaussians: %zu bytes resident, %zu bytes of float gaussians released\n",
+          quantized_hmm_size(decoder->quantized_hmm), released);
+  }
+
+  decoder->frame_skip = args_get_int(args, DECODER_MODULE_NAME".frame-skip", &error);
+  if (error != ARG_OK) decoder->frame_skip = 1;
+  decoder->frame_skip_threshold = args_get_float(args, DECODER_MODULE_NAME".frame-skip-threshold", &error);
+  if (error != ARG_OK) decoder->frame_skip_threshold = 0;
+  REQUIRE(decoder->frame_skip >= 0, "The frame skip must not be negative");
+  REQUIRE(decoder->frame_skip != 0 || decoder->frame_skip_threshold > 0, "A frame skip of 0 requires a frame skip threshold");
+
+  decoder->emission_threads = args_get_int(args, DECODER_MODULE_NAME".emission-threads", &error);
+  if (error != ARG_OK) decoder->emission_threads = 0;
+  decoder->emission_lookahead = args_get_int(args, DECODER_MODULE_NAME".emission-lookahead", &error);
+  if (error != ARG_OK) decoder->emission_lookahead = 4;
+  decoder->emission_active_set = args_get_bool(args, DECODER_MODULE_NAME".emission-active-set", &error);
+  if (error != ARG_OK) decoder->emission_active_set = false;
+  if (decoder->emission_threads > 0) {
+    // the workers compute the same emissions that the search would compute lazily
+    REQUIRE(decoder->emission_lookahead > 0, "The emission lookahead must be positive");
+    REQUIRE(decoder->gaussian_selection == NULL, "Emission threads cannot be combined with gaussian selection");
+    REQUIRE(decoder->frame_skip == 1, "Emission threads cannot be combined with frame skipping");
+  }
+
+  decoder->search_threads = args_get_int(args, DECODER_MODULE_NAME".search-threads", &error);
+  if (error != ARG_OK) decoder->search_threads = 1;
+  REQUIRE(decoder->search_threads > 0, "The number of search threads must be positive");
+
+  decoder->do_partial_distance = args_get_bool(args, DECODER_MODULE_NAME".partial-distance", &error);
+  if (error == ARG_OK && decoder->do_partial_distance) {
+    // bounded emissions are only valid in the frame in which they are computed
+    REQUIRE(decoder->frame_skip == 1, "Partial distance cannot be combined with frame skipping");
+    REQUIRE(decoder->quantized_hmm == NULL, "Partial distance cannot be combined with quantized models");
+    REQUIRE(decoder->emission_threads == 0, "Partial distance cannot be combined with emission threads");
+    REQUIRE(decoder->search_threads == 1, "Partial distance cannot be combined with search threads");
+    hmm_enable_partial_distance(decoder->hmm);
+  }
+  else {
+    decoder->do_partial_distance = false;
+  }
+
+  decoder->successor_cache = args_get_int(args, DECODER_MODULE_NAME".successor-cache", &error);
+  if (error != ARG_OK) decoder->successor_cache = 0;
+  REQUIRE(decoder->successor_cache >= 0, "The successor cache must not be negative");
+  decoder->successor_admission = args_get_int(args, DECODER_MODULE_NAME".successor-admission", &error);
+  if (error != ARG_OK) decoder->successor_admission = 2;
+  REQUIRE(decoder->successor_admission > 0, "The successor admission must be positive");
+
   TRACE(1, "Loading lexicon...\n");
   //Create vocab
   value = args_get_string(args, DECODER_MODULE_NAME".unk", &error);
@@ -331,6 +438,7 @@ decoder_t * decoder_create_from_args(const args_t *args) {
   file = smart_fopen(value, "r");
   CHECK_SYS_ERROR(file != NULL, "Couldn't open grammar file '%s'\n", value);
   grammar_load(decoder->grammar, file, grammar_type);
+  TRACE(1, "Grammar: %d states, %zu bytes resident\n", decoder->grammar->num_states, grammar_size(decoder->grammar));
 
   smart_fclose(file);
 
@@ -380,6 +488,24 @@ decoder_t * decoder_create_from_args(const args_t *args) {
   // insert !NULL symbol for lattices
   extended_vocab_insert_symbol(vocab, "!NULL", CATEGORY_NONE);
 
+  if (args_get_bool(args, DECODER_MODULE_NAME".lexical-tree", &error) && error == ARG_OK) {
+    REQUIRE(decoder->grammar->is_ngram && decoder->categories == NULL
+            && decoder->input_grammar == NULL && decoder->output_grammar == NULL,
+            "The lexical tree needs an n-gram without categories nor input and output grammars");
+    TRACE(1, "Building lexical tree...\n");
+    decoder->lex_tree = lex_tree_create(decoder->lex, decoder->grammar);
+
+    decoder->lm_lookahead_cache = args_get_int(args, DECODER_MODULE_NAME".lm-lookahead-cache", &error);
+    if (error != ARG_OK) decoder->lm_lookahead_cache = 0;
+    REQUIRE(decoder->lm_lookahead_cache >= 0, "The look-ahead cache must not be negative");
+    if (decoder->lm_lookahead_cache > 0) {
+      // the search and each of its threads keep their own cache
+      const int num_caches = 1 + ((decoder->search_threads > 1) ? decoder->search_threads : 0);
+      TRACE(1, "Look-ahead caches: %d of up to %zu bytes\n", num_caches,
+            (size_t) decoder->lm_lookahead_cache * decoder->lex_tree->num_nodes * sizeof(float));
+    }
+  }
+
   return decoder;
 }
 
@@ -418,7 +544,10 @@ void categories_delete(categories_t * categories){
 void decoder_delete(decoder_t *decoder) {
   if (decoder->input_grammar != NULL) grammar_delete(decoder->input_grammar);
   if (decoder->output_grammar != NULL) grammar_delete(decoder->output_grammar);
+  lex_tree_delete(decoder->lex_tree);
   grammar_delete(decoder->grammar);
+  gaussian_selection_delete(decoder->gaussian_selection);
+  quantized_hmm_delete(decoder->quantized_hmm);
   hmm_delete(decoder->hmm);
   extended_vocab_delete(decoder->vocab);
   lex_delete(decoder->lex);
@@ -9,6 +9,10 @@
 #define DECODER_H_
 
 #include <iatros/grammar.h>
+#include <iatros/gaussian_selection.h>
+#include <iatros/quantized_hmm.h>
+#include <iatros/heap.h>
+#include <iatros/lex_tree.h>
 #include <prhlt/args.h>
 
 #ifdef __cplusplus
@@ -23,7 +27,7 @@ static const arg_module_t decoder_module = { DECODER_MODULE_NAME, "decoder modul
         {"lexicon", ARG_FILE, NULL, ARG_FLAGS_NONE, "Lexicon file"},
         {"lexicon-type", ARG_STRING, "ATROS", ARG_FLAGS_NONE, "Lexicon format (ATROS, HTK)"},
         {"grammar", ARG_FILE, NULL, ARG_FLAGS_NONE, "Main grammar"},
-        {"grammar-type", ARG_STRING, "NGRAM", ARG_FLAGS_NONE, "Type of the main grammar (FSM, NGRAM). NGRAM by default"},
+        {"grammar-type", ARG_STRING, "NGRAM", ARG_FLAGS_NONE, "Type of the main grammar (FSM, NGRAM, BINARY_NGRAM). NGRAM by default"},
         {"input-grammar", ARG_FILE, NULL, ARG_FLAGS_NONE, "Input grammar"},
         {"output-grammar", ARG_FILE, NULL, ARG_FLAGS_NONE, "Output grammar"},
 
@@ -45,12 +49,35 @@ static const arg_module_t decoder_module = { DECODER_MODULE_NAME, "decoder modul
         {"word-separator", ARG_STRING, NULL, ARG_FLAGS_NONE, "String that separates words in a language phrase, i.e. '_'. Disabled by default."},
 
         {"histogram-pruning", ARG_INT, "10000", ARG_FLAGS_NONE, "Maximum number of hypotheses allowed by frame."},
+        {"pruning", ARG_STRING, "HEAP", ARG_FLAGS_NONE, "How histogram pruning is applied (HEAP, SELECTION). HEAP keeps a min-heap of the hypotheses, SELECTION selects the best ones when its buffer gets full. HEAP by default"},
+        {"adaptive-beam-hypotheses", ARG_INT, "0", ARG_FLAGS_NONE, "Adapts the beam of each frame so that about this number of hypotheses are active. '0' disables it"},
+        {"adaptive-beam-time", ARG_FLOAT, "0", ARG_FLAGS_NONE, "Adapts the beam of each frame so that each frame takes about these milliseconds. '0' disables it"},
+        {"adaptive-beam-min", ARG_FLOAT, "0", ARG_FLAGS_NONE, "Minimum beam allowed by the adaptive beam. '0' by default"},
+        {"adaptive-beam-max", ARG_FLOAT, NULL, ARG_FLAGS_NONE, "Maximum beam allowed by the adaptive beam. The adaptive beam starts from the beam, which is the maximum by default"},
 
         {"phrase-table", ARG_FILE, NULL, ARG_FLAGS_NONE, "Phrase table in moses format"},
         {"weights", ARG_STRING, NULL, ARG_FLAGS_NONE, "Weights for the log-lineal model in the phrase table separated by commas"},
 
         {"do-acoustic-early-pruning", ARG_BOOL, "true", ARG_FLAGS_NONE, "Enables acoustic early pruning"},
         {"create-dummy-acoustic-models", ARG_BOOL, NULL, ARG_FLAGS_NONE, "Enables the creation of dummy acoustic models"},
+        {"log-add", ARG_STRING, "EXACT", ARG_FLAGS_NONE, "How the gaussians of a mixture are added (EXACT, TABLE, POLY, MAX). EXACT by default"},
+        {"gaussian-selection-codebook", ARG_INT, "0", ARG_FLAGS_NONE, "Number of codewords used to select the gaussians evaluated in each frame. '0' disables gaussian selection"},
+        {"gaussian-selection-shortlist", ARG_INT, "4", ARG_FLAGS_NONE, "Number of codewords nearest to each frame whose gaussians are evaluated"},
+        {"gaussian-selection-floor", ARG_FLOAT, "-1000", ARG_FLAGS_NONE, "Log-density given to the gaussians that are not selected"},
+        {"quantization", ARG_STRING, "NONE", ARG_FLAGS_NONE, "Stores and scores the gaussians as integers (NONE, INT16, INT8). NONE by default"},
+        {"quantized-hmm", ARG_FILE, NULL, ARG_FLAGS_NONE, "Quantized gaussians of the HMM models, saved by iatros-hmm-quantize. It overrides quantization"},
+        {"frame-skip", ARG_INT, "1", ARG_FLAGS_NONE, "Maximum number of consecutive frames that share the emissions of the first one. '1' computes every frame, '0' leaves it to frame-skip-threshold"},
+        {"frame-skip-threshold", ARG_FLOAT, "0", ARG_FLAGS_NONE, "With frame-skip, emissions are computed again when the RMS difference between the features and those of the last computed frame exceeds this value. '0' disables it"},
+        {"emission-threads", ARG_INT, "0", ARG_FLAGS_NONE, "Number of threads that compute the emissions of the next frames while the search expands the current one. '0' disables them"},
+        {"emission-lookahead", ARG_INT, "4", ARG_FLAGS_NONE, "Number of frames after the current one whose emissions can be computed in advance"},
+        {"emission-active-set", ARG_BOOL, "false", ARG_FLAGS_NONE, "Compute in advance only the states needed in the last frame instead of all the states"},
+        {"search-threads", ARG_INT, "1", ARG_FLAGS_NONE, "Number of threads that expand the hypotheses of each frame. The result does not depend on it"},
+        {"partial-distance", ARG_BOOL, "false", ARG_FLAGS_NONE, "Abandons the evaluation of the gaussians that cannot reach the beam. It is only worth trying with narrow beams (see gaussian-benchmark). It assumes that language model scores are log-probabilities"},
+        {"lexical-tree", ARG_BOOL, "false", ARG_FLAGS_NONE, "Expands the words of an n-gram through a prefix tree of their pronunciations, so that words with the same first phonemes share their hypotheses"},
+        {"lm-lookahead-cache", ARG_INT, "64", ARG_FLAGS_NONE, "With lexical-tree, number of n-gram states whose language model look-ahead scores are kept. The search and each of its search-threads keep their own cache of this size. '0' disables the look-ahead"},
+
+        {"successor-cache", ARG_INT, "0", ARG_FLAGS_NONE, "With an n-gram without categories, number of states whose words are kept merged with the ones of their backoff states and sorted by probability. '0' expands the backoff states one after the other"},
+        {"successor-admission", ARG_INT, "2", ARG_FLAGS_NONE, "With successor-cache, number of times that a state must be expanded before its words are merged. Until then, its backoff states are expanded one after the other"},
 
         {"categories", ARG_FILE, NULL, ARG_FLAGS_NONE, "List of the categories with the associated grammars"},
         {NULL, ARG_END_MODULE, NULL, ARG_FLAGS_NONE, NULL}
@@ -89,6 +116,11 @@ typedef struct decoder_t {
   float wip_out;         ///< Word Insertion Penalty for output words
   int histogram_pruning; ///< Maximum number of hypotheses per frame
   float beam_pruning;    ///< Relative pruning w.r.t. the maximum hypothesis
+  pruning_engine_t pruning_engine; ///< How histogram pruning is applied
+  int adaptive_beam_hyps;    ///< If > 0, the beam of each frame is adapted to keep about this number of hypotheses
+  float adaptive_beam_time;  ///< If > 0, the beam of each frame is adapted so that a frame takes about these seconds
+  float adaptive_beam_min;   ///< Minimum beam allowed by the adaptive beam
+  float adaptive_beam_max;   ///< Maximum beam allowed by the adaptive beam
   bool do_acoustic_early_pruning; /**< If the acoustic early pruning is enabled or not.
                                      *  In this mode, before language model expansions,
                                      *  an estimation of the best acoustic score is
@@ -96,6 +128,25 @@ typedef struct decoder_t {
                                      *  so far, for the current feature vector. This estimate
                                      *  is used to prune the hypothesis before expanding
                                      *  the word */
+  gaussian_selection_t *gaussian_selection; ///< If != NULL, only the gaussians selected in each frame are evaluated
+  quantized_hmm_t *quantized_hmm; ///< If != NULL, emissions are computed with these quantized gaussians
+  int frame_skip;           /**< Maximum number of consecutive frames that share their emissions.
+                              *  1 disables frame skipping, 0 sets no maximum */
+  float frame_skip_threshold; ///< If > 0, emissions are computed again when the features change more than this
+  int emission_threads;     ///< Number of threads computing emissions in advance. 0 disables them
+  int emission_lookahead;   ///< Number of frames whose emissions can be computed in advance
+  bool emission_active_set; ///< If true, only the states needed in the last frame are computed in advance
+  int search_threads;       ///< Number of threads that expand the hypotheses of each frame. 1 disables them
+  bool do_partial_distance; /**< If enabled, the evaluation of a gaussian stops as soon as its
+                              *  partial distance shows that the emission cannot keep any
+                              *  hypothesis inside the beam of the current frame */
+  lex_tree_t *lex_tree;     /**< If != NULL, the single input words of the n-gram are expanded
+                              *  through this prefix tree and their language model probability
+                              *  is applied when their pronunciation ends */
+  int lm_lookahead_cache;   /**< Number of grammar states whose look-ahead scores over the lexical tree are kept
+                              *  by the search and by each search thread. 0 disables the look-ahead */
+  int successor_cache;      ///< Number of n-gram states whose words are kept merged with the ones of their backoff states. 0 disables the merge
+  int successor_admission;  ///< Number of times that a state must be expanded before its words are merged
 
 } decoder_t;
 
@@ -0,0 +1,296 @@
+/*
+ * emission_pipeline.c
+ *
+ *  Worker threads that compute the emissions of the next frames while the search
+ *  expands the current one
+ */
+
+#include <viterbi/emission_pipeline.h>
+#include <viterbi/thread_pool.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <prhlt/utils.h>
+#include <pthread.h>
+#include <string.h>
+
+/// Who owns the frame of a slot. Frames without a slot are pending
+typedef enum {
+  FRAME_RUNNING,     ///< a worker is computing it
+  FRAME_DONE         ///< it belongs to the search. Missing emissions are computed lazily
+} frame_status_t;
+
+/// Emissions of a frame computed in advance
+typedef struct {
+  int frame;              ///< frame that owns the slot, or -1
+  frame_status_t status;  ///< status of the frame
+  float *emissions;       ///< emissions of the frame when the search has no emission cache
+  int *states;            ///< states computed in advance
+  int n_states;           ///< number of states computed in advance. -1 means all the states
+} emission_slot_t;
+
+/** Pool of threads that compute the emissions ahead of the search.
+ * Workers take the pending frames inside the lookahead window after the frame of the
+ * search. When the search reaches a frame, it waits for the worker computing it or
+ * takes it if no worker has started it. A frame is never written by a worker and by
+ * the search at the same time, and both compute the same values, so the results of
+ * the search do not change.
+ * Each frame of the window has a slot in a ring of lookahead + 1 slots. A slot is
+ * reused when the search has moved past its frame, so unless the search shares an
+ * emission cache, the workers only need the memory of the slots whatever the length
+ * of the sample. The threads are created with the pipeline and sleep between samples
+ */
+struct emission_pipeline {
+  const hmm_t *hmm;                ///< acoustic model
+  const quantized_hmm_t *qhmm;     ///< quantized gaussians. If != NULL, emissions are computed with them
+  int lookahead;                   ///< number of frames after the frame of the search that workers can take
+  bool use_active_set;             ///< if true, workers only compute the states active in the last frame
+
+  thread_pool_t *pool;             ///< workers, which are threads 1 to num_threads of the pool
+  int16_t *qdata;                  ///< quantized features of each worker
+  pthread_mutex_t mutex;           ///< protects the fields below
+  pthread_cond_t cond;             ///< signals changes in the status of the frames
+  bool running;                    ///< if the workers are running
+  bool stop;                       ///< asks the workers to finish
+
+  const features_t *features;      ///< features being decoded
+  vector_t *emission_cache;        ///< emissions of each frame, or NULL to store them in the slots
+  int first_new_frame;             ///< frames before this one are already in the emission cache
+  emission_slot_t *slots;          ///< ring of slots. Frame f uses the slot f % (lookahead + 1)
+  int search_frame;                ///< last frame taken by the search
+
+  int *active_states;              ///< states computed in the last frame finished by the search
+  int n_active_states;             ///< number of active states. -1 means all the states
+  int *next_active_states;         ///< buffer to collect the active states outside the lock
+};
+
+/** Returns the slot of a frame
+ * @param pipeline the pipeline
+ * @param frame the frame
+ * @return the slot
+ */
+static emission_slot_t *emission_pipeline_slot(const emission_pipeline_t *pipeline, int frame) {
+  return &pipeline->slots[frame % (pipeline->lookahead + 1)];
+}
+
+/** Returns the first pending frame inside the lookahead window. The mutex must be locked
+ * @param pipeline the pipeline
+ * @return the frame or -1 if there is none
+ */
+static int emission_pipeline_next_frame(const emission_pipeline_t *pipeline) {
+  int last = pipeline->search_frame + pipeline->lookahead;
+  if (last >= pipeline->features->n_vectors) last = pipeline->features->n_vectors - 1;
+  int first = pipeline->search_frame + 1;
+  if (first < pipeline->first_new_frame) first = pipeline->first_new_frame;
+  for (int f = first; f <= last; f++) {
+    if (emission_pipeline_slot(pipeline, f)->frame != f) return f;
+  }
+  return -1;
+}
+
+/** Main loop of the workers
+ * @param arg the pipeline
+ * @param thread index of the worker in the pool
+ */
+static void emission_pipeline_worker(void *arg, int thread) {
+  emission_pipeline_t *pipeline = (emission_pipeline_t *) arg;
+  const hmm_t *hmm = pipeline->hmm;
+  int16_t *qdata = NULL;
+  if (pipeline->qhmm != NULL) qdata = pipeline->qdata + (size_t) (thread - 1) * pipeline->qhmm->stride;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  while (!pipeline->stop) {
+    const int frame = emission_pipeline_next_frame(pipeline);
+    if (frame < 0) {
+      pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+      continue;
+    }
+    emission_slot_t *slot = emission_pipeline_slot(pipeline, frame);
+    slot->frame = frame;
+    slot->status = FRAME_RUNNING;
+    slot->n_states = pipeline->n_active_states;
+    if (slot->n_states >= 0) memcpy(slot->states, pipeline->active_states, slot->n_states * sizeof(int));
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    float *t_probability = slot->emissions;
+    if (pipeline->emission_cache != NULL) t_probability = (float *) pipeline->emission_cache->data[frame];
+    const float *feat_vec = pipeline->features->vector[frame];
+    if (qdata != NULL) quantized_hmm_quantize_features(pipeline->qhmm, feat_vec, qdata);
+    const int n = (slot->n_states >= 0) ? slot->n_states : hmm->num_states;
+    for (int i = 0; i < n; i++) {
+      const int s = (slot->n_states >= 0) ? slot->states[i] : i;
+      if (qdata != NULL) {
+        t_probability[s] = quantized_hmm_log_emission(pipeline->qhmm, hmm->log_add, s, qdata);
+      }
+      else {
+        t_probability[s] = hmm_log_emission(hmm, s, feat_vec);
+      }
+    }
+
+    pthread_mutex_lock(&pipeline->mutex);
+    slot->status = FRAME_DONE;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/** Creates an emission pipeline and starts its threads, which wait for a sample
+ * @param hmm the acoustic model
+ * @param qhmm quantized gaussians of the acoustic model, or NULL to use hmm_log_emission()
+ * @param num_threads number of worker threads
+ * @param lookahead number of frames after the current one that can be computed in advance
+ * @param use_active_set if true, only the states whose emissions were needed in the last
+ *        frame are computed in advance, otherwise all the states are computed
+ * @return the pipeline
+ */
+emission_pipeline_t *emission_pipeline_create(const hmm_t *hmm, const quantized_hmm_t *qhmm,
+                                              int num_threads, int lookahead, bool use_active_set) {
+  REQUIRE(num_threads > 0, "The emission pipeline needs at least one thread");
+  REQUIRE(lookahead > 0, "The emission pipeline lookahead must be positive");
+
+  emission_pipeline_t *pipeline = (emission_pipeline_t *) calloc(1, sizeof(emission_pipeline_t));
+  MEMTEST(pipeline);
+  pipeline->hmm = hmm;
+  pipeline->qhmm = qhmm;
+  pipeline->lookahead = lookahead;
+  pipeline->use_active_set = use_active_set;
+  if (qhmm != NULL) {
+    pipeline->qdata = (int16_t *) malloc((size_t) num_threads * qhmm->stride * sizeof(int16_t));
+    MEMTEST(pipeline->qdata);
+  }
+  pipeline->slots = (emission_slot_t *) calloc(lookahead + 1, sizeof(emission_slot_t));
+  MEMTEST(pipeline->slots);
+  for (int i = 0; i <= lookahead; i++) {
+    pipeline->slots[i].emissions = (float *) malloc(hmm->num_states * sizeof(float));
+    MEMTEST(pipeline->slots[i].emissions);
+    pipeline->slots[i].states = (int *) malloc(hmm->num_states * sizeof(int));
+    MEMTEST(pipeline->slots[i].states);
+  }
+  pipeline->active_states = (int *) malloc(hmm->num_states * sizeof(int));
+  MEMTEST(pipeline->active_states);
+  pipeline->next_active_states = (int *) malloc(hmm->num_states * sizeof(int));
+  MEMTEST(pipeline->next_active_states);
+  pthread_mutex_init(&pipeline->mutex, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+
+  // resolve the gaussian kernel before the workers use it
+  gaussian_kernel_get();
+  // the thread that runs the search is thread 0 of the pool and it does not run the workers
+  pipeline->pool = thread_pool_create(num_threads + 1);
+  return pipeline;
+}
+
+/** Deletes an emission pipeline, stopping it if it is running
+ * @param pipeline the pipeline
+ */
+void emission_pipeline_delete(emission_pipeline_t *pipeline) {
+  if (pipeline == NULL) return;
+  if (pipeline->running) emission_pipeline_stop(pipeline);
+  thread_pool_delete(pipeline->pool);
+  pthread_mutex_destroy(&pipeline->mutex);
+  pthread_cond_destroy(&pipeline->cond);
+  for (int i = 0; i <= pipeline->lookahead; i++) {
+    free(pipeline->slots[i].emissions);
+    free(pipeline->slots[i].states);
+  }
+  free(pipeline->slots);
+  free(pipeline->qdata);
+  free(pipeline->active_states);
+  free(pipeline->next_active_states);
+  free(pipeline);
+}
+
+/** Starts the workers on the features of a sample
+ * @param pipeline the pipeline
+ * @param features the features. They must not change until the pipeline is stopped
+ * @param emission_cache the emission cache, which must have an element per frame, or NULL
+ *        to keep the emissions in the pipeline until the search acquires them
+ * @param first_new_frame frames before this one were already in the cache and they are
+ *        not computed by the workers
+ */
+void emission_pipeline_start(emission_pipeline_t *pipeline, const features_t *features,
+                             vector_t *emission_cache, int first_new_frame) {
+  REQUIRE(!pipeline->running, "The emission pipeline is already running");
+  REQUIRE(emission_cache == NULL || (int) emission_cache->n_elems >= features->n_vectors,
+          "The emission cache does not cover the features");
+
+  pipeline->features = features;
+  pipeline->emission_cache = emission_cache;
+  pipeline->first_new_frame = (emission_cache != NULL) ? first_new_frame : 0;
+  for (int i = 0; i <= pipeline->lookahead; i++) {
+    pipeline->slots[i].frame = -1;
+    pipeline->slots[i].status = FRAME_DONE;
+  }
+  pipeline->search_frame = -1;
+  pipeline->n_active_states = -1;
+  pipeline->stop = false;
+  pipeline->running = true;
+  thread_pool_start(pipeline->pool, emission_pipeline_worker, pipeline);
+}
+
+/** Stops the workers and waits for them
+ * @param pipeline the pipeline
+ */
+void emission_pipeline_stop(emission_pipeline_t *pipeline) {
+  if (!pipeline->running) return;
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->stop = true;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+  thread_pool_wait(pipeline->pool);
+  pipeline->running = false;
+}
+
+/** Returns if the workers are running
+ * @param pipeline the pipeline
+ * @return true if they are running
+ */
+bool emission_pipeline_is_running(const emission_pipeline_t *pipeline) {
+  return pipeline->running;
+}
+
+/** Takes a frame for the search. Afterwards, workers do not write its emissions
+ * and they can go on with the frames that follow it. Without an emission cache, the
+ * emissions computed in advance are valid until the search acquires the next frame
+ * @param pipeline the pipeline
+ * @param frame the frame
+ * @param emissions the emissions computed in advance, indexed by state
+ * @param states the states computed in advance, or NULL if they are the first ones
+ * @return the number of states computed in advance. With an emission cache, it is 0
+ *         because the emissions are already in the cache
+ */
+int emission_pipeline_acquire(emission_pipeline_t *pipeline, int frame, const float **emissions, const int **states) {
+  emission_slot_t *slot = emission_pipeline_slot(pipeline, frame);
+  pthread_mutex_lock(&pipeline->mutex);
+  if (frame >= pipeline->first_new_frame && slot->frame != frame) {
+    // nobody started it, the search computes it lazily
+    slot->frame = frame;
+    slot->status = FRAME_DONE;
+    slot->n_states = 0;
+  }
+  while (slot->status == FRAME_RUNNING) {
+    pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+  }
+  pipeline->search_frame = frame;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  if (pipeline->emission_cache != NULL || slot->frame != frame) return 0;
+  *emissions = slot->emissions;
+  *states = (slot->n_states >= 0) ? slot->states : NULL;
+  return (slot->n_states >= 0) ? slot->n_states : pipeline->hmm->num_states;
+}
+
+/** Tells the workers which states were needed in the frame that the search has just finished.
+ * It does nothing unless the pipeline uses the active set
+ * @param pipeline the pipeline
+ * @param states the states whose emissions were computed in the frame
+ * @param n_states the number of states
+ */
+void emission_pipeline_set_active(emission_pipeline_t *pipeline, const int *states, int n_states) {
+  if (!pipeline->use_active_set) return;
+  memcpy(pipeline->next_active_states, states, n_states * sizeof(int));
+  pthread_mutex_lock(&pipeline->mutex);
+  SWAP(pipeline->active_states, pipeline->next_active_states, int *);
+  pipeline->n_active_states = n_states;
+  pthread_mutex_unlock(&pipeline->mutex);
+}
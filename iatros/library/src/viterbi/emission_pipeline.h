@@ -0,0 +1,37 @@
+/*
+ * emission_pipeline.h
+ *
+ *  Worker threads that compute the emissions of the next frames while the search
+ *  expands the current one
+ */
+
+#ifndef EMISSION_PIPELINE_H_
+#define EMISSION_PIPELINE_H_
+
+#include <iatros/hmm.h>
+#include <iatros/quantized_hmm.h>
+#include <iatros/features.h>
+#include <prhlt/vector.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Pool of threads that compute the emissions ahead of the search
+typedef struct emission_pipeline emission_pipeline_t;
+
+emission_pipeline_t *emission_pipeline_create(const hmm_t *hmm, const quantized_hmm_t *qhmm,
+                                              int num_threads, int lookahead, bool use_active_set);
+void emission_pipeline_delete(emission_pipeline_t *pipeline);
+void emission_pipeline_start(emission_pipeline_t *pipeline, const features_t *features,
+                             vector_t *emission_cache, int first_new_frame);
+void emission_pipeline_stop(emission_pipeline_t *pipeline);
+bool emission_pipeline_is_running(const emission_pipeline_t *pipeline);
+int emission_pipeline_acquire(emission_pipeline_t *pipeline, int frame, const float **emissions, const int **states);
+void emission_pipeline_set_active(emission_pipeline_t *pipeline, const int *states, int n_states);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EMISSION_PIPELINE_H_ */
@@ -0,0 +1,122 @@
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <prhlt/utils.h>
+#include <prhlt/gzip.h>
+#include <viterbi/hmm.h>
+#include <viterbi/test_hmm.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define DEFAULT_FRAMES 100
+#define DEFAULT_BEAM 100.0
+/// number of phonemes of three states of the synthetic model
+#define SYNTHETIC_PHONEMES 1000
+#define SYNTHETIC_GAUSSIANS 16
+#define SYNTHETIC_FEATURES 39
+/// the means are drawn between minus and plus this range
+#define SYNTHETIC_MEAN_RANGE 5.0
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Compares the exact evaluation of all the states with the partial distance evaluation.
+ * The emission bound in each frame is the best emission minus a beam */
+static int benchmark(const hmm_t *hmm, int n_frames, float beam) {
+  const packed_hmm_t *packed = hmm->packed;
+  float *frame = (float *) malloc(packed->num_features * sizeof(float));
+  MEMTEST(frame);
+  float *ordered = (float *) malloc(packed->num_features * sizeof(float));
+  MEMTEST(ordered);
+  float *exact = (float *) malloc(packed->num_states * sizeof(float));
+  MEMTEST(exact);
+  float *bounded = (float *) malloc(packed->num_states * sizeof(float));
+  MEMTEST(bounded);
+
+  double exact_time = 0, bounded_time = 0, max_error = 0;
+  long total = 0, bounded_abandoned = 0, violations = 0;
+  srand(4321);
+  for (int t = 0; t < n_frames; t++) {
+    hmm_sample_frame(hmm, frame);
+
+    double start = now();
+    float best = LOG_ZERO;
+    for (int s = 0; s < packed->num_states; s++) {
+      exact[s] = hmm_log_emission(hmm, s, frame);
+      if (exact[s] > best) best = exact[s];
+    }
+    exact_time += now() - start;
+    total += packed->num_gaussians;
+
+    // gaussians abandoned against the beam
+    const float emission_min = best - beam;
+    start = now();
+    hmm_order_features(hmm, frame, ordered);
+    for (int s = 0; s < packed->num_states; s++) {
+      int n_abandoned;
+      bounded[s] = hmm_log_emission_bounded(hmm, s, ordered, emission_min, &n_abandoned);
+      bounded_abandoned += n_abandoned;
+    }
+    bounded_time += now() - start;
+    for (int s = 0; s < packed->num_states; s++) {
+      if (exact[s] >= emission_min) {
+        if (fabs(bounded[s] - exact[s]) > max_error) max_error = fabs(bounded[s] - exact[s]);
+      }
+      else if (bounded[s] >= emission_min) {
+        // emissions out of the beam must stay out of it
+        violations++;
+      }
+    }
+  }
+
+  printf("%-8s exact:         %8.3f ms/frame\n", gaussian_kernel_name(gaussian_kernel_get()), 1000 * exact_time / n_frames);
+  printf("%-8s beam %-8g  %8.3f ms/frame, speedup %5.2f, abandoned %6.2f%%\n", "", beam, 1000 * bounded_time / n_frames,
+         exact_time / bounded_time, (100.0 * bounded_abandoned) / total);
+  printf("%-8s max error inside the beam %g, bound violations %ld\n", "", max_error, violations);
+
+  free(frame);
+  free(ordered);
+  free(exact);
+  free(bounded);
+  return violations;
+}
+
+/* Benchmarks partial distance with every gaussian kernel supported by the CPU
+ * on a synthetic model or on the given one */
+int main (int argc, char *argv[]) {
+  const int n_frames = (argc > 1) ? atoi(argv[1]) : DEFAULT_FRAMES;
+  const float beam = (argc > 2) ? atof(argv[2]) : DEFAULT_BEAM;
+  if (n_frames <= 0 || argc > 4) {
+    fprintf(stderr, "Usage: %s [frames [beam [hmm-file]]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  hmm_t *hmm = NULL;
+  if (argc > 3) {
+    hmm = hmm_create();
+    FILE *file = smart_fopen(argv[3], "r");
+    CHECK_SYS_ERROR(file != NULL, "Couldn't open hmm file '%s'\n", argv[3]);
+    hmm_load(hmm, file);
+    smart_fclose(file);
+  }
+  else {
+    srand(1234);
+    hmm = test_hmm_create(SYNTHETIC_PHONEMES, SYNTHETIC_GAUSSIANS, SYNTHETIC_FEATURES, SYNTHETIC_MEAN_RANGE, true);
+  }
+  hmm_enable_partial_distance(hmm);
+  printf("model: %d states, %d gaussians, %d features\n", hmm->packed->num_states,
+         hmm->packed->num_gaussians, hmm->packed->num_features);
+
+  int violations = 0;
+  for (int k = GK_SCALAR; k < GK_MAX; k++) {
+    if (!gaussian_kernel_is_supported((gaussian_kernel_t) k)) continue;
+    gaussian_kernel_set((gaussian_kernel_t) k);
+    violations += benchmark(hmm, n_frames, beam);
+  }
+
+  hmm_delete(hmm);
+  return violations == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
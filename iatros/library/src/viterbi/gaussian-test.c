@@ -0,0 +1,157 @@
+#include <prhlt/trace.h>
+#include <viterbi/gaussian.h>
+#include <viterbi/hmm.h>
+#include <prhlt/constants.h>
+#include <math.h>
+#include <float.h>
+
+#define MAX_FEATURES 130
+/// Batch test: gaussians, frames and features (MFCC with deltas)
+#define BATCH_GAUSSIANS 37
+#define BATCH_FRAMES 300
+#define BATCH_FEATURES 39
+/// Largest mixture of the log-add test
+#define MAX_COMPONENTS 70
+
+/* Checks every gaussian kernel supported by the CPU against the scalar reference */
+static int test_kernels() {
+  float data[MAX_FEATURES], mean[MAX_FEATURES], inv_variance[MAX_FEATURES];
+  int errors = 0;
+
+  for (int k = GK_SCALAR; k < GK_MAX; k++) {
+    gaussian_kernel_t kernel = (gaussian_kernel_t) k;
+    if (!gaussian_kernel_is_supported(kernel)) {
+      printf("%-8s not supported\n", gaussian_kernel_name(kernel));
+      continue;
+    }
+    mahalanobis_fn_t fn = gaussian_kernel_function(kernel);
+    double max_error = 0;
+    for (int n = 1; n < MAX_FEATURES; n++) {
+      for (int i = 0; i < n; i++) {
+        data[i] = 10.0 * rand() / RAND_MAX - 5.0;
+        mean[i] = 10.0 * rand() / RAND_MAX - 5.0;
+        inv_variance[i] = 1.0 / (0.01 + 4.0 * rand() / RAND_MAX);
+      }
+      float expected = mahalanobis_scalar(data, mean, inv_variance, n);
+      float result = fn(data, mean, inv_variance, n);
+      double error = fabs(result - expected) / fabs(expected);
+      if (error > max_error) max_error = error;
+      if (error > 1e-5) {
+        printf("%-8s n=%d expected %g got %g\n", gaussian_kernel_name(kernel), n, expected, result);
+        errors++;
+      }
+    }
+    printf("%-8s max relative error %g\n", gaussian_kernel_name(kernel), max_error);
+  }
+  return errors;
+}
+
+/* Checks gaussian_batch_score() with every kernel against log_gaussian(). The first
+ * feature imitates c0: a large offset with a small variance */
+static int test_batch() {
+  static float means[BATCH_GAUSSIANS][BATCH_FEATURES], inv_variances[BATCH_GAUSSIANS][BATCH_FEATURES];
+  static float variances[BATCH_GAUSSIANS][BATCH_FEATURES], frame_data[BATCH_FRAMES][BATCH_FEATURES];
+  static float scores[BATCH_FRAMES * BATCH_GAUSSIANS];
+  float gconsts[BATCH_GAUSSIANS];
+  const float *frames[BATCH_FRAMES];
+  mean_t mean[BATCH_GAUSSIANS];
+  variance_t variance[BATCH_GAUSSIANS];
+  gaussian_t gaussian[BATCH_GAUSSIANS];
+  int errors = 0;
+
+  for (int g = 0; g < BATCH_GAUSSIANS; g++) {
+    double gconst = BATCH_FEATURES * log(2 * M_PI);
+    for (int i = 0; i < BATCH_FEATURES; i++) {
+      const double offset = (i == 0) ? 60.0 : 0.0;
+      means[g][i] = offset + 6.0 * rand() / RAND_MAX - 3.0;
+      variances[g][i] = (i == 0) ? 0.1 : 0.05 + 2.0 * rand() / RAND_MAX;
+      inv_variances[g][i] = 1.0 / variances[g][i];
+      gconst += log(variances[g][i]);
+    }
+    mean[g].mean = means[g];
+    variance[g].variance = variances[g];
+    variance[g].inv_variance = inv_variances[g];
+    gconsts[g] = gaussian[g].constant = gconst;
+    gaussian[g].mean = &mean[g];
+    gaussian[g].variance = &variance[g];
+  }
+  for (int t = 0; t < BATCH_FRAMES; t++) {
+    const float *near = means[rand() % BATCH_GAUSSIANS];
+    for (int i = 0; i < BATCH_FEATURES; i++) {
+      frame_data[t][i] = near[i] + 2.0 * rand() / RAND_MAX - 1.0;
+    }
+    frames[t] = frame_data[t];
+  }
+
+  gaussian_batch_t *batch = gaussian_batch_create(BATCH_GAUSSIANS, BATCH_FEATURES, means[0], inv_variances[0],
+                                                  BATCH_FEATURES, gconsts);
+  for (int k = GK_SCALAR; k < GK_MAX; k++) {
+    gaussian_kernel_t kernel = (gaussian_kernel_t) k;
+    if (!gaussian_kernel_set(kernel)) continue;
+    gaussian_batch_score(batch, frames, BATCH_FRAMES, scores);
+    double max_error = 0;
+    for (int t = 0; t < BATCH_FRAMES; t++) {
+      for (int g = 0; g < BATCH_GAUSSIANS; g++) {
+        const float expected = log_gaussian(frames[t], &gaussian[g], BATCH_FEATURES);
+        const float result = scores[t * BATCH_GAUSSIANS + g];
+        const double error = fabs(result - expected) / (1 + fabs(expected));
+        if (error > max_error) max_error = error;
+        if (error > 1e-5) {
+          printf("batch %-8s frame %d gaussian %d expected %g got %g\n", gaussian_kernel_name(kernel), t, g, expected, result);
+          errors++;
+        }
+      }
+    }
+    printf("batch %-8s max relative error %g\n", gaussian_kernel_name(kernel), max_error);
+  }
+  gaussian_batch_delete(batch);
+  gaussian_kernel_set(GK_AUTO);
+  return errors;
+}
+
+/* Checks every log-add type, with every kernel, against the addition in double precision */
+static int test_log_add() {
+  static const double tolerances[MAX_LOG_ADD_TYPE] = { 1e-5, 2e-3, 1e-5, 0 };
+  static const char *names[MAX_LOG_ADD_TYPE] = { "exact", "table", "poly", "max" };
+  float scores[MAX_COMPONENTS];
+  int errors = 0;
+
+  if (!is_logzero(log_add_reduce(NULL, 0, LA_EXACT))) {
+    printf("log-add of no components is not LOG_ZERO\n");
+    errors++;
+  }
+  for (int k = GK_SCALAR; k < GK_MAX; k++) {
+    gaussian_kernel_t kernel = (gaussian_kernel_t) k;
+    if (!gaussian_kernel_set(kernel)) continue;
+    double max_errors[MAX_LOG_ADD_TYPE] = { 0 };
+    for (int n = 1; n < MAX_COMPONENTS; n++) {
+      double max = -FLT_MAX;
+      for (int i = 0; i < n; i++) {
+        scores[i] = -100.0 - 40.0 * rand() / RAND_MAX;
+        if (scores[i] > max) max = scores[i];
+      }
+      double sum = 0;
+      for (int i = 0; i < n; i++) sum += exp(scores[i] - max);
+      for (int type = LA_EXACT; type < MAX_LOG_ADD_TYPE; type++) {
+        const double expected = (type == LA_MAX) ? max : max + log(sum);
+        const double error = fabs(log_add_reduce(scores, n, (log_add_t) type) - expected);
+        if (error > max_errors[type]) max_errors[type] = error;
+      }
+    }
+    for (int type = LA_EXACT; type < MAX_LOG_ADD_TYPE; type++) {
+      printf("log-add %-6s %-8s max error %g\n", names[type], gaussian_kernel_name(kernel), max_errors[type]);
+      if (max_errors[type] > tolerances[type] + 1e-5) errors++;
+    }
+  }
+  gaussian_kernel_set(GK_AUTO);
+  return errors;
+}
+
+int main (int UNUSED(argc), char *UNUSED(argv[])) {
+  srand(1234);
+  int errors = test_kernels();
+  errors += test_batch();
+  errors += test_log_add();
+  printf("selected kernel: %s\n", gaussian_kernel_name(gaussian_kernel_get()));
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
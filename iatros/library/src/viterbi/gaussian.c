@@ -0,0 +1,641 @@
+/*
+ * gaussian.c
+ *
+ *  Diagonal gaussian scoring kernels with runtime CPU dispatch
+ */
+
+#include <viterbi/gaussian.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define GAUSSIAN_X86_DISPATCH
+#include <immintrin.h>
+#if defined(__clang__) || __GNUC__ >= 7
+#define GAUSSIAN_HAVE_AVX512
+#endif
+#endif
+
+static const char *kernel_names[GK_MAX] = { "auto", "scalar", "sse", "avx2", "avx512" };
+
+/** Reference implementation of the kernel.
+ * Accumulates in double precision and is used when no SIMD extension is available
+ */
+float mahalanobis_scalar(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  double num = 0.0;
+  for (int i = 0; i < num_features; i++) {
+    float diff = data[i] - mean[i];
+    num += diff * diff * inv_variance[i];
+  }
+  return num;
+}
+
+#ifdef GAUSSIAN_X86_DISPATCH
+
+__attribute__((target("sse2")))
+static float mahalanobis_sse(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  __m128 acc = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 4 <= num_features; i += 4) {
+    __m128 diff = _mm_sub_ps(_mm_loadu_ps(data + i), _mm_loadu_ps(mean + i));
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(diff, diff), _mm_loadu_ps(inv_variance + i)));
+  }
+  float partial[4];
+  _mm_storeu_ps(partial, acc);
+  float sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+  for (; i < num_features; i++) {
+    float diff = data[i] - mean[i];
+    sum += diff * diff * inv_variance[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float mahalanobis_avx2(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  // two independent accumulators to hide the latency of the fma
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= num_features; i += 16) {
+    __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(data + i), _mm256_loadu_ps(mean + i));
+    __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(data + i + 8), _mm256_loadu_ps(mean + i + 8));
+    acc0 = _mm256_fmadd_ps(_mm256_mul_ps(diff0, _mm256_loadu_ps(inv_variance + i)), diff0, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_mul_ps(diff1, _mm256_loadu_ps(inv_variance + i + 8)), diff1, acc1);
+  }
+  for (; i + 8 <= num_features; i += 8) {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(data + i), _mm256_loadu_ps(mean + i));
+    acc0 = _mm256_fmadd_ps(_mm256_mul_ps(diff, _mm256_loadu_ps(inv_variance + i)), diff, acc0);
+  }
+  acc0 = _mm256_add_ps(acc0, acc1);
+  __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  float sum = _mm_cvtss_f32(acc);
+  for (; i < num_features; i++) {
+    float diff = data[i] - mean[i];
+    sum += diff * diff * inv_variance[i];
+  }
+  return sum;
+}
+
+#ifdef GAUSSIAN_HAVE_AVX512
+__attribute__((target("avx512f")))
+static float mahalanobis_avx512(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= num_features; i += 16) {
+    __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(data + i), _mm512_loadu_ps(mean + i));
+    acc = _mm512_fmadd_ps(_mm512_mul_ps(diff, _mm512_loadu_ps(inv_variance + i)), diff, acc);
+  }
+  if (i < num_features) {
+    // masked loads avoid reading past the end of the vectors
+    __mmask16 mask = (__mmask16) ((1u << (num_features - i)) - 1);
+    __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, data + i), _mm512_maskz_loadu_ps(mask, mean + i));
+    acc = _mm512_fmadd_ps(_mm512_mul_ps(diff, _mm512_maskz_loadu_ps(mask, inv_variance + i)), diff, acc);
+  }
+  return _mm512_reduce_add_ps(acc);
+}
+#endif
+
+#endif // GAUSSIAN_X86_DISPATCH
+
+/*
+ * Batched scoring. The quadratic form of a diagonal gaussian is expanded as
+ *   -1/2 (gconst + sum_i iv_i (x_i - mu_i)^2) = bias + sum_i x_i (iv_i mu_i) + sum_i x_i^2 (-iv_i / 2)
+ * with bias = -1/2 (gconst + sum_i iv_i mu_i^2), so that scoring a block of frames
+ * against all the gaussians is the product of the extended features [x, x^2] by a
+ * weight matrix. Weights are stored in panels of TILE_COLS gaussians and the product
+ * is computed in tiles of TILE_ROWS frames by TILE_COLS gaussians kept in registers.
+ */
+#define TILE_ROWS 4
+#define TILE_COLS 16
+/// number of frames whose extended features are kept in cache while the panels are streamed
+#define BLOCK_FRAMES 64
+
+/** Computes a tile of the product
+ * @param features TILE_ROWS rows of extended features
+ * @param ld_features distance in floats between two rows of features
+ * @param panel num_weights rows of TILE_COLS weights
+ * @param num_weights number of extended features
+ * @param tile output TILE_ROWS x TILE_COLS products
+ */
+typedef void (*gaussian_tile_fn_t)(const float *features, int ld_features, const float *panel, int num_weights, float *tile);
+
+static void gaussian_tile_scalar(const float *features, int ld_features, const float *panel, int num_weights, float *tile) {
+  float acc[TILE_ROWS][TILE_COLS];
+  memset(acc, 0, sizeof(acc));
+  for (int k = 0; k < num_weights; k++) {
+    const float *w = panel + k * TILE_COLS;
+    for (int r = 0; r < TILE_ROWS; r++) {
+      const float x = features[r * ld_features + k];
+      for (int j = 0; j < TILE_COLS; j++) {
+        acc[r][j] += x * w[j];
+      }
+    }
+  }
+  memcpy(tile, acc, sizeof(acc));
+}
+
+#ifdef GAUSSIAN_X86_DISPATCH
+__attribute__((target("avx2,fma")))
+static void gaussian_tile_avx2(const float *features, int ld_features, const float *panel, int num_weights, float *tile) {
+  __m256 acc00 = _mm256_setzero_ps(), acc01 = _mm256_setzero_ps();
+  __m256 acc10 = _mm256_setzero_ps(), acc11 = _mm256_setzero_ps();
+  __m256 acc20 = _mm256_setzero_ps(), acc21 = _mm256_setzero_ps();
+  __m256 acc30 = _mm256_setzero_ps(), acc31 = _mm256_setzero_ps();
+  for (int k = 0; k < num_weights; k++) {
+    const __m256 w0 = _mm256_load_ps(panel + k * TILE_COLS);
+    const __m256 w1 = _mm256_load_ps(panel + k * TILE_COLS + 8);
+    __m256 x = _mm256_broadcast_ss(features + k);
+    acc00 = _mm256_fmadd_ps(x, w0, acc00); acc01 = _mm256_fmadd_ps(x, w1, acc01);
+    x = _mm256_broadcast_ss(features + ld_features + k);
+    acc10 = _mm256_fmadd_ps(x, w0, acc10); acc11 = _mm256_fmadd_ps(x, w1, acc11);
+    x = _mm256_broadcast_ss(features + 2 * ld_features + k);
+    acc20 = _mm256_fmadd_ps(x, w0, acc20); acc21 = _mm256_fmadd_ps(x, w1, acc21);
+    x = _mm256_broadcast_ss(features + 3 * ld_features + k);
+    acc30 = _mm256_fmadd_ps(x, w0, acc30); acc31 = _mm256_fmadd_ps(x, w1, acc31);
+  }
+  _mm256_storeu_ps(tile +  0, acc00); _mm256_storeu_ps(tile +  8, acc01);
+  _mm256_storeu_ps(tile + 16, acc10); _mm256_storeu_ps(tile + 24, acc11);
+  _mm256_storeu_ps(tile + 32, acc20); _mm256_storeu_ps(tile + 40, acc21);
+  _mm256_storeu_ps(tile + 48, acc30); _mm256_storeu_ps(tile + 56, acc31);
+}
+
+#ifdef GAUSSIAN_HAVE_AVX512
+__attribute__((target("avx512f")))
+static void gaussian_tile_avx512(const float *features, int ld_features, const float *panel, int num_weights, float *tile) {
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+  for (int k = 0; k < num_weights; k++) {
+    const __m512 w = _mm512_load_ps(panel + k * TILE_COLS);
+    acc0 = _mm512_fmadd_ps(_mm512_set1_ps(features[k]), w, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_set1_ps(features[ld_features + k]), w, acc1);
+    acc2 = _mm512_fmadd_ps(_mm512_set1_ps(features[2 * ld_features + k]), w, acc2);
+    acc3 = _mm512_fmadd_ps(_mm512_set1_ps(features[3 * ld_features + k]), w, acc3);
+  }
+  _mm512_storeu_ps(tile +  0, acc0);
+  _mm512_storeu_ps(tile + 16, acc1);
+  _mm512_storeu_ps(tile + 32, acc2);
+  _mm512_storeu_ps(tile + 48, acc3);
+}
+#endif
+#endif // GAUSSIAN_X86_DISPATCH
+
+/** Returns the tile function that matches a kernel
+ * @param kernel the kernel
+ * @return the tile function. Kernels without a specific tile function use the scalar one
+ */
+static gaussian_tile_fn_t gaussian_tile_function(gaussian_kernel_t kernel) {
+  switch (kernel) {
+#ifdef GAUSSIAN_X86_DISPATCH
+  case GK_AVX2: return gaussian_tile_avx2;
+#ifdef GAUSSIAN_HAVE_AVX512
+  case GK_AVX512: return gaussian_tile_avx512;
+#endif
+#endif
+  default: return gaussian_tile_scalar;
+  }
+}
+
+/** Returns the kernel function that implements an extension
+ * @param kernel the kernel
+ * @return the function or NULL if the kernel was not compiled in
+ */
+mahalanobis_fn_t gaussian_kernel_function(gaussian_kernel_t kernel) {
+  switch (kernel) {
+  case GK_SCALAR: return mahalanobis_scalar;
+#ifdef GAUSSIAN_X86_DISPATCH
+  case GK_SSE: return mahalanobis_sse;
+  case GK_AVX2: return mahalanobis_avx2;
+#ifdef GAUSSIAN_HAVE_AVX512
+  case GK_AVX512: return mahalanobis_avx512;
+#endif
+#endif
+  default: return NULL;
+  }
+}
+
+/** Checks whether a kernel is compiled in and supported by the running CPU
+ * @param kernel the kernel
+ * @return true if the kernel can be used
+ */
+bool gaussian_kernel_is_supported(gaussian_kernel_t kernel) {
+  if (kernel == GK_AUTO) return true;
+  if (gaussian_kernel_function(kernel) == NULL) return false;
+#ifdef GAUSSIAN_X86_DISPATCH
+  __builtin_cpu_init();
+  switch (kernel) {
+  case GK_SSE: return __builtin_cpu_supports("sse2");
+  case GK_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  case GK_AVX512: return __builtin_cpu_supports("avx512f");
+  default: break;
+  }
+#endif
+  return kernel == GK_SCALAR;
+}
+
+/// kernel in use. Resolved the first time a gaussian is evaluated
+static gaussian_kernel_t current_kernel = GK_AUTO;
+static float mahalanobis_resolve(const float *data, const float *mean, const float *inv_variance, int num_features);
+static mahalanobis_fn_t mahalanobis_impl = mahalanobis_resolve;
+
+/** Selects the kernel used by mahalanobis()
+ * @param kernel the kernel. GK_AUTO selects the fastest supported one
+ * @return false if the kernel is not supported by the CPU
+ */
+bool gaussian_kernel_set(gaussian_kernel_t kernel) {
+  if (kernel == GK_AUTO) {
+    int k;
+    for (k = GK_MAX - 1; k > GK_SCALAR; k--) {
+      if (gaussian_kernel_is_supported((gaussian_kernel_t) k)) break;
+    }
+    kernel = (gaussian_kernel_t) k;
+  }
+  else if (!gaussian_kernel_is_supported(kernel)) {
+    return false;
+  }
+  current_kernel = kernel;
+  mahalanobis_impl = gaussian_kernel_function(kernel);
+  return true;
+}
+
+/** Returns the kernel in use
+ * @return the kernel
+ */
+gaussian_kernel_t gaussian_kernel_get() {
+  if (current_kernel == GK_AUTO) gaussian_kernel_set(GK_AUTO);
+  return current_kernel;
+}
+
+/** Returns the name of a kernel
+ * @param kernel the kernel
+ * @return the name
+ */
+const char *gaussian_kernel_name(gaussian_kernel_t kernel) {
+  REQUIRE(kernel >= GK_AUTO && kernel < GK_MAX, "Invalid gaussian kernel %d", kernel);
+  return kernel_names[kernel];
+}
+
+static float mahalanobis_resolve(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  gaussian_kernel_set(GK_AUTO);
+  return mahalanobis_impl(data, mean, inv_variance, num_features);
+}
+
+/** Computes the weighted squared distance with the kernel in use.
+ * The first call selects the fastest kernel supported by the CPU unless
+ * gaussian_kernel_set() has been called before
+ */
+float mahalanobis(const float *data, const float *mean, const float *inv_variance, int num_features) {
+  return mahalanobis_impl(data, mean, inv_variance, num_features);
+}
+
+/// number of dimensions accumulated between two checks of the bound (a cache line)
+#define PARTIAL_DISTANCE_BLOCK 16
+
+/** Computes the weighted squared distance but stops as soon as it exceeds a bound
+ * @param data a feature vector
+ * @param mean the mean
+ * @param inv_variance the inverse of the diagonal covariance
+ * @param num_features the number of features
+ * @param bound the evaluation stops when the partial distance is greater than bound
+ * @return the distance, or a partial distance greater than bound if the evaluation stopped
+ *
+ * Since every dimension adds a non-negative term, the partial distance is a lower bound
+ * of the distance. Dimensions should be ordered so that the largest terms come first.
+ * Each block of dimensions is accumulated with the selected kernel
+ */
+float mahalanobis_bounded(const float *data, const float *mean, const float *inv_variance, int num_features, float bound) {
+  float sum = 0;
+  for (int i = 0; i < num_features; i += PARTIAL_DISTANCE_BLOCK) {
+    const int n = (num_features - i < PARTIAL_DISTANCE_BLOCK) ? num_features - i : PARTIAL_DISTANCE_BLOCK;
+    sum += mahalanobis_impl(data + i, mean + i, inv_variance + i, n);
+    if (sum > bound) break;
+  }
+  return sum;
+}
+
+/** Allocates memory aligned to SIMD_ALIGNMENT bytes
+ * @param size number of bytes
+ * @return the memory. It must be released with free()
+ */
+void *simd_malloc(size_t size) {
+  void *ptr = NULL;
+  int error = posix_memalign(&ptr, SIMD_ALIGNMENT, size > 0 ? size : SIMD_ALIGNMENT);
+  CHECK_SYS_ERROR(error == 0 && ptr != NULL, "Memory test");
+  return ptr;
+}
+
+struct gaussian_batch {
+  int num_gaussians; ///< Number of gaussians
+  int num_features;  ///< Number of features
+  int num_weights;   ///< Number of extended features (2 * num_features)
+  int num_panels;    ///< Number of panels of TILE_COLS gaussians
+  float *weights;    ///< Weights stored panel by panel (num_panels x num_weights x TILE_COLS)
+  float *biases;     ///< Bias of each gaussian (num_panels x TILE_COLS)
+  float *centre;     ///< Average of the means, subtracted from the frames and the means
+};
+
+/** Prepares a set of gaussians to be scored in batch
+ * @param num_gaussians number of gaussians
+ * @param num_features number of features
+ * @param means means of the gaussians, one row of stride floats per gaussian
+ * @param inv_variances inverse variances of the gaussians, one row of stride floats per gaussian
+ * @param stride distance in floats between the rows of two consecutive gaussians
+ * @param gconsts gconst of each gaussian
+ * @return the batch
+ */
+gaussian_batch_t *gaussian_batch_create(int num_gaussians, int num_features, const float *means,
+                                        const float *inv_variances, int stride, const float *gconsts) {
+  gaussian_batch_t *batch = (gaussian_batch_t *) malloc(sizeof(gaussian_batch_t));
+  MEMTEST(batch);
+  batch->num_gaussians = num_gaussians;
+  batch->num_features = num_features;
+  batch->num_weights = 2 * num_features;
+  batch->num_panels = (num_gaussians + TILE_COLS - 1) / TILE_COLS;
+
+  const size_t panel_size = (size_t) batch->num_weights * TILE_COLS;
+  batch->weights = (float *) simd_malloc(batch->num_panels * panel_size * sizeof(float));
+  batch->biases = (float *) simd_malloc(batch->num_panels * TILE_COLS * sizeof(float));
+  memset(batch->weights, 0, batch->num_panels * panel_size * sizeof(float));
+  memset(batch->biases, 0, batch->num_panels * TILE_COLS * sizeof(float));
+
+  // the expanded form is evaluated around the average of the means, which keeps its terms small
+  batch->centre = (float *) malloc(num_features * sizeof(float));
+  MEMTEST(batch->centre);
+  for (int i = 0; i < num_features; i++) {
+    double sum = 0;
+    for (int g = 0; g < num_gaussians; g++) sum += means[(size_t) g * stride + i];
+    batch->centre[i] = (num_gaussians > 0) ? sum / num_gaussians : 0;
+  }
+
+  for (int g = 0; g < num_gaussians; g++) {
+    const float *mean = means + (size_t) g * stride;
+    const float *inv_variance = inv_variances + (size_t) g * stride;
+    float *panel = batch->weights + (g / TILE_COLS) * panel_size;
+    const int col = g % TILE_COLS;
+    double bias = gconsts[g];
+    for (int i = 0; i < num_features; i++) {
+      const double centred = (double) mean[i] - batch->centre[i];
+      panel[i * TILE_COLS + col] = inv_variance[i] * centred;
+      panel[(num_features + i) * TILE_COLS + col] = -0.5 * inv_variance[i];
+      bias += inv_variance[i] * centred * centred;
+    }
+    batch->biases[g] = bias / -2.0;
+  }
+  return batch;
+}
+
+/** Deletes a batch
+ * @param batch the batch
+ */
+void gaussian_batch_delete(gaussian_batch_t *batch) {
+  if (batch == NULL) return;
+  free(batch->weights);
+  free(batch->biases);
+  free(batch->centre);
+  free(batch);
+}
+
+/** Returns the number of gaussians in the batch
+ * @param batch the batch
+ * @return the number of gaussians
+ */
+int gaussian_batch_num_gaussians(const gaussian_batch_t *batch) {
+  return batch->num_gaussians;
+}
+
+/** Computes the logarithm of the density of every gaussian for a set of frames
+ * @param batch the batch
+ * @param frames the feature vectors
+ * @param n_frames number of frames
+ * @param scores output matrix of n_frames x num_gaussians log-densities, row by row
+ *
+ * The quadratic form is expanded as \f$x'\Sigma^{-1}x - 2\mu'\Sigma^{-1}x + \mu'\Sigma^{-1}\mu\f$,
+ * where the frame and the mean are first centred on the average of the means of the batch.
+ * The terms are added in float, so the absolute error is about 1e-7 times the distance
+ * of the frame and of the mean to that average, instead of to the origin. Features with
+ * a large offset and a small variance (e.g. c0) would otherwise cancel catastrophically
+ */
+void gaussian_batch_score(const gaussian_batch_t *batch, const float * const *frames, int n_frames, float *scores) {
+  const gaussian_tile_fn_t tile_fn = gaussian_tile_function(gaussian_kernel_get());
+  const int num_features = batch->num_features;
+  const int ld = batch->num_weights;
+  const size_t panel_size = (size_t) batch->num_weights * TILE_COLS;
+  float *block = (float *) simd_malloc((size_t) BLOCK_FRAMES * ld * sizeof(float));
+  float tile[TILE_ROWS * TILE_COLS];
+
+  for (int t0 = 0; t0 < n_frames; t0 += BLOCK_FRAMES) {
+    const int n_block = (n_frames - t0 < BLOCK_FRAMES) ? n_frames - t0 : BLOCK_FRAMES;
+    const int n_rows = ((n_block + TILE_ROWS - 1) / TILE_ROWS) * TILE_ROWS;
+
+    // build the centred extended features [x, x^2], padding the last tile with zeros
+    for (int r = 0; r < n_rows; r++) {
+      float *x = block + (size_t) r * ld;
+      if (r < n_block) {
+        const float *frame = frames[t0 + r];
+        for (int i = 0; i < num_features; i++) {
+          const float centred = frame[i] - batch->centre[i];
+          x[i] = centred;
+          x[num_features + i] = centred * centred;
+        }
+      }
+      else {
+        memset(x, 0, ld * sizeof(float));
+      }
+    }
+
+    // each panel is loaded once per block and reused by all the tiles of frames
+    for (int p = 0; p < batch->num_panels; p++) {
+      const float *panel = batch->weights + p * panel_size;
+      const float *bias = batch->biases + p * TILE_COLS;
+      const int g0 = p * TILE_COLS;
+      const int n_cols = (batch->num_gaussians - g0 < TILE_COLS) ? batch->num_gaussians - g0 : TILE_COLS;
+      for (int r0 = 0; r0 < n_block; r0 += TILE_ROWS) {
+        tile_fn(block + (size_t) r0 * ld, ld, panel, batch->num_weights, tile);
+        for (int r = 0; r < TILE_ROWS && r0 + r < n_block; r++) {
+          float *out = scores + (size_t) (t0 + r0 + r) * batch->num_gaussians + g0;
+          for (int j = 0; j < n_cols; j++) {
+            out[j] = bias[j] + tile[r * TILE_COLS + j];
+          }
+        }
+      }
+    }
+  }
+  free(block);
+}
+
+/// Differences of log-probabilities above this value are neglected by the table (exp(-16) ~ 1e-7)
+#define LOG_ADD_TABLE_RANGE 16
+/// Number of entries of the table per unit of difference
+#define LOG_ADD_TABLE_RESOLUTION 256
+#define LOG_ADD_TABLE_SIZE (LOG_ADD_TABLE_RANGE * LOG_ADD_TABLE_RESOLUTION + 1)
+
+/// log(1 + exp(-d)) sampled at d = i / LOG_ADD_TABLE_RESOLUTION
+static float log_add_table_values[LOG_ADD_TABLE_SIZE];
+static bool log_add_table_ready = false;
+
+/** Converts a string to a log-add type
+ * @param log_add_str EXACT, TABLE, POLY or MAX
+ * @return the log-add type or MAX_LOG_ADD_TYPE if the string is not valid
+ */
+log_add_t get_log_add_type(const char *log_add_str) {
+  log_add_t type = MAX_LOG_ADD_TYPE;
+  if (log_add_str == NULL)                         type = MAX_LOG_ADD_TYPE;
+  else if (strcasecmp(log_add_str, "EXACT") == 0)  type = LA_EXACT;
+  else if (strcasecmp(log_add_str, "TABLE") == 0)  type = LA_TABLE;
+  else if (strcasecmp(log_add_str, "POLY") == 0)   type = LA_POLY;
+  else if (strcasecmp(log_add_str, "MAX") == 0)    type = LA_MAX;
+  return type;
+}
+
+/** Fills the table used by log_add_table().
+ * It must be called before scoring starts if several threads use the table
+ */
+void log_add_init_table() {
+  if (log_add_table_ready) return;
+  for (int i = 0; i < LOG_ADD_TABLE_SIZE; i++) {
+    log_add_table_values[i] = log1p(exp(-(double) i / LOG_ADD_TABLE_RESOLUTION));
+  }
+  log_add_table_ready = true;
+}
+
+/** Adds two log-probabilities with a table instead of log() and exp()
+ * @param a a log-probability
+ * @param b a log-probability
+ * @return an approximation of log(exp(a) + exp(b)) with an absolute error below 1e-3
+ */
+float log_add_table(float a, float b) {
+  if (b > a) SWAP(a, b, float);
+  const float diff = a - b;
+  if (!(diff < LOG_ADD_TABLE_RANGE)) return a;
+  if (!log_add_table_ready) log_add_init_table();
+  return a + log_add_table_values[(int) (diff * LOG_ADD_TABLE_RESOLUTION + 0.5f)];
+}
+
+/// Differences of log-probabilities below this value underflow in the polynomial exponential
+#define LOG_ADD_POLY_MIN -87.0f
+
+/** Computes exp(x) for x in [LOG_ADD_POLY_MIN, 0] with a relative error below 1e-6.
+ * exp(x) = 2^k * 2^f with k integer and f in [-0.5, 0.5]. 2^f is a polynomial (the
+ * coefficients of the Cephes exp2f()) and 2^k is written in the exponent bits
+ */
+static inline float log_add_poly_exp(float x) {
+  if (x < LOG_ADD_POLY_MIN) x = LOG_ADD_POLY_MIN;
+  const float t = x * 1.44269504f;
+  // t <= 0, so the truncation of 0.5 - t is the rounding of -t
+  const float k = -(float) (int32_t) (0.5f - t);
+  const float f = t - k;
+  const float p = 1.0f + f * (0.693147203f + f * (0.240226479f + f * (0.0555033247f + f * (0.00961843736f
+                  + f * (0.00133988744f + f * 0.000153533619f)))));
+  union { int32_t i; float f; } scale;
+  scale.i = ((int32_t) k + 127) << 23;
+  return p * scale.f;
+}
+
+/** Computes log(x) for a normal x > 0 with an absolute error below 1e-6.
+ * x = 2^e * m with m in [1, 2), and log(m) = 2 atanh((m - 1) / (m + 1)) is a series
+ */
+static inline float log_add_poly_log(float x) {
+  union { int32_t i; float f; } bits;
+  bits.f = x;
+  const int e = ((bits.i >> 23) & 0xff) - 127;
+  bits.i = (bits.i & 0x007fffff) | 0x3f800000;
+  const float z = (bits.f - 1.0f) / (bits.f + 1.0f);
+  const float z2 = z * z;
+  return e * 0.693147181f + 2.0f * z * (1.0f + z2 * (1.0f / 3 + z2 * (1.0f / 5 + z2 * (1.0f / 7 + z2 * (1.0f / 9)))));
+}
+
+/** Adds a vector of log-probabilities with the polynomial approximations
+ * @param scores the log-probabilities
+ * @param n the number of log-probabilities
+ * @param max the maximum of scores
+ * @return an approximation of log(sum_i exp(scores[i]))
+ */
+static float log_add_poly(const float *scores, int n, float max) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) sum += log_add_poly_exp(scores[i] - max);
+  return max + log_add_poly_log(sum);
+}
+
+#ifdef GAUSSIAN_X86_DISPATCH
+/** Vectorized log_add_poly() that evaluates 8 components at once. The last lanes are
+ * padded with LOG_ADD_POLY_MIN, which adds less than 1e-37
+ */
+__attribute__((target("avx2,fma")))
+static float log_add_poly_avx2(const float *scores, int n, float max) {
+  const __m256 vmax = _mm256_set1_ps(max);
+  const __m256 vmin = _mm256_set1_ps(LOG_ADD_POLY_MIN);
+  __m256 acc = _mm256_setzero_ps();
+  for (int i = 0; i < n; i += 8) {
+    __m256 x;
+    if (n - i >= 8) {
+      x = _mm256_sub_ps(_mm256_loadu_ps(scores + i), vmax);
+    }
+    else {
+      float tail[8];
+      for (int j = 0; j < 8; j++) tail[j] = (i + j < n) ? scores[i + j] - max : LOG_ADD_POLY_MIN;
+      x = _mm256_loadu_ps(tail);
+    }
+    x = _mm256_max_ps(x, vmin);
+    const __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+    const __m256 k = _mm256_round_ps(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m256 f = _mm256_sub_ps(t, k);
+    __m256 p = _mm256_set1_ps(0.000153533619f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.00133988744f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.00961843736f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.0555033247f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.240226479f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.693147203f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+    const __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+    acc = _mm256_fmadd_ps(p, _mm256_castsi256_ps(scale), acc);
+  }
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return max + log_add_poly_log(_mm_cvtss_f32(sum));
+}
+#endif
+
+/** Adds a vector of log-probabilities, e.g. the weighted components of a mixture
+ * @param scores the log-probabilities
+ * @param n the number of log-probabilities
+ * @param type how the log-probabilities are added
+ * @return log(sum_i exp(scores[i])) or its approximation. LOG_ZERO if n is 0
+ *
+ * The exact addition factors out the maximum so that a single log() is computed
+ * for the whole vector. The table addition and the polynomial addition avoid
+ * transcendental functions; the latter reduces 8 components at a time when the
+ * selected gaussian kernel is AVX2 or better. The maximum approximation (Viterbi)
+ * only keeps the best component
+ */
+float log_add_reduce(const float *scores, int n, log_add_t type) {
+  if (n <= 0) return LOG_ZERO;
+  float max = scores[0];
+  for (int i = 1; i < n; i++) {
+    if (scores[i] > max) max = scores[i];
+  }
+  if (type == LA_MAX || n == 1 || is_logzero(max)) return max;
+
+  if (type == LA_TABLE) {
+    float sum = scores[0];
+    for (int i = 1; i < n; i++) sum = log_add_table(sum, scores[i]);
+    return sum;
+  }
+
+  if (type == LA_POLY) {
+#ifdef GAUSSIAN_X86_DISPATCH
+    if (gaussian_kernel_get() >= GK_AVX2) return log_add_poly_avx2(scores, n, max);
+#endif
+    return log_add_poly(scores, n, max);
+  }
+
+  double sum = 0;
+  for (int i = 0; i < n; i++) sum += exp(scores[i] - max);
+  return max + log(sum);
+}
@@ -0,0 +1,64 @@
+/*
+ * gaussian.h
+ *
+ *  Diagonal gaussian scoring kernels with runtime CPU dispatch
+ */
+
+#ifndef GAUSSIAN_H_
+#define GAUSSIAN_H_
+
+#include <prhlt/utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Alignment in bytes of the vectors read by the kernels (a cache line)
+#define SIMD_ALIGNMENT 64
+
+/// Available implementations of the diagonal gaussian kernel
+typedef enum { GK_AUTO = 0, GK_SCALAR, GK_SSE, GK_AVX2, GK_AVX512, GK_MAX } gaussian_kernel_t;
+
+/** Computes the weighted squared distance between a feature vector and a mean
+ * @param data a feature vector \f${\bf o}\f$
+ * @param mean the mean \f${\bf \mu}\f$
+ * @param inv_variance the inverse of the diagonal covariance \f${\bf \Sigma}^{-1}\f$
+ * @param num_features the number of features \f$n\f$
+ * @return \f$({\bf o}-{\bf \mu})'{\bf \Sigma}^{-1}({\bf o}-{\bf \mu})\f$
+ */
+typedef float (*mahalanobis_fn_t)(const float *data, const float *mean, const float *inv_variance, int num_features);
+
+float mahalanobis_scalar(const float *data, const float *mean, const float *inv_variance, int num_features);
+float mahalanobis(const float *data, const float *mean, const float *inv_variance, int num_features);
+float mahalanobis_bounded(const float *data, const float *mean, const float *inv_variance, int num_features, float bound);
+
+gaussian_kernel_t gaussian_kernel_get();
+bool gaussian_kernel_set(gaussian_kernel_t kernel);
+bool gaussian_kernel_is_supported(gaussian_kernel_t kernel);
+mahalanobis_fn_t gaussian_kernel_function(gaussian_kernel_t kernel);
+const char *gaussian_kernel_name(gaussian_kernel_t kernel);
+
+void *simd_malloc(size_t size);
+
+/// Implementations of the addition of log-probabilities used to combine the components of a mixture
+typedef enum { LA_EXACT = 0, LA_TABLE, LA_POLY, LA_MAX, MAX_LOG_ADD_TYPE } log_add_t;
+
+log_add_t get_log_add_type(const char *log_add_str);
+void log_add_init_table();
+float log_add_table(float a, float b);
+float log_add_reduce(const float *scores, int n, log_add_t type);
+
+/// Set of gaussians prepared to be scored against blocks of frames
+typedef struct gaussian_batch gaussian_batch_t;
+
+gaussian_batch_t *gaussian_batch_create(int num_gaussians, int num_features, const float *means,
+                                        const float *inv_variances, int stride, const float *gconsts);
+void gaussian_batch_delete(gaussian_batch_t *batch);
+int gaussian_batch_num_gaussians(const gaussian_batch_t *batch);
+void gaussian_batch_score(const gaussian_batch_t *batch, const float * const *frames, int n_frames, float *scores);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAUSSIAN_H_ */
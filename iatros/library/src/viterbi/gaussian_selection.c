@@ -0,0 +1,213 @@
+/*
+ * gaussian_selection.c
+ *
+ *  Gaussian selection based on a codebook of the gaussian means
+ */
+
+#include <viterbi/gaussian_selection.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <string.h>
+
+/// maximum number of k-means iterations used to build the codebook
+#define GS_MAX_ITERATIONS 10
+
+/** Returns the nearest codeword to a vector
+ * @param gs the gaussian selection
+ * @param data the vector
+ * @return the index of the nearest codeword
+ */
+static int gaussian_selection_nearest(const gaussian_selection_t *gs, const float *data) {
+  int best = 0;
+  float best_dist = FLT_MAX;
+  for (int c = 0; c < gs->num_codewords; c++) {
+    float dist = mahalanobis(data, gs->codewords + (size_t) c * gs->stride, gs->inv_variance, gs->num_features);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = c;
+    }
+  }
+  return best;
+}
+
+/** Clusters the gaussians of a packed model into a codebook
+ * @param packed the packed model
+ * @param num_codewords the number of codewords
+ * @param shortlist_size number of codewords selected per frame
+ * @param floor log-density given to the gaussians that are not selected
+ * @return the gaussian selection
+ *
+ * The means are clustered with k-means using a distance weighted with the inverse of
+ * the average variance of the model. Each gaussian is assigned to its nearest codeword
+ */
+gaussian_selection_t *gaussian_selection_create(const packed_hmm_t *packed, int num_codewords, int shortlist_size, float floor) {
+  REQUIRE(num_codewords > 0, "The gaussian selection codebook must have at least one codeword");
+  REQUIRE(shortlist_size > 0, "The gaussian selection shortlist must have at least one codeword");
+
+  gaussian_selection_t *gs = (gaussian_selection_t *) malloc(sizeof(gaussian_selection_t));
+  MEMTEST(gs);
+  const int num_gaussians = packed->num_gaussians;
+  if (num_codewords > num_gaussians) num_codewords = num_gaussians;
+  if (shortlist_size > num_codewords) shortlist_size = num_codewords;
+
+  gs->num_codewords = num_codewords;
+  gs->num_features = packed->num_features;
+  gs->stride = packed->stride;
+  gs->shortlist_size = shortlist_size;
+  gs->floor = floor;
+
+  // weight each dimension with the inverse of the average variance
+  gs->inv_variance = (float *) simd_malloc(gs->stride * sizeof(float));
+  memset(gs->inv_variance, 0, gs->stride * sizeof(float));
+  for (int i = 0; i < gs->num_features; i++) {
+    double variance = 0;
+    for (int g = 0; g < num_gaussians; g++) {
+      variance += 1.0 / packed->inv_variances[(size_t) g * packed->stride + i];
+    }
+    gs->inv_variance[i] = num_gaussians / variance;
+  }
+
+  // initialize the codewords with gaussians evenly spread over the model
+  const size_t codebook_size = (size_t) num_codewords * gs->stride * sizeof(float);
+  gs->codewords = (float *) simd_malloc(codebook_size);
+  memset(gs->codewords, 0, codebook_size);
+  for (int c = 0; c < num_codewords; c++) {
+    const int g = (int) (((long) c * num_gaussians) / num_codewords);
+    memcpy(gs->codewords + (size_t) c * gs->stride, packed->means + (size_t) g * packed->stride, gs->num_features * sizeof(float));
+  }
+
+  int *assignment = (int *) malloc(num_gaussians * sizeof(int));
+  MEMTEST(assignment);
+  int *counts = (int *) malloc(num_codewords * sizeof(int));
+  MEMTEST(counts);
+  double *sums = (double *) malloc((size_t) num_codewords * gs->num_features * sizeof(double));
+  MEMTEST(sums);
+  for (int g = 0; g < num_gaussians; g++) assignment[g] = -1;
+
+  for (int it = 0; it < GS_MAX_ITERATIONS; it++) {
+    int changes = 0;
+    memset(counts, 0, num_codewords * sizeof(int));
+    memset(sums, 0, (size_t) num_codewords * gs->num_features * sizeof(double));
+
+    for (int g = 0; g < num_gaussians; g++) {
+      const float *mean = packed->means + (size_t) g * packed->stride;
+      int c = gaussian_selection_nearest(gs, mean);
+      if (c != assignment[g]) changes++;
+      assignment[g] = c;
+      counts[c]++;
+      for (int i = 0; i < gs->num_features; i++) {
+        sums[(size_t) c * gs->num_features + i] += mean[i];
+      }
+    }
+    TRACE(1, "Gaussian selection: iteration %d, %d gaussians changed of codeword\n", it, changes);
+    if (changes == 0) break;
+
+    // empty clusters keep their codeword
+    for (int c = 0; c < num_codewords; c++) {
+      if (counts[c] == 0) continue;
+      for (int i = 0; i < gs->num_features; i++) {
+        gs->codewords[(size_t) c * gs->stride + i] = sums[(size_t) c * gs->num_features + i] / counts[c];
+      }
+    }
+  }
+  free(sums);
+
+  // store the gaussians of each codeword contiguously
+  gs->offsets = (int *) malloc((num_codewords + 1) * sizeof(int));
+  MEMTEST(gs->offsets);
+  gs->gaussians = (int *) malloc(num_gaussians * sizeof(int));
+  MEMTEST(gs->gaussians);
+  gs->offsets[0] = 0;
+  for (int c = 0; c < num_codewords; c++) gs->offsets[c + 1] = gs->offsets[c] + counts[c];
+  memset(counts, 0, num_codewords * sizeof(int));
+  for (int g = 0; g < num_gaussians; g++) {
+    const int c = assignment[g];
+    gs->gaussians[gs->offsets[c] + counts[c]] = g;
+    counts[c]++;
+  }
+
+  free(counts);
+  free(assignment);
+  return gs;
+}
+
+/** Deletes a gaussian selection
+ * @param gs the gaussian selection
+ */
+void gaussian_selection_delete(gaussian_selection_t *gs) {
+  if (gs == NULL) return;
+  free(gs->codewords);
+  free(gs->inv_variance);
+  free(gs->offsets);
+  free(gs->gaussians);
+  free(gs);
+}
+
+/** Selects the gaussians of the codewords nearest to a feature vector
+ * @param gs the gaussian selection
+ * @param data a feature vector
+ * @param stamps a vector with an element per gaussian. Selected gaussians are stamped with generation
+ * @param generation stamp of the current frame. It must be different in each frame
+ * @return the number of selected gaussians
+ */
+int gaussian_selection_select(const gaussian_selection_t *gs, const float *data, int *stamps, int generation) {
+  int shortlist[gs->shortlist_size];
+  float distances[gs->shortlist_size];
+  int n_shortlist = 0;
+
+  // keep the nearest codewords sorted by distance
+  for (int c = 0; c < gs->num_codewords; c++) {
+    float dist = mahalanobis(data, gs->codewords + (size_t) c * gs->stride, gs->inv_variance, gs->num_features);
+    if (n_shortlist == gs->shortlist_size && dist >= distances[n_shortlist - 1]) continue;
+    int i = (n_shortlist < gs->shortlist_size) ? n_shortlist++ : n_shortlist - 1;
+    for (; i > 0 && distances[i - 1] > dist; i--) {
+      distances[i] = distances[i - 1];
+      shortlist[i] = shortlist[i - 1];
+    }
+    distances[i] = dist;
+    shortlist[i] = c;
+  }
+
+  int n_selected = 0;
+  for (int i = 0; i < n_shortlist; i++) {
+    const int c = shortlist[i];
+    for (int j = gs->offsets[c]; j < gs->offsets[c + 1]; j++) {
+      stamps[gs->gaussians[j]] = generation;
+    }
+    n_selected += gs->offsets[c + 1] - gs->offsets[c];
+  }
+  return n_selected;
+}
+
+/** Computes the logarithm of the emission probability of a state evaluating only the selected gaussians
+ * @param gs the gaussian selection
+ * @param hmm the hmm. Its components are added as in hmm_log_emission()
+ * @param state the state id
+ * @param data a feature vector
+ * @param stamps the stamps set by gaussian_selection_select()
+ * @param generation stamp of the current frame
+ * @param n_evaluated output number of gaussians evaluated. It can be NULL
+ * @return the approximated logarithm of the gaussian mixture density function of the state
+ */
+float gaussian_selection_log_emission(const gaussian_selection_t *gs, const hmm_t *hmm, int state,
+                                      const float *data, const int *stamps, int generation, int *n_evaluated) {
+  const packed_hmm_t *packed = hmm->packed;
+  const int first = packed->offsets[state];
+  const int n = packed->offsets[state + 1] - first;
+  float scores[n > 0 ? n : 1];
+  int evaluated = 0;
+  for (int i = 0; i < n; i++) {
+    const int g = first + i;
+    float score = gs->floor;
+    if (stamps[g] == generation) {
+      const size_t offset = (size_t) g * packed->stride;
+      score = (packed->gconsts[g] + mahalanobis(data, packed->means + offset,
+               packed->inv_variances + offset, packed->num_features)) / -2.0;
+      if (score < gs->floor) score = gs->floor;
+      evaluated++;
+    }
+    scores[i] = score + packed->priors[g];
+  }
+  if (n_evaluated != NULL) *n_evaluated = evaluated;
+  return log_add_reduce(scores, n, hmm->log_add);
+}
@@ -0,0 +1,43 @@
+/*
+ * gaussian_selection.h
+ *
+ *  Gaussian selection based on a codebook of the gaussian means
+ */
+
+#ifndef GAUSSIAN_SELECTION_H_
+#define GAUSSIAN_SELECTION_H_
+
+#include <iatros/hmm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Codebook used to preselect the gaussians that are evaluated in each frame.
+ * The means of all the gaussians are clustered at load time. In each frame, only
+ * the gaussians that belong to the nearest codewords are evaluated and the rest
+ * of them are given a floor score
+ */
+typedef struct {
+  int num_codewords;    ///< Number of codewords
+  int num_features;     ///< Number of features
+  int stride;           ///< Distance in floats between two consecutive codewords
+  float *codewords;     ///< Centroids of the clusters (num_codewords x stride)
+  float *inv_variance;  ///< Weights of the distance to the codewords (inverse of the average variance)
+  int *offsets;         ///< First gaussian of each codeword in gaussians. It has num_codewords + 1 elements
+  int *gaussians;       ///< Gaussians that belong to each codeword
+  int shortlist_size;   ///< Number of codewords selected per frame
+  float floor;          ///< Log-density given to the gaussians that are not selected
+} gaussian_selection_t;
+
+gaussian_selection_t *gaussian_selection_create(const packed_hmm_t *packed, int num_codewords, int shortlist_size, float floor);
+void gaussian_selection_delete(gaussian_selection_t *gs);
+int gaussian_selection_select(const gaussian_selection_t *gs, const float *data, int *stamps, int generation);
+float gaussian_selection_log_emission(const gaussian_selection_t *gs, const hmm_t *hmm, int state,
+                                      const float *data, const int *stamps, int generation, int *n_evaluated);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAUSSIAN_SELECTION_H_ */
@@ -19,6 +19,10 @@
 #include <float.h>
 #include <ctype.h>
 #include <search.h>
+#include <stdint.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 
 grammar_type_t get_grammar_type(const char *grammar_type_str) {
@@ -28,6 +32,7 @@ grammar_type_t get_grammar_type(const char *grammar_type_str) {
   else if (strcmp(grammar_type_str, "FSM") == 0)   type = FSM_GRAMMAR;
   else if (strcmp(grammar_type_str, "PHRASE_TABLE") == 0) type = PHRASE_TABLE_GRAMMAR;
   else if (strcmp(grammar_type_str, "LAT") == 0)   type = LAT_GRAMMAR;
+  else if (strcmp(grammar_type_str, "BINARY_NGRAM") == 0) type = BINARY_NGRAM_GRAMMAR;
   return type;
 }
 
@@ -140,6 +145,25 @@ void grammar_append(grammar_t *grammar, state_grammar_t * state_grammar) {
   grammar->num_states++;
 }
 
+///Returns the index of a grammar state in the vector of states of its grammar
+/**
+ * @param state a grammar state or STATE_NONE
+ * @return the index or STATE_INDEX_NONE if state is STATE_NONE
+ */
+INLINE int state_grammar_get_index(const state_grammar_t *state) {
+  return (state != STATE_NONE) ? state->num_state : STATE_INDEX_NONE;
+}
+
+///Returns the grammar state with a given index
+/**
+ * @param grammar the grammar of the state
+ * @param index the index of the state or STATE_INDEX_NONE
+ * @return the state or STATE_NONE if index is STATE_INDEX_NONE
+ */
+INLINE state_grammar_t *grammar_get_state(const grammar_t *grammar, int index) {
+  return (index != STATE_INDEX_NONE) ? grammar->vector[index] : STATE_NONE;
+}
+
 
 
 ///compares the probability of two word states
@@ -218,23 +242,120 @@ void list_states_append(list_states_t *list, state_grammar_t *state, float prob)
 */
 void grammar_sort_by_prob(grammar_t *grammar) {
   for (int i = 0; i < grammar->num_states; i++) {
+    // the states of the block were sorted before it was built, and their words cannot be reallocated
+    if (grammar->block != NULL && i < grammar->block->num_states) continue;
     state_grammar_sort(grammar->vector[i], word_state_prob_cmp);
   }
 }
 
+/// minimum number of words that grammar_freeze() copies between two trims of the heap
+#define GRAMMAR_FREEZE_TRIM_WORDS (1 << 18)
+
+///moves the states of a grammar to a block, so that the states, their words and their names are
+///stored in three contiguous arrays in the order of the states. The words of each state keep the
+///order they had, so the grammar should be sorted first. The search runs on the frozen grammar as
+///on any other, but its states are next to each other in memory and no new words can be appended
+///to them. The words still point to their next states: they are moved to the block, not replaced
+///by state indices. The words of the old states are released while they are copied and, where
+///malloc_trim() exists, their memory is returned to the system every few of them, so that the
+///grammar is not resident twice
+/**
+@param grammar Grammar without word search
+*/
+void grammar_freeze(grammar_t *grammar) {
+  REQUIRE(grammar->block == NULL, "The grammar is already frozen");
+
+  int num_words = 0, num_names = 0;
+  for (int i = 0; i < grammar->num_states; i++) {
+    REQUIRE(grammar->vector[i]->search.type == SS_NO_SEARCH, "The grammar must be frozen before building its word search");
+    REQUIRE(grammar->vector[i]->num_state == i, "Incorrect state number in grammar");
+    num_words += grammar->vector[i]->num_words;
+    num_names += symlen(grammar->vector[i]->name) + 1;
+  }
+
+  grammar_block_t *block = (grammar_block_t *) malloc(sizeof(grammar_block_t));
+  MEMTEST(block);
+  block->num_states = grammar->num_states;
+  block->num_words = num_words;
+  block->states = (state_grammar_t *) malloc((grammar->num_states > 0 ? grammar->num_states : 1) * sizeof(state_grammar_t));
+  MEMTEST(block->states);
+  block->words = (words_state_t *) malloc((num_words > 0 ? num_words : 1) * sizeof(words_state_t));
+  MEMTEST(block->words);
+  block->names = (symbol_t *) malloc((num_names > 0 ? num_names : 1) * sizeof(symbol_t));
+  MEMTEST(block->names);
+
+  // the states are copied first, and then the pointers to the old states are moved to the new ones.
+  // The words and the name of each old state are released as soon as they are copied
+  int w = 0, c = 0;
+#ifdef HAVE_MALLOC_TRIM
+  const int trim_words = (num_words / 16 > GRAMMAR_FREEZE_TRIM_WORDS) ? num_words / 16 : GRAMMAR_FREEZE_TRIM_WORDS;
+  int trimmed_words = 0;
+#endif
+  for (int i = 0; i < grammar->num_states; i++) {
+    state_grammar_t *old = grammar->vector[i];
+    state_grammar_t *state = &block->states[i];
+    *state = *old;
+    state->words = block->words + w;
+    // the states without words may have no array
+    if (old->num_words > 0) memcpy(state->words, old->words, old->num_words * sizeof(words_state_t));
+    state->name = block->names + c;
+    memcpy(state->name, old->name, (symlen(old->name) + 1) * sizeof(symbol_t));
+    w += old->num_words;
+    c += symlen(old->name) + 1;
+    free(old->words);
+    free(old->name);
+    old->words = NULL;
+    old->name = NULL;
+#ifdef HAVE_MALLOC_TRIM
+    // freed memory stays in the heap of the process until it is trimmed
+    if (w - trimmed_words >= trim_words) {
+      malloc_trim(0);
+      trimmed_words = w;
+    }
+#endif
+  }
+  for (int i = 0; i < grammar->num_states; i++) {
+    state_grammar_t *state = &block->states[i];
+    for (int m = 0; m < state->num_words; m++) {
+      if (state->words[m].state_next != STATE_NONE) {
+        state->words[m].state_next = &block->states[state->words[m].state_next->num_state];
+      }
+    }
+    if (state->state_bo != STATE_NONE) state->state_bo = &block->states[state->state_bo->num_state];
+  }
+  for (int l = 0; l < grammar->list_initial->num_elements; l++) {
+    grammar->list_initial->vector[l].state = &block->states[grammar->list_initial->vector[l].state->num_state];
+  }
+  for (int l = 0; l < grammar->list_end->num_elements; l++) {
+    grammar->list_end->vector[l].state = &block->states[grammar->list_end->vector[l].state->num_state];
+  }
+
+  for (int i = 0; i < grammar->num_states; i++) {
+    state_grammar_delete(grammar->vector[i]);
+    grammar->vector[i] = &block->states[i];
+  }
+  grammar->block = block;
+}
+
 ///creates the necessary structures to search output words in grammar states
 ///this is useful for additional input/output ngram expansion and for prefix search
 /**
 @param grammar Grammar
 */
 void grammar_build_word_search(grammar_t *grammar) {
+  if (grammar->vocab_type == GV_INPUT) grammar_build_word_hash(grammar, grammar->vocab->in);
+  else if (grammar->vocab_type == GV_OUTPUT) grammar_build_word_hash(grammar, grammar->vocab->out);
   for (int i = 0; i < grammar->num_states; i++) {
     switch (grammar->vocab_type) {
     case GV_INPUT:
-      state_grammar_build_word_search_secondary(grammar->vector[i], grammar->vocab->in);
+      if (grammar->vector[i]->search.type == SS_NO_SEARCH) {
+        state_grammar_build_word_search_secondary(grammar->vector[i], grammar->vocab->in);
+      }
       break;
     case GV_OUTPUT:
-      state_grammar_build_word_search_secondary(grammar->vector[i], grammar->vocab->out);
+      if (grammar->vector[i]->search.type == SS_NO_SEARCH) {
+        state_grammar_build_word_search_secondary(grammar->vector[i], grammar->vocab->out);
+      }
       break;
     case GV_BILINGUAL:
       state_grammar_build_word_search_primary(grammar->vector[i], grammar->vocab);
@@ -246,6 +367,21 @@ void grammar_build_word_search(grammar_t *grammar) {
 }
 
 
+///creates a single table to find the words of the dense states of a frozen grammar, instead of
+///a search per state, so that state_grammar_fill_word_state() finds each word in constant time.
+///The states with few words are searched linearly. The states that are not frozen, whose words
+///are already searched or that have almost every word of the vocab are not changed
+/**
+@param grammar Grammar
+@param vocab the vocab of the words of the states
+*/
+void grammar_build_word_hash(grammar_t *grammar, const vocab_t *vocab) {
+  if (grammar->block == NULL || grammar->word_hash != NULL) return;
+  grammar->word_hash = word_hash_create(grammar->block->words, grammar->block->states,
+                                        grammar->block->num_states, vocab);
+}
+
+
 ///Converts indexes to pointers in grammar
 /**
  * @param grammar grammar
@@ -285,6 +421,280 @@ void grammar_convert_indexes_to_pointers(grammar_t *grammar) {
   }
 }
 
+/// first line of the binary n-grams
+#define BINARY_NGRAM_MAGIC "#iATROS binary n-gram\n"
+/// version of the binary format
+#define BINARY_NGRAM_VERSION 2
+/// the sections of a binary n-gram start at multiples of this number of bytes, so that their arrays are aligned in the buffer that reads the file
+#define BINARY_NGRAM_ALIGNMENT 8
+/// number of int32_t in the header
+#define BINARY_NGRAM_HEADER_SIZE 12
+/// bits of the probabilities and backoff weights that are not quantized
+#define BINARY_NGRAM_FLOAT_BITS 32
+/// number of times that the codebooks of the quantized probabilities are refined
+#define BINARY_NGRAM_QUANTIZATION_ITERATIONS 10
+
+/// State or end state of a binary n-gram
+typedef struct {
+  int32_t state; ///< index of the state
+  float prob;    ///< probability of starting or ending in the state
+} binary_ngram_entry_t;
+
+/// State of a binary n-gram
+typedef struct {
+  int32_t first_word; ///< index of the first word of the state
+  int32_t num_words;  ///< number of words of the state
+  int32_t first_name; ///< index of the first symbol of the name of the state
+  int32_t state_bo;   ///< index of the backoff state or -1
+} binary_ngram_state_t;
+
+/// Word of a binary n-gram
+typedef struct {
+  int32_t word;       ///< index of the word in the symbols of the file
+  int32_t state_next; ///< index of the state reached with the word
+} binary_ngram_word_t;
+
+/** Sections of a binary n-gram. The probabilities of the words and the backoff weights of the
+ * states are kept apart from them, either as floats or as codes of 8 or 16 bits. The codes index
+ * the codebooks of the order of their state: first the n codebooks of the probabilities and
+ * then the n codebooks of the backoff weights
+ */
+typedef enum { BNS_INITIAL, BNS_END, BNS_STATES, BNS_WORDS, BNS_PROBS, BNS_BACKOFFS, BNS_CODEBOOKS, BNS_NAMES,
+               BNS_SYMBOL_OFFSETS, BNS_SYMBOLS, MAX_BNS } binary_ngram_section_t;
+
+/** Computes where the sections of a binary n-gram start
+ * @param header the header of the file
+ * @param offsets the offset of each section. offsets[MAX_BNS] is the size of the file
+ */
+static void binary_ngram_layout(const int32_t *header, size_t *offsets) {
+  const int bits = header[11];
+  const size_t num_codes = (bits < BINARY_NGRAM_FLOAT_BITS) ? (size_t) 1 << bits : 0;
+  const size_t sizes[MAX_BNS] = {
+    (size_t) header[7] * sizeof(binary_ngram_entry_t),
+    (size_t) header[8] * sizeof(binary_ngram_entry_t),
+    (size_t) header[2] * sizeof(binary_ngram_state_t),
+    (size_t) header[3] * sizeof(binary_ngram_word_t),
+    (size_t) header[3] * (bits / 8),
+    (size_t) header[2] * (bits / 8),
+    2 * (size_t) header[1] * num_codes * sizeof(float),
+    (size_t) header[4] * sizeof(int32_t),
+    (size_t) header[5] * sizeof(int32_t),
+    (size_t) header[6]
+  };
+  size_t offset = sizeof(BINARY_NGRAM_MAGIC) - 1 + BINARY_NGRAM_HEADER_SIZE * sizeof(int32_t);
+  for (int s = 0; s < MAX_BNS; s++) {
+    offset = (offset + BINARY_NGRAM_ALIGNMENT - 1) / BINARY_NGRAM_ALIGNMENT * BINARY_NGRAM_ALIGNMENT;
+    offsets[s] = offset;
+    offset += sizes[s];
+  }
+  offsets[MAX_BNS] = offset;
+}
+
+/** Returns the order of the probabilities of the words of a state of an n-gram, which is the
+ * order of its backoff weight too
+ * @param name the name of the state
+ * @param n the order of the n-gram
+ * @return the order, from 1 to n
+ */
+static int binary_ngram_order(const symbol_t *name, int n) {
+  const int order = symlen(name) + 1;
+  return (order < n) ? order : n;
+}
+
+/** Returns a probability or a backoff weight of a binary n-gram
+ * @param values the probabilities or the backoff weights of the file
+ * @param bits the bits of each value
+ * @param codebook the codebook of the order of the value. It is not used if the value is a float
+ * @param i the index of the value
+ * @return the value
+ */
+static float binary_ngram_value(const void *values, int bits, const float *codebook, int i) {
+  switch (bits) {
+  case 8:
+    return codebook[((const uint8_t *) values)[i]];
+  case 16:
+    return codebook[((const uint16_t *) values)[i]];
+  default:
+    return ((const float *) values)[i];
+  }
+}
+
+/** Returns the symbol of the grammar vocabulary for a symbol of a binary n-gram.
+ * The symbols are inserted in the vocabulary the first time they are used, as the n-gram parser does
+ * @param grammar the grammar
+ * @param strings the symbols of the file
+ * @param offsets the offset of each symbol in strings
+ * @param num_symbols the number of symbols of the file
+ * @param symbols the symbols of the vocabulary found so far or VOCAB_NONE
+ * @param s the symbol of the file
+ * @return the symbol of the vocabulary
+ */
+static symbol_t binary_ngram_symbol(grammar_t *grammar, const char *strings, const int32_t *offsets, int num_symbols, symbol_t *symbols, int32_t s) {
+  REQUIRE(s >= 0 && s < num_symbols, "Incorrect symbol number in binary n-gram");
+  if (symbols[s] == VOCAB_NONE) {
+    switch (grammar->vocab_type) {
+    case GV_BILINGUAL:
+      symbols[s] = extended_vocab_insert_symbol(grammar->vocab, strings + offsets[s], -1);
+      break;
+    case GV_INPUT:
+      symbols[s] = vocab_insert_symbol(grammar->vocab->in, strings + offsets[s], -1);
+      break;
+    case GV_OUTPUT:
+      symbols[s] = vocab_insert_symbol(grammar->vocab->out, strings + offsets[s], -1);
+      break;
+    default:
+      ERROR("Invalid grammar vocab type\n");
+    }
+  }
+  return symbols[s];
+}
+
+/** Loads an n-gram saved with grammar_write_binary_ngram().
+ * The file is read with a single fread once its header gives its size, and the states
+ * are filled in a single pass over its arrays. The states point to each other and to
+ * symbols of the vocabulary, so the arrays of the file cannot be used in place. The
+ * quantized probabilities and backoff weights are decoded into floats, so the grammar
+ * takes the same memory whatever the bits of the file
+ * @param grammar an empty grammar
+ * @param file the binary n-gram. It does not need to be seekable
+ */
+static void grammar_load_binary_ngram(grammar_t *grammar, FILE *file) {
+  REQUIRE(grammar->num_states == 0, "The binary n-gram must be loaded in an empty grammar");
+
+  const size_t magic_size = sizeof(BINARY_NGRAM_MAGIC) - 1;
+  char magic[sizeof(BINARY_NGRAM_MAGIC)];
+  int32_t header[BINARY_NGRAM_HEADER_SIZE];
+  REQUIRE(fread(magic, 1, magic_size, file) == magic_size && memcmp(magic, BINARY_NGRAM_MAGIC, magic_size) == 0
+          && fread(header, sizeof(int32_t), BINARY_NGRAM_HEADER_SIZE, file) == BINARY_NGRAM_HEADER_SIZE,
+          "The file is not a binary n-gram\n");
+  REQUIRE(header[0] == BINARY_NGRAM_VERSION, "Unsupported binary n-gram version %d\n", header[0]);
+  for (int h = 1; h < BINARY_NGRAM_HEADER_SIZE; h++) {
+    REQUIRE(header[h] >= -1, "Invalid binary n-gram header\n");
+  }
+  REQUIRE(header[1] > 0 && header[2] > 0 && header[3] >= 0 && header[4] >= header[2] && header[5] >= 0 && header[6] >= 0
+          && header[7] > 0 && header[8] >= 0, "Invalid binary n-gram sizes\n");
+  REQUIRE(header[11] == 8 || header[11] == 16 || header[11] == BINARY_NGRAM_FLOAT_BITS,
+          "Invalid number of bits of the binary n-gram probabilities: %d\n", header[11]);
+  size_t offsets[MAX_BNS + 1];
+  binary_ngram_layout(header, offsets);
+
+  // the sections are read after the header, at the offsets they have in the file
+  const size_t header_size = magic_size + sizeof(header);
+  char *data = (char *) malloc(offsets[MAX_BNS]);
+  MEMTEST(data);
+  REQUIRE(fread(data + header_size, 1, offsets[MAX_BNS] - header_size, file) == offsets[MAX_BNS] - header_size,
+          "The binary n-gram is truncated\n");
+
+  const int num_states = header[2], num_words = header[3], num_names = header[4], num_symbols = header[5], bits = header[11];
+  const int num_codes = (bits < BINARY_NGRAM_FLOAT_BITS) ? 1 << bits : 0;
+  const binary_ngram_entry_t *initial = (const binary_ngram_entry_t *) (data + offsets[BNS_INITIAL]);
+  const binary_ngram_entry_t *end = (const binary_ngram_entry_t *) (data + offsets[BNS_END]);
+  const binary_ngram_state_t *states = (const binary_ngram_state_t *) (data + offsets[BNS_STATES]);
+  const binary_ngram_word_t *words = (const binary_ngram_word_t *) (data + offsets[BNS_WORDS]);
+  const void *probs = data + offsets[BNS_PROBS];
+  const void *backoffs = data + offsets[BNS_BACKOFFS];
+  const float *codebooks = (const float *) (data + offsets[BNS_CODEBOOKS]);
+  const int32_t *names = (const int32_t *) (data + offsets[BNS_NAMES]);
+  const int32_t *symbol_offsets = (const int32_t *) (data + offsets[BNS_SYMBOL_OFFSETS]);
+  const char *strings = data + offsets[BNS_SYMBOLS];
+  REQUIRE(header[6] > 0 && strings[header[6] - 1] == '\0', "Invalid binary n-gram symbols\n");
+  for (int s = 0; s < num_symbols; s++) {
+    REQUIRE(symbol_offsets[s] >= 0 && symbol_offsets[s] < header[6], "Invalid binary n-gram symbols\n");
+  }
+
+  symbol_t *symbols = (symbol_t *) malloc(num_symbols * sizeof(symbol_t));
+  MEMTEST(symbols);
+  for (int s = 0; s < num_symbols; s++) symbols[s] = VOCAB_NONE;
+
+  // the initial and end states depend on the start and end words
+  symbol_t start = (header[9] != -1) ? binary_ngram_symbol(grammar, strings, symbol_offsets, num_symbols, symbols, header[9]) : VOCAB_NONE;
+  symbol_t end_word = (header[10] != -1) ? binary_ngram_symbol(grammar, strings, symbol_offsets, num_symbols, symbols, header[10]) : VOCAB_NONE;
+  REQUIRE(start == grammar->start, "The binary n-gram was converted with a different start word\n");
+  REQUIRE(end_word == grammar->end, "The binary n-gram was converted with a different end word\n");
+
+  grammar_block_t *block = (grammar_block_t *) malloc(sizeof(grammar_block_t));
+  MEMTEST(block);
+  block->num_states = num_states;
+  block->num_words = num_words;
+  block->states = (state_grammar_t *) malloc(num_states * sizeof(state_grammar_t));
+  MEMTEST(block->states);
+  block->words = (words_state_t *) malloc((num_words > 0 ? num_words : 1) * sizeof(words_state_t));
+  MEMTEST(block->words);
+  block->names = (symbol_t *) malloc(num_names * sizeof(symbol_t));
+  MEMTEST(block->names);
+  grammar->block = block;
+
+  grammar->vector = (state_grammar_t **) realloc(grammar->vector, num_states * sizeof(state_grammar_t *));
+  MEMTEST(grammar->vector);
+  grammar->num_states = num_states;
+  grammar->n = header[1];
+  grammar->is_ngram = true;
+
+  for (int i = 0; i < num_names; i++) {
+    block->names[i] = (names[i] != -1) ? binary_ngram_symbol(grammar, strings, symbol_offsets, num_symbols, symbols, names[i]) : VOCAB_NONE;
+  }
+  REQUIRE(block->names[num_names - 1] == VOCAB_NONE, "Invalid binary n-gram state names\n");
+
+  for (int i = 0; i < num_states; i++) {
+    const binary_ngram_state_t *bs = &states[i];
+    REQUIRE(bs->first_word >= 0 && bs->num_words >= 0 && bs->first_word <= num_words - bs->num_words
+            && bs->first_name >= 0 && bs->first_name < num_names
+            && bs->state_bo >= -1 && bs->state_bo < num_states, "Invalid binary n-gram state %d\n", i);
+    state_grammar_t *state = &block->states[i];
+    state->words = block->words + bs->first_word;
+    state->num_words = bs->num_words;
+    state->name = block->names + bs->first_name;
+    const int order = binary_ngram_order(state->name, grammar->n);
+    state->bo = binary_ngram_value(backoffs, bits, codebooks + (grammar->n + order - 1) * num_codes, i);
+    state->state_bo = (bs->state_bo != -1) ? &block->states[bs->state_bo] : STATE_NONE;
+    state->num_state = i;
+    state->search.type = SS_NO_SEARCH;
+    state->search.data = NULL;
+    grammar->vector[i] = state;
+
+    for (int w = bs->first_word; w < bs->first_word + bs->num_words; w++) {
+      REQUIRE(words[w].state_next >= 0 && words[w].state_next < num_states, "Incorrect state number in grammar");
+      block->words[w].word = binary_ngram_symbol(grammar, strings, symbol_offsets, num_symbols, symbols, words[w].word);
+      block->words[w].prob = binary_ngram_value(probs, bits, codebooks + (order - 1) * num_codes, w);
+      block->words[w].state_next = &block->states[words[w].state_next];
+    }
+  }
+
+  for (int l = 0; l < header[7] + header[8]; l++) {
+    const binary_ngram_entry_t *entry = (l < header[7]) ? &initial[l] : &end[l - header[7]];
+    REQUIRE(entry->state >= 0 && entry->state < num_states, "Incorrect state number in grammar");
+    list_states_append((l < header[7]) ? grammar->list_initial : grammar->list_end, &block->states[entry->state], entry->prob);
+  }
+
+  // the silence is forced as the n-gram parser does, since it does not depend on the file
+  if (grammar->silence != VOCAB_NONE && grammar->force_silence) {
+    REQUIRE(grammar->list_initial->num_elements == 1, "An n-gram has a single initial state");
+    state_grammar_t *initial_state = state_grammar_create();
+    grammar_append(grammar, initial_state);
+    state_grammar_append(initial_state, grammar->silence, .0, grammar->list_initial->vector[0].state);
+    grammar->list_initial->vector[0].state = initial_state;
+  }
+
+  free(symbols);
+  free(data);
+}
+
+/** Returns the memory taken by the states of a grammar, their words and their names, and by the
+ * table that finds their words. The searches of the words of each state are not counted
+ * @param grammar the grammar
+ * @return the number of bytes
+ */
+size_t grammar_size(const grammar_t *grammar) {
+  size_t size = grammar->num_states * (sizeof(state_grammar_t *) + sizeof(state_grammar_t));
+  for (int i = 0; i < grammar->num_states; i++) {
+    const state_grammar_t *state = grammar->vector[i];
+    size += state->num_words * sizeof(words_state_t);
+    if (state->name != NULL) size += (symlen(state->name) + 1) * sizeof(symbol_t);
+  }
+  if (grammar->word_hash != NULL) size += (grammar->word_hash->mask + 1) * sizeof(int);
+  return size;
+}
+
 ///Load grammar
 /**
 @param grammar Grammar
@@ -302,11 +712,16 @@ void grammar_load(grammar_t *grammar, FILE *file, grammar_type_t type) {
     grammar_load_phrase_table(grammar, file);
 //  } else if (type == LAT_GRAMMAR) {
 //    grammar_load_lat(grammar, file);
+  } else if (type == BINARY_NGRAM_GRAMMAR) {
+    // the words were sorted when the n-gram was converted
+    grammar_load_binary_ngram(grammar, file);
+    return;
   } else {
     FAIL("Unknown type of grammar\n");
   }
 
   grammar_sort_by_prob(grammar);
+  grammar_freeze(grammar);
   //XXX: the build word search process is quite consuming for large
   //     corpus (WSJ 64K). For this reason, we move the function out.
   //     Just call it in case it is needed.
@@ -333,6 +748,8 @@ grammar_t * grammar_create(lex_t *lex, extended_vocab_t *vocab) {
   grammar->pause   = VOCAB_NONE;
   grammar->start   = VOCAB_NONE;
   grammar->end     = VOCAB_NONE;
+  grammar->block   = NULL;
+  grammar->word_hash = NULL;
 
   grammar->num_states = 0;
 
@@ -362,6 +779,8 @@ grammar_t * grammar_create_secondary(grammar_t *base_grammar, grammar_vocab_type
   MEMTEST(grammar);
 
   *grammar = *base_grammar;
+  grammar->block = NULL;
+  grammar->word_hash = NULL;
 
   grammar->vector = (state_grammar_t **) malloc(sizeof(state_grammar_t *));
   MEMTEST(grammar->vector);
@@ -404,9 +823,22 @@ void state_grammar_delete(state_grammar_t *state) {
 */
 void grammar_delete(grammar_t *grammar){
   for (int i = 0; i < grammar->num_states; i++) {
-    state_grammar_delete(grammar->vector[i]);
+    if (grammar->block != NULL && i < grammar->block->num_states) {
+      // the words and the name are in the block
+      state_grammar_delete_word_search(grammar->vector[i]);
+    }
+    else {
+      state_grammar_delete(grammar->vector[i]);
+    }
   }
   free(grammar->vector);
+  word_hash_delete(grammar->word_hash);
+  if (grammar->block != NULL) {
+    free(grammar->block->states);
+    free(grammar->block->words);
+    free(grammar->block->names);
+    free(grammar->block);
+  }
 
   free(grammar->list_initial->vector);
   free(grammar->list_initial);
@@ -547,3 +979,424 @@ void grammar_write_slf(const grammar_t *grammar, FILE* file) {
   }
 
 }
+
+/** Writes a section of a binary n-gram after padding the file up to its offset
+ * @param file the output file
+ * @param position number of bytes written so far. It is updated
+ * @param offset offset of the section
+ * @param data the section
+ * @param size size of the section in bytes
+ * @return false if the file couldn't be written
+ */
+static bool binary_ngram_write_section(FILE *file, size_t *position, size_t offset, const void *data, size_t size) {
+  bool ok = true;
+  for (; *position < offset && ok; (*position)++) ok = fputc('\0', file) != EOF;
+  ok = ok && (size == 0 || fwrite(data, size, 1, file) == 1);
+  *position += size;
+  return ok;
+}
+
+///compares two floats
+static int binary_ngram_float_cmp(const void *a, const void *b) {
+  const float f1 = *(const float *) a, f2 = *(const float *) b;
+  return (f1 > f2) - (f1 < f2);
+}
+
+/** Quantizes the probabilities or the backoff weights of an n-gram with a codebook per order.
+ * The values of each order are sorted and split into bins with the same number of values, and
+ * each code is the mean of its bin, so that the frequent values get more codes. Then the codes
+ * are refined with Lloyd iterations, so that the values that are far from the rest, like the
+ * highest probabilities, get their own codes. If there are less different values than codes,
+ * the codes are the values themselves. The last code is kept for LOG_ZERO. Each value is
+ * replaced with its nearest code
+ * @param values the values
+ * @param orders the order of each value, from 1 to n
+ * @param num_values the number of values
+ * @param n the order of the n-gram
+ * @param bits 8 or 16
+ * @param codebooks the n codebooks of 1 << bits floats. They are filled
+ * @param codes the code of each value, as uint8_t or uint16_t. They are filled
+ */
+static void binary_ngram_quantize(const float *values, const int *orders, int num_values, int n, int bits, float *codebooks, void *codes) {
+  const int num_codes = 1 << bits;
+  float *sorted = (float *) malloc((num_values > 0 ? num_values : 1) * sizeof(float));
+  MEMTEST(sorted);
+  for (int o = 1; o <= n; o++) {
+    float *codebook = codebooks + (o - 1) * num_codes;
+    int num_sorted = 0;
+    for (int v = 0; v < num_values; v++) {
+      if (orders[v] == o && !is_logzero(values[v])) sorted[num_sorted++] = values[v];
+    }
+    qsort(sorted, num_sorted, sizeof(float), binary_ngram_float_cmp);
+
+    int num_different = 0;
+    for (int v = 0; v < num_sorted && num_different < num_codes; v++) {
+      if (v == 0 || sorted[v] != sorted[v - 1]) num_different++;
+    }
+    if (num_different > 0 && num_different < num_codes) {
+      // the codes are kept sorted by repeating the last value
+      int c = 0;
+      for (int v = 0; v < num_sorted; v++) {
+        if (v == 0 || sorted[v] != sorted[v - 1]) codebook[c++] = sorted[v];
+      }
+      for (; c < num_codes - 1; c++) codebook[c] = codebook[c - 1];
+    }
+    else {
+      // the bins that are empty because there are few values take the value where they start
+      for (int c = 0; c < num_codes - 1; c++) {
+        const int first = (int) ((int64_t) c * num_sorted / (num_codes - 1));
+        const int last = (int) ((int64_t) (c + 1) * num_sorted / (num_codes - 1));
+        if (first < last) {
+          double sum = 0;
+          for (int v = first; v < last; v++) sum += sorted[v];
+          codebook[c] = sum / (last - first);
+        }
+        else {
+          codebook[c] = (num_sorted > 0) ? sorted[(first < num_sorted) ? first : num_sorted - 1] : 0;
+        }
+      }
+      // each code moves to the mean of the values that are nearer to it than to the next code,
+      // which keeps the codes sorted
+      for (int i = 0; i < BINARY_NGRAM_QUANTIZATION_ITERATIONS; i++) {
+        int v = 0;
+        for (int c = 0; c < num_codes - 1; c++) {
+          const float limit = (c < num_codes - 2) ? (codebook[c] + codebook[c + 1]) / 2 : FLT_MAX;
+          double sum = 0;
+          int count = 0;
+          for (; v < num_sorted && sorted[v] <= limit; v++, count++) sum += sorted[v];
+          if (count > 0) codebook[c] = sum / count;
+        }
+      }
+    }
+    codebook[num_codes - 1] = LOG_ZERO;
+
+    for (int v = 0; v < num_values; v++) {
+      if (orders[v] != o) continue;
+      int code = num_codes - 1;
+      if (!is_logzero(values[v])) {
+        // the codes are sorted, so the nearest one is the first one that is not smaller or the previous one
+        int left = 0, right = num_codes - 2;
+        while (left < right) {
+          const int middle = (left + right) / 2;
+          if (codebook[middle] < values[v]) left = middle + 1;
+          else right = middle;
+        }
+        code = left;
+        if (code > 0 && values[v] - codebook[code - 1] < codebook[code] - values[v]) code--;
+      }
+      if (bits == 8) ((uint8_t *) codes)[v] = code;
+      else ((uint16_t *) codes)[v] = code;
+    }
+  }
+  free(sorted);
+}
+
+/** writes an n-gram in binary format, so that grammar_load() reads it with BINARY_NGRAM_GRAMMAR
+ * without parsing it. The numbers are written in the byte order of the machine, and the start
+ * and end words of the grammar must be the same when it is loaded
+ *
+ * @param grammar the n-gram, loaded without forcing the silence
+ * @param file the output file
+ * @param bits bits of the probabilities and backoff weights in the file: 8 or 16 to quantize them
+ *        with a codebook per order, or 32 to keep them as floats. Quantization only shrinks
+ *        the file, since they are loaded back as floats
+ */
+void grammar_write_binary_ngram(const grammar_t *grammar, FILE* file, int bits) {
+  REQUIRE(grammar->is_ngram && grammar->n > 0, "Only n-grams can be written in binary format");
+  REQUIRE(bits == 8 || bits == 16 || bits == BINARY_NGRAM_FLOAT_BITS, "The probabilities can only be written with 8, 16 or 32 bits\n");
+  REQUIRE(grammar->silence == VOCAB_NONE || !grammar->force_silence, "The silence is forced when the binary n-gram is loaded");
+
+  const vocab_t *vocab = NULL;
+  switch (grammar->vocab_type) {
+  case GV_BILINGUAL:
+    vocab = grammar->vocab->extended;
+    break;
+  case GV_INPUT:
+    vocab = grammar->vocab->in;
+    break;
+  case GV_OUTPUT:
+    vocab = grammar->vocab->out;
+    break;
+  default:
+    ERROR("Invalid grammar vocab type\n");
+  }
+
+  // the symbols of the file are the ones of the vocabulary
+  const int num_symbols = vocab->last;
+  int32_t *symbol_offsets = (int32_t *) malloc((num_symbols > 0 ? num_symbols : 1) * sizeof(int32_t));
+  MEMTEST(symbol_offsets);
+  size_t symbols_size = 0;
+  for (int s = 0; s < num_symbols; s++) {
+    symbol_offsets[s] = symbols_size;
+    symbols_size += strlen(vocab_get_string(vocab, (symbol_t) s)) + 1;
+  }
+  char *strings = (char *) malloc(symbols_size > 0 ? symbols_size : 1);
+  MEMTEST(strings);
+  for (int s = 0; s < num_symbols; s++) {
+    strcpy(strings + symbol_offsets[s], vocab_get_string(vocab, (symbol_t) s));
+  }
+
+  int num_words = 0, num_names = 0;
+  for (int i = 0; i < grammar->num_states; i++) {
+    num_words += grammar->vector[i]->num_words;
+    num_names += symlen(grammar->vector[i]->name) + 1;
+  }
+  binary_ngram_state_t *states = (binary_ngram_state_t *) malloc(grammar->num_states * sizeof(binary_ngram_state_t));
+  MEMTEST(states);
+  binary_ngram_word_t *words = (binary_ngram_word_t *) malloc((num_words > 0 ? num_words : 1) * sizeof(binary_ngram_word_t));
+  MEMTEST(words);
+  int32_t *names = (int32_t *) malloc(num_names * sizeof(int32_t));
+  MEMTEST(names);
+  // the probabilities of the words and then the backoff weights of the states, with their orders
+  const int num_values = num_words + grammar->num_states;
+  float *values = (float *) malloc(num_values * sizeof(float));
+  MEMTEST(values);
+  int *orders = (int *) malloc(num_values * sizeof(int));
+  MEMTEST(orders);
+
+  int w = 0, c = 0;
+  for (int i = 0; i < grammar->num_states; i++) {
+    const state_grammar_t *state = grammar->vector[i];
+    states[i].first_word = w;
+    states[i].num_words = state->num_words;
+    states[i].first_name = c;
+    states[i].state_bo = state_grammar_get_index(state->state_bo);
+    const int order = binary_ngram_order(state->name, grammar->n);
+    values[num_words + i] = state->bo;
+    orders[num_words + i] = order;
+    for (int m = 0; m < state->num_words; m++, w++) {
+      REQUIRE(state->words[m].state_next != STATE_NONE, "The n-gram has a word without target state");
+      words[w].word = state->words[m].word;
+      words[w].state_next = state->words[m].state_next->num_state;
+      values[w] = state->words[m].prob;
+      orders[w] = order;
+    }
+    for (const symbol_t *sym = state->name; *sym != VOCAB_NONE; sym++) names[c++] = *sym;
+    names[c++] = -1;
+  }
+
+  const int num_initial = grammar->list_initial->num_elements, num_end = grammar->list_end->num_elements;
+  binary_ngram_entry_t *entries = (binary_ngram_entry_t *) malloc((num_initial + num_end + 1) * sizeof(binary_ngram_entry_t));
+  MEMTEST(entries);
+  for (int l = 0; l < num_initial + num_end; l++) {
+    const prob_state_t *ps = (l < num_initial) ? &grammar->list_initial->vector[l] : &grammar->list_end->vector[l - num_initial];
+    entries[l].state = ps->state->num_state;
+    entries[l].prob = ps->prob;
+  }
+
+  const int32_t header[BINARY_NGRAM_HEADER_SIZE] = { BINARY_NGRAM_VERSION, grammar->n, grammar->num_states, num_words, num_names,
+                                                     num_symbols, symbols_size, num_initial, num_end,
+                                                     (grammar->start != VOCAB_NONE) ? grammar->start : -1,
+                                                     (grammar->end != VOCAB_NONE) ? grammar->end : -1, bits };
+  size_t offsets[MAX_BNS + 1];
+  binary_ngram_layout(header, offsets);
+
+  const size_t codebooks_size = offsets[BNS_CODEBOOKS + 1] - offsets[BNS_CODEBOOKS];
+  float *codebooks = NULL;
+  void *codes = values;
+  if (bits < BINARY_NGRAM_FLOAT_BITS) {
+    codebooks = (float *) malloc(codebooks_size);
+    MEMTEST(codebooks);
+    codes = malloc(num_values * (bits / 8));
+    MEMTEST(codes);
+    // the probabilities and the backoff weights have their own codebooks
+    binary_ngram_quantize(values, orders, num_words, grammar->n, bits, codebooks, codes);
+    binary_ngram_quantize(values + num_words, orders + num_words, grammar->num_states, grammar->n, bits,
+                          codebooks + grammar->n * (1 << bits), (char *) codes + num_words * (bits / 8));
+  }
+
+  size_t position = sizeof(BINARY_NGRAM_MAGIC) - 1 + sizeof(header);
+  bool ok = fputs(BINARY_NGRAM_MAGIC, file) != EOF;
+  ok = ok && fwrite(header, sizeof(header), 1, file) == 1;
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_INITIAL], entries, num_initial * sizeof(binary_ngram_entry_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_END], entries + num_initial, num_end * sizeof(binary_ngram_entry_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_STATES], states, grammar->num_states * sizeof(binary_ngram_state_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_WORDS], words, num_words * sizeof(binary_ngram_word_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_PROBS], codes, num_words * (bits / 8));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_BACKOFFS], (char *) codes + num_words * (bits / 8),
+                                        grammar->num_states * (bits / 8));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_CODEBOOKS], codebooks, codebooks_size);
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_NAMES], names, num_names * sizeof(int32_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_SYMBOL_OFFSETS], symbol_offsets, num_symbols * sizeof(int32_t));
+  ok = ok && binary_ngram_write_section(file, &position, offsets[BNS_SYMBOLS], strings, symbols_size);
+  CHECK_SYS_ERROR(ok, "Couldn't write the binary n-gram\n");
+
+  if (codes != values) free(codes);
+  free(codebooks);
+  free(orders);
+  free(values);
+  free(entries);
+  free(names);
+  free(words);
+  free(states);
+  free(strings);
+  free(symbol_offsets);
+}
+
+/** Creates a cache of the words that can follow the states of an n-gram
+ * @param grammar the n-gram
+ * @param capacity maximum number of states whose words are kept
+ * @param admission number of requests of a state that merge its words. Until then, they are not merged
+ * @return the cache
+ */
+grammar_successors_t *grammar_successors_create(const grammar_t *grammar, int capacity, int admission) {
+  REQUIRE(grammar->is_ngram, "Only the states of an n-gram have backoff states to merge");
+  REQUIRE(capacity > 0, "The successor cache needs at least one entry");
+  REQUIRE(admission > 0, "A state must be requested at least once to merge its words");
+
+  grammar_successors_t *successors = (grammar_successors_t *) calloc(1, sizeof(grammar_successors_t));
+  MEMTEST(successors);
+  successors->grammar = grammar;
+  successors->capacity = capacity;
+  successors->admission = admission;
+  successors->head = -1;
+  successors->tail = -1;
+  successors->words = (successor_t **) calloc(capacity, sizeof(successor_t *));
+  MEMTEST(successors->words);
+  successors->num_words = (int *) calloc(capacity, sizeof(int));
+  MEMTEST(successors->num_words);
+  successors->size = (int *) calloc(capacity, sizeof(int));
+  MEMTEST(successors->size);
+  successors->entry_state = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(successors->entry_state);
+  successors->prev = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(successors->prev);
+  successors->next = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(successors->next);
+  successors->state_entry = (int *) malloc(grammar->num_states * sizeof(int));
+  MEMTEST(successors->state_entry);
+  for (int s = 0; s < grammar->num_states; s++) successors->state_entry[s] = -1;
+  successors->state_requests = (int *) calloc(grammar->num_states, sizeof(int));
+  MEMTEST(successors->state_requests);
+  return successors;
+}
+
+/** Deletes a cache of the words that can follow the states of an n-gram
+ * @param successors the cache
+ */
+void grammar_successors_delete(grammar_successors_t *successors) {
+  if (successors == NULL) return;
+  TRACE(1, "Successor words merged for %d grammar states\n", successors->num_misses);
+  for (int e = 0; e < successors->capacity; e++) free(successors->words[e]);
+  free(successors->words);
+  free(successors->num_words);
+  free(successors->size);
+  free(successors->entry_state);
+  free(successors->prev);
+  free(successors->next);
+  free(successors->state_entry);
+  free(successors->state_requests);
+  free(successors->visit);
+  free(successors);
+}
+
+///compares the probability of two successors. Ties are broken by word so that the order does not depend on qsort
+static int successor_prob_cmp(const void *va, const void *vb) {
+  const successor_t *a = (const successor_t *) va;
+  const successor_t *b = (const successor_t *) vb;
+  if (a->prob < b->prob) return 1;
+  if (a->prob > b->prob) return -1;
+  return (a->word > b->word) - (a->word < b->word);
+}
+
+/** Merges the words of a state with the ones of its backoff states.
+ * A word is taken from the first state of the backoff chain that has it, and
+ * the chain ends at the first state that cannot back off
+ * @param successors the cache
+ * @param state the grammar state
+ * @param entry the entry in which the words are stored
+ */
+static void grammar_successors_merge(grammar_successors_t *successors, int state, int entry) {
+  const grammar_t *grammar = successors->grammar;
+
+  int total = 0;
+  for (const state_grammar_t *s = grammar_get_state(grammar, state); s != STATE_NONE; s = s->state_bo) {
+    total += s->num_words;
+    if (is_logzero(s->bo)) break;
+  }
+  if (total > successors->size[entry]) {
+    successors->words[entry] = (successor_t *) realloc(successors->words[entry], total * sizeof(successor_t));
+    MEMTEST(successors->words[entry]);
+    successors->size[entry] = total;
+  }
+  // the vocabulary can grow after the grammar is loaded
+  if (grammar->vocab->extended->last > successors->num_visit) {
+    successors->visit = (int *) realloc(successors->visit, grammar->vocab->extended->last * sizeof(int));
+    MEMTEST(successors->visit);
+    memset(successors->visit + successors->num_visit, 0, (grammar->vocab->extended->last - successors->num_visit) * sizeof(int));
+    successors->num_visit = grammar->vocab->extended->last;
+  }
+
+  successor_t *words = successors->words[entry];
+  const int visit = successors->num_misses + 1;
+  int n = 0;
+  float backoff = 0;
+  for (const state_grammar_t *s = grammar_get_state(grammar, state); s != STATE_NONE; s = s->state_bo) {
+    for (int m = 0; m < s->num_words; m++) {
+      if (successors->visit[s->words[m].word] == visit) continue;
+      successors->visit[s->words[m].word] = visit;
+      words[n].state_next = s->words[m].state_next;
+      words[n].word = s->words[m].word;
+      words[n].prob = s->words[m].prob + backoff;
+      words[n].history = s->num_state;
+      n++;
+    }
+    if (is_logzero(s->bo)) break;
+    backoff += s->bo;
+  }
+  qsort(words, n, sizeof(successor_t), successor_prob_cmp);
+  successors->num_words[entry] = n;
+}
+
+/** Returns the words that can follow a state of an n-gram, merged with the ones
+ * of its backoff states and sorted by probability
+ * @param successors the cache
+ * @param state the grammar state
+ * @param num_words the number of words
+ * @return the words or NULL if the state has not been requested enough times to merge
+ *         them. They are valid until the next call
+ */
+const successor_t *grammar_successors_get(grammar_successors_t *successors, int state, int *num_words) {
+  int entry = successors->state_entry[state];
+
+  if (entry == -1) {
+    // states that are rarely requested are not worth merging
+    if (++successors->state_requests[state] < successors->admission) return NULL;
+    successors->state_requests[state] = 0;
+
+    // take a free entry or evict the least recently used one
+    if (successors->num_entries < successors->capacity) {
+      entry = successors->num_entries++;
+    }
+    else {
+      entry = successors->tail;
+      successors->state_entry[successors->entry_state[entry]] = -1;
+      successors->tail = successors->prev[entry];
+      if (successors->tail != -1) successors->next[successors->tail] = -1;
+      else successors->head = -1;
+    }
+    successors->entry_state[entry] = state;
+    successors->state_entry[state] = entry;
+    grammar_successors_merge(successors, state, entry);
+    successors->num_misses++;
+  }
+  else if (entry != successors->head) {
+    // unlink the entry before moving it to the front
+    successors->next[successors->prev[entry]] = successors->next[entry];
+    if (successors->next[entry] != -1) successors->prev[successors->next[entry]] = successors->prev[entry];
+    else successors->tail = successors->prev[entry];
+  }
+  else {
+    *num_words = successors->num_words[entry];
+    return successors->words[entry];
+  }
+
+  // the entry is the most recently used one
+  successors->prev[entry] = -1;
+  successors->next[entry] = successors->head;
+  if (successors->head != -1) successors->prev[successors->head] = entry;
+  successors->head = entry;
+  if (successors->tail == -1) successors->tail = entry;
+  *num_words = successors->num_words[entry];
+  return successors->words[entry];
+}
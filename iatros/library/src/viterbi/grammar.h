@@ -19,7 +19,7 @@ extern "C" {
 /// type of grammar vocabulary
 typedef enum { GV_BILINGUAL, GV_INPUT, GV_OUTPUT, MAX_GV} grammar_vocab_type_t;
 /// type of grammar
-typedef enum { FSM_GRAMMAR = 0, NGRAM_GRAMMAR, PHRASE_TABLE_GRAMMAR, LAT_GRAMMAR, MAX_GRAMMAR_TYPE } grammar_type_t;
+typedef enum { FSM_GRAMMAR = 0, NGRAM_GRAMMAR, PHRASE_TABLE_GRAMMAR, LAT_GRAMMAR, BINARY_NGRAM_GRAMMAR, MAX_GRAMMAR_TYPE } grammar_type_t;
 
 /// Initial and end states
 typedef struct prob_state {
@@ -51,6 +51,19 @@ struct state_grammar_t {
   state_search_t search;
 };
 #define STATE_NONE NULL
+/// Index of STATE_NONE
+#define STATE_INDEX_NONE -1
+
+/** Arrays that hold the states of a frozen grammar or of an n-gram loaded in binary format, instead of
+ * allocating them one by one. The words of each state follow the ones of the previous state
+ */
+typedef struct {
+  state_grammar_t *states; ///< the states, which are the first ones of the grammar
+  int num_states;          ///< number of states
+  words_state_t *words;    ///< words of all the states
+  int num_words;           ///< number of words
+  symbol_t *names;         ///< names of all the states
+} grammar_block_t;
 
 /// Grammar.
 typedef struct grammar_t {
@@ -71,28 +84,75 @@ typedef struct grammar_t {
   symbol_t pause; ///< Number of word short pause
   symbol_t start; ///< Number of word intial
   symbol_t end; ///< Number of word end
+  grammar_block_t *block; ///< If != NULL, the states that were frozen or loaded from a binary n-gram. Grammars copied from this one must not share it
+  word_hash_t *word_hash; ///< If != NULL, the table that finds the words of the states of the block. Grammars copied from this one must not share it
 } grammar_t;
 
+/// A word that can follow an n-gram state, found in the state or in one of its backoff states
+typedef struct {
+  state_grammar_t *state_next; ///< state reached with the word
+  symbol_t word;               ///< extended word
+  float prob;                  ///< probability of the word, including the backoff weights to reach its state
+  int history;                 ///< number of the state in which the word was found
+} successor_t;
+
+/** Words that can follow the states of an n-gram. The words of a state are merged
+ * with the ones of its backoff states that it does not have, and they are sorted
+ * by probability, so that they can be expanded in a single pass. Merging a state
+ * walks its whole backoff chain, so the words of a state are only merged once it
+ * has been requested admission times since it was last evicted, and the least
+ * recently used states are evicted when the cache is full
+ */
+typedef struct {
+  const grammar_t *grammar; ///< the n-gram
+  int capacity;             ///< maximum number of states in the cache
+  int admission;            ///< number of requests of a state not in the cache that merge its words
+  int num_entries;          ///< number of entries in use
+  successor_t **words;      ///< merged words of each entry. They are allocated when first used
+  int *num_words;           ///< number of merged words of each entry
+  int *size;                ///< number of allocated words of each entry
+  int *entry_state;         ///< grammar state of each entry
+  int *prev;                ///< previous entry in the list of recently used entries or -1
+  int *next;                ///< next entry in the list of recently used entries or -1
+  int head;                 ///< most recently used entry or -1
+  int tail;                 ///< least recently used entry or -1
+  int *state_entry;         ///< entry of each grammar state or -1 if it is not in the cache
+  int *state_requests;      ///< requests of each grammar state since it was last evicted, while it is not in the cache
+  int *visit;               ///< number of the last merge in which each word was found, to ignore it in the next backoff states
+  int num_visit;            ///< number of words in visit
+  int num_misses;           ///< number of times that the words of a state were merged
+} grammar_successors_t;
+
 grammar_type_t get_grammar_type(const char *grammar_type_str);
 grammar_t * grammar_create(lex_t *lex, extended_vocab_t *vocab);
 grammar_t * grammar_create_secondary(grammar_t *base_grammar, grammar_vocab_type_t vocab_type);
 void grammar_delete(grammar_t *grammar);
+size_t grammar_size(const grammar_t *grammar);
 void grammar_load(grammar_t *grammar, FILE *aux, grammar_type_t type);
 bool grammar_is_end_word(const grammar_t *grammar, symbol_t word);
 int  grammar_is_final_state(const grammar_t *grammar, const state_grammar_t * state);
 int  grammar_is_initial_state(const grammar_t *grammar, state_grammar_t * state);
 void grammar_append(grammar_t *grammar, state_grammar_t * state_grammar);
+INLINE state_grammar_t *grammar_get_state(const grammar_t *grammar, int index);
 void grammar_convert_indexes_to_pointers(grammar_t *grammar);
 void grammar_sort_by_prob(grammar_t *grammar);
+void grammar_freeze(grammar_t *grammar);
 void grammar_build_word_search(grammar_t *grammar);
+void grammar_build_word_hash(grammar_t *grammar, const vocab_t *vocab);
 void grammar_write_dot(const grammar_t *grammar, FILE* file);
 void grammar_write_slf(const grammar_t *grammar, FILE* file);
+void grammar_write_binary_ngram(const grammar_t *grammar, FILE* file, int bits);
+
+grammar_successors_t *grammar_successors_create(const grammar_t *grammar, int capacity, int admission);
+void grammar_successors_delete(grammar_successors_t *successors);
+const successor_t *grammar_successors_get(grammar_successors_t *successors, int state, int *num_words);
 
 
 state_grammar_t *state_grammar_create();
 int state_grammar_append(state_grammar_t * state, symbol_t word, float prob, state_grammar_t * state_next);
 void state_grammar_set_name(state_grammar_t * state, symbol_t *syms);
 void state_grammar_delete(state_grammar_t *state);
+INLINE int state_grammar_get_index(const state_grammar_t *state);
 
 void list_states_clear(list_states_t *list);
 void list_states_append(list_states_t *list, state_grammar_t *state_id, float prob);
@@ -15,6 +15,23 @@
 #include <prhlt/trace.h>
 #include <prhlt/vector.h>
 
+/// multiplier of the hash of the words of the states. 2^64 divided by the golden ratio
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+/// states of a frozen grammar with fewer words are searched linearly in their contiguous words,
+/// which is faster than the table for them
+#define WORD_HASH_MIN_WORDS 16
+
+///tells whether the words of a state are so many that an array indexed by word finds them
+/**
+@param num_words the number of words of the state
+@param vocab the vocab
+@return true if the state must use direct access
+*/
+static bool use_direct_access(int num_words, const vocab_t *vocab) {
+  // we sum two just in case the grammar has <s> and </s>.
+  return num_words > 2 && num_words + 2 > vocab->last * 0.9;
+}
+
 ///compares the symbols of two word states
 int word_state_sym_cmp(const void *va, const void *vb) {
   symbol_t sa = (*((words_state_t**) va))->word;
@@ -38,8 +55,7 @@ void state_grammar_build_word_search_secondary(state_grammar_t *state, const voc
     state->search.type = SS_LINEAR_SEARCH_SECONDARY;
   }
   // second case. the number state outputs is more than 90% the vocabulary size. We use direct accessing.
-  // we sum two just in case the grammar has <s> and </s>.
-  else if (state->num_words + 2 > vocab->last * 0.9) {
+  else if (use_direct_access(state->num_words, vocab)) {
     REQUIRE(state->num_words <= vocab->last, "Incorrect number of words in state");
     state->search.data = (words_state_t **)malloc(vocab->last * sizeof(words_state_t *));
     memset(state->search.data, 0, vocab->last * sizeof(words_state_t *));
@@ -80,6 +96,9 @@ words_state_t* state_grammar_find_secondary(state_grammar_t *state, const symbol
       else return *ret;
     }
     break;
+  case SS_HASH_SECONDARY:
+    return word_hash_find((const word_hash_t *) state->search.data, state, symbol);
+    break;
   case SS_LINEAR_SEARCH_SECONDARY:
   default: {// for secondary grammars linear search and no search are equivalent
       for (words_state_t *word = state->words; word < state->words + state->num_words; word++) {
@@ -240,6 +259,91 @@ void state_grammar_build_word_search_primary(state_grammar_t *state, const exten
   }
 }
 
+/** hash of a word of a state
+@param state the number of the state
+@param symbol the word
+@return the hash
+*/
+static unsigned long long word_hash_key(int state, symbol_t symbol) {
+  unsigned long long key = (unsigned int) state | ((unsigned long long) (unsigned int) symbol << 32);
+  key *= HASH_MULTIPLIER;
+  return key ^ (key >> 29);
+}
+
+/** creates the table that finds the words of the dense states of a frozen grammar. The states
+whose words are not searched yet and have at least WORD_HASH_MIN_WORDS words are set to search
+them in the table, and the table must be deleted after them with word_hash_delete(). The states
+with fewer words are searched linearly, and the states that have almost every word of the vocab
+are left without search, so that state_grammar_build_word_search_secondary() gives them direct
+access. Those are usually the states where the backoffs end
+@param words the contiguous words of the states
+@param states the states, whose words are in words
+@param num_states the number of states
+@param vocab the vocab of the words
+@return the table
+*/
+word_hash_t *word_hash_create(const words_state_t *words, state_grammar_t *states, int num_states, const vocab_t *vocab) {
+  word_hash_t *hash = (word_hash_t *) malloc(sizeof(word_hash_t));
+  MEMTEST(hash);
+  hash->words = words;
+  long long num_words = 0;
+  for (int i = 0; i < num_states; i++) {
+    state_grammar_t *state = &states[i];
+    if (state->search.type != SS_NO_SEARCH || use_direct_access(state->num_words, vocab)) continue;
+    if (state->num_words < WORD_HASH_MIN_WORDS) state->search.type = SS_LINEAR_SEARCH_SECONDARY;
+    else num_words += state->num_words;
+  }
+  // at most half of the slots are used, so that the probes are short
+  unsigned long long n_slots = 2;
+  while (n_slots < 2 * (unsigned long long) num_words) n_slots *= 2;
+  hash->mask = n_slots - 1;
+  hash->slots = (int *) malloc(n_slots * sizeof(int));
+  MEMTEST(hash->slots);
+  memset(hash->slots, -1, n_slots * sizeof(int));
+
+  for (int i = 0; i < num_states; i++) {
+    state_grammar_t *state = &states[i];
+    if (state->search.type != SS_NO_SEARCH || use_direct_access(state->num_words, vocab)) continue;
+    for (int w = 0; w < state->num_words; w++) {
+      // the first word is kept if the state has repeated words, as in linear search
+      if (word_hash_find(hash, state, state->words[w].word) != NULL) continue;
+      unsigned long long h = word_hash_key(state->num_state, state->words[w].word);
+      while (hash->slots[h & hash->mask] != -1) h++;
+      hash->slots[h & hash->mask] = &state->words[w] - words;
+    }
+    state->search.type = SS_HASH_SECONDARY;
+    state->search.data = hash;
+  }
+  return hash;
+}
+
+/** deletes the table of words of a frozen grammar
+@param hash the table or NULL
+*/
+void word_hash_delete(word_hash_t *hash) {
+  if (hash == NULL) return;
+  free(hash->slots);
+  free(hash);
+}
+
+/** finds a word of a state in the table of words of its grammar
+@param hash the table
+@param state the state, which must be one of the states of the table
+@param symbol the word
+@return the word of the state or NULL if the state does not have it
+*/
+words_state_t *word_hash_find(const word_hash_t *hash, const state_grammar_t *state, symbol_t symbol) {
+  for (unsigned long long h = word_hash_key(state->num_state, symbol);; h++) {
+    const int index = hash->slots[h & hash->mask];
+    if (index == -1) return NULL;
+    // the words of each state are contiguous, so the state of a word is found by its position
+    const words_state_t *word = &hash->words[index];
+    if (word->word == symbol && word >= state->words && word < state->words + state->num_words) {
+      return (words_state_t *) word;
+    }
+  }
+}
+
 /// releases the memory allocated by build_word_search
 /**
  * @param state a grammar state
@@ -261,6 +365,7 @@ void state_grammar_delete_word_search(state_grammar_t *state) {
       vector_delete(vector);
     }
     break;
+  case SS_HASH_SECONDARY: // the table belongs to the grammar
   default:
     break;
   }
@@ -22,6 +22,7 @@ typedef enum {  SS_NO_SEARCH,
                 SS_LINEAR_SEARCH_SECONDARY,
                 SS_BINARY_SEARCH_SECONDARY,
                 SS_DIRECT_ACCESS_SECONDARY,
+                SS_HASH_SECONDARY,
                 SS_END_SECONDARY,
                 MAX_SS
 } search_type_t;
@@ -36,11 +37,25 @@ typedef struct state_search_t {
 typedef struct state_grammar_t state_grammar_t;
 typedef struct words_state_t words_state_t;
 
+/** Open addressing table that finds the words of the states of a frozen grammar given the
+ * number of the state and the word. The slots keep the index of the words in the contiguous
+ * array of words of the grammar, so its size depends on the number of words and not on the
+ * size of the vocabulary. Only the states with many words use it, with the SS_HASH_SECONDARY search
+ */
+typedef struct {
+  const words_state_t *words; ///< the words of all the states
+  int *slots;                 ///< index of a word in words or -1 if the slot is empty
+  unsigned long long mask;    ///< number of slots minus one. The number of slots is a power of two
+} word_hash_t;
+
 void state_grammar_build_word_search_secondary(state_grammar_t *state, const vocab_t *vocab);
 words_state_t* state_grammar_find_secondary(state_grammar_t *state, const symbol_t symbol);
 vector_t* state_grammar_find_primary(state_grammar_t *state, const symbol_t symbol);
 void state_grammar_build_word_search_primary(state_grammar_t *state, const extended_vocab_t *vocab);
 void state_grammar_delete_word_search(state_grammar_t *state);
+word_hash_t *word_hash_create(const words_state_t *words, state_grammar_t *states, int num_states, const vocab_t *vocab);
+void word_hash_delete(word_hash_t *hash);
+words_state_t *word_hash_find(const word_hash_t *hash, const state_grammar_t *state, symbol_t symbol);
 
 bool state_grammar_fill_word_state(state_grammar_t *state, words_state_t* word_state);
 
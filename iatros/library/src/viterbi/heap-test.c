@@ -0,0 +1,129 @@
+#include <prhlt/trace.h>
+#include <viterbi/heap.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_FRAMES 50
+#define NUM_KEYS 3000
+#define NUM_STATES 64
+
+/// A hypothesis that survived a frame
+typedef struct {
+  int key;
+  float score;
+} survivor_t;
+
+static int survivor_cmp(const void *a, const void *b) {
+  const survivor_t *s1 = (const survivor_t *) a, *s2 = (const survivor_t *) b;
+  if (s1->key != s2->key) return s1->key - s2->key;
+  return (s1->score > s2->score) - (s1->score < s2->score);
+}
+
+static int float_cmp(const void *a, const void *b) {
+  const float f1 = *(const float *) a, f2 = *(const float *) b;
+  return (f1 > f2) - (f1 < f2);
+}
+
+/* Prunes a frame and returns its sorted hypotheses */
+static int collect(hyp_heap_t *hh, survivor_t *survivors) {
+  int n = 0;
+  hh_prune(hh);
+  while (!hh_is_empty(hh)) {
+    const hyp_t *hyp = hh_pop(hh);
+    survivors[n].key = hyp->word;
+    survivors[n].score = hyp->probability.final;
+    n++;
+  }
+  qsort(survivors, n, sizeof(survivor_t), survivor_cmp);
+  return n;
+}
+
+/* Checks that both pruning engines keep the same hypotheses. The scores of each key
+ * grow along the frame, so that the hypotheses evicted by the heap are never
+ * recombined with better ones, and all the scores are different */
+int main (int UNUSED(argc), char *UNUSED(argv[])) {
+  const int histograms[] = { 2, 10, 100, 1000, 5000 };
+  const float beams[] = { 5, 50, 1000 };
+  const int n_hyps = 20000;
+  hyp_t *hyps = (hyp_t *) calloc(n_hyps, sizeof(hyp_t));
+  float *scores = (float *) malloc(n_hyps * sizeof(float));
+  survivor_t *heap_survivors = (survivor_t *) malloc(n_hyps * sizeof(survivor_t));
+  survivor_t *selection_survivors = (survivor_t *) malloc(n_hyps * sizeof(survivor_t));
+  int *positions = (int *) malloc(n_hyps * sizeof(int));
+  float *key_scores = (float *) malloc(n_hyps * sizeof(float));
+  int key_offsets[NUM_KEYS + 1];
+  int errors = 0;
+
+  srand(1234);
+  for (size_t h = 0; h < sizeof(histograms) / sizeof(histograms[0]); h++) {
+    for (size_t b = 0; b < sizeof(beams) / sizeof(beams[0]); b++) {
+      hyp_heap_t *heap = hh_create(histograms[h], beams[b], PE_HEAP);
+      hyp_heap_t *selection = hh_create(histograms[h], beams[b], PE_SELECTION);
+      int n_frame_errors = 0;
+
+      for (int f = 0; f < NUM_FRAMES; f++) {
+        hh_clear(heap);
+        hh_clear(selection);
+
+        // distinct scores whose order is random
+        for (int i = 0; i < n_hyps; i++) scores[i] = -100.0f * i / n_hyps;
+        for (int i = n_hyps - 1; i > 0; i--) {
+          int j = rand() % (i + 1);
+          SWAP(scores[i], scores[j], float);
+        }
+
+        const int n_keys = 1 + rand() % NUM_KEYS;
+        for (int i = 0; i < n_hyps; i++) {
+          hyp_t *hyp = &hyps[i];
+          memset(hyp, 0, sizeof(hyp_t));
+          hyp->word = (symbol_t) (rand() % n_keys);
+          hyp->state = hyp->word % NUM_STATES;
+          hyp->history = (hyp->word / NUM_STATES) % NUM_STATES;
+          hyp->phoneme = hyp->word % 40;
+          hyp->state_hmm = hyp->word % 3;
+        }
+
+        // the scores of each key are sorted so that they grow in the order of insertion.
+        // positions has the hypotheses grouped by key, in order of insertion
+        memset(key_offsets, 0, (NUM_KEYS + 1) * sizeof(int));
+        for (int i = 0; i < n_hyps; i++) key_offsets[hyps[i].word + 1]++;
+        for (int k = 0; k < n_keys; k++) key_offsets[k + 1] += key_offsets[k];
+        for (int i = 0; i < n_hyps; i++) positions[key_offsets[hyps[i].word]++] = i;
+        for (int k = 0, first = 0; k < n_keys; first = key_offsets[k], k++) {
+          for (int i = first; i < key_offsets[k]; i++) key_scores[i - first] = scores[positions[i]];
+          qsort(key_scores, key_offsets[k] - first, sizeof(float), float_cmp);
+          for (int i = first; i < key_offsets[k]; i++) hyps[positions[i]].probability.final = key_scores[i - first];
+        }
+
+        for (int i = 0; i < n_hyps; i++) {
+          hh_insert(heap, &hyps[i]);
+          hh_insert(selection, &hyps[i]);
+        }
+
+        if (hh_max(heap) != hh_max(selection) || hh_limit(heap) != hh_limit(selection)) {
+          n_frame_errors++;
+          continue;
+        }
+        int n_heap = collect(heap, heap_survivors);
+        int n_selection = collect(selection, selection_survivors);
+        if (n_heap != n_selection
+            || memcmp(heap_survivors, selection_survivors, n_heap * sizeof(survivor_t)) != 0) {
+          n_frame_errors++;
+        }
+      }
+
+      printf("histogram %5d beam %6g: %d of %d frames differ\n", histograms[h], beams[b], n_frame_errors, NUM_FRAMES);
+      errors += n_frame_errors;
+      hh_delete(heap);
+      hh_delete(selection);
+    }
+  }
+
+  free(hyps);
+  free(scores);
+  free(heap_survivors);
+  free(selection_survivors);
+  free(positions);
+  free(key_scores);
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
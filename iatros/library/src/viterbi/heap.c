@@ -11,6 +11,7 @@
 #include <string.h>
 #include <float.h>
 #include <math.h>
+#include <strings.h>
 #include "heap.h"
 
 #define parent(i) (i/2)
@@ -21,7 +22,7 @@
 typedef struct hyp_node_t {
   hyp_t hyp;  ///< Hypothesis of the search process
   int index_heap; ///< Index of the heap where is the state
-  struct hyp_node_t *next; ///< Next node in hash table
+  uint64_t key; ///< Hash of the hypothesis in the token table
 } hyp_node_t;
 
 /// Heap to viterbi
@@ -32,12 +33,20 @@ typedef struct {
   bool is_heap; ///< Flag to indicate if is a heap o a vector
 } heap_t;
 
-///Hash table
+/// Slot of the token table
 typedef struct {
-  hyp_node_t **vector; ///< Array of pointers to states (array of lists of states)
-  int num_buckets; ///< Number of buckets
-  int num_elements; ///< Number of elements
-} thash_v_t;
+  uint64_t key;      ///< Hash of the hypothesis, compared before the hypothesis itself
+  unsigned stamp;    ///< Generation in which the slot was filled. The slot is empty if it is not the current one
+  int node;          ///< Index of the node of the hypothesis in the pool
+} token_slot_t;
+
+/// Open addressing hash table with linear probing to find the hypotheses in the heap
+typedef struct {
+  token_slot_t *slots; ///< Slots. Their number is a power of two
+  unsigned mask;       ///< Number of slots - 1
+  unsigned generation; ///< Stamp of the slots that are in use. It is never 0
+  hyp_node_t *nodes;   ///< Pool of nodes referenced by the slots
+} token_table_t;
 
 /// Pool of states
 typedef struct {
@@ -47,13 +56,16 @@ typedef struct {
 
 struct hyp_heap_t {
   heap_t *heap;  ///< a heap of hypotheses
-  thash_v_t *hash; ///< a hash to find hypotheses in the heap
+  token_table_t *table; ///< a hash table to find hypotheses in the heap
   pool_t *pool; ///< a memory pool to avoid continuous and costly memory allocations
 
   float beam;  ///< the beam w.r.t. the maximum probability
   float max_elements; ///< max number of elements (a.k.a. histogram_pruning)
   float max_probability; ///< Maximum state probability in the heap
   float current_limit;   ///< Scores worse that current limit are automatically discarded
+
+  pruning_engine_t engine; ///< how histogram pruning is applied
+  float threshold;         ///< With PE_SELECTION, score of the worst hypothesis kept in the last selection
 };
 
 
@@ -104,12 +116,14 @@ INLINE void heap_heapify(heap_t *heap, int position) {
     }
     if (heap->vector[son]->hyp.probability.final < node->hyp.probability.final) {
       heap->vector[position] = heap->vector[son];
+      heap->vector[position]->index_heap = position;
     } else {
       break;
     }
     position = son;
   }
   heap->vector[position] = node;
+  node->index_heap = position;
 }
 
 ///Build a heap from a vector
@@ -191,182 +205,131 @@ void hh_check_heap(hyp_heap_t *hh){
 //   return num_elements;
 // }
 
-///Deletes an element from hash table and returns it
+///Creates a new token table
 /**
- @param thash a hash table
- @param hyp_node an hypothesis node
- @return the deleted state
+ @param max_elems maximum number of hypotheses in the table
+ @param nodes pool with the nodes that will be inserted
+ @return the token table
+ The number of slots is the power of two that is at least four times max_elems,
+ so the table never needs to grow and its load factor is at most 0.25
  */
-INLINE hyp_node_t *thash_delete_element(thash_v_t *thash, hyp_node_t *hyp_node) {
-  //Calculate the number of bucket
-  unsigned int f = (hyp_hash(&hyp_node->hyp) % thash->num_buckets);
-
-  hyp_node_t *current = thash->vector[f];
-  hyp_node_t *previous = NULL;
-
-  // search the hyp node in the bucket list
-  while (current != NULL && hyp_cmp(&hyp_node->hyp, &current->hyp) == 0) {
-    previous = current;
-    current = current->next;
-  }
-
-  //XXX: this shouldn't happen. if we are trying to delete it is because we inserted it
-  // however it is necessary to put it. why? is there something wrong in the code?
-  if (current == NULL)
-    return NULL;
-
-  // it is the first element in the list
-  if (previous == NULL)
-    thash->vector[f] = current->next;
-  // it is next to another element
-  else
-    previous->next = current->next;
+INLINE token_table_t *token_table_create(int max_elems, hyp_node_t *nodes) {
+  token_table_t *table = (token_table_t *) malloc(sizeof(token_table_t));
+  MEMTEST(table);
 
-  thash->num_elements--;
+  unsigned num_slots = 16;
+  while (num_slots < 4 * (unsigned) max_elems) num_slots *= 2;
+  table->mask = num_slots - 1;
 
-  return current;
+  table->slots = (token_slot_t *) calloc(num_slots, sizeof(token_slot_t));
+  MEMTEST(table->slots);
+  table->generation = 1;
+  table->nodes = nodes;
 
+  return table;
 }
 
-///Erases all hash table elements
+///Delete token table
 /**
- @param thash hash table
+ @param table the token table
  */
-INLINE void thash_clear(thash_v_t * thash) {
-  memset(thash->vector, 0, thash->num_buckets * sizeof(hyp_node_t*));
-  thash->num_elements = 0;
+INLINE void token_table_delete(token_table_t *table) {
+  free(table->slots);
+  free(table);
 }
 
-///Creates a new hash table
+///Erases all the token table elements
 /**
- @param b Number of buckets
- @return Hash table
- The actual number of buckets is the closest prime number higher than the double of b
+ @param table the token table
+ The slots of previous generations are empty, so only the stamps are reset when the generation wraps
  */
-INLINE thash_v_t *thash_create(int b) {
-  thash_v_t *thash = (thash_v_t*) malloc(sizeof(thash_v_t));
-  MEMTEST(thash);
-
-  thash->num_buckets = next_prime(b);
-
-  thash->vector = (hyp_node_t**) malloc(thash->num_buckets * sizeof(hyp_node_t*));
-  MEMTEST(thash->vector);
-  thash_clear(thash);
-
-  return thash;
+INLINE void token_table_clear(token_table_t *table) {
+  table->generation++;
+  if (table->generation == 0) {
+    for (unsigned i = 0; i <= table->mask; i++) table->slots[i].stamp = 0;
+    table->generation = 1;
+  }
 }
 
-///Delete hash table
+///finds a node in the token table
 /**
- @param thash Hash table
+ @param table the token table
+ @param key the hash of the hypothesis
+ @param hyp the hypothesis
+ @return the node if it has been found, NULL otherwise
  */
-INLINE void thash_delete(thash_v_t *thash) {
-  free(thash->vector);
-  free(thash);
+INLINE hyp_node_t *token_table_find(const token_table_t *table, uint64_t key, const hyp_t *hyp) {
+  for (unsigned i = key & table->mask; table->slots[i].stamp == table->generation; i = (i + 1) & table->mask) {
+    const token_slot_t *slot = &table->slots[i];
+    if (slot->key == key && hyp_cmp(hyp, &table->nodes[slot->node].hyp)) return &table->nodes[slot->node];
+  }
+  return NULL;
 }
 
-INLINE void thash_insert(thash_v_t *thash, hyp_node_t *node);
-    //If we have the same number of elements of half of the num_buckets we duplicate the size of thash
-
-///Duplicate the size of hash table
+///Inserts a node in the token table
 /**
- @param thash Hash table
+ @param table the token table
+ @param key the hash of the hypothesis of the node
+ @param node node of the pool. It must not be in the table
  */
-INLINE void thash_expand(thash_v_t *thash){
-
- hyp_node_t *aux;
-
- //We duplicate the size of thash
- thash_v_t *thash_aux=thash_create(thash->num_buckets*2);
-
- //We calculate the new position of all elements of hash table
- for(int i=0; i<thash->num_buckets; i++){
-  if(thash->vector[i]!=NULL){
-   aux=thash->vector[i];
-   while(aux!=NULL){
-    thash->vector[i]=aux->next;
-    thash_insert(thash_aux, aux);
-    aux=thash->vector[i];
-   }
-  }
- }
-
- // we swap the hash tables and delete the old one
- SWAP(*thash, *thash_aux, thash_v_t);
- thash_delete(thash_aux);
-
+INLINE void token_table_insert(token_table_t *table, uint64_t key, hyp_node_t *node) {
+  unsigned i = key & table->mask;
+  while (table->slots[i].stamp == table->generation) i = (i + 1) & table->mask;
+  node->key = key;
+  table->slots[i].key = key;
+  table->slots[i].stamp = table->generation;
+  table->slots[i].node = node - table->nodes;
 }
 
-///Inserts a node in a hash table
+///Deletes a node from the token table
 /**
- @param thash Hash table
- @param node node
+ @param table the token table
+ @param node the node. It must be in the table
+ The elements that follow it in its run are shifted back, so that lookups
+ never need tombstones
  */
-INLINE void thash_insert(thash_v_t *thash, hyp_node_t *node) {
-  //XXX: why do we need this? is b the max number of elements?
-  //     it shoudn't, since we have set it as closest double prime thing
-  if (thash->num_buckets != thash->num_elements) {
-    thash->num_elements++;
-
-    // find the bucket
-    int f = (hyp_hash(&node->hyp) % thash->num_buckets);
-
-    REQUIRE(f<thash->num_buckets, "Incorrect bucket (%d) in hash (max: %d) \n", f, thash->num_buckets);
-
-    // insert the element in the front of the list
-    node->next = thash->vector[f];
-    thash->vector[f] = node;
+INLINE void token_table_delete_element(token_table_t *table, const hyp_node_t *node) {
+  const int index = node - table->nodes;
+  unsigned i = node->key & table->mask;
+  while (table->slots[i].node != index || table->slots[i].stamp != table->generation) {
+    i = (i + 1) & table->mask;
+  }
 
-    //If we have the same number of elements of half of the num_buckets we duplicate the size of thash
-    if(thash->num_elements > (thash->num_buckets/2)){
-     thash_expand(thash);
+  for (unsigned j = (i + 1) & table->mask; table->slots[j].stamp == table->generation; j = (j + 1) & table->mask) {
+    // the element in j can fill the hole in i if its home slot is not in (i, j]
+    const unsigned home = table->slots[j].key & table->mask;
+    if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+      table->slots[i] = table->slots[j];
+      i = j;
     }
-
   }
+  table->slots[i].stamp = 0;
 }
 
-///finds a node in the hash table
-/**
- @param thash Hash table
- @param node node
- @return the node if it has been found, NULL otherwise
+/** Gets the pruning engine from a string
+ * @param pruning_str the engine: HEAP or SELECTION
+ * @return the engine or MAX_PRUNING_ENGINE if it is unknown
  */
-INLINE hyp_node_t *thash_find(const thash_v_t *thash, const hyp_t *hyp) {
-  // the hash in empty, so the node doesn't exist
-  if (thash->num_elements == 0)
-    return NULL;
-
-  // find the bucket
-  unsigned int f = (hyp_hash(hyp) % thash->num_buckets);
-
-  hyp_node_t *current = thash->vector[f];
-  hyp_node_t *previous = NULL;
-
-  // find the hyp in the list
-  while (current != NULL && hyp_cmp(hyp, &(current->hyp)) == 0) {
-    previous = current;
-    current = current->next;
-  }
-
-   //XXX: why do we do this? isn't that wrong? we should change the table hash content
-   //The element in the first position of the list
-   if (previous != NULL && current != NULL) {
-     previous->next = current->next;
-     current->next = thash->vector[f];
-     thash->vector[f] = current;
-   }
-
-  return current;
+pruning_engine_t get_pruning_engine(const char *pruning_str) {
+  pruning_engine_t engine = MAX_PRUNING_ENGINE;
+  if (pruning_str == NULL)                              engine = MAX_PRUNING_ENGINE;
+  else if (strcasecmp(pruning_str, "HEAP") == 0)        engine = PE_HEAP;
+  else if (strcasecmp(pruning_str, "SELECTION") == 0)   engine = PE_SELECTION;
+  return engine;
 }
 
 ///creates a new hypothesis heap
 /**
  * @param max_elems maximum number of elements (a.k.a. histogram pruning)
  * @param beam beam w.r.t. the maximum probability
+ * @param engine how histogram pruning is applied
+ * With PE_SELECTION, the heap has room for twice the number of elements
+ * so that the best ones are selected only when it gets full
  */
-hyp_heap_t *hh_create(int max_elems, float beam) {
+hyp_heap_t *hh_create(int max_elems, float beam, pruning_engine_t engine) {
   hyp_heap_t *hh;
 
+  REQUIRE(engine != PE_SELECTION || max_elems > 1, "The histogram pruning must be greater than 1");
   hh = (hyp_heap_t *)malloc(sizeof(hyp_heap_t));
   MEMTEST(hh);
 
@@ -374,20 +337,27 @@ hyp_heap_t *hh_create(int max_elems, float beam) {
   hh->max_probability = LOG_ZERO;
   hh->max_elements = max_elems;
   hh->current_limit = LOG_ZERO;
+  hh->engine = engine;
+  hh->threshold = LOG_ZERO;
 
-  //Create hash table
-/*  hh->hash = thash_create(max_elems);*/
-  hh->hash = thash_create(10000);
-
-  hh->heap = heap_create(max_elems);
+  const int pool_size = (engine == PE_SELECTION) ? 2 * max_elems : max_elems;
+  hh->heap = heap_create(pool_size);
 
   //Pools of memory
   hh->pool=(pool_t *)malloc(sizeof(pool_t));
   MEMTEST(hh->pool);
-  hh->pool->vector=(hyp_node_t *)malloc((max_elems+1)*sizeof(hyp_node_t));
+  hh->pool->vector=(hyp_node_t *)malloc((pool_size+1)*sizeof(hyp_node_t));
   MEMTEST(hh->pool->vector);
   hh->pool->num_elements=0;
 
+  // without a heap, the vector is a permutation of the pool whose first elements are in use
+  if (engine == PE_SELECTION) {
+    for (int i = 1; i < pool_size; i++) hh->heap->vector[i] = &hh->pool->vector[i];
+  }
+
+  //Create hash table. It can hold all the nodes of the pool
+  hh->table = token_table_create(pool_size, hh->pool->vector);
+
   return hh;
 }
 
@@ -401,7 +371,8 @@ new memory
 */
 INLINE hyp_node_t *hh_delete_node(hyp_heap_t *hh, hyp_node_t *node) {
   //Delete state from hash table
-  hyp_node_t *deleted_node = thash_delete_element(hh->hash, node);
+  token_table_delete_element(hh->table, node);
+  hyp_node_t *deleted_node = node;
 
   //XXX: what is this for?
   //*deleted_node = hh->pool->vector[hh->pool->num_elements];
@@ -422,7 +393,7 @@ INLINE hyp_node_t *hh_delete_node(hyp_heap_t *hh, hyp_node_t *node) {
 void hh_delete(hyp_heap_t *hh) {
   free(hh->heap->vector);
   free(hh->heap);
-  thash_delete(hh->hash);
+  token_table_delete(hh->table);
   free(hh->pool->vector);
   free(hh->pool);
   free(hh);
@@ -436,11 +407,12 @@ void hh_delete(hyp_heap_t *hh) {
 void hh_clear(hyp_heap_t *hh) {
   hh->max_probability = LOG_ZERO;
   hh->current_limit = LOG_ZERO;
+  hh->threshold = LOG_ZERO;
 
   hh->pool->num_elements = 0;
 
   hh->heap->is_heap=0;
-  thash_clear(hh->hash);
+  token_table_clear(hh->table);
   heap_clear(hh->heap);
 }
 
@@ -481,6 +453,124 @@ INLINE hyp_node_t *hh_new_node(hyp_heap_t *hh, hyp_t *hyp) {
 }
 
 
+///Moves the best hypotheses of a vector to its first positions
+/**
+@param vector vector of nodes
+@param n number of nodes
+@param k number of best nodes
+The order of the nodes in each part is undefined (quickselect)
+*/
+static void select_best(hyp_node_t **vector, int n, int k) {
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    const float a = vector[lo]->hyp.probability.final;
+    const float b = vector[(lo + hi) / 2]->hyp.probability.final;
+    const float c = vector[hi]->hyp.probability.final;
+    const float pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (vector[i]->hyp.probability.final > pivot) i++;
+      while (vector[j]->hyp.probability.final < pivot) j--;
+      if (i <= j) {
+        SWAP(vector[i], vector[j], hyp_node_t *);
+        i++;
+        j--;
+      }
+    }
+    // nodes in [lo, j] are not worse than the pivot and nodes in [i, hi] are not better
+    if (k - 1 <= j) hi = j;
+    else if (k - 1 >= i) lo = i;
+    else break;
+  }
+}
+
+///Applies histogram pruning to a heap without order
+/**
+@param hh the heap
+@param capacity number of hypotheses that are kept
+The best hypotheses are kept and the others are returned to the pool. Hypotheses
+out of the beam are selected only among themselves, since they are worse than
+any hypothesis within the beam
+*/
+static void hh_select(hyp_heap_t *hh, int capacity) {
+  heap_t *heap = hh->heap;
+  hyp_node_t **vector = heap->vector + 1;
+  const int n = heap->num_elements;
+  if (n <= capacity) return;
+
+  // move the hypotheses within the beam to the front
+  int in_beam = 0;
+  for (int i = 0; i < n; i++) {
+    if (vector[i]->hyp.probability.final >= hh->current_limit) {
+      SWAP(vector[in_beam], vector[i], hyp_node_t *);
+      in_beam++;
+    }
+  }
+  if (in_beam >= capacity) {
+    select_best(vector, in_beam, capacity);
+  }
+  else {
+    select_best(vector + in_beam, n - in_beam, capacity - in_beam);
+  }
+
+  float threshold = vector[0]->hyp.probability.final;
+  for (int i = 1; i < capacity; i++) {
+    if (vector[i]->hyp.probability.final < threshold) threshold = vector[i]->hyp.probability.final;
+  }
+  if (threshold > hh->threshold) hh->threshold = threshold;
+
+  // the dropped nodes stay after the ones in use, so they are reused by the next insertions
+  heap->num_elements = capacity;
+  token_table_clear(hh->table);
+  for (int i = 0; i < capacity; i++) {
+    token_table_insert(hh->table, vector[i]->key, vector[i]);
+  }
+}
+
+///Inserts a hypothesis into a heap without order
+/**
+@param hh Heap where to introduce the new state
+@param hyp the new hypothesis. It is within the beam
+@return a code defined by beam_status_t
+When the heap gets full, the best half of the hypotheses are selected
+and the worst score kept becomes the threshold to insert new ones
+*/
+INLINE beam_status_t hh_insert_unsorted(hyp_heap_t *hh, hyp_t *hyp) {
+  // all the hypotheses in the heap are better than the threshold
+  if (!is_logzero(hh->threshold) && hyp->probability.final <= hh->threshold) return REJECT_FULL;
+
+  const uint64_t key = hyp_hash(hyp);
+  hyp_node_t *existing_node = token_table_find(hh->table, key, hyp);
+  if (existing_node != NULL) {
+    if (hyp->probability.final > existing_node->hyp.probability.final) {
+      existing_node->hyp = *hyp;
+      return REPLACE;
+    }
+    return REJECT_NO_REPLACE;
+  }
+
+  heap_t *heap = hh->heap;
+  if (heap->num_elements + 1 == heap->max) {
+    hh_select(hh, (int) hh->max_elements - 1);
+    if (hyp->probability.final <= hh->threshold) return REJECT_FULL;
+  }
+  hyp_node_t *node = heap->vector[++heap->num_elements];
+  node->hyp = *hyp;
+  token_table_insert(hh->table, key, node);
+  return INSERT;
+}
+
+///Applies histogram pruning to the hypotheses inserted so far
+/**
+@param hh the heap
+With PE_SELECTION, it must be called before iterating over the hypotheses.
+With PE_HEAP, the heap is always pruned and it does nothing
+*/
+INLINE void hh_prune(hyp_heap_t *hh) {
+  if (hh->engine == PE_SELECTION) hh_select(hh, (int) hh->max_elements - 1);
+}
+
 ///Inserts a hypothesis into the heap
 /**
 @param hh Heap where to introduce the new state
@@ -498,10 +588,13 @@ INLINE beam_status_t hh_insert(hyp_heap_t *hh, hyp_t *hyp) {
       hh->current_limit = hh->max_probability - hh->beam;
     }
 
+    if (hh->engine == PE_SELECTION) return hh_insert_unsorted(hh, hyp);
+
     // remember we are doing dynamic programming
     // so the new hypotheses reaching the same state must compete.
     // therefore, we find if the node has already been inserted
-    hyp_node_t *existing_node = thash_find(hh->hash, hyp);
+    const uint64_t key = hyp_hash(hyp);
+    hyp_node_t *existing_node = token_table_find(hh->table, key, hyp);
 
     // we didn't find it
     if (existing_node == NULL) {
@@ -514,7 +607,7 @@ INLINE beam_status_t hh_insert(hyp_heap_t *hh, hyp_t *hyp) {
 
       // insert the new node in the heap and the table
       heap_insert(hh->heap, node);
-      thash_insert(hh->hash, node);
+      token_table_insert(hh->table, key, node);
       return INSERT;
     }
     // we found it, so we make it compete with the existing hypotheses
@@ -601,7 +694,13 @@ INLINE float hh_max(const hyp_heap_t *hh) {
 @return the maximum probability of the heap
 */
 INLINE float hh_min(const hyp_heap_t *hh) {
-  return hh->heap->vector[1]->hyp.probability.final;
+  if (hh->heap->is_heap || hh->heap->num_elements == 0) return hh->heap->vector[1]->hyp.probability.final;
+  // the elements are not sorted yet
+  float min = hh->heap->vector[1]->hyp.probability.final;
+  for (int i = 2; i <= hh->heap->num_elements; i++) {
+    if (hh->heap->vector[i]->hyp.probability.final < min) min = hh->heap->vector[i]->hyp.probability.final;
+  }
+  return min;
 }
 
 ///returns the current of the heap.
@@ -613,6 +712,18 @@ INLINE float hh_beam(const hyp_heap_t *hh) {
   return hh->beam;
 }
 
+///sets the beam of the heap.
+/**
+@param hh the heap. It should be empty, since the hypotheses already inserted are not pruned again
+@param beam the new beam
+*/
+INLINE void hh_set_beam(hyp_heap_t *hh, float beam) {
+  hh->beam = beam;
+  if (!is_logzero(hh->max_probability) && hh->max_probability - beam > hh->current_limit) {
+    hh->current_limit = hh->max_probability - beam;
+  }
+}
+
 ///Sorts the heap elements so that they can be iterated from higher probability to lower
 /**
 @param heap Heap
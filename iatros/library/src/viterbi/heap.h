@@ -15,10 +15,19 @@
 struct hyp_heap_t;
 typedef struct hyp_heap_t hyp_heap_t;
 
-hyp_heap_t *hh_create(int max_elems, float beam);
+/// How histogram pruning is applied
+typedef enum {
+  PE_HEAP = 0,    ///< a min-heap is maintained once the heap is full and the worst hypothesis is replaced
+  PE_SELECTION,   ///< hypotheses are collected unsorted and the best ones are selected when the buffer is full
+  MAX_PRUNING_ENGINE
+} pruning_engine_t;
+
+pruning_engine_t get_pruning_engine(const char *pruning_str);
+hyp_heap_t *hh_create(int max_elems, float beam, pruning_engine_t engine);
 void hh_delete(hyp_heap_t *hh);
 void hh_clear(hyp_heap_t *hh);
 INLINE beam_status_t hh_insert(hyp_heap_t *hh, hyp_t *hyp);
+INLINE void hh_prune(hyp_heap_t *hh);
 INLINE hyp_t *hh_pop(hyp_heap_t *hh);
 INLINE int hh_size(const hyp_heap_t *hh);
 INLINE int hh_capacity(const hyp_heap_t *hh);
@@ -27,6 +36,7 @@ INLINE float hh_limit(const hyp_heap_t *hh);
 INLINE float hh_max(const hyp_heap_t *hh);
 INLINE float hh_min(const hyp_heap_t *hh);
 INLINE float hh_beam(const hyp_heap_t *hh);
+INLINE void hh_set_beam(hyp_heap_t *hh, float beam);
 INLINE int hh_sort(hyp_heap_t *hh);
 void hh_print(FILE *file, const hyp_heap_t *hh, const grammar_t *grammar);
 void hh_print_stats(FILE *file, const hyp_heap_t *heap, const grammar_t *grammar);
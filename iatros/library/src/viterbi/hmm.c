@@ -7,6 +7,7 @@
 
 #include <prhlt/constants.h>
 #include <prhlt/utils.h>
+#include <prhlt/trace.h>
 #include "hmm.h"
 #include <string.h>
 #include <math.h>
@@ -50,13 +51,22 @@ double calculate_gconst(variance_t *variance, int num_features) {
  * \frac{1}{-2} \left(gconst + ({\bf o}-{\bf \mu})'{\bf \Sigma}^{-1}({\bf o}-{\bf \mu}) \right) \f$
  *
  * \f$gconst\f$ is usually precomputed by the function calculate_gconst()
+ *
+ * The quadratic form is computed by the SIMD kernel selected at runtime (see mahalanobis())
+ * using the inverse variances precomputed by hmm_prepare(). Gaussians that have not been
+ * prepared are scored with the original scalar loop
  */
 INLINE float log_gaussian(const float * data, const gaussian_t *gaussian, int num_features) {
+  const variance_t *variance = gaussian->variance;
+  if (variance->inv_variance != NULL) {
+    return (gaussian->constant + mahalanobis(data, gaussian->mean->mean, variance->inv_variance, num_features)) / -2.0;
+  }
+
   register double num = 0.0;
 
   for (int ll = 0; ll < num_features; ll++) {
     register float diff = data[ll] - gaussian->mean->mean[ll];
-    num += (diff * diff) / gaussian->variance->variance[ll];
+    num += (diff * diff) / variance->variance[ll];
   }
 
   return (gaussian->constant + num) / -2.0;
@@ -85,11 +95,105 @@ INLINE float log_gaussian_mixture(const float * data, const mixture_t *mixture,
 }
 
 
+/** Computes the logarithm of the emission probability of a state
+ * @param hmm the hmm
+ * @param state the state id
+ * @param data a feature vector \f${\bf o}\f$
+ * @return the logarithm of the gaussian mixture density function of the state
+ *
+ * It reads the gaussians from the packed model built by hmm_prepare(), which stores
+ * them contiguously and aligned, instead of following the pointers of the hmm tree.
+ * The components are added as selected by hmm_set_log_add(). With LA_EXACT the
+ * result is the same as log_gaussian_mixture()
+ */
+INLINE float hmm_log_emission(const hmm_t *hmm, int state, const float *data) {
+  const packed_hmm_t *packed = hmm->packed;
+  if (packed == NULL) {
+    return log_gaussian_mixture(data, hmm->states[state]->mixture, hmm->num_features);
+  }
+
+  const int first = packed->offsets[state];
+  const int n = packed->offsets[state + 1] - first;
+  float scores[n > 0 ? n : 1];
+  for (int i = 0; i < n; i++) {
+    const size_t offset = (size_t) (first + i) * packed->stride;
+    scores[i] = (packed->gconsts[first + i] + mahalanobis(data, packed->means + offset,
+                 packed->inv_variances + offset, packed->num_features)) / -2.0 + packed->priors[first + i];
+  }
+  return log_add_reduce(scores, n, hmm->log_add);
+}
+
+/// Gap above emission_min from which the gaussians abandoned by hmm_log_emission_bounded() are neglected (exp(-16) ~ 1e-7)
+#define PARTIAL_DISTANCE_COMPLETION_GAP 16.0
+
+/** Computes the logarithm of the emission probability of a state abandoning the
+ * gaussians that cannot reach the beam
+ * @param hmm the hmm, prepared with hmm_enable_partial_distance()
+ * @param state the state id
+ * @param ordered_data a feature vector permuted with hmm_order_features()
+ * @param emission_min emissions below this value are not needed exactly. LOG_ZERO to disable the bound
+ * @param n_abandoned output number of gaussians abandoned. It can be NULL
+ * @return the logarithm of the gaussian mixture density function of the state,
+ *         or a value lower than emission_min if the real one is lower than emission_min
+ *
+ * The distance of each gaussian is accumulated by blocks of dimensions and the gaussian is
+ * abandoned as soon as its score falls below emission_min minus the logarithm of the number
+ * of components. Together they add less than exp(emission_min), so the whole mixture cannot
+ * reach emission_min unless the other components do. In that case the abandoned gaussians are
+ * completed, unless the mixture is more than PARTIAL_DISTANCE_COMPLETION_GAP above emission_min
+ * and their contribution is negligible. Without emission_min every gaussian is evaluated
+ */
+INLINE float hmm_log_emission_bounded(const hmm_t *hmm, int state, const float *ordered_data, float emission_min, int *n_abandoned) {
+  const packed_hmm_t *packed = hmm->packed;
+  const int first = packed->offsets[state];
+  const int n = packed->offsets[state + 1] - first;
+  const float beam_bound = is_logzero(emission_min) ? LOG_ZERO : emission_min - logf(n);
+  float scores[n > 0 ? n : 1];
+  int pending[n > 0 ? n : 1];
+  int n_scores = 0, n_pending = 0;
+  float best_pending = LOG_ZERO;
+  for (int i = 0; i < n; i++) {
+    const int g = first + i;
+    const size_t offset = (size_t) g * packed->stride;
+    // distance from which the score of the gaussian is below the bound
+    const float bound = is_logzero(beam_bound) ? FLT_MAX : -2.0 * (beam_bound - packed->priors[g]) - packed->gconsts[g];
+    const float dist = mahalanobis_bounded(ordered_data, packed->ordered_means + offset,
+                                           packed->ordered_inv_variances + offset, packed->num_features, bound);
+    // when the gaussian is abandoned the score is an upper bound of the real one
+    const float score = (packed->gconsts[g] + dist) / -2.0 + packed->priors[g];
+    if (dist <= bound) {
+      scores[n_scores++] = score;
+    }
+    else {
+      pending[n_pending++] = g;
+      if (score > best_pending) best_pending = score;
+    }
+  }
+
+  if (n_scores == 0) {
+    if (n_abandoned != NULL) *n_abandoned = n;
+    return best_pending;
+  }
+  float result = log_add_reduce(scores, n_scores, hmm->log_add);
+  if (n_pending > 0 && result >= beam_bound && result < emission_min + PARTIAL_DISTANCE_COMPLETION_GAP) {
+    // the mixture may reach emission_min and the abandoned gaussians are not negligible
+    for (int i = 0; i < n_pending; i++) {
+      const int g = pending[i];
+      const size_t offset = (size_t) g * packed->stride;
+      scores[n_scores++] = (packed->gconsts[g] + mahalanobis(ordered_data, packed->ordered_means + offset,
+                            packed->ordered_inv_variances + offset, packed->num_features)) / -2.0 + packed->priors[g];
+    }
+    result = log_add_reduce(scores, n_scores, hmm->log_add);
+  }
+  if (n_abandoned != NULL) *n_abandoned = n - n_scores;
+  return result;
+}
+
 void compute_all_emissions(float *vector_cc, float *t_probability, hmm_t *hmm) {
   for (int s = 0; s < hmm->num_states; s++) {
     //If probability is not calculate
     if (is_logzero(t_probability[s])) {
-      t_probability[s] = log_gaussian_mixture(vector_cc, hmm->states[s]->mixture, hmm->num_features);
+      t_probability[s] = hmm_log_emission(hmm, s, vector_cc);
     }
   }
 }
@@ -133,7 +237,8 @@ void print_variance(variance_t *variance, FILE *file, int num){
  int i;
 fprintf(file, "<VARIANCE> %d\n", num);
    for(i=0; i<num; i++){
-    fprintf(file, "%e ", variance->variance[i]);
+    // prepared hmms only keep the inverse variances
+    fprintf(file, "%e ", (variance->variance != NULL) ? variance->variance[i] : 1.0 / variance->inv_variance[i]);
    }
    fprintf(file, "\n");
 }
@@ -327,6 +432,156 @@ void hmm_save(hmm_t *hmm, FILE *file) {
 
 }
 
+/** Flattens the gaussians of the hmm into a packed model.
+ * Gaussians are stored state by state, in the same order as in their mixtures,
+ * so that the gaussians of a state are contiguous in memory. Vectors are padded
+ * with zeros to a multiple of the alignment
+ * @param hmm the hmm. Inverse variances must be computed
+ * @return the packed model
+ */
+static packed_hmm_t *packed_hmm_create(const hmm_t *hmm) {
+  packed_hmm_t *packed = (packed_hmm_t *) malloc(sizeof(packed_hmm_t));
+  MEMTEST(packed);
+
+  const int floats_per_line = SIMD_ALIGNMENT / sizeof(float);
+  packed->num_states = hmm->num_states;
+  packed->num_features = hmm->num_features;
+  packed->stride = ((hmm->num_features + floats_per_line - 1) / floats_per_line) * floats_per_line;
+
+  packed->offsets = (int *) malloc((hmm->num_states + 1) * sizeof(int));
+  MEMTEST(packed->offsets);
+  packed->num_gaussians = 0;
+  for (int s = 0; s < hmm->num_states; s++) {
+    packed->offsets[s] = packed->num_gaussians;
+    packed->num_gaussians += hmm->states[s]->mixture->num_distributions;
+  }
+  packed->offsets[hmm->num_states] = packed->num_gaussians;
+
+  const size_t vector_size = (size_t) packed->num_gaussians * packed->stride * sizeof(float);
+  packed->means = (float *) simd_malloc(vector_size);
+  packed->inv_variances = (float *) simd_malloc(vector_size);
+  memset(packed->means, 0, vector_size);
+  memset(packed->inv_variances, 0, vector_size);
+  packed->gconsts = (float *) simd_malloc(packed->num_gaussians * sizeof(float));
+  packed->priors = (float *) simd_malloc(packed->num_gaussians * sizeof(float));
+  packed->dim_order = NULL;
+  packed->ordered_means = NULL;
+  packed->ordered_inv_variances = NULL;
+
+  for (int s = 0; s < hmm->num_states; s++) {
+    const mixture_t *mixture = hmm->states[s]->mixture;
+    for (int d = 0; d < mixture->num_distributions; d++) {
+      const int g = packed->offsets[s] + d;
+      const distribution_t *distribution = mixture->distributions[d];
+      REQUIRE(distribution != NULL, "Missing gaussian %d in state %d", d, s);
+      const gaussian_t *gaussian = distribution->gaussian;
+      memcpy(packed->means + (size_t) g * packed->stride, gaussian->mean->mean, hmm->num_features * sizeof(float));
+      memcpy(packed->inv_variances + (size_t) g * packed->stride, gaussian->variance->inv_variance, hmm->num_features * sizeof(float));
+      packed->gconsts[g] = gaussian->constant;
+      packed->priors[g] = distribution->prior;
+    }
+  }
+
+  return packed;
+}
+
+/** Makes the means and inverse variances of the hmm point to the ones of the packed model,
+ * which owns them from then on, so that the gaussians are not stored twice. The variances
+ * are released, since the scores only need their inverses. A vector that is shared by several
+ * gaussians points to the copy of the first one
+ * @param hmm the hmm
+ * @param packed the packed model, built from the hmm
+ */
+static void packed_hmm_share(hmm_t *hmm, const packed_hmm_t *packed) {
+  // the vectors are released first, and the ones that are still owned by the hmm are freed
+  for (int s = 0; s < hmm->num_states; s++) {
+    const mixture_t *mixture = hmm->states[s]->mixture;
+    for (int d = 0; d < mixture->num_distributions; d++) {
+      mean_t *mean = mixture->distributions[d]->gaussian->mean;
+      variance_t *variance = mixture->distributions[d]->gaussian->variance;
+      if (!mean->is_packed) free(mean->mean);
+      mean->mean = NULL;
+      mean->is_packed = true;
+      if (!variance->is_packed) free(variance->inv_variance);
+      free(variance->variance);
+      variance->inv_variance = NULL;
+      variance->variance = NULL;
+      variance->is_packed = true;
+    }
+  }
+  for (int s = 0; s < hmm->num_states; s++) {
+    const mixture_t *mixture = hmm->states[s]->mixture;
+    for (int d = 0; d < mixture->num_distributions; d++) {
+      const size_t offset = (size_t) (packed->offsets[s] + d) * packed->stride;
+      const gaussian_t *gaussian = mixture->distributions[d]->gaussian;
+      if (gaussian->mean->mean == NULL) gaussian->mean->mean = packed->means + offset;
+      if (gaussian->variance->inv_variance == NULL) gaussian->variance->inv_variance = packed->inv_variances + offset;
+    }
+  }
+}
+
+/** Deletes a packed model
+ * @param packed the packed model
+ */
+static void packed_hmm_delete(packed_hmm_t *packed) {
+  if (packed == NULL) return;
+  free(packed->offsets);
+  free(packed->means);
+  free(packed->inv_variances);
+  free(packed->gconsts);
+  free(packed->priors);
+  free(packed->dim_order);
+  free(packed->ordered_means);
+  free(packed->ordered_inv_variances);
+  free(packed);
+}
+
+/** Compiles the transitions with probability > 0 of a matrix into lists of arcs, so that
+ * the search does not scan the rows of the matrix, and finds out its topology
+ * @param matrix the matrix
+ */
+static void matrix_transitions_compile(matrix_transitions_t *matrix) {
+  const int n = matrix->num_transitions;
+
+  free(matrix->arcs);
+  free(matrix->first_arc);
+  matrix->first_arc = (int *) malloc((n + 1) * sizeof(int));
+  MEMTEST(matrix->first_arc);
+  int n_arcs = 0;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      if (!is_logzero(matrix->matrix_transitions[i][j])) n_arcs++;
+    }
+  }
+  matrix->arcs = (hmm_arc_t *) malloc((n_arcs > 0 ? n_arcs : 1) * sizeof(hmm_arc_t));
+  MEMTEST(matrix->arcs);
+
+  n_arcs = 0;
+  for (int i = 0; i < n; i++) {
+    matrix->first_arc[i] = n_arcs;
+    for (int j = 0; j < n; j++) {
+      if (!is_logzero(matrix->matrix_transitions[i][j])) {
+        matrix->arcs[n_arcs].target = j;
+        matrix->arcs[n_arcs].prob = matrix->matrix_transitions[i][j];
+        matrix->arcs[n_arcs].is_exit = (j == n - 1);
+        n_arcs++;
+      }
+    }
+  }
+  matrix->first_arc[n] = n_arcs;
+
+  // left-to-right: row 0 goes to 1, row i goes to i and i + 1, and the last row is empty.
+  // Then the arcs of the emitting state s are at 1 + 2 * s
+  bool is_left_to_right = (n >= 3 && matrix->first_arc[1] == 1 && matrix->arcs[0].target == 1
+                           && matrix->first_arc[n - 1] == n_arcs);
+  for (int i = 1; is_left_to_right && i < n - 1; i++) {
+    const hmm_arc_t *arc = &matrix->arcs[matrix->first_arc[i]];
+    is_left_to_right = (matrix->first_arc[i + 1] - matrix->first_arc[i] == 2
+                        && arc[0].target == i && arc[1].target == i + 1);
+  }
+  matrix->topology = is_left_to_right ? HT_LEFT_TO_RIGHT : HT_GENERIC;
+}
+
 ///Function to create the hmm
 /**
 @return hmm
@@ -365,6 +620,9 @@ hmm_t * hmm_create() {
  hmm->n_hmm_states = 0;
  hmm->locations = NULL;
 
+ hmm->packed = NULL;
+ hmm->log_add = LA_EXACT;
+
  return hmm;
 }
 
@@ -379,6 +637,7 @@ void hmm_delete(hmm_t *hmm){
  for(i=0; i<hmm->num_variances; i++){
   free(hmm->variances[i]->label);
   free(hmm->variances[i]->variance);
+  if (!hmm->variances[i]->is_packed) free(hmm->variances[i]->inv_variance);
   free(hmm->variances[i]);
  }
  free(hmm->variances);
@@ -386,7 +645,7 @@ void hmm_delete(hmm_t *hmm){
  //Means
  for(i=0; i<hmm->num_means; i++){
   free(hmm->means[i]->label);
-  free(hmm->means[i]->mean);
+  if (!hmm->means[i]->is_packed) free(hmm->means[i]->mean);
   free(hmm->means[i]);
  }
  free(hmm->means);
@@ -405,6 +664,8 @@ void hmm_delete(hmm_t *hmm){
    free(hmm->matrix[i]->matrix_transitions[j]);
   }
   free(hmm->matrix[i]->matrix_transitions);
+  free(hmm->matrix[i]->arcs);
+  free(hmm->matrix[i]->first_arc);
   free(hmm->matrix[i]->label);
   free(hmm->matrix[i]);
  }
@@ -429,18 +690,219 @@ void hmm_delete(hmm_t *hmm){
  free(hmm->phonemes);
 
  free(hmm->locations);
+ packed_hmm_delete(hmm->packed);
  free(hmm);
 }
 
+/** Precomputes the data needed to score the hmm efficiently.
+ * It computes the inverse of each variance vector, so that the gaussian kernels
+ * multiply instead of divide, builds the packed model used by hmm_log_emission()
+ * and compiles the transition matrices into lists of arcs.
+ * The means and inverse variances of the gaussians are moved to the packed model and
+ * the variances are released, so the gaussians are stored once.
+ * It is called by hmm_load() and must be called again if the gaussians are modified
+ * @param hmm the hmm
+ */
+void hmm_prepare(hmm_t *hmm) {
+  for (int v = 0; v < hmm->num_variances; v++) {
+    variance_t *variance = hmm->variances[v];
+    // the variances that were released are already inverted
+    if (variance->variance == NULL) continue;
+    if (!variance->is_packed) free(variance->inv_variance);
+    variance->inv_variance = (float *) malloc(hmm->num_features * sizeof(float));
+    MEMTEST(variance->inv_variance);
+    variance->is_packed = false;
+    for (int i = 0; i < hmm->num_features; i++) {
+      variance->inv_variance[i] = 1.0 / variance->variance[i];
+    }
+  }
+
+  // the vectors of the old packed model are read before it is deleted
+  packed_hmm_t *packed = packed_hmm_create(hmm);
+  packed_hmm_share(hmm, packed);
+  packed_hmm_delete(hmm->packed);
+  hmm->packed = packed;
+
+  for (int m = 0; m < hmm->num_matrix; m++) {
+    matrix_transitions_compile(hmm->matrix[m]);
+  }
+}
+
+/** Selects how the components of the mixtures are added by hmm_log_emission()
+ * @param hmm the hmm
+ * @param log_add exact addition, table addition, polynomial addition or maximum approximation
+ */
+void hmm_set_log_add(hmm_t *hmm, log_add_t log_add) {
+  REQUIRE(log_add >= LA_EXACT && log_add < MAX_LOG_ADD_TYPE, "Invalid log-add type %d", log_add);
+  if (log_add == LA_TABLE) log_add_init_table();
+  hmm->log_add = log_add;
+}
+
+/** Draws a feature vector from a gaussian of the hmm chosen at random with rand().
+ * It is used to measure the scores without real features
+ * @param hmm the hmm, after hmm_prepare()
+ * @param frame output feature vector of num_features elements
+ */
+void hmm_sample_frame(const hmm_t *hmm, float *frame) {
+  const packed_hmm_t *packed = hmm->packed;
+  REQUIRE(packed != NULL && packed->means != NULL, "The hmm must be prepared to draw frames from it");
+  const int g = rand() % packed->num_gaussians;
+  for (int i = 0; i < packed->num_features; i++) {
+    const size_t offset = (size_t) g * packed->stride + i;
+    const double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    const double noise = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    frame[i] = packed->means[offset] + noise / sqrt(packed->inv_variances[offset]);
+  }
+}
+
+/** Releases the float gaussians of a prepared hmm whose emissions are computed with
+ * another copy of them, e.g. a quantized model. The topology and the offsets, gconsts
+ * and priors of the packed model are kept, but hmm_log_emission(), the partial distance,
+ * gaussian selection and hmm_save() cannot be used afterwards
+ * @param hmm the hmm, after hmm_prepare()
+ * @return the number of bytes released
+ */
+size_t hmm_release_gaussians(hmm_t *hmm) {
+  packed_hmm_t *packed = hmm->packed;
+  REQUIRE(packed != NULL, "The hmm must be prepared before releasing its gaussians");
+  size_t released = 0;
+  for (int m = 0; m < hmm->num_means; m++) {
+    mean_t *mean = hmm->means[m];
+    if (!mean->is_packed && mean->mean != NULL) {
+      free(mean->mean);
+      released += hmm->num_features * sizeof(float);
+    }
+    mean->mean = NULL;
+    mean->is_packed = true;
+  }
+  for (int v = 0; v < hmm->num_variances; v++) {
+    variance_t *variance = hmm->variances[v];
+    if (!variance->is_packed && variance->inv_variance != NULL) {
+      free(variance->inv_variance);
+      released += hmm->num_features * sizeof(float);
+    }
+    if (variance->variance != NULL) {
+      free(variance->variance);
+      released += hmm->num_features * sizeof(float);
+    }
+    variance->variance = NULL;
+    variance->inv_variance = NULL;
+    variance->is_packed = true;
+  }
+
+  const size_t vector_size = (size_t) packed->num_gaussians * packed->stride * sizeof(float);
+  if (packed->means != NULL) released += 2 * vector_size;
+  if (packed->ordered_means != NULL) released += 2 * vector_size;
+  free(packed->means);
+  free(packed->inv_variances);
+  free(packed->dim_order);
+  free(packed->ordered_means);
+  free(packed->ordered_inv_variances);
+  packed->means = packed->inv_variances = NULL;
+  packed->ordered_means = packed->ordered_inv_variances = NULL;
+  packed->dim_order = NULL;
+  return released;
+}
+
+/** Prepares the hmm to be scored with hmm_log_emission_bounded().
+ * It builds a copy of the packed model with the dimensions sorted by decreasing average
+ * inverse variance, so that the partial distances grow as fast as possible
+ * @param hmm the hmm, after hmm_prepare()
+ */
+void hmm_enable_partial_distance(hmm_t *hmm) {
+  packed_hmm_t *packed = hmm->packed;
+  REQUIRE(packed != NULL && packed->means != NULL, "The hmm must be prepared before enabling partial distance");
+  if (packed->dim_order != NULL) return;
+
+  double *weight = (double *) malloc(packed->num_features * sizeof(double));
+  MEMTEST(weight);
+  packed->dim_order = (int *) malloc(packed->num_features * sizeof(int));
+  MEMTEST(packed->dim_order);
+  for (int i = 0; i < packed->num_features; i++) {
+    weight[i] = 0;
+    for (int g = 0; g < packed->num_gaussians; g++) {
+      weight[i] += packed->inv_variances[(size_t) g * packed->stride + i];
+    }
+  }
+  // insertion sort, there are only a few dozens of dimensions
+  for (int i = 0; i < packed->num_features; i++) {
+    int j = i;
+    for (; j > 0 && weight[packed->dim_order[j - 1]] < weight[i]; j--) {
+      packed->dim_order[j] = packed->dim_order[j - 1];
+    }
+    packed->dim_order[j] = i;
+  }
+  free(weight);
+
+  const size_t vector_size = (size_t) packed->num_gaussians * packed->stride * sizeof(float);
+  packed->ordered_means = (float *) simd_malloc(vector_size);
+  packed->ordered_inv_variances = (float *) simd_malloc(vector_size);
+  memset(packed->ordered_means, 0, vector_size);
+  memset(packed->ordered_inv_variances, 0, vector_size);
+  for (int g = 0; g < packed->num_gaussians; g++) {
+    const size_t offset = (size_t) g * packed->stride;
+    for (int i = 0; i < packed->num_features; i++) {
+      packed->ordered_means[offset + i] = packed->means[offset + packed->dim_order[i]];
+      packed->ordered_inv_variances[offset + i] = packed->inv_variances[offset + packed->dim_order[i]];
+    }
+  }
+}
+
+/** Permutes a feature vector as the model used by hmm_log_emission_bounded()
+ * @param hmm the hmm, prepared with hmm_enable_partial_distance()
+ * @param data a feature vector
+ * @param ordered_data output permuted feature vector
+ */
+void hmm_order_features(const hmm_t *hmm, const float *data, float *ordered_data) {
+  const packed_hmm_t *packed = hmm->packed;
+  for (int i = 0; i < packed->num_features; i++) {
+    ordered_data[i] = data[packed->dim_order[i]];
+  }
+}
+
+/// number of frames scored together by hmm_compute_emission_probabilities()
+#define EMISSION_BLOCK_FRAMES 256
+
 void hmm_compute_emission_probabilities(const hmm_t *hmm, features_t *features) {
-  // for each class
-  for (int t = 0; t < features->n_vectors; t++) {
-    float *probs = (float *) malloc(hmm->num_states * sizeof(float));
-    for (int s = 0; s < hmm->num_states; s++) {
-      probs[s] = log_gaussian_mixture(features->vector[t], hmm->states[s]->mixture, hmm->num_features);
+  const packed_hmm_t *packed = hmm->packed;
+
+  if (packed == NULL) {
+    // for each class
+    for (int t = 0; t < features->n_vectors; t++) {
+      float *probs = (float *) malloc(hmm->num_states * sizeof(float));
+      for (int s = 0; s < hmm->num_states; s++) {
+        probs[s] = hmm_log_emission(hmm, s, features->vector[t]);
+      }
+      SWAP(features->vector[t], probs, float *);
+      free(probs);
+    }
+  }
+  else {
+    // score blocks of frames against all the gaussians at once and then combine the mixtures
+    gaussian_batch_t *batch = gaussian_batch_create(packed->num_gaussians, packed->num_features,
+        packed->means, packed->inv_variances, packed->stride, packed->gconsts);
+    float *scores = (float *) malloc((size_t) EMISSION_BLOCK_FRAMES * packed->num_gaussians * sizeof(float));
+    MEMTEST(scores);
+    for (int t0 = 0; t0 < features->n_vectors; t0 += EMISSION_BLOCK_FRAMES) {
+      const int n_block = (features->n_vectors - t0 < EMISSION_BLOCK_FRAMES) ? features->n_vectors - t0 : EMISSION_BLOCK_FRAMES;
+      gaussian_batch_score(batch, (const float * const *) features->vector + t0, n_block, scores);
+      for (int t = 0; t < n_block; t++) {
+        const float *score = scores + (size_t) t * packed->num_gaussians;
+        float *probs = (float *) malloc(hmm->num_states * sizeof(float));
+        MEMTEST(probs);
+        for (int s = 0; s < hmm->num_states; s++) {
+          const int first = packed->offsets[s];
+          const int n = packed->offsets[s + 1] - first;
+          float components[n > 0 ? n : 1];
+          for (int i = 0; i < n; i++) components[i] = score[first + i] + packed->priors[first + i];
+          probs[s] = log_add_reduce(components, n, hmm->log_add);
+        }
+        SWAP(features->vector[t0 + t], probs, float *);
+        free(probs);
+      }
     }
-    SWAP(features->vector[t], probs, float *);
-    free(probs);
+    free(scores);
+    gaussian_batch_delete(batch);
   }
 
   // fill structure field
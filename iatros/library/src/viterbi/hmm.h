@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <prhlt/utils.h>
 #include <iatros/features.h>
+#include <iatros/gaussian.h>
 
 
 ///Structs for hmm
@@ -18,12 +19,15 @@ typedef enum { GAUSSIAN } distribution_type_t;
 typedef struct mean {
   char *label; ///< Name of mean
   float *mean; ///< vector of means
+  bool is_packed; ///< if mean points to the packed model, which owns it. Set by hmm_prepare()
 } mean_t;
 
 /// Variance. ~v
 typedef struct variance {
   char *label; ///< Name of variance
-  float *variance; ///< Vector of variances
+  float *variance; ///< Vector of variances. Released by hmm_prepare(), which keeps only the inverse
+  float *inv_variance; ///< Vector of inverse variances. Filled by hmm_prepare()
+  bool is_packed; ///< if inv_variance points to the packed model, which owns it. Set by hmm_prepare()
 } variance_t;
 
 /// Gaussian mixture component. ~m
@@ -64,11 +68,29 @@ typedef struct state {
   int id; ///< state id
 } state_t;
 
+/// Topologies of transition matrices whose expansion is specialized
+typedef enum {
+  HT_GENERIC,      ///< any topology
+  HT_LEFT_TO_RIGHT /**< left-to-right without skips: the only entry goes to the first state, and
+                        every emitting state has a self loop and a transition to the next state */
+} hmm_topology_t;
+
+/// Transition with probability > 0 of a compiled matrix
+typedef struct hmm_arc {
+  int target;   ///< destination column in the matrix. The emitting state is target - 1
+  float prob;   ///< log-probability
+  bool is_exit; ///< if the destination is the final non-emitting state
+} hmm_arc_t;
+
 /// Transition probabilities. ~t
 typedef struct matrix_transitions {
   char *label; ///< Name of matrix
   float **matrix_transitions; ///< Matrix in log-probabilities
   int num_transitions; ///< Number of transitions
+
+  hmm_arc_t *arcs; ///< Transitions with probability > 0 sorted by source and target. Filled by hmm_prepare()
+  int *first_arc; ///< First arc of each source row. It has num_transitions + 1 elements
+  hmm_topology_t topology; ///< Topology of the matrix
 } matrix_transitions_t;
 
 /// Phoneme. ~h
@@ -80,6 +102,22 @@ typedef struct phoneme {
   int num_states; ///< Number of states in phoneme
 } phoneme_t;
 
+/// Acoustic model flattened for scoring. Built by hmm_prepare()
+typedef struct packed_hmm {
+  int num_states; ///< Number of states
+  int num_gaussians; ///< Number of gaussians in all the states
+  int num_features; ///< Number of features
+  int stride; ///< Distance in floats between the vectors of two consecutive gaussians
+  int *offsets; ///< First gaussian of each state. It has num_states + 1 elements
+  float *means; ///< Means of all the gaussians (num_gaussians x stride)
+  float *inv_variances; ///< Inverse variances of all the gaussians (num_gaussians x stride)
+  float *gconsts; ///< Gconst of each gaussian
+  float *priors; ///< Log-prior of each gaussian in the mixture of its state
+  int *dim_order; ///< Dimensions sorted by decreasing average inverse variance. NULL if partial distance is disabled
+  float *ordered_means; ///< Means with the dimensions permuted by dim_order (num_gaussians x stride)
+  float *ordered_inv_variances; ///< Inverse variances with the dimensions permuted by dim_order (num_gaussians x stride)
+} packed_hmm_t;
+
 /// Hidden Markov Model
 typedef struct hmm {
   int num_phonemes; ///< Number of phonemes in the HMM
@@ -104,6 +142,9 @@ typedef struct hmm {
   variance_t **variances; ///< Vector of variances
 
   int num_features; ///< Number of features
+
+  packed_hmm_t *packed; ///< Flattened copy of the gaussians used for scoring
+  log_add_t log_add; ///< How the components of the mixtures are added when scoring
 } hmm_t;
 
 //Functions for hmm
@@ -114,9 +155,22 @@ void hmm_save(hmm_t *hmm, FILE *file);
 hmm_t * hmm_create();
 //Delete hmm
 void hmm_delete(hmm_t *hmm);
+//Precompute the data needed to score the hmm
+void hmm_prepare(hmm_t *hmm);
+//Draw a feature vector from a random gaussian
+void hmm_sample_frame(const hmm_t *hmm, float *frame);
+//Release the float gaussians when the emissions are computed with another copy of them
+size_t hmm_release_gaussians(hmm_t *hmm);
+//Select how the components of the mixtures are added
+void hmm_set_log_add(hmm_t *hmm, log_add_t log_add);
+//Prepare the hmm to abandon the evaluation of gaussians that cannot reach a bound
+void hmm_enable_partial_distance(hmm_t *hmm);
+void hmm_order_features(const hmm_t *hmm, const float *data, float *ordered_data);
 
 INLINE float log_gaussian(const float * data, const gaussian_t *gaussian, int num_features);
 INLINE float log_gaussian_mixture(const float * data, const mixture_t *mixture, int num_features);
+INLINE float hmm_log_emission(const hmm_t *hmm, int state, const float *data);
+INLINE float hmm_log_emission_bounded(const hmm_t *hmm, int state, const float *ordered_data, float emission_min, int *n_abandoned);
 void hmm_compute_emission_probabilities(const hmm_t *hmm, features_t *features);
 #endif // _HMM_H
 
@@ -8,16 +8,24 @@
 #include "hypothesis.h"
 #include <prhlt/utils.h>
 
+/// multiplier of the hash. 2^64 divided by the golden ratio
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
 ///Hash function for hypothesis
 /**
  * @param hyp the hypothesis
+ * @return a 64 bit hash of the fields compared by hyp_cmp()
+ * The small fields are packed in a word and the grammar states and the word pointer
+ * are combined with multiplications, so that all the bits of the hash depend on all the fields.
  * Note: state_in and state_out have been not considered since that grammars are to be deterministic.
  * Thus, state_in and state_out do not add additional information
  */
-INLINE unsigned int hyp_hash(const hyp_t *hyp) {
-  return hyp->state_hmm + (hyp->state_lexic << 9)
-         + (hyp->phoneme << 18) + (hyp->word << 7) + ((size_t)hyp->history << 11)
-         + ((size_t)(hyp->word_ptr) << 13);
+INLINE uint64_t hyp_hash(const hyp_t *hyp) {
+  uint64_t key = (uint64_t) hyp->state_hmm | ((uint64_t) (uint32_t) hyp->state_lexic << 8)
+                 | ((uint64_t) (uint16_t) hyp->phoneme << 16) | ((uint64_t) (uint32_t) hyp->word << 32);
+  key = (key ^ ((uint64_t) (uint32_t) hyp->state | ((uint64_t) (uint32_t) hyp->history << 32))) * HASH_MULTIPLIER;
+  key = (key ^ (uint64_t) (uintptr_t) hyp->word_ptr ^ ((uint64_t) (uint32_t) hyp->category << 48)) * HASH_MULTIPLIER;
+  return key ^ (key >> 32);
 }
 
 ///Compares two hypotheses
@@ -25,13 +33,14 @@ INLINE unsigned int hyp_hash(const hyp_t *hyp) {
  * @param h1 an hypothesis
  * @param h2 an hypothesis
  * @return true if h1 == h2, false otherwise
+ * The category is compared since the indices of the grammar states are relative to its grammar.
  * Note: state_in and state_out have been not considered since that grammars are to be deterministic.
  * Thus, state_in and state_out do not add additional information
  */
 INLINE bool hyp_cmp(const hyp_t *h1, const hyp_t *h2) {
  return (h1->phoneme==h2->phoneme && h1->word==h2->word && h1->word_ptr==h2->word_ptr
         && h1->state==h2->state && h1->state_hmm==h2->state_hmm
-        && h1->state_lexic==h2->state_lexic&& h1->history==h2->history);
+        && h1->state_lexic==h2->state_lexic&& h1->history==h2->history && h1->category==h2->category);
 
 }
 
@@ -41,13 +50,12 @@ INLINE bool hyp_cmp(const hyp_t *h1, const hyp_t *h2) {
  * @param hyp hypothesis
  */
 void hyp_print(FILE *out, const hyp_t *hyp, const extended_vocab_t *vocab) {
-  int hist_state_num = (hyp->history != NULL) ? hyp->history->num_state : -1;
   float ac = hyp->probability.acoustic;
   float lm = hyp->probability.lm;
 
   fprintf(out, "%s(%d)[%s(%d)](%d,%d,%d) %d->%d (a=%g,l=%g,f=%g) from %d",
       vocab_get_string(vocab->in, hyp->word), hyp->word,
       extended_vocab_get_string(vocab, hyp->extended), hyp->extended,
-      hyp->state_hmm, hyp->phoneme, hyp->state_lexic, hist_state_num, hyp->state->num_state,
+      hyp->state_hmm, hyp->phoneme, hyp->state_lexic, hyp->history, hyp->state,
       ac, lm, hyp->probability.final, hyp->index);
 }
@@ -10,29 +10,36 @@
 
 #include <iatros/probability.h>
 #include <iatros/grammar.h>
+#include <stdint.h>
 
-/// State viterbi. State in heap in each t
+/** State viterbi. State in heap in each t.
+ * Grammar states are stored as indices in the vector of states of their grammar
+ * (see grammar_get_state()), and the fields are sorted by size, so that
+ * hypotheses are small to copy and to keep in the heap.
+ * state and history belong to the grammar of the category if category != CATEGORY_NONE
+ * or to the main grammar otherwise
+ */
 typedef struct {
-  int index; ///< Index in the lattice
-  state_grammar_t * history; ///< Number of source state of the grammar
-  state_grammar_t * state;   ///< Number of target state of the grammar
-  state_grammar_t * history_category; ///< Number of source state of the grammar in the aef with the category
-  state_grammar_t * state_in; ///< Number of target state of the input grammar
-  state_grammar_t * state_out; ///< Number of target state of the output grammar
-  symbol_t word;      ///< The current word. It should be *word_ptr or silence
-  int category;       ///< Number of vector of categories with the AEF or -1
+  probability_t probability; ///< Probability of the state
   const symbol_t *word_ptr; /**< Word pointer for extended symbols.
                            It points to the current position in the VOCAB_NONE-terminated
                            input symbol. In principle *word_ptr should be equal to word
                            except for silence and non-grammar symbols */
+  int index; ///< Index in the lattice
+  int history; ///< Number of source state of the grammar
+  int state;   ///< Number of target state of the grammar
+  int history_category; ///< Number of source state of the main grammar in the aef with the category
+  int state_in; ///< Number of target state of the input grammar
+  int state_out; ///< Number of target state of the output grammar
+  symbol_t word;      ///< The current word. It should be *word_ptr or silence
+  int category;       ///< Number of vector of categories with the AEF or -1
   symbol_t extended;  ///< The extended symbol
-  unsigned char state_hmm;   ///< State of hmm
-  unsigned char state_lexic; ///< State of model lexic
+  int state_lexic;    ///< State of model lexic, or node of the lexical tree if word_ptr == NULL
   short phoneme;             ///< Phoneme of the word
-  probability_t probability; ///< Probability of the state
+  unsigned char state_hmm;   ///< State of hmm
 } hyp_t;
 
-INLINE unsigned int hyp_hash(const hyp_t *hyp);
+INLINE uint64_t hyp_hash(const hyp_t *hyp);
 INLINE bool hyp_cmp(const hyp_t *s1, const hyp_t *s2);
 void hyp_print(FILE *out, const hyp_t *hyp, const extended_vocab_t *vocab);
 
@@ -20,39 +20,64 @@
 #define left(i)   (2*i)
 #define right(i)  (2*i+1)
 
-/** creates a new lattice state with capacity for nbest hypothesis
- * @param nbest Maxim number of elements in the state
- * @return a new lattice state
+/// multiplier of the hash of the lattice states. 2^64 divided by the golden ratio
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+/// initial number of slots of the table of lattice states of a frame
+#define MIN_STATE_SLOTS 64
+
+/** makes room for a number of hypotheses in a lattice state
+ * @param lat_state a lattice state
+ * @param capacity the number of hypotheses
  */
-lat_state_t *lat_state_create(int nbest) {
-  lat_state_t *lat_state = (lat_state_t *)calloc(1, sizeof(lat_state_t));
-  MEMTEST(lat_state);
-
-  lat_state->nbest = nbest;
-  int capacity = nbest + 1;
-
+static void lat_state_reserve(lat_state_t *lat_state, int capacity) {
+  if (capacity <= lat_state->capacity) return;
 
-  // nbest == 0 means no nbest limit, do dynamic reallocation
-  if (lat_state->nbest == 0) capacity = 1;
-  lat_state->words = (lat_hyp_t **)malloc(capacity * sizeof(lat_hyp_t *));
+  // the heap starts at position 1
+  lat_state->words = (lat_hyp_t **)realloc(lat_state->words, (capacity + 1) * sizeof(lat_hyp_t *));
   MEMTEST(lat_state->words);
-  for (int i = 1; i < capacity; i++) {
+  for (int i = lat_state->capacity + 1; i <= capacity; i++) {
     lat_state->words[i] = (lat_hyp_t *)malloc(sizeof(lat_hyp_t));
     MEMTEST(lat_state->words[i]);
   }
+  lat_state->capacity = capacity;
+}
+
+/** empties a lattice state so that it can be used again. The hypotheses already allocated are kept
+ * @param lat_state a lattice state
+ * @param nbest Maxim number of elements in the state
+ */
+static void lat_state_reset(lat_state_t *lat_state, int nbest) {
+  lat_state->nbest = nbest;
+  // nbest == 0 means no nbest limit, do dynamic reallocation
+  if (nbest > 0) lat_state_reserve(lat_state, nbest);
 
   lat_state->num_words = 0;
   //We do not have max so far
   lat_state->max = NULL;
 
+  lat_state->state = STATE_INDEX_NONE;
+  lat_state->history_category = STATE_INDEX_NONE;
+  lat_state->word_ptr = NULL;
   lat_state->category = CATEGORY_NONE;
+}
+
+/** creates a new lattice state with capacity for nbest hypothesis
+ * @param nbest Maxim number of elements in the state
+ * @return a new lattice state
+ */
+lat_state_t *lat_state_create(int nbest) {
+  lat_state_t *lat_state = (lat_state_t *)calloc(1, sizeof(lat_state_t));
+  MEMTEST(lat_state);
+
+  lat_state->words = NULL;
+  lat_state->capacity = 0;
+  lat_state_reset(lat_state, nbest);
 
   return lat_state;
 }
 
 void lat_state_delete(lat_state_t *lat_state) {
-  int capacity = (lat_state->nbest == 0)?lat_state->num_words:lat_state->nbest;
-  for (int i = 1; i <= capacity; i++) {
+  for (int i = 1; i <= lat_state->capacity; i++) {
     free(lat_state->words[i]);
   }
   free(lat_state->words);
@@ -166,12 +191,10 @@ bool lat_state_insert(lat_state_t *lat_state, hyp_t *hyp) {
   else {
     lat_state->num_words++;
 
-    // nbest == 0 means no nbest limit, allocate space for one more hyp
-    if (lat_state->nbest == 0) {
-      heap = lat_state->words = (lat_hyp_t **)realloc(lat_state->words, (lat_state->num_words + 1) * sizeof(lat_hyp_t *));
-      MEMTEST(lat_state->words);
-      heap[lat_state->num_words] = (lat_hyp_t *)malloc(sizeof(lat_hyp_t));
-      MEMTEST(lat_state->words[lat_state->num_words]);
+    // nbest == 0 means no nbest limit, make room for more hyps
+    if (lat_state->num_words > lat_state->capacity) {
+      lat_state_reserve(lat_state, 2 * lat_state->num_words);
+      heap = lat_state->words;
     }
 
     heap[lat_state->num_words]->index = hyp->index;
@@ -216,8 +239,11 @@ lattice_t *lattice_create(int nbest, int nnode, const decoder_t *decoder) {
 
   //Table of words
   lattice = (lattice_t *) malloc(sizeof(lattice_t));
+  MEMTEST(lattice);
   lattice->num_elements = 0;
   lattice->vector = NULL;
+  lattice->n_states = 0;
+  lattice->capacity = 0;
 
   lattice->nbest = nbest;
   lattice->nnode = nnode;
@@ -225,14 +251,54 @@ lattice_t *lattice_create(int nbest, int nnode, const decoder_t *decoder) {
 
   //Create vector of visits in table of words
   lattice->decoder = decoder;
-  lattice->grammar_state_index = hash_create(541, NULL);
+  lattice->state_slots = (lat_state_slot_t *) calloc(MIN_STATE_SLOTS, sizeof(lat_state_slot_t));
+  MEMTEST(lattice->state_slots);
+  lattice->state_mask = MIN_STATE_SLOTS - 1;
+  lattice->n_frame_states = 0;
+  lattice->frame_stamp = 1;
 
   lattice->n_frames = 0;
   lattice->initial_index = 0;
 
+  lattice->n_samples = 0;
+  lattice->n_allocations = 0;
+
   return lattice;
 }
 
+/** appends a lattice state to the lattice. States kept from previous samples are reused
+ * @param lattice a lattice
+ * @param nbest Maxim number of elements in the state
+ * @return the new lattice state
+ */
+static lat_state_t *lattice_append_state(lattice_t *lattice, int nbest) {
+  if (lattice->num_elements == lattice->capacity) {
+    lattice->capacity = (lattice->capacity > 0) ? 2 * lattice->capacity : MIN_STATE_SLOTS;
+    lattice->vector = (lat_state_t **) realloc(lattice->vector, lattice->capacity * sizeof(lat_state_t *));
+    MEMTEST(lattice->vector);
+    lattice->n_allocations++;
+  }
+
+  lat_state_t *lat_state;
+  if (lattice->num_elements < lattice->n_states) {
+    lat_state = lattice->vector[lattice->num_elements];
+    const int capacity = lat_state->capacity;
+    lat_state_reset(lat_state, nbest);
+    if (lat_state->capacity != capacity) lattice->n_allocations++;
+  }
+  else {
+    lat_state = lat_state_create(nbest);
+    lattice->vector[lattice->num_elements] = lat_state;
+    lattice->n_states++;
+    lattice->n_allocations++;
+  }
+
+  lat_state->t = lattice->n_frames - 1;
+  lat_state->index = lattice->num_elements;
+  lattice->num_elements++;
+  return lat_state;
+}
+
 
 
 ///adds a fake final node to the lattice at frame t and
@@ -244,10 +310,7 @@ lattice_t *lattice_create(int nbest, int nnode, const decoder_t *decoder) {
 */
 void lattice_add_final_node(lattice_t *lattice) {
   //Create un new element in table of words
-  lattice->vector = (lat_state_t **) realloc(lattice->vector, sizeof(lat_state_t *) * (lattice->num_elements + 1));
-  lattice->vector[lattice->num_elements] = lat_state_create(lattice->nbest);
-  lattice->vector[lattice->num_elements]->t = lattice->n_frames - 1;
-  lattice->num_elements++;
+  lat_state_t *final_state = lattice_append_state(lattice, lattice->nbest);
 
   symbol_t sym = extended_vocab_find_symbol(lattice->decoder->vocab, "!NULL");
   const extended_symbol_t *symbol_null = extended_vocab_get_extended_symbol(lattice->decoder->vocab, sym);
@@ -263,17 +326,48 @@ void lattice_add_final_node(lattice_t *lattice) {
       hyp.word = symbol_null->input[0];
       hyp.index = element;
       hyp.category = CATEGORY_NONE;
-      lat_state_insert(lattice->vector[lattice->num_elements - 1], &hyp);
+      hyp.state_in = STATE_INDEX_NONE;
+      hyp.state_out = STATE_INDEX_NONE;
+      const int capacity = final_state->capacity;
+      lat_state_insert(final_state, &hyp);
+      if (final_state->capacity != capacity) lattice->n_allocations++;
     }
   }
 }
 
-/** key that identifies lattice states
- */
-struct lat_state_key {
-  const state_grammar_t *grammar_state; /**< the grammar state*/
-  const symbol_t *phrase_state; /**< the word being processed in the phrase */
-};
+/** hash of the key of a lattice state
+@param word_ptr the word being processed in the phrase
+@param state the index of the grammar state
+@param category the category, since state is relative to its grammar
+@return the hash
+*/
+static unsigned long long lat_state_hash(const symbol_t *word_ptr, int state, int category) {
+  unsigned long long key = (unsigned int) state | ((unsigned long long) (unsigned int) category << 32);
+  key = (key ^ (unsigned long long) (size_t) word_ptr) * HASH_MULTIPLIER;
+  return key ^ (key >> 29);
+}
+
+/** doubles the number of slots of the table of lattice states, keeping the states of the current frame
+@param lattice a lattice
+*/
+static void lattice_grow_slots(lattice_t *lattice) {
+  lat_state_slot_t *old_slots = lattice->state_slots;
+  const int old_n_slots = lattice->state_mask + 1;
+
+  lattice->state_mask = 2 * old_n_slots - 1;
+  lattice->state_slots = (lat_state_slot_t *) calloc(lattice->state_mask + 1, sizeof(lat_state_slot_t));
+  MEMTEST(lattice->state_slots);
+  lattice->n_allocations++;
+
+  for (int i = 0; i < old_n_slots; i++) {
+    const lat_state_slot_t *slot = &old_slots[i];
+    if (slot->stamp != lattice->frame_stamp) continue;
+    unsigned long long h = lat_state_hash(slot->word_ptr, slot->state, slot->category);
+    while (lattice->state_slots[h & lattice->state_mask].stamp == lattice->frame_stamp) h++;
+    lattice->state_slots[h & lattice->state_mask] = *slot;
+  }
+  free(old_slots);
+}
 
 /** inserts a hypothesis at frame t in the lattice
 @param lattice a lattice
@@ -282,17 +376,22 @@ struct lat_state_key {
 @return the index in the lattice of the hypothesis lattice state
 */
 lat_state_t * lattice_insert(lattice_t *lattice, hyp_t *hyp) {
-  struct lat_state_key key = { hyp->state, hyp->word_ptr };
-  lat_state_t * lat_state = (lat_state_t *) hash_search(&key, sizeof(struct lat_state_key), lattice->grammar_state_index);
-  //lat_state_t * lat_state = (lat_state_t *) hash_search(&(hyp->state), sizeof(lat_state_t *), lattice->grammar_state_index);
+  // keep the table at most half full
+  if (2 * (lattice->n_frame_states + 1) > lattice->state_mask + 1) lattice_grow_slots(lattice);
+
+  unsigned long long h = lat_state_hash(hyp->word_ptr, hyp->state, hyp->category);
+  lat_state_slot_t *slot = &lattice->state_slots[h & lattice->state_mask];
+  while (slot->stamp == lattice->frame_stamp
+         && (slot->word_ptr != hyp->word_ptr || slot->state != hyp->state || slot->category != hyp->category)) {
+    h++;
+    slot = &lattice->state_slots[h & lattice->state_mask];
+  }
 
+  lat_state_t * lat_state;
   // if we haven't visited the state yet
-  if (lat_state == NULL) {
+  if (slot->stamp != lattice->frame_stamp) {
     //Create un new element in table of words
-    lattice->vector = (lat_state_t **) realloc(lattice->vector, sizeof(lat_state_t *) * (lattice->num_elements + 1));
-    MEMTEST(lattice->vector);
-    lat_state = lat_state_create(lattice->nnode);
-    lattice->vector[lattice->num_elements] = lat_state;
+    lat_state = lattice_append_state(lattice, lattice->nnode);
 
     lat_state->state = hyp->state;
     lat_state->word_ptr = hyp->word_ptr;
@@ -300,16 +399,21 @@ lat_state_t * lattice_insert(lattice_t *lattice, hyp_t *hyp) {
 
     lat_state->category = hyp->category;
 
-    lat_state->t = lattice->n_frames - 1;
-    lat_state->index = lattice->num_elements;
-
-    hash_insert(&key, sizeof(struct lat_state_key), lat_state, lattice->grammar_state_index);
-    //hash_insert(&(hyp->state), sizeof(lat_state_t *), lat_state, lattice->grammar_state_index);
-    lattice->num_elements++;
+    slot->word_ptr = hyp->word_ptr;
+    slot->state = hyp->state;
+    slot->category = hyp->category;
+    slot->stamp = lattice->frame_stamp;
+    slot->index = lat_state->index;
+    lattice->n_frame_states++;
+  }
+  else {
+    lat_state = lattice->vector[slot->index];
   }
 
   //Insert element in heap
+  const int capacity = lat_state->capacity;
   lat_state_insert(lat_state, hyp);
+  if (lat_state->capacity != capacity) lattice->n_allocations++;
   return lat_state;
 }
 
@@ -318,15 +422,26 @@ lat_state_t * lattice_insert(lattice_t *lattice, hyp_t *hyp) {
 @param lattice the lattice to be deleted
 */
 void lattice_delete(lattice_t *lattice){
-  for(int t=0; t<lattice->num_elements; t++){
+  for(int t=0; t<lattice->n_states; t++){
     lat_state_delete(lattice->vector[t]);
   }
   free(lattice->vector);
 
-  hash_delete(lattice->grammar_state_index, false);
+  free(lattice->state_slots);
   free(lattice);
 }
 
+///empties the lattice so that it can decode a new sample
+/**
+The lattice states and the table of states are kept and reused by the next sample
+@param lattice the lattice
+*/
+void lattice_clear(lattice_t *lattice) {
+  lattice->num_elements = 0;
+  lattice->n_frames = 0;
+  lattice_reset_frame(lattice);
+}
+
 ///sorts all the states in the lattice
 /**
 @param lattice a lattice
@@ -590,8 +705,13 @@ float lattice_best_hyp(const lattice_t *lattice, symbol_t **result) {
 // }
 
 void lattice_reset_frame(lattice_t *lattice) {
-  // initialize visited words
-  hash_clear(lattice->grammar_state_index, false);
+  // initialize visited words. The slots with older stamps are empty
+  lattice->frame_stamp++;
+  if (lattice->frame_stamp == 0) {
+    memset(lattice->state_slots, 0, (lattice->state_mask + 1) * sizeof(lat_state_slot_t));
+    lattice->frame_stamp = 1;
+  }
+  lattice->n_frame_states = 0;
   lattice->initial_index = lattice->num_elements;
 }
 
@@ -33,8 +33,8 @@ typedef struct {
   symbol_t word; ///< Word
   const symbol_t *word_ptr; ///< Word pointer for extended symbols.
   symbol_t extended; ///< extended word
-  state_grammar_t * state_in; ///< Number of target state of the input grammar
-  state_grammar_t * state_out; ///< Number of target state of the output grammar
+  int state_in; ///< Number of target state of the input grammar
+  int state_out; ///< Number of target state of the output grammar
 } lat_hyp_t;
 
 /// A state of the lattice
@@ -42,20 +42,33 @@ typedef struct {
   lat_hyp_t **words; ///< Egdes with the word that arrived to the state
   lat_hyp_t *max; ///< Maximum element in the heap of table of words
   int num_words; ///< Number of words
-  state_grammar_t * state; ///< Number of state
-  state_grammar_t * history_category; ///< Number of source state of the grammar in the aef with the category
+  int state; ///< Number of state in the grammar of the category or in the main grammar
+  int history_category; ///< Number of source state of the main grammar in the aef with the category
   const symbol_t *word_ptr; ///< Word pointer for extended symbols.
 
   int category; ///< Number of aef with the category
   int t; ///< t when the word ends
   int nbest; ///< the maximum number of hypotheses that can be stored
+  int capacity; ///< number of allocated hypotheses. It can be greater than nbest when the state is reused
   int index; ///< index of the lat_state in the lattice
 } lat_state_t;
 
+/// Entry of the table that finds the lattice states inserted in the current frame
+typedef struct {
+  const symbol_t *word_ptr; ///< the word being processed in the phrase
+  int state;                ///< the grammar state
+  int category;             ///< the category, since state is relative to its grammar
+  unsigned stamp;           ///< the entry is empty unless it has the stamp of the current frame
+  int index;                ///< index of the lattice state
+} lat_state_slot_t;
+
 /// List with table of words.
 typedef struct lattice_t {
   int num_elements; ///< Number of elements in a vector
   lat_state_t **vector; ///< Table of words
+  int n_states; /**< Number of allocated lattice states. The ones after num_elements
+                     are kept from previous samples to be reused */
+  int capacity; ///< Size of vector
 
   int nnode; ///< Number of edges in a state in word graph
   int nbest; ///< Number of n-best to word graph
@@ -65,7 +78,13 @@ typedef struct lattice_t {
   int n_frames; ///< number of frames
   int initial_index; ///< latest initial index
 
-  hash_t *grammar_state_index; ///< contains the table indexes for the visited states in the grammar
+  lat_state_slot_t *state_slots; ///< open addressing table with the lattice states of the current frame
+  int state_mask;       ///< number of slots minus one. The number of slots is a power of two
+  int n_frame_states;   ///< number of lattice states inserted in the current frame
+  unsigned frame_stamp; ///< stamp of the current frame in state_slots
+
+  int n_samples;     ///< number of samples decoded since the lattice was created
+  int n_allocations; ///< number of times that the lattice has allocated memory since it was created
 } lattice_t;
 
 #ifdef __cplusplus
@@ -80,6 +99,7 @@ void lattice_sort(lattice_t *lattice);
 float lattice_best_hyp(const lattice_t *lattice, symbol_t **result);
 void lattice_write(const lattice_t *lattice, FILE *file, const char *name);
 void lattice_delete(lattice_t *lattice);
+void lattice_clear(lattice_t *lattice);
 void lattice_dump(const lattice_t *lattice, FILE *file);
 void lattice_add_final_node(lattice_t *lattice);
 void lattice_reset_frame(lattice_t *lattice);
@@ -0,0 +1,374 @@
+/*
+ * lex_tree.c
+ *
+ *  Lexicon organized as a prefix tree of phonemes, so that the words that share
+ *  their first phonemes share their hypotheses until they diverge
+ */
+
+#include <viterbi/lex_tree.h>
+#include <viterbi/grammar_search.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <string.h>
+
+/// Node of the tree while it is being built
+typedef struct {
+  int phoneme;      ///< phoneme of the arc from its parent
+  int first_child;  ///< first child or -1
+  int next_sibling; ///< next child of its parent or -1
+  int first_word;   ///< first word that ends in the node or -1
+} trie_node_t;
+
+/// Word of the tree while it is being built
+typedef struct {
+  lex_tree_word_t word; ///< the word
+  int next;             ///< next word that ends in the same node or -1
+} trie_word_t;
+
+/// Tree while it is being built. Children and words are linked lists
+typedef struct {
+  trie_node_t *nodes; ///< nodes
+  int num_nodes;      ///< number of nodes
+  int max_nodes;      ///< allocated nodes
+  trie_word_t *words; ///< words
+  int num_words;      ///< number of words
+  int max_words;      ///< allocated words
+} trie_t;
+
+/** Returns the child of a node through a phoneme, creating it if it does not exist
+ * @param trie the tree being built
+ * @param node the node
+ * @param phoneme the phoneme
+ * @return the child
+ */
+static int trie_child(trie_t *trie, int node, int phoneme) {
+  for (int child = trie->nodes[node].first_child; child != -1; child = trie->nodes[child].next_sibling) {
+    if (trie->nodes[child].phoneme == phoneme) return child;
+  }
+
+  if (trie->num_nodes == trie->max_nodes) {
+    trie->max_nodes *= 2;
+    trie->nodes = (trie_node_t *) realloc(trie->nodes, trie->max_nodes * sizeof(trie_node_t));
+    MEMTEST(trie->nodes);
+  }
+  const int child = trie->num_nodes++;
+  trie->nodes[child].phoneme = phoneme;
+  trie->nodes[child].first_child = -1;
+  trie->nodes[child].first_word = -1;
+  trie->nodes[child].next_sibling = trie->nodes[node].first_child;
+  trie->nodes[node].first_child = child;
+  return child;
+}
+
+/** Adds a word that ends in a node. If the word already ends there with
+ * another pronunciation, the most probable one is kept
+ * @param trie the tree being built
+ * @param node the node
+ * @param extended the extended symbol of the word
+ * @param probability the log-probability of the pronunciation
+ */
+static void trie_add_word(trie_t *trie, int node, symbol_t extended, float probability) {
+  for (int w = trie->nodes[node].first_word; w != -1; w = trie->words[w].next) {
+    if (trie->words[w].word.extended == extended) {
+      if (probability > trie->words[w].word.probability) trie->words[w].word.probability = probability;
+      return;
+    }
+  }
+
+  if (trie->num_words == trie->max_words) {
+    trie->max_words *= 2;
+    trie->words = (trie_word_t *) realloc(trie->words, trie->max_words * sizeof(trie_word_t));
+    MEMTEST(trie->words);
+  }
+  const int w = trie->num_words++;
+  trie->words[w].word.extended = extended;
+  trie->words[w].word.probability = probability;
+  trie->words[w].next = trie->nodes[node].first_word;
+  trie->nodes[node].first_word = w;
+}
+
+/** Inserts the pronunciations of a lexicon model that start in one of its states
+ * @param trie the tree being built
+ * @param model the lexicon model
+ * @param state the state of the model
+ * @param node the node of the tree reached with the phonemes before state
+ * @param probability the log-probability of the phonemes before state
+ * @param extended the extended symbol of the word
+ * @param depth the number of phonemes before state
+ */
+static void trie_insert_model(trie_t *trie, const model_t *model, int state, int node, float probability,
+                              symbol_t extended, int depth) {
+  // the search finishes the word as soon as it reaches the end state
+  if (state == model->end) {
+    if (node != LEX_TREE_ROOT) trie_add_word(trie, node, extended, probability);
+    return;
+  }
+  REQUIRE(depth < model->num_states, "The lexicon model of '%s' has cycles", model->label);
+
+  const state_lex_t *state_lex = model->states[state];
+  for (int e = 0; e < state_lex->num_edges; e++) {
+    const edge_t *edge = state_lex->edges[e];
+    const int child = trie_child(trie, node, edge->phoneme);
+    trie_insert_model(trie, model, edge->destination, child, probability + edge->probability, extended, depth + 1);
+  }
+}
+
+/** Tells if a word of the grammar can be expanded through the tree
+ * @param lex the lexicon
+ * @param grammar the grammar
+ * @param extended the extended symbol of the word
+ * @return true if it is a single input word without translation nor category that is in the lexicon
+ */
+static bool lex_tree_accepts(const lex_t *lex, const grammar_t *grammar, symbol_t extended) {
+  const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, extended);
+  if (word->input == NULL || word->input[0] == VOCAB_NONE || word->input[1] != VOCAB_NONE) return false;
+  if (word->output != NULL && word->output[0] != VOCAB_NONE) return false;
+  const symbol_t in_word = word->input[0];
+  if (grammar->vocab->in->info[in_word].category != CATEGORY_NONE) return false;
+  return in_word < lex->num_models && lex->models[in_word] != NULL;
+}
+
+/** Creates the lexical tree of the words of an n-gram grammar.
+ * It also builds the word search of the states of the grammar that have none, so that
+ * the probability of the words can be found when their pronunciation ends
+ * @param lex the lexicon
+ * @param grammar the grammar. It must not be sorted again afterwards
+ * @return the tree
+ */
+lex_tree_t *lex_tree_create(const lex_t *lex, grammar_t *grammar) {
+  REQUIRE(grammar->is_ngram, "The lexical tree needs an n-gram grammar");
+  const int n_extended = grammar->vocab->extended->last;
+
+  lex_tree_t *tree = (lex_tree_t *) calloc(1, sizeof(lex_tree_t));
+  MEMTEST(tree);
+  tree->grammar = grammar;
+  tree->is_tree_word = (bool *) calloc(n_extended, sizeof(bool));
+  MEMTEST(tree->is_tree_word);
+
+  // words that can be expanded from some state of the grammar
+  bool *in_grammar = (bool *) calloc(n_extended, sizeof(bool));
+  MEMTEST(in_grammar);
+  grammar_build_word_hash(grammar, grammar->vocab->extended);
+  for (int s = 0; s < grammar->num_states; s++) {
+    state_grammar_t *state = grammar->vector[s];
+    for (int w = 0; w < state->num_words; w++) in_grammar[state->words[w].word] = true;
+    if (state->search.type == SS_NO_SEARCH) {
+      state_grammar_build_word_search_secondary(state, grammar->vocab->extended);
+    }
+  }
+
+  trie_t trie;
+  trie.max_nodes = 1024;
+  trie.nodes = (trie_node_t *) malloc(trie.max_nodes * sizeof(trie_node_t));
+  MEMTEST(trie.nodes);
+  trie.max_words = 1024;
+  trie.words = (trie_word_t *) malloc(trie.max_words * sizeof(trie_word_t));
+  MEMTEST(trie.words);
+  trie.num_nodes = 1;
+  trie.num_words = 0;
+  trie.nodes[LEX_TREE_ROOT].phoneme = -1;
+  trie.nodes[LEX_TREE_ROOT].first_child = -1;
+  trie.nodes[LEX_TREE_ROOT].next_sibling = -1;
+  trie.nodes[LEX_TREE_ROOT].first_word = -1;
+
+  for (int e = 0; e < n_extended; e++) {
+    const symbol_t extended = (symbol_t) e;
+    // start and end words are never expanded from the grammar
+    if (!in_grammar[e] || extended == grammar->start || extended == grammar->end) continue;
+    if (lex_tree_accepts(lex, grammar, extended)) {
+      const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, extended);
+      const model_t *model = lex->models[word->input[0]];
+      trie_insert_model(&trie, model, model->initial, LEX_TREE_ROOT, 0.0, extended, 0);
+      tree->is_tree_word[e] = true;
+    }
+    else {
+      tree->num_other_words++;
+    }
+  }
+  free(in_grammar);
+
+  // number the nodes in breadth-first order so that the children of a node are contiguous
+  int *order = (int *) malloc(trie.num_nodes * sizeof(int));
+  MEMTEST(order);
+  int *new_ids = (int *) malloc(trie.num_nodes * sizeof(int));
+  MEMTEST(new_ids);
+  int n_ordered = 1;
+  order[0] = LEX_TREE_ROOT;
+  new_ids[LEX_TREE_ROOT] = LEX_TREE_ROOT;
+  for (int i = 0; i < n_ordered; i++) {
+    for (int child = trie.nodes[order[i]].first_child; child != -1; child = trie.nodes[child].next_sibling) {
+      new_ids[child] = n_ordered;
+      order[n_ordered++] = child;
+    }
+  }
+
+  tree->num_nodes = trie.num_nodes;
+  tree->nodes = (lex_tree_node_t *) malloc(tree->num_nodes * sizeof(lex_tree_node_t));
+  MEMTEST(tree->nodes);
+  tree->arcs = (lex_tree_arc_t *) malloc(tree->num_nodes * sizeof(lex_tree_arc_t));
+  MEMTEST(tree->arcs);
+  tree->words = (lex_tree_word_t *) malloc((trie.num_words > 0 ? trie.num_words : 1) * sizeof(lex_tree_word_t));
+  MEMTEST(tree->words);
+  tree->num_arcs = 0;
+  tree->num_words = 0;
+  for (int i = 0; i < n_ordered; i++) {
+    const trie_node_t *trie_node = &trie.nodes[order[i]];
+    lex_tree_node_t *node = &tree->nodes[i];
+
+    node->first_arc = tree->num_arcs;
+    for (int child = trie_node->first_child; child != -1; child = trie.nodes[child].next_sibling) {
+      tree->arcs[tree->num_arcs].phoneme = trie.nodes[child].phoneme;
+      tree->arcs[tree->num_arcs].destination = new_ids[child];
+      tree->num_arcs++;
+    }
+    node->num_arcs = tree->num_arcs - node->first_arc;
+
+    node->first_word = tree->num_words;
+    for (int w = trie_node->first_word; w != -1; w = trie.words[w].next) {
+      tree->words[tree->num_words++] = trie.words[w].word;
+    }
+    node->num_words = tree->num_words - node->first_word;
+  }
+
+  free(order);
+  free(new_ids);
+  free(trie.nodes);
+  free(trie.words);
+
+  TRACE(1, "Lexical tree with %d nodes and %d pronunciations. %d words out of the tree\n",
+        tree->num_nodes, tree->num_words, tree->num_other_words);
+  return tree;
+}
+
+/** Deletes a lexical tree
+ * @param tree the tree
+ */
+void lex_tree_delete(lex_tree_t *tree) {
+  if (tree == NULL) return;
+  free(tree->nodes);
+  free(tree->arcs);
+  free(tree->words);
+  free(tree->is_tree_word);
+  free(tree);
+}
+
+/** Creates a cache of look-ahead scores
+ * @param tree the lexical tree
+ * @param capacity maximum number of grammar states whose scores are kept
+ * @param gsf grammar scale factor applied to the language model probabilities
+ * @return the cache
+ */
+lex_tree_lookahead_t *lex_tree_lookahead_create(const lex_tree_t *tree, int capacity, float gsf) {
+  REQUIRE(capacity > 0, "The look-ahead cache needs at least one entry");
+
+  lex_tree_lookahead_t *lookahead = (lex_tree_lookahead_t *) calloc(1, sizeof(lex_tree_lookahead_t));
+  MEMTEST(lookahead);
+  lookahead->tree = tree;
+  lookahead->gsf = gsf;
+  lookahead->capacity = capacity;
+  lookahead->head = -1;
+  lookahead->tail = -1;
+  lookahead->scores = (float **) calloc(capacity, sizeof(float *));
+  MEMTEST(lookahead->scores);
+  lookahead->entry_state = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(lookahead->entry_state);
+  lookahead->prev = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(lookahead->prev);
+  lookahead->next = (int *) malloc(capacity * sizeof(int));
+  MEMTEST(lookahead->next);
+  lookahead->state_entry = (int *) malloc(tree->grammar->num_states * sizeof(int));
+  MEMTEST(lookahead->state_entry);
+  for (int s = 0; s < tree->grammar->num_states; s++) lookahead->state_entry[s] = -1;
+  return lookahead;
+}
+
+/** Deletes a cache of look-ahead scores
+ * @param lookahead the cache
+ */
+void lex_tree_lookahead_delete(lex_tree_lookahead_t *lookahead) {
+  if (lookahead == NULL) return;
+  TRACE(1, "Look-ahead scores computed for %d grammar states\n", lookahead->num_misses);
+  for (int e = 0; e < lookahead->capacity; e++) free(lookahead->scores[e]);
+  free(lookahead->scores);
+  free(lookahead->entry_state);
+  free(lookahead->prev);
+  free(lookahead->next);
+  free(lookahead->state_entry);
+  free(lookahead);
+}
+
+/** Computes the look-ahead scores of the nodes of the tree for a grammar state.
+ * Since children go after their parents, the nodes are visited backwards
+ * @param lookahead the cache
+ * @param state the grammar state
+ * @param scores the scores of the nodes
+ */
+static void lex_tree_lookahead_compute(const lex_tree_lookahead_t *lookahead, int state, float *scores) {
+  const lex_tree_t *tree = lookahead->tree;
+  const grammar_t *grammar = tree->grammar;
+  state_grammar_t *grammar_state = grammar_get_state(grammar, state);
+
+  for (int n = tree->num_nodes - 1; n >= 0; n--) {
+    const lex_tree_node_t *node = &tree->nodes[n];
+    float best = LOG_ZERO;
+    for (const lex_tree_word_t *word = &tree->words[node->first_word]; word < &tree->words[node->first_word + node->num_words]; word++) {
+      words_state_t ws = { STATE_NONE, word->extended, LOG_ZERO };
+      if (state_grammar_fill_word_state(grammar_state, &ws)) {
+        const float score = word->probability + ws.prob * lookahead->gsf
+                          + extended_vocab_get_extended_symbol(grammar->vocab, word->extended)->combined_score;
+        if (score > best) best = score;
+      }
+    }
+    for (const lex_tree_arc_t *arc = &tree->arcs[node->first_arc]; arc < &tree->arcs[node->first_arc + node->num_arcs]; arc++) {
+      if (scores[arc->destination] > best) best = scores[arc->destination];
+    }
+    scores[n] = best;
+  }
+}
+
+/** Returns the look-ahead scores of the nodes of the tree for a grammar state.
+ * Nodes below which no word can follow the state get LOG_ZERO
+ * @param lookahead the cache
+ * @param state the grammar state
+ * @return the scores of the nodes. They are valid until the next call
+ */
+const float *lex_tree_lookahead_get(lex_tree_lookahead_t *lookahead, int state) {
+  int entry = lookahead->state_entry[state];
+
+  if (entry == -1) {
+    // take a free entry or evict the least recently used one
+    if (lookahead->num_entries < lookahead->capacity) {
+      entry = lookahead->num_entries++;
+      lookahead->scores[entry] = (float *) malloc(lookahead->tree->num_nodes * sizeof(float));
+      MEMTEST(lookahead->scores[entry]);
+    }
+    else {
+      entry = lookahead->tail;
+      lookahead->state_entry[lookahead->entry_state[entry]] = -1;
+      lookahead->tail = lookahead->prev[entry];
+      if (lookahead->tail != -1) lookahead->next[lookahead->tail] = -1;
+      else lookahead->head = -1;
+    }
+    lookahead->entry_state[entry] = state;
+    lookahead->state_entry[state] = entry;
+    lex_tree_lookahead_compute(lookahead, state, lookahead->scores[entry]);
+    lookahead->num_misses++;
+  }
+  else if (entry != lookahead->head) {
+    // unlink the entry before moving it to the front
+    lookahead->next[lookahead->prev[entry]] = lookahead->next[entry];
+    if (lookahead->next[entry] != -1) lookahead->prev[lookahead->next[entry]] = lookahead->prev[entry];
+    else lookahead->tail = lookahead->prev[entry];
+  }
+  else {
+    return lookahead->scores[entry];
+  }
+
+  // the entry is the most recently used one
+  lookahead->prev[entry] = -1;
+  lookahead->next[entry] = lookahead->head;
+  if (lookahead->head != -1) lookahead->prev[lookahead->head] = entry;
+  lookahead->head = entry;
+  if (lookahead->tail == -1) lookahead->tail = entry;
+  return lookahead->scores[entry];
+}
@@ -0,0 +1,93 @@
+/*
+ * lex_tree.h
+ *
+ *  Lexicon organized as a prefix tree of phonemes, so that the words that share
+ *  their first phonemes share their hypotheses until they diverge
+ */
+
+#ifndef LEX_TREE_H_
+#define LEX_TREE_H_
+
+#include <iatros/lex.h>
+#include <iatros/grammar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Root node of the lexical tree
+#define LEX_TREE_ROOT 0
+
+/// Phoneme that goes from a node of the tree to one of its children
+typedef struct {
+  int phoneme;     ///< phoneme of the arc
+  int destination; ///< child node
+} lex_tree_arc_t;
+
+/// Word whose pronunciation ends in a node of the tree
+typedef struct {
+  symbol_t extended; ///< extended symbol of the word in the grammar
+  float probability; ///< log-probability of the pronunciation in the lexicon
+} lex_tree_word_t;
+
+/// Node of the tree. Its arcs and words are contiguous in the arrays of the tree
+typedef struct {
+  int first_arc; ///< first arc in arcs
+  int num_arcs;  ///< number of arcs
+  int first_word; ///< first word in words
+  int num_words;  ///< number of words that end in the node
+} lex_tree_node_t;
+
+/** Prefix tree built from the pronunciations of the lexicon.
+ * It holds the words of an n-gram grammar that are a single input word without
+ * translation, so that the word identity is only needed when the pronunciation
+ * ends. The language model probability is applied then, from the grammar state in
+ * which the word started. The rest of the words are expanded with their own
+ * lexicon models
+ */
+typedef struct {
+  const grammar_t *grammar; ///< grammar whose words are in the tree
+  int num_nodes;            ///< number of nodes
+  lex_tree_node_t *nodes;   ///< nodes. The root is LEX_TREE_ROOT and children go after their parents
+  int num_arcs;             ///< number of arcs
+  lex_tree_arc_t *arcs;     ///< arcs of all the nodes
+  int num_words;            ///< number of pronunciations
+  lex_tree_word_t *words;   ///< words of all the nodes
+  bool *is_tree_word;       ///< if each extended symbol is expanded through the tree
+  int num_other_words;      ///< number of words of the grammar that are not in the tree
+} lex_tree_t;
+
+/** Look-ahead scores of the nodes of a lexical tree for the states of its grammar.
+ * The score of a node for a grammar state is the best score that any word below the
+ * node can get at its end from that state, so that hypotheses inside the tree are
+ * pruned as if they already had the language model probability of their best word.
+ * The scores of a grammar state are computed the first time they are needed and the
+ * least recently used states are evicted when the cache is full
+ */
+typedef struct {
+  const lex_tree_t *tree; ///< the tree
+  float gsf;              ///< grammar scale factor applied to the language model probabilities
+  int capacity;           ///< maximum number of grammar states in the cache
+  int num_entries;        ///< number of entries in use
+  float **scores;         ///< scores of the nodes of each entry. They are allocated when first used
+  int *entry_state;       ///< grammar state of each entry
+  int *prev;              ///< previous entry in the list of recently used entries or -1
+  int *next;              ///< next entry in the list of recently used entries or -1
+  int head;               ///< most recently used entry or -1
+  int tail;               ///< least recently used entry or -1
+  int *state_entry;       ///< entry of each grammar state or -1 if it is not in the cache
+  int num_misses;         ///< number of times that the scores of a grammar state were computed
+} lex_tree_lookahead_t;
+
+lex_tree_t *lex_tree_create(const lex_t *lex, grammar_t *grammar);
+void lex_tree_delete(lex_tree_t *tree);
+
+lex_tree_lookahead_t *lex_tree_lookahead_create(const lex_tree_t *tree, int capacity, float gsf);
+void lex_tree_lookahead_delete(lex_tree_lookahead_t *lookahead);
+const float *lex_tree_lookahead_get(lex_tree_lookahead_t *lookahead, int state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LEX_TREE_H_ */
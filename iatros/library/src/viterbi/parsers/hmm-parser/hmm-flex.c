@@ -234,6 +234,7 @@ int hmm_load(hmm_t * hmm,FILE *file) {
   /*================================================================*/
   /* parse it ------------------------------------------------------*/
   if (hmm_get_next_line() == 0) hmm_parse(hmm);
+  hmm_prepare(hmm);
 
   /*================================================================*/
   /* ending... -----------------------------------------------------*/
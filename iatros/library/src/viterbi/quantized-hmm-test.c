@@ -0,0 +1,122 @@
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <viterbi/hmm.h>
+#include <viterbi/quantized_hmm.h>
+#include <viterbi/test_hmm.h>
+#include <string.h>
+#include <math.h>
+
+/// number of frames drawn from each model
+#define TEST_FRAMES 50
+/// emissions further than this from the best one are not compared with the float model
+#define ERROR_BEAM 30.0
+
+/* Checks that a saved model is loaded back unchanged */
+static int test_round_trip(const quantized_hmm_t *qhmm) {
+  const size_t element_size = (qhmm->type == QT_INT8) ? sizeof(int8_t) : sizeof(int16_t);
+  const size_t vector_size = (size_t) qhmm->num_gaussians * qhmm->stride * element_size;
+  FILE *file = tmpfile();
+  CHECK_SYS_ERROR(file != NULL, "Couldn't create a temporary file\n");
+  quantized_hmm_save(qhmm, file);
+  rewind(file);
+  quantized_hmm_t *loaded = quantized_hmm_load(file);
+  fclose(file);
+
+  bool ok = loaded->type == qhmm->type && loaded->num_states == qhmm->num_states
+         && loaded->num_gaussians == qhmm->num_gaussians && loaded->num_features == qhmm->num_features
+         && loaded->stride == qhmm->stride
+         && memcmp(loaded->offsets, qhmm->offsets, (qhmm->num_states + 1) * sizeof(int)) == 0
+         && memcmp(loaded->centers, qhmm->centers, qhmm->num_features * sizeof(float)) == 0
+         && memcmp(loaded->steps, qhmm->steps, qhmm->num_features * sizeof(float)) == 0
+         && memcmp(loaded->means, qhmm->means, vector_size) == 0
+         && memcmp(loaded->precisions, qhmm->precisions, vector_size) == 0
+         && memcmp(loaded->precision_scales, qhmm->precision_scales, qhmm->num_gaussians * sizeof(float)) == 0
+         && memcmp(loaded->gconsts, qhmm->gconsts, qhmm->num_gaussians * sizeof(float)) == 0
+         && memcmp(loaded->priors, qhmm->priors, qhmm->num_gaussians * sizeof(float)) == 0;
+  quantized_hmm_delete(loaded);
+  if (!ok) printf("the loaded model differs from the saved one\n");
+  return ok ? 0 : 1;
+}
+
+/* Computes the emission of a state from the quantized values in double precision */
+static float reference_log_emission(const quantized_hmm_t *qhmm, int state, const int16_t *qdata) {
+  const int first = qhmm->offsets[state];
+  const int n = qhmm->offsets[state + 1] - first;
+  float scores[n > 0 ? n : 1];
+  for (int k = 0; k < n; k++) {
+    const int g = first + k;
+    double dist = 0;
+    for (int i = 0; i < qhmm->num_features; i++) {
+      const size_t offset = (size_t) g * qhmm->stride + i;
+      const double mean = (qhmm->type == QT_INT8) ? ((int8_t *) qhmm->means)[offset] : ((int16_t *) qhmm->means)[offset];
+      const double precision = (qhmm->type == QT_INT8) ? ((int8_t *) qhmm->precisions)[offset] : ((int16_t *) qhmm->precisions)[offset];
+      dist += precision * (qdata[i] - mean) * (qdata[i] - mean);
+    }
+    scores[k] = (qhmm->gconsts[g] + qhmm->precision_scales[g] * dist) / -2.0 + qhmm->priors[g];
+  }
+  return log_add_reduce(scores, n, LA_EXACT);
+}
+
+/* Checks the quantized emissions of every kernel against the reference computed from the
+ * quantized values and against the float model. The last frame is far from every mean, so
+ * the features are clipped and the distances are the largest possible ones */
+static int test_emissions(const hmm_t *hmm, const quantized_hmm_t *qhmm, double tolerance) {
+  const int num_states = hmm->packed->num_states;
+  float frame[hmm->num_features];
+  int16_t qframe[qhmm->stride];
+  float exact[num_states];
+  int errors = 0;
+
+  for (int k = GK_SCALAR; k < GK_MAX; k++) {
+    gaussian_kernel_t kernel = (gaussian_kernel_t) k;
+    if (!gaussian_kernel_set(kernel)) continue;
+    double max_kernel_error = 0, max_model_error = 0;
+    srand(4321);
+    for (int t = 0; t <= TEST_FRAMES; t++) {
+      if (t < TEST_FRAMES) hmm_sample_frame(hmm, frame);
+      else for (int i = 0; i < hmm->num_features; i++) frame[i] = 1e4;
+      quantized_hmm_quantize_features(qhmm, frame, qframe);
+      float best = LOG_ZERO;
+      for (int s = 0; s < num_states; s++) {
+        exact[s] = hmm_log_emission(hmm, s, frame);
+        if (exact[s] > best) best = exact[s];
+      }
+      for (int s = 0; s < num_states; s++) {
+        const float result = quantized_hmm_log_emission(qhmm, LA_EXACT, s, qframe);
+        const float reference = reference_log_emission(qhmm, s, qframe);
+        const double kernel_error = fabs(result - reference) / (1 + fabs(reference));
+        if (kernel_error > max_kernel_error) max_kernel_error = kernel_error;
+        if (t < TEST_FRAMES && exact[s] >= best - ERROR_BEAM && fabs(result - exact[s]) > max_model_error) {
+          max_model_error = fabs(result - exact[s]);
+        }
+      }
+    }
+    printf("%-5s %-8s max error against the quantized values %g, against the float model %g\n",
+           qhmm->type == QT_INT8 ? "int8" : "int16", gaussian_kernel_name(kernel), max_kernel_error, max_model_error);
+    if (max_kernel_error > 1e-5) errors++;
+    if (max_model_error > tolerance) errors++;
+  }
+  gaussian_kernel_set(GK_AUTO);
+  return errors;
+}
+
+/* Tests the quantized models on a typical model and on the largest 8 bit one */
+int main (int UNUSED(argc), char *UNUSED(argv[])) {
+  // phonemes of three states, gaussians per state and features
+  static const int sizes[][3] = { { 67, 8, 39 }, { 7, 4, 256 } };
+  int errors = 0;
+
+  srand(1234);
+  for (size_t m = 0; m < sizeof(sizes) / sizeof(sizes[0]); m++) {
+    hmm_t *hmm = test_hmm_create(sizes[m][0], sizes[m][1], sizes[m][2], 3.0, true);
+    printf("model: %d states, %d gaussians, %d features\n", hmm->num_states, hmm->num_states * sizes[m][1], sizes[m][2]);
+    for (int type = QT_INT16; type <= QT_INT8; type++) {
+      quantized_hmm_t *qhmm = quantized_hmm_create(hmm->packed, (quantization_t) type);
+      errors += test_round_trip(qhmm);
+      errors += test_emissions(hmm, qhmm, (type == QT_INT8) ? 2.0 : 0.05);
+      quantized_hmm_delete(qhmm);
+    }
+    hmm_delete(hmm);
+  }
+  return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
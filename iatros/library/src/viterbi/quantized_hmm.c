@@ -0,0 +1,378 @@
+/*
+ * quantized_hmm.c
+ *
+ *  Acoustic model with the gaussians stored as scaled 8 or 16 bit integers
+ */
+
+#include <viterbi/quantized_hmm.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define QUANTIZED_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+/// first line of the binary files
+#define QUANTIZED_HMM_MAGIC "#iATROS quantized hmm\n"
+/// version of the binary format
+#define QUANTIZED_HMM_VERSION 1
+/// number of standard deviations of the widest gaussian kept around the means of each dimension
+#define QUANTIZED_HMM_MARGIN 4.0
+/// number of elements processed by each step of the SIMD kernels
+#define QUANTIZED_HMM_BLOCK 16
+/** largest number of features of 8 bit models. Each term of the distance is below
+ * 254^2 * 127 < 2^23, so the 32 bit sums of at most 256 terms do not overflow */
+#define QUANTIZED_HMM_INT8_MAX_FEATURES 256
+
+/** Returns the largest quantized value of a type
+ * @param type the quantization type
+ * @return the largest value
+ */
+static int quantized_max(quantization_t type) {
+  return (type == QT_INT8) ? INT8_MAX : INT16_MAX;
+}
+
+/** Returns the size of a quantized element
+ * @param type the quantization type
+ * @return the size in bytes
+ */
+static size_t quantized_size(quantization_t type) {
+  return (type == QT_INT8) ? sizeof(int8_t) : sizeof(int16_t);
+}
+
+/** Gets the quantization type from a string
+ * @param quantization_str the type: NONE, INT16 or INT8
+ * @return the type or MAX_QUANTIZATION_TYPE if it is unknown
+ */
+quantization_t get_quantization_type(const char *quantization_str) {
+  quantization_t type = MAX_QUANTIZATION_TYPE;
+  if (quantization_str == NULL)                         type = MAX_QUANTIZATION_TYPE;
+  else if (strcasecmp(quantization_str, "NONE") == 0)   type = QT_NONE;
+  else if (strcasecmp(quantization_str, "INT16") == 0)  type = QT_INT16;
+  else if (strcasecmp(quantization_str, "INT8") == 0)   type = QT_INT8;
+  return type;
+}
+
+/** Allocates the arrays of a quantized model whose sizes are already set
+ * @param qhmm the quantized model
+ */
+static void quantized_hmm_alloc(quantized_hmm_t *qhmm) {
+  const size_t vector_size = (size_t) qhmm->num_gaussians * qhmm->stride * quantized_size(qhmm->type);
+  qhmm->offsets = (int *) malloc((qhmm->num_states + 1) * sizeof(int));
+  MEMTEST(qhmm->offsets);
+  qhmm->centers = (float *) malloc(qhmm->num_features * sizeof(float));
+  MEMTEST(qhmm->centers);
+  qhmm->steps = (float *) malloc(qhmm->num_features * sizeof(float));
+  MEMTEST(qhmm->steps);
+  qhmm->means = simd_malloc(vector_size);
+  qhmm->precisions = simd_malloc(vector_size);
+  memset(qhmm->means, 0, vector_size);
+  memset(qhmm->precisions, 0, vector_size);
+  qhmm->precision_scales = (float *) malloc(qhmm->num_gaussians * sizeof(float));
+  MEMTEST(qhmm->precision_scales);
+  qhmm->gconsts = (float *) malloc(qhmm->num_gaussians * sizeof(float));
+  MEMTEST(qhmm->gconsts);
+  qhmm->priors = (float *) malloc(qhmm->num_gaussians * sizeof(float));
+  MEMTEST(qhmm->priors);
+}
+
+/** Quantizes the gaussians of a packed model
+ * @param packed the packed model
+ * @param type QT_INT16 or QT_INT8
+ * @return the quantized model
+ *
+ * The range of each dimension covers the means plus QUANTIZED_HMM_MARGIN times
+ * the largest standard deviation, so that the features seen in practice are not clipped
+ */
+quantized_hmm_t *quantized_hmm_create(const packed_hmm_t *packed, quantization_t type) {
+  REQUIRE(type == QT_INT16 || type == QT_INT8, "Invalid quantization type %d", type);
+  REQUIRE(type != QT_INT8 || packed->num_features <= QUANTIZED_HMM_INT8_MAX_FEATURES,
+          "Too many features for 8 bit quantization (at most %d)", QUANTIZED_HMM_INT8_MAX_FEATURES);
+
+  quantized_hmm_t *qhmm = (quantized_hmm_t *) malloc(sizeof(quantized_hmm_t));
+  MEMTEST(qhmm);
+  qhmm->type = type;
+  qhmm->num_states = packed->num_states;
+  qhmm->num_gaussians = packed->num_gaussians;
+  qhmm->num_features = packed->num_features;
+  qhmm->stride = ((packed->num_features + QUANTIZED_HMM_BLOCK - 1) / QUANTIZED_HMM_BLOCK) * QUANTIZED_HMM_BLOCK;
+  quantized_hmm_alloc(qhmm);
+  memcpy(qhmm->offsets, packed->offsets, (qhmm->num_states + 1) * sizeof(int));
+  memcpy(qhmm->gconsts, packed->gconsts, qhmm->num_gaussians * sizeof(float));
+  memcpy(qhmm->priors, packed->priors, qhmm->num_gaussians * sizeof(float));
+
+  const int max_value = quantized_max(type);
+  for (int i = 0; i < qhmm->num_features; i++) {
+    float min_mean = FLT_MAX, max_mean = -FLT_MAX, max_variance = 0;
+    for (int g = 0; g < qhmm->num_gaussians; g++) {
+      const size_t offset = (size_t) g * packed->stride + i;
+      if (packed->means[offset] < min_mean) min_mean = packed->means[offset];
+      if (packed->means[offset] > max_mean) max_mean = packed->means[offset];
+      if (1.0 / packed->inv_variances[offset] > max_variance) max_variance = 1.0 / packed->inv_variances[offset];
+    }
+    qhmm->centers[i] = (min_mean + max_mean) / 2.0;
+    qhmm->steps[i] = ((max_mean - min_mean) / 2.0 + QUANTIZED_HMM_MARGIN * sqrt(max_variance)) / max_value;
+    if (qhmm->steps[i] <= 0) qhmm->steps[i] = 1;
+  }
+
+  for (int g = 0; g < qhmm->num_gaussians; g++) {
+    const float *mean = packed->means + (size_t) g * packed->stride;
+    const float *inv_variance = packed->inv_variances + (size_t) g * packed->stride;
+    float max_precision = 0;
+    for (int i = 0; i < qhmm->num_features; i++) {
+      const float precision = inv_variance[i] * qhmm->steps[i] * qhmm->steps[i];
+      if (precision > max_precision) max_precision = precision;
+    }
+    qhmm->precision_scales[g] = (max_precision > 0) ? max_precision / max_value : 1;
+
+    const size_t offset = (size_t) g * qhmm->stride;
+    for (int i = 0; i < qhmm->num_features; i++) {
+      float q_mean = roundf((mean[i] - qhmm->centers[i]) / qhmm->steps[i]);
+      if (q_mean > max_value) q_mean = max_value;
+      if (q_mean < -max_value) q_mean = -max_value;
+      const float q_precision = roundf(inv_variance[i] * qhmm->steps[i] * qhmm->steps[i] / qhmm->precision_scales[g]);
+      if (type == QT_INT8) {
+        ((int8_t *) qhmm->means)[offset + i] = (int8_t) q_mean;
+        ((int8_t *) qhmm->precisions)[offset + i] = (int8_t) q_precision;
+      }
+      else {
+        ((int16_t *) qhmm->means)[offset + i] = (int16_t) q_mean;
+        ((int16_t *) qhmm->precisions)[offset + i] = (int16_t) q_precision;
+      }
+    }
+  }
+  return qhmm;
+}
+
+/** Deletes a quantized model
+ * @param qhmm the quantized model
+ */
+void quantized_hmm_delete(quantized_hmm_t *qhmm) {
+  if (qhmm == NULL) return;
+  free(qhmm->offsets);
+  free(qhmm->centers);
+  free(qhmm->steps);
+  free(qhmm->means);
+  free(qhmm->precisions);
+  free(qhmm->precision_scales);
+  free(qhmm->gconsts);
+  free(qhmm->priors);
+  free(qhmm);
+}
+
+/** Returns the memory used by the gaussians of a quantized model
+ * @param qhmm the quantized model
+ * @return the size in bytes
+ */
+size_t quantized_hmm_size(const quantized_hmm_t *qhmm) {
+  return 2 * (size_t) qhmm->num_gaussians * qhmm->stride * quantized_size(qhmm->type)
+       + 3 * (size_t) qhmm->num_gaussians * sizeof(float)
+       + 2 * (size_t) qhmm->num_features * sizeof(float)
+       + (size_t) (qhmm->num_states + 1) * sizeof(int);
+}
+
+/** Saves a quantized model in binary format.
+ * The numbers are written in the byte order of the machine
+ * @param qhmm the quantized model
+ * @param file the output file
+ */
+void quantized_hmm_save(const quantized_hmm_t *qhmm, FILE *file) {
+  const int32_t header[] = { QUANTIZED_HMM_VERSION, qhmm->type, qhmm->num_states,
+                             qhmm->num_gaussians, qhmm->num_features, qhmm->stride };
+  const size_t vector_size = (size_t) qhmm->num_gaussians * qhmm->stride * quantized_size(qhmm->type);
+  bool ok = fputs(QUANTIZED_HMM_MAGIC, file) != EOF;
+  ok = ok && fwrite(header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(qhmm->offsets, sizeof(int), qhmm->num_states + 1, file) == (size_t) qhmm->num_states + 1;
+  ok = ok && fwrite(qhmm->centers, sizeof(float), qhmm->num_features, file) == (size_t) qhmm->num_features;
+  ok = ok && fwrite(qhmm->steps, sizeof(float), qhmm->num_features, file) == (size_t) qhmm->num_features;
+  ok = ok && fwrite(qhmm->means, vector_size, 1, file) == 1;
+  ok = ok && fwrite(qhmm->precisions, vector_size, 1, file) == 1;
+  ok = ok && fwrite(qhmm->precision_scales, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  ok = ok && fwrite(qhmm->gconsts, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  ok = ok && fwrite(qhmm->priors, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  CHECK_SYS_ERROR(ok, "Couldn't write the quantized hmm\n");
+}
+
+/** Loads a quantized model saved with quantized_hmm_save()
+ * @param file the input file
+ * @return the quantized model
+ */
+quantized_hmm_t *quantized_hmm_load(FILE *file) {
+  char magic[sizeof(QUANTIZED_HMM_MAGIC)];
+  int32_t header[6];
+  REQUIRE(fgets(magic, sizeof(magic), file) != NULL && strcmp(magic, QUANTIZED_HMM_MAGIC) == 0,
+          "The file is not a quantized hmm\n");
+  REQUIRE(fread(header, sizeof(header), 1, file) == 1, "Couldn't read the quantized hmm header\n");
+  REQUIRE(header[0] == QUANTIZED_HMM_VERSION, "Unsupported quantized hmm version %d\n", header[0]);
+  REQUIRE(header[1] == QT_INT16 || header[1] == QT_INT8, "Invalid quantization type %d\n", header[1]);
+  REQUIRE(header[2] > 0 && header[3] > 0 && header[4] > 0 && header[5] >= header[4]
+          && header[5] % QUANTIZED_HMM_BLOCK == 0, "Invalid quantized hmm sizes\n");
+  REQUIRE(header[1] != QT_INT8 || header[5] <= QUANTIZED_HMM_INT8_MAX_FEATURES,
+          "Too many features for 8 bit quantization (at most %d)\n", QUANTIZED_HMM_INT8_MAX_FEATURES);
+
+  quantized_hmm_t *qhmm = (quantized_hmm_t *) malloc(sizeof(quantized_hmm_t));
+  MEMTEST(qhmm);
+  qhmm->type = (quantization_t) header[1];
+  qhmm->num_states = header[2];
+  qhmm->num_gaussians = header[3];
+  qhmm->num_features = header[4];
+  qhmm->stride = header[5];
+  quantized_hmm_alloc(qhmm);
+
+  const size_t vector_size = (size_t) qhmm->num_gaussians * qhmm->stride * quantized_size(qhmm->type);
+  bool ok = fread(qhmm->offsets, sizeof(int), qhmm->num_states + 1, file) == (size_t) qhmm->num_states + 1;
+  ok = ok && fread(qhmm->centers, sizeof(float), qhmm->num_features, file) == (size_t) qhmm->num_features;
+  ok = ok && fread(qhmm->steps, sizeof(float), qhmm->num_features, file) == (size_t) qhmm->num_features;
+  ok = ok && fread(qhmm->means, vector_size, 1, file) == 1;
+  ok = ok && fread(qhmm->precisions, vector_size, 1, file) == 1;
+  ok = ok && fread(qhmm->precision_scales, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  ok = ok && fread(qhmm->gconsts, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  ok = ok && fread(qhmm->priors, sizeof(float), qhmm->num_gaussians, file) == (size_t) qhmm->num_gaussians;
+  REQUIRE(ok, "The quantized hmm is truncated\n");
+  REQUIRE(qhmm->offsets[0] == 0 && qhmm->offsets[qhmm->num_states] == qhmm->num_gaussians,
+          "Invalid quantized hmm offsets\n");
+  return qhmm;
+}
+
+/** Quantizes a feature vector with the steps of a quantized model
+ * @param qhmm the quantized model
+ * @param data a feature vector
+ * @param qdata output quantized vector. It must have stride elements
+ */
+void quantized_hmm_quantize_features(const quantized_hmm_t *qhmm, const float *data, int16_t *qdata) {
+  const int max_value = quantized_max(qhmm->type);
+  for (int i = 0; i < qhmm->num_features; i++) {
+    float value = roundf((data[i] - qhmm->centers[i]) / qhmm->steps[i]);
+    if (value > max_value) value = max_value;
+    if (value < -max_value) value = -max_value;
+    qdata[i] = (int16_t) value;
+  }
+  for (int i = qhmm->num_features; i < qhmm->stride; i++) qdata[i] = 0;
+}
+
+/** Computes the weighted squared distance between quantized vectors
+ * @param qdata a quantized feature vector
+ * @param mean the quantized mean, int8_t or int16_t
+ * @param precision the quantized inverse variance, int8_t or int16_t
+ * @param n the number of elements
+ * @return \f$\sum_i p_i (o_i - \mu_i)^2\f$
+ */
+typedef float (*quantized_distance_fn_t)(const int16_t *qdata, const void *mean, const void *precision, int n);
+
+/** Weighted squared distance of 8 bit gaussians.
+ * Differences are at most 254 and precisions 127, so diff * precision fits in 16 bits
+ * and each term in 23 bits. The sum fits in 32 bits up to QUANTIZED_HMM_INT8_MAX_FEATURES
+ */
+static float quantized_distance_int8_scalar(const int16_t *qdata, const void *mean_v, const void *precision_v, int n) {
+  const int8_t *mean = (const int8_t *) mean_v, *precision = (const int8_t *) precision_v;
+  int32_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    const int32_t diff = qdata[i] - mean[i];
+    sum += diff * diff * precision[i];
+  }
+  return sum;
+}
+
+/** Weighted squared distance of 16 bit gaussians.
+ * The differences are integers but they are weighted in floating point
+ */
+static float quantized_distance_int16_scalar(const int16_t *qdata, const void *mean_v, const void *precision_v, int n) {
+  const int16_t *mean = (const int16_t *) mean_v, *precision = (const int16_t *) precision_v;
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    const float diff = (int32_t) qdata[i] - mean[i];
+    sum += diff * diff * precision[i];
+  }
+  return sum;
+}
+
+#ifdef QUANTIZED_X86_DISPATCH
+
+__attribute__((target("avx2")))
+static float quantized_distance_int8_avx2(const int16_t *qdata, const void *mean_v, const void *precision_v, int n) {
+  const int8_t *mean = (const int8_t *) mean_v, *precision = (const int8_t *) precision_v;
+  __m256i acc = _mm256_setzero_si256();
+  for (int i = 0; i < n; i += QUANTIZED_HMM_BLOCK) {
+    const __m256i m = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (mean + i)));
+    const __m256i p = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (precision + i)));
+    const __m256i diff = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) (qdata + i)), m);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_mullo_epi16(diff, p), diff));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static float quantized_distance_int16_avx2(const int16_t *qdata, const void *mean_v, const void *precision_v, int n) {
+  const int16_t *mean = (const int16_t *) mean_v, *precision = (const int16_t *) precision_v;
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  for (int i = 0; i < n; i += QUANTIZED_HMM_BLOCK) {
+    const __m256i x = _mm256_loadu_si256((const __m256i *) (qdata + i));
+    const __m256i m = _mm256_loadu_si256((const __m256i *) (mean + i));
+    const __m256i p = _mm256_loadu_si256((const __m256i *) (precision + i));
+    const __m256 diff0 = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(x)),
+                                                             _mm256_cvtepi16_epi32(_mm256_castsi256_si128(m))));
+    const __m256 diff1 = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1)),
+                                                             _mm256_cvtepi16_epi32(_mm256_extracti128_si256(m, 1))));
+    const __m256 p0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(p)));
+    const __m256 p1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(p, 1)));
+    acc0 = _mm256_fmadd_ps(_mm256_mul_ps(diff0, diff0), p0, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_mul_ps(diff1, diff1), p1, acc1);
+  }
+  const __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+/** Selects the distance kernel of a quantized model
+ * @param qhmm the quantized model
+ * @param length output number of elements that the kernel must process
+ * @return the kernel
+ *
+ * The SIMD kernels are used when the selected gaussian kernel is AVX2 or better.
+ * They process whole strides, whose padding has null precisions
+ */
+static quantized_distance_fn_t quantized_distance_function(const quantized_hmm_t *qhmm, int *length) {
+#ifdef QUANTIZED_X86_DISPATCH
+  if (gaussian_kernel_get() >= GK_AVX2) {
+    *length = qhmm->stride;
+    return (qhmm->type == QT_INT8) ? quantized_distance_int8_avx2 : quantized_distance_int16_avx2;
+  }
+#endif
+  *length = qhmm->num_features;
+  return (qhmm->type == QT_INT8) ? quantized_distance_int8_scalar : quantized_distance_int16_scalar;
+}
+
+/** Computes the logarithm of the emission probability of a state with a quantized model
+ * @param qhmm the quantized model
+ * @param log_add how the components of the mixture are added
+ * @param state the state id
+ * @param qdata a feature vector quantized with quantized_hmm_quantize_features()
+ * @return the logarithm of the gaussian mixture density function of the state
+ */
+float quantized_hmm_log_emission(const quantized_hmm_t *qhmm, log_add_t log_add, int state, const int16_t *qdata) {
+  const int first = qhmm->offsets[state];
+  const int n = qhmm->offsets[state + 1] - first;
+  const size_t element_size = quantized_size(qhmm->type);
+  int length;
+  const quantized_distance_fn_t distance = quantized_distance_function(qhmm, &length);
+  float scores[n > 0 ? n : 1];
+  for (int i = 0; i < n; i++) {
+    const int g = first + i;
+    const size_t offset = (size_t) g * qhmm->stride * element_size;
+    const float dist = distance(qdata, (const char *) qhmm->means + offset, (const char *) qhmm->precisions + offset, length);
+    scores[i] = (qhmm->gconsts[g] + qhmm->precision_scales[g] * dist) / -2.0 + qhmm->priors[g];
+  }
+  return log_add_reduce(scores, n, log_add);
+}
@@ -0,0 +1,58 @@
+/*
+ * quantized_hmm.h
+ *
+ *  Acoustic model with the gaussians stored as scaled 8 or 16 bit integers
+ */
+
+#ifndef QUANTIZED_HMM_H_
+#define QUANTIZED_HMM_H_
+
+#include <iatros/hmm.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Storage of the quantized gaussians
+typedef enum { QT_NONE = 0, QT_INT16, QT_INT8, MAX_QUANTIZATION_TYPE } quantization_t;
+
+/** Gaussians of an acoustic model quantized for storage and scoring.
+ * Each dimension i has a center \f$c_i\f$ and a step \f$s_i\f$ shared by all the
+ * gaussians and by the features, so that means and features are stored as
+ * \f$q(x_i) = round((x_i - c_i)/s_i)\f$ and their difference is an integer.
+ * The inverse variances are multiplied by \f$s_i^2\f$ and scaled per gaussian
+ * to the integer range, so the weighted distance of gaussian g is
+ * \f$r_g \sum_i p_{gi} (q(o_i) - q(\mu_{gi}))^2\f$. With QT_INT8 the sum is
+ * computed with integer arithmetic, so it is limited to 256 features
+ */
+typedef struct {
+  quantization_t type;     ///< QT_INT16 or QT_INT8
+  int num_states;          ///< Number of states
+  int num_gaussians;       ///< Number of gaussians in all the states
+  int num_features;        ///< Number of features
+  int stride;              ///< Distance in elements between the vectors of two consecutive gaussians
+  int *offsets;            ///< First gaussian of each state. It has num_states + 1 elements
+  float *centers;          ///< Center of each dimension
+  float *steps;            ///< Quantization step of each dimension
+  void *means;             ///< Quantized means (num_gaussians x stride), int8_t or int16_t
+  void *precisions;        ///< Quantized inverse variances (num_gaussians x stride), int8_t or int16_t
+  float *precision_scales; ///< Scale of the inverse variances of each gaussian
+  float *gconsts;          ///< Gconst of each gaussian
+  float *priors;           ///< Log-prior of each gaussian in the mixture of its state
+} quantized_hmm_t;
+
+quantization_t get_quantization_type(const char *quantization_str);
+quantized_hmm_t *quantized_hmm_create(const packed_hmm_t *packed, quantization_t type);
+void quantized_hmm_delete(quantized_hmm_t *qhmm);
+size_t quantized_hmm_size(const quantized_hmm_t *qhmm);
+void quantized_hmm_save(const quantized_hmm_t *qhmm, FILE *file);
+quantized_hmm_t *quantized_hmm_load(FILE *file);
+void quantized_hmm_quantize_features(const quantized_hmm_t *qhmm, const float *data, int16_t *qdata);
+float quantized_hmm_log_emission(const quantized_hmm_t *qhmm, log_add_t log_add, int state, const int16_t *qdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QUANTIZED_HMM_H_ */
@@ -9,6 +9,82 @@
 #include <viterbi/lattice.h>
 #include <prhlt/trace.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+
+/// weight of the beam estimated in the last frame when the adaptive beam is updated
+#define ADAPTIVE_BEAM_GAIN 0.5
+
+/** Returns the initial beam of a search
+ * @param decoder the decoder of the search
+ * @return the beam of the decoder, inside the limits of the adaptive beam if it is enabled
+ */
+static float search_initial_beam(const decoder_t *decoder) {
+  if (decoder->adaptive_beam_hyps <= 0 && decoder->adaptive_beam_time <= 0) return decoder->beam_pruning;
+  return fminf(fmaxf(decoder->beam_pruning, decoder->adaptive_beam_min), decoder->adaptive_beam_max);
+}
+
+/** Returns the time of a monotonic clock
+ * @return the time in seconds
+ */
+static double search_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Creates the threads that expand the hypotheses of each frame
+ * @param decoder the decoder of the search
+ * @return the threads
+ */
+static search_threads_t *search_threads_create(const decoder_t *decoder) {
+  const int num_states = decoder->hmm->num_states;
+  search_threads_t *threads = (search_threads_t *) calloc(1, sizeof(search_threads_t));
+  MEMTEST(threads);
+  threads->pool = thread_pool_create(decoder->search_threads);
+  threads->workers = (search_worker_t *) calloc(decoder->search_threads, sizeof(search_worker_t));
+  MEMTEST(threads->workers);
+  for (int t = 0; t < decoder->search_threads; t++) {
+    search_worker_t *worker = &threads->workers[t];
+    worker->heap = hh_create(decoder->histogram_pruning, decoder->beam_pruning, decoder->pruning_engine);
+    if (decoder->lex_tree != NULL && decoder->lm_lookahead_cache > 0) {
+      worker->lm_lookahead = lex_tree_lookahead_create(decoder->lex_tree, decoder->lm_lookahead_cache, decoder->gsf);
+    }
+    worker->states = (int *) malloc(num_states * sizeof(int));
+    MEMTEST(worker->states);
+    worker->state_stamps = (unsigned *) calloc(num_states, sizeof(unsigned));
+    MEMTEST(worker->state_stamps);
+  }
+  threads->states = (int *) malloc(num_states * sizeof(int));
+  MEMTEST(threads->states);
+  threads->emissions = (float *) malloc(num_states * sizeof(float));
+  MEMTEST(threads->emissions);
+  threads->state_stamps = (unsigned *) calloc(num_states, sizeof(unsigned));
+  MEMTEST(threads->state_stamps);
+  return threads;
+}
+
+/** Deletes the threads that expand the hypotheses of each frame
+ * @param threads the threads
+ */
+static void search_threads_delete(search_threads_t *threads) {
+  if (threads == NULL) return;
+  for (int t = 0; t < thread_pool_num_threads(threads->pool); t++) {
+    search_worker_t *worker = &threads->workers[t];
+    hh_delete(worker->heap);
+    lex_tree_lookahead_delete(worker->lm_lookahead);
+    free(worker->events);
+    free(worker->states);
+    free(worker->state_stamps);
+  }
+  thread_pool_delete(threads->pool);
+  free(threads->workers);
+  free(threads->hyps);
+  free(threads->states);
+  free(threads->emissions);
+  free(threads->state_stamps);
+  free(threads);
+}
 
 /** Creates a new search info and associates it to a decoder
  * @param decoder decoder to which the search is associated
@@ -21,21 +97,90 @@ search_t * search_create(const decoder_t *decoder) {
   search->decoder = decoder_dup(decoder);
 
   //Create vector of visits for language model expansion
-  search->visit = (int *) malloc(decoder->vocab->extended->last * sizeof(int));
+  search->visit = (unsigned *) calloc(decoder->vocab->extended->last, sizeof(unsigned));
   MEMTEST(search->visit);
+  search->visit_generation = 0;
 
   // Vectors to probabilities
   search->t_probability =  (float *)malloc(decoder->hmm->num_states * sizeof(float));
+  MEMTEST(search->t_probability);
+  search->emission_stamps = (unsigned *) calloc(decoder->hmm->num_states, sizeof(unsigned));
+  MEMTEST(search->emission_stamps);
+  search->emission_generation = 0;
+  search->emission_cache = NULL;
+  search->feature_type = FT_UNKNOWN;
   search_clear_acoustic_probability_cache(search);
 
   // create couple of hypothesis heaps to alternate during the decoding process
-  search->heap      = hh_create(decoder->histogram_pruning, decoder->beam_pruning);
-  search->prev_heap = hh_create(decoder->histogram_pruning, decoder->beam_pruning);
+  search->beam = search_initial_beam(decoder);
+  search->frame_start = 0;
+  search->heap      = hh_create(decoder->histogram_pruning, search->beam, decoder->pruning_engine);
+  search->prev_heap = hh_create(decoder->histogram_pruning, search->beam, decoder->pruning_engine);
 
   search->stats = NULL;
+  search->stats_capacity = 0;
+  search->frame_counts = NULL;
   search->n_frames = 0;
+  search->n_samples = 0;
+  search->n_allocations = 0;
+  search->final_candidates = vector_create();
   search->is_prefix_search = false;
-  search->emission_cache = NULL;
+
+  search->selected_gaussians = NULL;
+  search->selection_generation = 0;
+  if (decoder->gaussian_selection != NULL) {
+    search->selected_gaussians = (int *) calloc(decoder->hmm->packed->num_gaussians, sizeof(int));
+    MEMTEST(search->selected_gaussians);
+  }
+
+  search->emission_pipeline = NULL;
+  if (decoder->emission_threads > 0) {
+    search->emission_pipeline = emission_pipeline_create(decoder->hmm, decoder->quantized_hmm,
+        decoder->emission_threads, decoder->emission_lookahead, decoder->emission_active_set);
+  }
+  search->emission_states = NULL;
+  search->n_emission_states = 0;
+  if (decoder->emission_threads > 0 && decoder->emission_active_set) {
+    search->emission_states = (int *) malloc(decoder->hmm->num_states * sizeof(int));
+    MEMTEST(search->emission_states);
+  }
+
+  search->reference_feat_vec = NULL;
+  search->reference_frame = -1;
+  if (decoder->frame_skip != 1) {
+    search->reference_feat_vec = (float *) malloc(decoder->hmm->num_features * sizeof(float));
+    MEMTEST(search->reference_feat_vec);
+  }
+
+  search->quantized_feat_vec = NULL;
+  if (decoder->quantized_hmm != NULL) {
+    search->quantized_feat_vec = (int16_t *) malloc(decoder->quantized_hmm->stride * sizeof(int16_t));
+    MEMTEST(search->quantized_feat_vec);
+  }
+
+  search->lm_lookahead = NULL;
+  if (decoder->lex_tree != NULL && decoder->lm_lookahead_cache > 0) {
+    // the scores do not depend on the sample, so they are kept for the next ones
+    search->lm_lookahead = lex_tree_lookahead_create(decoder->lex_tree, decoder->lm_lookahead_cache, decoder->gsf);
+  }
+
+  search->successors = NULL;
+  if (decoder->successor_cache > 0 && decoder->grammar->is_ngram && decoder->categories == NULL) {
+    // like the look-ahead scores, the merged words are kept for the next samples
+    search->successors = grammar_successors_create(decoder->grammar, decoder->successor_cache, decoder->successor_admission);
+  }
+
+  search->threads = NULL;
+  search->worker = NULL;
+  if (decoder->search_threads > 1) {
+    search->threads = search_threads_create(decoder);
+  }
+
+  search->ordered_feat_vec = NULL;
+  if (decoder->do_partial_distance) {
+    search->ordered_feat_vec = (float *) malloc(decoder->hmm->num_features * sizeof(float));
+    MEMTEST(search->ordered_feat_vec);
+  }
 
   return search;
 }
@@ -45,13 +190,25 @@ search_t * search_create(const decoder_t *decoder) {
  */
 void search_delete(search_t *search) {
   if (ENABLE_STATISTICS) {
-    for (int f = 0; f < search->n_frames; f++) {
+    for (int f = 0; f < search->stats_capacity; f++) {
       free(search->stats[f]);
     }
     free(search->stats);
   }
 
+  free(search->frame_counts);
+  vector_delete(search->final_candidates);
+  emission_pipeline_delete(search->emission_pipeline);
+  free(search->emission_states);
   free(search->visit);
+  free(search->emission_stamps);
+  free(search->selected_gaussians);
+  free(search->ordered_feat_vec);
+  free(search->quantized_feat_vec);
+  free(search->reference_feat_vec);
+  lex_tree_lookahead_delete(search->lm_lookahead);
+  grammar_successors_delete(search->successors);
+  search_threads_delete(search->threads);
 
   if (search->emission_cache == NULL) {
     free(search->t_probability);
@@ -84,12 +241,15 @@ void search_clear(search_t *search) {
   const decoder_t *decoder = search->decoder;
 
   // Create vector of visits for language model expansion
-  search->visit = (int *)realloc(search->visit, decoder->vocab->extended->last * sizeof(int));
+  search->visit = (unsigned *)realloc(search->visit, decoder->vocab->extended->last * sizeof(unsigned));
   MEMTEST(search->visit);
+  memset(search->visit, 0, decoder->vocab->extended->last * sizeof(unsigned));
+  search->visit_generation = 0;
 
   // Vectors to probabilities
   if (search->emission_cache == NULL) {
     search->t_probability =  (float *)realloc(search->t_probability, decoder->hmm->num_states * sizeof(float));
+    MEMTEST(search->t_probability);
   }
   search_clear_acoustic_probability_cache(search);
 
@@ -98,16 +258,14 @@ void search_clear(search_t *search) {
   hh_clear(search->heap);
   hh_clear(search->prev_heap);
 
-  // reset the statistics
-  if (ENABLE_STATISTICS) {
-    for (int f = 0; f < search->n_frames; f++) {
-      free(search->stats[f]);
-    }
-    free(search->stats);
-    search->stats = NULL;
-  }
-  search->n_frames = 0;
+  // the adaptive beam starts again from the beam of the decoder
+  search->beam = search_initial_beam(decoder);
+  hh_set_beam(search->heap, search->beam);
+  hh_set_beam(search->prev_heap, search->beam);
 
+  // the statistics of the frames are kept to be reused
+  search->n_frames = 0;
+  search->reference_frame = -1;
 }
 
 /** initializes the emission cache
@@ -118,24 +276,141 @@ void search_create_emission_cache(search_t *search) {
   search->emission_cache = vector_create();
 }
 
+/** deletes an emission cache that is not shared with other searches
+ * and goes back to computing the emissions of each frame from scratch
+ * @param search the search
+ */
+void search_delete_emission_cache(search_t *search) {
+  for (size_t i = 0; i < search->emission_cache->n_elems; i++) {
+    free(search->emission_cache->data[i]);
+  }
+  vector_delete(search->emission_cache);
+  search->emission_cache = NULL;
+  search->t_probability = (float *) malloc(search->decoder->hmm->num_states * sizeof(float));
+  MEMTEST(search->t_probability);
+  search_clear_acoustic_probability_cache(search);
+}
+
 /// initialises the acoustic probability cache
 /**
  * @param search the search with the acoustic cache to initialise
  */
 INLINE void search_clear_acoustic_probability_cache(search_t *search) {
-  for (int i = 0; i < search->decoder->hmm->num_states; i++) {
-    search->t_probability[i] = LOG_ZERO;
+  if (search->emission_cache == NULL) {
+    // a new stamp invalidates all the emissions of the previous frame
+    search->emission_generation++;
+    if (search->emission_generation == 0) {
+      memset(search->emission_stamps, 0, search->decoder->hmm->num_states * sizeof(unsigned));
+      search->emission_generation = 1;
+    }
+  }
+  else {
+    // the arrays of the emission cache are shared, so they keep the LOG_ZERO marks
+    for (int i = 0; i < search->decoder->hmm->num_states; i++) {
+      search->t_probability[i] = LOG_ZERO;
+    }
   }
+  search->max_emission = LOG_ZERO;
   search->best_achievable_ac = LOG_ZERO;
 }
 
 
-/// initialises the vector of visited words for backoff word expansion
+/** Returns if the emission of a state is already in the acoustic probability cache
+ * @param search the search
+ * @param state the state
+ * @return true if t_probability[state] is valid in this frame
+ */
+INLINE bool search_has_emission(const search_t *search, int state) {
+  if (search->emission_cache == NULL && search->feature_type != FT_EMISSION_PROBABILITIES) {
+    return search->emission_stamps[state] == search->emission_generation;
+  }
+  return !is_logzero(search->t_probability[state]);
+}
+
+/** Stores the emission of a state in the acoustic probability cache
+ * @param search the search
+ * @param state the state
+ * @param emission the emission
+ */
+INLINE void search_set_emission(search_t *search, int state, float emission) {
+  search->t_probability[state] = emission;
+  search->emission_stamps[state] = search->emission_generation;
+  if (emission > search->max_emission) search->max_emission = emission;
+  if (search->emission_states != NULL && search->n_emission_states < search->decoder->hmm->num_states) {
+    search->emission_states[search->n_emission_states++] = state;
+  }
+}
+
+
+/** Returns if the beam of each frame is adapted
+ * @param search the search
+ * @return true if the decoder has a target number of hypotheses or a target frame time
+ */
+INLINE bool search_has_adaptive_beam(const search_t *search) {
+  return search->decoder->adaptive_beam_hyps > 0 || search->decoder->adaptive_beam_time > 0;
+}
+
+/** Sets the adaptive beam in the heap of a new frame. The heap must be empty
+ * @param search the search
+ */
+void search_start_adaptive_beam(search_t *search) {
+  hh_set_beam(search->heap, search->beam);
+  if (search->decoder->adaptive_beam_time > 0) search->frame_start = search_time();
+}
+
+/** Updates the adaptive beam for the next frame with the hypotheses kept in the current one.
+ * The heap must be already pruned.
+ * @param search the search
+ *
+ * The beam is steered towards the one estimated from this frame, which is the minimum of:
+ *  - with a target number of hypotheses, the range of scores that would have kept that number
+ *    of hypotheses, assuming that their scores are spread uniformly from hh_min() to hh_max().
+ *    When there are fewer hypotheses, it is not narrower than the current beam, since it
+ *    was not the beam what limited them.
+ *  - with a target frame time, the current beam scaled by the ratio between the target
+ *    and the time of this frame, assuming that the time grows linearly with the beam.
+ */
+void search_adapt_beam(search_t *search) {
+  const decoder_t *decoder = search->decoder;
+  const hyp_heap_t *heap = search->heap;
+  const float beam = hh_beam(heap);
+  float estimate = decoder->adaptive_beam_max;
+
+  if (decoder->adaptive_beam_hyps > 0 && hh_size(heap) > 1) {
+    const int n_hyps = hh_size(heap);
+    const float range = hh_max(heap) - hh_min(heap);
+    if (range > 0) {
+      float hyps_beam = range * decoder->adaptive_beam_hyps / n_hyps;
+      if (n_hyps < decoder->adaptive_beam_hyps && hyps_beam < beam) hyps_beam = beam;
+      estimate = fminf(estimate, hyps_beam);
+    }
+  }
+
+  if (decoder->adaptive_beam_time > 0) {
+    const double elapsed = search_time() - search->frame_start;
+    if (elapsed > 0) estimate = fminf(estimate, beam * (decoder->adaptive_beam_time / elapsed));
+  }
+
+  const float next_beam = beam + ADAPTIVE_BEAM_GAIN * (estimate - beam);
+  search->beam = fminf(fmaxf(next_beam, decoder->adaptive_beam_min), decoder->adaptive_beam_max);
+
+  if (ENABLE_STATISTICS) {
+    search->stats[search->n_frames - 1]->ab_frames = 1;
+    search->stats[search->n_frames - 1]->ab_beam = beam;
+  }
+}
+
+/// initialises the vector of visited words for backoff word expansion.
+/// Only the stamp changes, unless it wraps around
 /**
  * @param search the search
  */
 INLINE void search_clear_visited_words(search_t *search) {
-  memset(search->visit, 0, (search->decoder->vocab->extended->last) * sizeof(int));
+  search->visit_generation++;
+  if (search->visit_generation == 0) {
+    memset(search->visit, 0, (search->decoder->vocab->extended->last) * sizeof(unsigned));
+    search->visit_generation = 1;
+  }
 }
 
 /** Computes best achievable ac
@@ -144,15 +419,22 @@ INLINE void search_clear_visited_words(search_t *search) {
  * so that we can use it in the future to do early pruning
  */
 void search_compute_best_achievable_ac(search_t *search) {
-  search->best_achievable_ac = LOG_ZERO;
-  for (int s = 0; s < search->decoder->hmm->num_states; s++) {
-    if (search->t_probability[s] > search->best_achievable_ac) search->best_achievable_ac = search->t_probability[s];
+  if (search->emission_cache == NULL && search->feature_type != FT_EMISSION_PROBABILITIES) {
+    // all the emissions of this frame were stored with search_set_emission()
+    search->best_achievable_ac = search->max_emission;
+  }
+  else {
+    // emissions may come from other searches or from the features
+    search->best_achievable_ac = LOG_ZERO;
+    for (int s = 0; s < search->decoder->hmm->num_states; s++) {
+      if (search->t_probability[s] > search->best_achievable_ac) search->best_achievable_ac = search->t_probability[s];
+    }
   }
 
   if (ENABLE_STATISTICS >= SV_SHOW_WORD_EXPANSION) {
     search->stats[search->n_frames-1]->num_seen_states = 0;
     for (int s = 0; s < search->decoder->hmm->num_states; s++) {
-      if (!is_logzero(search->t_probability[s])) search->stats[search->n_frames - 1]->num_seen_states++;
+      if (search_has_emission(search, s)) search->stats[search->n_frames - 1]->num_seen_states++;
     }
     fprintf(stderr, "Seen %d(%6.2f%%) states out of %d\n", search->stats[search->n_frames-1]->num_seen_states, 100.0 * search->stats[search->n_frames-1]->num_seen_states
         / (float) search->stats[search->n_frames-1]->num_states, search->stats[search->n_frames-1]->num_states);
@@ -11,26 +11,91 @@
 #include <iatros/decoder.h>
 #include <iatros/statistics.h>
 #include <iatros/heap.h>
+#include <iatros/emission_pipeline.h>
+#include <iatros/thread_pool.h>
+
+/// Hypothesis produced by a search thread, which the search inserts in the same order
+typedef struct {
+  hyp_t hyp;        ///< the hypothesis
+  bool is_word_end; ///< if true, it goes to the lattice, otherwise to the heap
+} search_event_t;
+
+/// Search thread that expands a range of the hypotheses of a frame
+typedef struct {
+  hyp_heap_t *heap;         ///< private heap that discards the hypotheses that the heap of the search would reject
+  lex_tree_lookahead_t *lm_lookahead; /**< private look-ahead scores. The scores returned by a cache are only valid
+                                        *  until its next call, so the threads cannot share one. Only with lexical tree */
+  search_event_t *events;   ///< hypotheses produced in the range, in the order of a single thread
+  int n_events;             ///< number of events
+  int events_capacity;      ///< number of allocated events. They are reused by the next frames
+  int *states;              ///< states whose emissions are needed by the range and are not in the cache
+  int n_states;             ///< number of states
+  unsigned *state_stamps;   ///< generation in which each state was added to states
+  unsigned state_generation; ///< current generation of state_stamps
+  int first_hyp;            ///< first hypothesis of the range
+  int last_hyp;             ///< hypothesis after the range
+  int n_allocations;        ///< number of times that events were allocated since the search took them into account
+} search_worker_t;
+
+/// Threads that expand the hypotheses of each frame
+typedef struct {
+  thread_pool_t *pool;      ///< the threads
+  search_worker_t *workers; ///< state of each thread
+  hyp_t *hyps;              ///< hypotheses of the previous frame in the order in which they are expanded
+  int n_hyps;               ///< number of hypotheses
+  int hyps_capacity;        ///< number of allocated hypotheses
+  int *states;              ///< states whose emissions are computed by the threads in the current frame
+  float *emissions;         ///< emissions of those states
+  int n_states;             ///< number of states
+  unsigned *state_stamps;   ///< generation in which each state was added to states
+  unsigned state_generation; ///< current generation of state_stamps
+} search_threads_t;
 
 typedef struct {
   decoder_t *decoder;         ///< decoder used to perform the search
 
   stats_t **stats;            ///< frame statistics
+  int stats_capacity;         ///< number of allocated frame statistics. They are reused by the next samples
+  int *frame_counts;          ///< counts of the expansions of the current frame. Only with SV_SHOW_FRAME statistics
   int n_frames;               ///< number of decoded frames
+  int n_samples;              ///< number of samples decoded since the search was created
+  int n_allocations;          ///< number of times that the search allocated memory while decoding the current sample
+  vector_t *final_candidates; ///< hypotheses that can end the sentence in the last frame
 
   hyp_heap_t *heap;           ///< Heap where new hypothesis are added
   hyp_heap_t *prev_heap;      ///< Heap with hypothesis that must be expanded
+  float beam;                 ///< beam of the next frame. It only changes with adaptive beam
+  double frame_start;         ///< time at which the current frame started. Only with adaptive beam
 
   //Vectors to stores probability information from states.
   float *t_probability; ///< Vectors to write the calculated probabilities
+  unsigned *emission_stamps; /**< frame stamp of each state whose emission in t_probability is valid.
+                                  Without emission cache, it replaces the LOG_ZERO marks so that
+                                  clearing the emissions of a frame does not depend on the number of states */
+  unsigned emission_generation; ///< stamp of the current frame in emission_stamps
+  float max_emission; ///< maximum emission stored with search_set_emission() in the current frame
+  int *emission_states; ///< states stored with search_set_emission() in the current frame. Only for the active set of the emission threads
+  int n_emission_states; ///< number of states in emission_states
 
   feat_type_t feature_type; ///< type of features. Some types have special behaviours
 
   //Vector of visits in Language Model Expansion
-  int *visit;
+  unsigned *visit; ///< stamp of the last word expansion in which each extended word was expanded
+  unsigned visit_generation; ///< stamp of the current word expansion in visit
+  grammar_successors_t *successors; ///< if != NULL, words of the n-gram states merged with the ones of their backoff states
   bool is_prefix_search; ///< indicates if it is a prefix search
   vector_t *emission_cache; ///< if != NULL, it stores temporary emission probabilities for latter usage
   float best_achievable_ac; ///< cache for the best achievable ac score
+  emission_pipeline_t *emission_pipeline; ///< if != NULL, threads compute the emissions ahead of the search
+  int *selected_gaussians; ///< frame in which each gaussian was selected last. Only with gaussian selection
+  int selection_generation; ///< stamp of the current frame for the selected gaussians
+  float *reference_feat_vec; ///< features of the last frame whose emissions were computed. Only with frame skipping
+  int reference_frame; ///< frame of reference_feat_vec, -1 if there is none
+  int16_t *quantized_feat_vec; ///< feature vector of the current frame quantized. Only with quantized models
+  float *ordered_feat_vec; ///< feature vector of the current frame permuted for partial distance. Only with partial distance
+  lex_tree_lookahead_t *lm_lookahead; ///< language model look-ahead scores over the lexical tree. Only with lexical tree
+  search_threads_t *threads; ///< if != NULL, several threads expand the hypotheses of each frame
+  search_worker_t *worker; ///< in the copy of the search used by a search thread, its state. NULL otherwise
   bool do_acoustic_early_pruning; /**< If the acoustic early pruning is enabled or not.
                                        Note that this can be different from the one in decoder
                                        since when we do not have best achievable ac, we disable
@@ -45,9 +110,15 @@ search_t * search_create(const decoder_t *decoder);
 void search_delete(search_t *search);
 void search_clear(search_t *search);
 void search_create_emission_cache(search_t *search);
+void search_delete_emission_cache(search_t *search);
 INLINE void search_clear_acoustic_probability_cache(search_t *search);
 INLINE void search_clear_visited_words(search_t *search);
 INLINE void search_compute_best_achievable_ac(search_t *search);
+INLINE bool search_has_emission(const search_t *search, int state);
+INLINE void search_set_emission(search_t *search, int state, float emission);
+INLINE bool search_has_adaptive_beam(const search_t *search);
+void search_start_adaptive_beam(search_t *search);
+void search_adapt_beam(search_t *search);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1040 @@
+/*
+ * search_network.c
+ *
+ *  Search network compiled offline from the acoustic model, the lexicon and a
+ *  finite-state grammar, and the Viterbi decoder that runs on it
+ */
+
+#include <viterbi/search_network.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <string.h>
+#include <stdint.h>
+
+/// Identifies the binary format of the network
+#define SEARCH_NETWORK_MAGIC "#iATROS search network\n"
+/// Version of the binary format
+#define SEARCH_NETWORK_VERSION 1
+
+/// Node of the network while it is being built
+typedef struct {
+  int phoneme;      ///< phoneme of the arc from its parent or -1 in the root of a grammar state
+  int first_child;  ///< first child or -1
+  int next_sibling; ///< next child of its parent or -1
+  int first_word;   ///< first word that ends in the node or -1
+} net_node_t;
+
+/// Word of the network while it is being built
+typedef struct {
+  int label;    ///< index of the word in the labels
+  float weight; ///< log-probability of the word, its pronunciation and the penalty
+  int state;    ///< grammar state reached by the word
+  int next;     ///< next word that ends in the same node or -1
+} net_word_t;
+
+/** Network while it is being built. It is a prefix tree per grammar state whose
+ * roots are the first nodes. Children always go after their parents
+ */
+typedef struct {
+  net_node_t *nodes; ///< nodes
+  int num_nodes;     ///< number of nodes
+  int max_nodes;     ///< allocated nodes
+  net_word_t *words; ///< words
+  int num_words;     ///< number of words
+  int max_words;     ///< allocated words
+} net_builder_t;
+
+/** Returns the child of a node through a phoneme, creating it if it does not exist
+ * @param builder the network being built
+ * @param node the node
+ * @param phoneme the phoneme
+ * @return the child
+ */
+static int builder_child(net_builder_t *builder, int node, int phoneme) {
+  for (int child = builder->nodes[node].first_child; child != -1; child = builder->nodes[child].next_sibling) {
+    if (builder->nodes[child].phoneme == phoneme) return child;
+  }
+
+  if (builder->num_nodes == builder->max_nodes) {
+    builder->max_nodes *= 2;
+    builder->nodes = (net_node_t *) realloc(builder->nodes, builder->max_nodes * sizeof(net_node_t));
+    MEMTEST(builder->nodes);
+  }
+  const int child = builder->num_nodes++;
+  builder->nodes[child].phoneme = phoneme;
+  builder->nodes[child].first_child = -1;
+  builder->nodes[child].first_word = -1;
+  builder->nodes[child].next_sibling = builder->nodes[node].first_child;
+  builder->nodes[node].first_child = child;
+  return child;
+}
+
+/** Adds a word that ends in a node. If the word already goes from there to the
+ * same grammar state, the most probable one is kept
+ * @param builder the network being built
+ * @param node the node
+ * @param label the label of the word
+ * @param weight the log-probability of the word
+ * @param state the grammar state reached by the word
+ */
+static void builder_add_word(net_builder_t *builder, int node, int label, float weight, int state) {
+  for (int w = builder->nodes[node].first_word; w != -1; w = builder->words[w].next) {
+    if (builder->words[w].label == label && builder->words[w].state == state) {
+      if (weight > builder->words[w].weight) builder->words[w].weight = weight;
+      return;
+    }
+  }
+
+  if (builder->num_words == builder->max_words) {
+    builder->max_words *= 2;
+    builder->words = (net_word_t *) realloc(builder->words, builder->max_words * sizeof(net_word_t));
+    MEMTEST(builder->words);
+  }
+  const int w = builder->num_words++;
+  builder->words[w].label = label;
+  builder->words[w].weight = weight;
+  builder->words[w].state = state;
+  builder->words[w].next = builder->nodes[node].first_word;
+  builder->nodes[node].first_word = w;
+}
+
+/** Inserts the pronunciations of a sequence of input words that start in a state of the
+ * lexicon model of the first one. The pronunciation of a word follows the one of the previous word
+ * @param builder the network being built
+ * @param lex the lexicon
+ * @param input the input words that are left, ended by VOCAB_NONE
+ * @param state the state in the model of the first input word
+ * @param node the node reached with the phonemes before state
+ * @param weight the log-probability of the word and of the phonemes before state
+ * @param label the label of the word
+ * @param next_state the grammar state reached by the word
+ * @param depth the number of phonemes before state in the model of the first input word
+ */
+static void builder_insert(net_builder_t *builder, const lex_t *lex, const symbol_t *input, int state, int node,
+                           float weight, int label, int next_state, int depth) {
+  const model_t *model = lex->models[*input];
+  if (state == model->end) {
+    if (input[1] != VOCAB_NONE) {
+      builder_insert(builder, lex, input + 1, lex->models[input[1]]->initial, node, weight, label, next_state, 0);
+    }
+    else if (builder->nodes[node].phoneme != -1) {
+      builder_add_word(builder, node, label, weight, next_state);
+    }
+    return;
+  }
+  REQUIRE(depth < model->num_states, "The lexicon model of '%s' has cycles", model->label);
+
+  const state_lex_t *state_lex = model->states[state];
+  for (int e = 0; e < state_lex->num_edges; e++) {
+    const edge_t *edge = state_lex->edges[e];
+    const int child = builder_child(builder, node, edge->phoneme);
+    builder_insert(builder, lex, input, edge->destination, child, weight + edge->probability, label, next_state, depth + 1);
+  }
+}
+
+/** Returns the label of a word, adding it to the labels of the network the first time
+ * @param network the network
+ * @param labels label of each extended symbol or -1
+ * @param vocab the vocabulary of the grammar
+ * @param extended the extended symbol of the word
+ * @return the label
+ */
+static int network_label(search_network_t *network, int *labels, const extended_vocab_t *vocab, symbol_t extended) {
+  if (labels[extended] == -1) {
+    network->labels = (char **) realloc(network->labels, (network->num_labels + 1) * sizeof(char *));
+    MEMTEST(network->labels);
+    network->labels[network->num_labels] = strdup(extended_vocab_get_string(vocab, extended));
+    MEMTEST(network->labels[network->num_labels]);
+    labels[extended] = network->num_labels++;
+  }
+  return labels[extended];
+}
+
+/** Tells if all the input words of a grammar word have a pronunciation
+ * @param lex the lexicon
+ * @param grammar the grammar
+ * @param word the word
+ * @return true if they are in the lexicon and none of them is a category
+ */
+static bool network_accepts(const lex_t *lex, const grammar_t *grammar, const extended_symbol_t *word) {
+  if (word->input == NULL || word->input[0] == VOCAB_NONE) return false;
+  for (const symbol_t *in_word = word->input; *in_word != VOCAB_NONE; in_word++) {
+    if (grammar->vocab->in->info[*in_word].category != CATEGORY_NONE) return false;
+    if (*in_word >= lex->num_models || lex->models[*in_word] == NULL) return false;
+  }
+  return true;
+}
+
+/// Pushed network before merging. Arcs and words of each node are sorted
+typedef struct {
+  int num_nodes;                 ///< number of nodes
+  int *first_arc;                ///< first arc of each node. It has num_nodes + 1 elements
+  search_network_arc_t *arcs;    ///< arcs
+  int *first_word;               ///< first word of each node. It has num_nodes + 1 elements
+  search_network_word_t *words;  ///< words. Their destination is a node
+  float *final;                  ///< final log-probability of each node
+  int *node_class;               ///< node that represents each node after merging
+} net_pushed_t;
+
+static int network_arc_cmp(const void *a, const void *b) {
+  const search_network_arc_t *a1 = (const search_network_arc_t *) a, *a2 = (const search_network_arc_t *) b;
+  return a1->phoneme - a2->phoneme;
+}
+
+static int network_word_cmp(const void *a, const void *b) {
+  const search_network_word_t *w1 = (const search_network_word_t *) a, *w2 = (const search_network_word_t *) b;
+  if (w1->label != w2->label) return w1->label - w2->label;
+  if (w1->destination != w2->destination) return w1->destination - w2->destination;
+  return (w1->weight > w2->weight) - (w1->weight < w2->weight);
+}
+
+/** Hashes the outgoing transitions of a node of the pushed network
+ * @param pushed the pushed network
+ * @param node the node
+ * @return the hash
+ */
+static uint32_t node_hash(const net_pushed_t *pushed, int node) {
+  uint32_t h = 2166136261u, bits;
+  memcpy(&bits, &pushed->final[node], sizeof(bits));
+  h = (h ^ bits) * 16777619u;
+  for (int a = pushed->first_arc[node]; a < pushed->first_arc[node + 1]; a++) {
+    memcpy(&bits, &pushed->arcs[a].weight, sizeof(bits));
+    h = (h ^ (uint32_t) pushed->arcs[a].phoneme) * 16777619u;
+    h = (h ^ (uint32_t) pushed->node_class[pushed->arcs[a].destination]) * 16777619u;
+    h = (h ^ bits) * 16777619u;
+  }
+  for (int w = pushed->first_word[node]; w < pushed->first_word[node + 1]; w++) {
+    memcpy(&bits, &pushed->words[w].weight, sizeof(bits));
+    h = (h ^ (uint32_t) pushed->words[w].label) * 16777619u;
+    h = (h ^ (uint32_t) pushed->node_class[pushed->words[w].destination]) * 16777619u;
+    h = (h ^ bits) * 16777619u;
+  }
+  return h;
+}
+
+/** Tells if two nodes of the pushed network have the same outgoing transitions
+ * @param pushed the pushed network
+ * @param n1 a node
+ * @param n2 another node
+ * @return true if they can be merged
+ */
+static bool node_equal(const net_pushed_t *pushed, int n1, int n2) {
+  if (pushed->final[n1] != pushed->final[n2]) return false;
+  if (pushed->first_arc[n1 + 1] - pushed->first_arc[n1] != pushed->first_arc[n2 + 1] - pushed->first_arc[n2]) return false;
+  if (pushed->first_word[n1 + 1] - pushed->first_word[n1] != pushed->first_word[n2 + 1] - pushed->first_word[n2]) return false;
+  for (int a1 = pushed->first_arc[n1], a2 = pushed->first_arc[n2]; a1 < pushed->first_arc[n1 + 1]; a1++, a2++) {
+    const search_network_arc_t *arc1 = &pushed->arcs[a1], *arc2 = &pushed->arcs[a2];
+    if (arc1->phoneme != arc2->phoneme || arc1->weight != arc2->weight
+        || pushed->node_class[arc1->destination] != pushed->node_class[arc2->destination]) return false;
+  }
+  for (int w1 = pushed->first_word[n1], w2 = pushed->first_word[n2]; w1 < pushed->first_word[n1 + 1]; w1++, w2++) {
+    const search_network_word_t *word1 = &pushed->words[w1], *word2 = &pushed->words[w2];
+    if (word1->label != word2->label || word1->weight != word2->weight
+        || pushed->node_class[word1->destination] != pushed->node_class[word2->destination]) return false;
+  }
+  return true;
+}
+
+/** Merges a range of nodes with the equivalent nodes already seen.
+ * The destinations of the arcs and words of the nodes must be merged before
+ * @param pushed the pushed network
+ * @param buckets first node of each bucket or -1
+ * @param chain next node of the same bucket
+ * @param mask number of buckets - 1
+ * @param first first node of the range
+ * @param last last node of the range. Nodes are visited from last to first
+ */
+static void merge_nodes(net_pushed_t *pushed, int *buckets, int *chain, uint32_t mask, int first, int last) {
+  for (int n = last; n >= first; n--) {
+    const uint32_t b = node_hash(pushed, n) & mask;
+    int rep = buckets[b];
+    while (rep != -1 && !node_equal(pushed, n, rep)) rep = chain[rep];
+    if (rep != -1) {
+      pushed->node_class[n] = rep;
+    }
+    else {
+      chain[n] = buckets[b];
+      buckets[b] = n;
+    }
+  }
+}
+
+/** Compiles the search network of a decoder with a finite-state grammar.
+ * Every state of the grammar gets a prefix tree of the pronunciations of the words
+ * that leave it, including silence and short pause, so that the phonemes are
+ * deterministic inside a word. The best score of the words below each node is pushed
+ * towards the root, and the root of a grammar state towards the words that reach it,
+ * so that the scores of partial words are as tight as possible for the beam. Finally,
+ * the nodes with the same arcs, words and final score are merged, which shares the
+ * suffixes of the pronunciations
+ * @param decoder the decoder
+ * @return the network
+ */
+search_network_t *search_network_create(const decoder_t *decoder) {
+  const grammar_t *grammar = decoder->grammar;
+  const lex_t *lex = decoder->lex;
+  REQUIRE(!grammar->is_ngram && decoder->categories == NULL
+          && decoder->input_grammar == NULL && decoder->output_grammar == NULL,
+          "The search network needs a finite-state grammar without categories nor input and output grammars");
+  const int num_states = grammar->num_states;
+
+  search_network_t *network = (search_network_t *) calloc(1, sizeof(search_network_t));
+  MEMTEST(network);
+  const hmm_t *hmm = decoder->hmm;
+  network->num_phonemes = hmm->num_phonemes;
+  network->phoneme_labels = (char **) malloc(hmm->num_phonemes * sizeof(char *));
+  MEMTEST(network->phoneme_labels);
+  for (int p = 0; p < hmm->num_phonemes; p++) {
+    network->phoneme_labels[p] = strdup(hmm->phonemes[p]->label);
+    MEMTEST(network->phoneme_labels[p]);
+  }
+  int *labels = (int *) malloc(grammar->vocab->extended->last * sizeof(int));
+  MEMTEST(labels);
+  for (int e = 0; e < grammar->vocab->extended->last; e++) labels[e] = -1;
+
+  // the roots of the grammar states are the first nodes
+  net_builder_t builder;
+  builder.max_nodes = num_states + 1024;
+  builder.nodes = (net_node_t *) malloc(builder.max_nodes * sizeof(net_node_t));
+  MEMTEST(builder.nodes);
+  builder.max_words = 1024;
+  builder.words = (net_word_t *) malloc(builder.max_words * sizeof(net_word_t));
+  MEMTEST(builder.words);
+  builder.num_nodes = num_states;
+  builder.num_words = 0;
+  for (int s = 0; s < num_states; s++) {
+    builder.nodes[s].phoneme = -1;
+    builder.nodes[s].first_child = -1;
+    builder.nodes[s].next_sibling = -1;
+    builder.nodes[s].first_word = -1;
+  }
+
+  int n_skipped = 0;
+  for (int s = 0; s < num_states; s++) {
+    const state_grammar_t *state = grammar->vector[s];
+    for (int w = 0; w < state->num_words; w++) {
+      const words_state_t *ws = &state->words[w];
+      const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, ws->word);
+      // start and end words are never expanded from the grammar
+      if (ws->word == grammar->start || ws->word == grammar->end || ws->state_next == STATE_NONE) continue;
+      if (!network_accepts(lex, grammar, word)) {
+        n_skipped++;
+        continue;
+      }
+      const float weight = ws->prob * decoder->gsf + word->combined_score - decoder->wip;
+      const int label = network_label(network, labels, grammar->vocab, ws->word);
+      builder_insert(&builder, lex, word->input, lex->models[word->input[0]]->initial, s, weight, label,
+                     state_grammar_get_index(ws->state_next), 0);
+    }
+
+    // silence and short pause can be inserted in any state without leaving it
+    const symbol_t fillers[] = { grammar->silence, grammar->pause };
+    for (size_t f = 0; f < sizeof(fillers) / sizeof(fillers[0]); f++) {
+      if (fillers[f] == VOCAB_NONE) continue;
+      const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, fillers[f]);
+      if (!network_accepts(lex, grammar, word)) continue;
+      const int label = network_label(network, labels, grammar->vocab, fillers[f]);
+      builder_insert(&builder, lex, word->input, lex->models[word->input[0]]->initial, s,
+                     grammar->silence_score * decoder->gsf - decoder->wip, label, s, 0);
+    }
+  }
+  free(labels);
+  if (n_skipped > 0) TRACE(1, "%d grammar transitions have words without pronunciation and were left out of the search network\n", n_skipped);
+
+  // best score of the words below each node. Children go after their parents
+  float *best = (float *) malloc(builder.num_nodes * sizeof(float));
+  MEMTEST(best);
+  for (int n = builder.num_nodes - 1; n >= 0; n--) {
+    best[n] = LOG_ZERO;
+    for (int w = builder.nodes[n].first_word; w != -1; w = builder.words[w].next) {
+      if (builder.words[w].weight > best[n]) best[n] = builder.words[w].weight;
+    }
+    for (int child = builder.nodes[n].first_child; child != -1; child = builder.nodes[child].next_sibling) {
+      if (best[child] > best[n]) best[n] = best[child];
+    }
+  }
+  // the score pushed to each node. Nodes that reach no words keep their scores
+  for (int n = 0; n < builder.num_nodes; n++) {
+    if (is_logzero(best[n])) best[n] = 0;
+  }
+
+  // pushed network, with the destination of the words in their grammar states
+  net_pushed_t pushed;
+  pushed.num_nodes = builder.num_nodes;
+  pushed.first_arc = (int *) malloc((builder.num_nodes + 1) * sizeof(int));
+  MEMTEST(pushed.first_arc);
+  pushed.arcs = (search_network_arc_t *) malloc(builder.num_nodes * sizeof(search_network_arc_t));
+  MEMTEST(pushed.arcs);
+  pushed.first_word = (int *) malloc((builder.num_nodes + 1) * sizeof(int));
+  MEMTEST(pushed.first_word);
+  pushed.words = (search_network_word_t *) malloc((builder.num_words + 1) * sizeof(search_network_word_t));
+  MEMTEST(pushed.words);
+  pushed.final = (float *) malloc(builder.num_nodes * sizeof(float));
+  MEMTEST(pushed.final);
+  pushed.node_class = (int *) malloc(builder.num_nodes * sizeof(int));
+  MEMTEST(pushed.node_class);
+
+  int num_arcs = 0, num_words = 0;
+  for (int n = 0; n < builder.num_nodes; n++) {
+    pushed.first_arc[n] = num_arcs;
+    for (int child = builder.nodes[n].first_child; child != -1; child = builder.nodes[child].next_sibling) {
+      search_network_arc_t *arc = &pushed.arcs[num_arcs++];
+      arc->phoneme = builder.nodes[child].phoneme;
+      arc->weight = best[child] - best[n];
+      arc->destination = child;
+    }
+    qsort(&pushed.arcs[pushed.first_arc[n]], num_arcs - pushed.first_arc[n], sizeof(search_network_arc_t), network_arc_cmp);
+
+    pushed.first_word[n] = num_words;
+    for (int w = builder.nodes[n].first_word; w != -1; w = builder.words[w].next) {
+      const net_word_t *net_word = &builder.words[w];
+      if (is_logzero(net_word->weight)) continue;
+      search_network_word_t *word = &pushed.words[num_words++];
+      word->label = net_word->label;
+      word->weight = net_word->weight - best[n] + best[net_word->state];
+      word->destination = net_word->state;
+    }
+    qsort(&pushed.words[pushed.first_word[n]], num_words - pushed.first_word[n], sizeof(search_network_word_t), network_word_cmp);
+
+    pushed.final[n] = LOG_ZERO;
+    if (n < num_states) {
+      const int final_idx = grammar_is_final_state(grammar, grammar->vector[n]);
+      if (final_idx != -1) pushed.final[n] = grammar->list_end->vector[final_idx].prob * decoder->gsf - best[n];
+    }
+    pushed.node_class[n] = n;
+  }
+  pushed.first_arc[builder.num_nodes] = num_arcs;
+  pushed.first_word[builder.num_nodes] = num_words;
+
+  // merge the nodes of the trees from the leaves, and then the roots, whose
+  // words reach the roots of other trees
+  uint32_t num_buckets = 1;
+  while (num_buckets < 2 * (uint32_t) builder.num_nodes) num_buckets *= 2;
+  int *buckets = (int *) malloc(num_buckets * sizeof(int));
+  MEMTEST(buckets);
+  for (uint32_t b = 0; b < num_buckets; b++) buckets[b] = -1;
+  int *chain = (int *) malloc(builder.num_nodes * sizeof(int));
+  MEMTEST(chain);
+  merge_nodes(&pushed, buckets, chain, num_buckets - 1, num_states, builder.num_nodes - 1);
+  merge_nodes(&pushed, buckets, chain, num_buckets - 1, 0, num_states - 1);
+  free(buckets);
+  free(chain);
+
+  // final network with the nodes that represent the others
+  int *new_ids = (int *) malloc(builder.num_nodes * sizeof(int));
+  MEMTEST(new_ids);
+  network->num_nodes = 0;
+  network->num_arcs = 0;
+  network->num_words = 0;
+  for (int n = 0; n < builder.num_nodes; n++) {
+    if (pushed.node_class[n] != n) continue;
+    new_ids[n] = network->num_nodes++;
+    network->num_arcs += pushed.first_arc[n + 1] - pushed.first_arc[n];
+    network->num_words += pushed.first_word[n + 1] - pushed.first_word[n];
+  }
+  network->nodes = (search_network_node_t *) malloc(network->num_nodes * sizeof(search_network_node_t));
+  MEMTEST(network->nodes);
+  network->arcs = (search_network_arc_t *) malloc((network->num_arcs + 1) * sizeof(search_network_arc_t));
+  MEMTEST(network->arcs);
+  network->words = (search_network_word_t *) malloc((network->num_words + 1) * sizeof(search_network_word_t));
+  MEMTEST(network->words);
+  network->num_arcs = 0;
+  network->num_words = 0;
+  for (int n = 0; n < builder.num_nodes; n++) {
+    if (pushed.node_class[n] != n) continue;
+    search_network_node_t *node = &network->nodes[new_ids[n]];
+    node->first_arc = network->num_arcs;
+    node->num_arcs = pushed.first_arc[n + 1] - pushed.first_arc[n];
+    for (int a = pushed.first_arc[n]; a < pushed.first_arc[n + 1]; a++) {
+      search_network_arc_t *arc = &network->arcs[network->num_arcs++];
+      *arc = pushed.arcs[a];
+      arc->destination = new_ids[pushed.node_class[arc->destination]];
+    }
+    node->first_word = network->num_words;
+    node->num_words = pushed.first_word[n + 1] - pushed.first_word[n];
+    for (int w = pushed.first_word[n]; w < pushed.first_word[n + 1]; w++) {
+      search_network_word_t *word = &network->words[network->num_words++];
+      *word = pushed.words[w];
+      word->destination = new_ids[pushed.node_class[word->destination]];
+    }
+    node->final = pushed.final[n];
+  }
+
+  network->num_initial = grammar->list_initial->num_elements;
+  network->initial_nodes = (int *) malloc((network->num_initial + 1) * sizeof(int));
+  MEMTEST(network->initial_nodes);
+  network->initial_weights = (float *) malloc((network->num_initial + 1) * sizeof(float));
+  MEMTEST(network->initial_weights);
+  for (int i = 0; i < network->num_initial; i++) {
+    const int s = state_grammar_get_index(grammar->list_initial->vector[i].state);
+    network->initial_nodes[i] = new_ids[pushed.node_class[s]];
+    network->initial_weights[i] = grammar->list_initial->vector[i].prob * decoder->gsf + best[s];
+  }
+
+  TRACE(1, "Search network: %d nodes (%d before merging), %d arcs, %d words\n",
+        network->num_nodes, builder.num_nodes, network->num_arcs, network->num_words);
+
+  free(new_ids);
+  free(pushed.first_arc);
+  free(pushed.arcs);
+  free(pushed.first_word);
+  free(pushed.words);
+  free(pushed.final);
+  free(pushed.node_class);
+  free(best);
+  free(builder.nodes);
+  free(builder.words);
+  return network;
+}
+
+/** Deletes a search network
+ * @param network the network
+ */
+void search_network_delete(search_network_t *network) {
+  if (network == NULL) return;
+  if (network->phoneme_labels != NULL) {
+    for (int p = 0; p < network->num_phonemes; p++) free(network->phoneme_labels[p]);
+  }
+  if (network->labels != NULL) {
+    for (int l = 0; l < network->num_labels; l++) free(network->labels[l]);
+  }
+  free(network->phoneme_labels);
+  free(network->labels);
+  free(network->nodes);
+  free(network->arcs);
+  free(network->words);
+  free(network->initial_nodes);
+  free(network->initial_weights);
+  free(network);
+}
+
+/** Writes a string with its length
+ * @param string the string
+ * @param file the output file
+ * @return true if it was written
+ */
+static bool write_string(const char *string, FILE *file) {
+  const int32_t length = strlen(string);
+  return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(string, 1, length, file) == (size_t) length;
+}
+
+/** Reads a string written with write_string()
+ * @param file the input file
+ * @return the string or NULL if the file is truncated
+ */
+static char *read_string(FILE *file) {
+  int32_t length;
+  if (fread(&length, sizeof(length), 1, file) != 1 || length < 0) return NULL;
+  char *string = (char *) malloc(length + 1);
+  MEMTEST(string);
+  if (fread(string, 1, length, file) != (size_t) length) {
+    free(string);
+    return NULL;
+  }
+  string[length] = '\0';
+  return string;
+}
+
+/** Saves a search network in binary format.
+ * The numbers are written in the byte order of the machine
+ * @param network the network
+ * @param file the output file
+ */
+void search_network_save(const search_network_t *network, FILE *file) {
+  const int32_t header[] = { SEARCH_NETWORK_VERSION, network->num_phonemes, network->num_labels, network->num_nodes,
+                             network->num_arcs, network->num_words, network->num_initial };
+  bool ok = fputs(SEARCH_NETWORK_MAGIC, file) != EOF;
+  ok = ok && fwrite(header, sizeof(header), 1, file) == 1;
+  for (int p = 0; ok && p < network->num_phonemes; p++) ok = write_string(network->phoneme_labels[p], file);
+  for (int l = 0; ok && l < network->num_labels; l++) ok = write_string(network->labels[l], file);
+  ok = ok && fwrite(network->nodes, sizeof(search_network_node_t), network->num_nodes, file) == (size_t) network->num_nodes;
+  ok = ok && fwrite(network->arcs, sizeof(search_network_arc_t), network->num_arcs, file) == (size_t) network->num_arcs;
+  ok = ok && fwrite(network->words, sizeof(search_network_word_t), network->num_words, file) == (size_t) network->num_words;
+  ok = ok && fwrite(network->initial_nodes, sizeof(int), network->num_initial, file) == (size_t) network->num_initial;
+  ok = ok && fwrite(network->initial_weights, sizeof(float), network->num_initial, file) == (size_t) network->num_initial;
+  CHECK_SYS_ERROR(ok, "Couldn't write the search network\n");
+}
+
+/** Loads a search network saved with search_network_save()
+ * @param file the input file
+ * @param hmm the acoustic model used to decode. Its phonemes must be the ones of the network
+ * @return the network
+ */
+search_network_t *search_network_load(FILE *file, const hmm_t *hmm) {
+  char magic[sizeof(SEARCH_NETWORK_MAGIC)];
+  int32_t header[7];
+  REQUIRE(fgets(magic, sizeof(magic), file) != NULL && strcmp(magic, SEARCH_NETWORK_MAGIC) == 0,
+          "The file is not a search network\n");
+  REQUIRE(fread(header, sizeof(header), 1, file) == 1, "Couldn't read the search network header\n");
+  REQUIRE(header[0] == SEARCH_NETWORK_VERSION, "Unsupported search network version %d\n", header[0]);
+  REQUIRE(header[1] >= 0 && header[2] >= 0 && header[3] > 0 && header[4] >= 0 && header[5] >= 0 && header[6] >= 0,
+          "Invalid search network sizes\n");
+  REQUIRE(header[1] == hmm->num_phonemes, "The search network was built with %d phonemes and the hmm has %d\n",
+          header[1], hmm->num_phonemes);
+
+  search_network_t *network = (search_network_t *) calloc(1, sizeof(search_network_t));
+  MEMTEST(network);
+  network->num_phonemes = header[1];
+  network->num_labels = header[2];
+  network->num_nodes = header[3];
+  network->num_arcs = header[4];
+  network->num_words = header[5];
+  network->num_initial = header[6];
+
+  network->phoneme_labels = (char **) calloc(network->num_phonemes + 1, sizeof(char *));
+  MEMTEST(network->phoneme_labels);
+  for (int p = 0; p < network->num_phonemes; p++) {
+    network->phoneme_labels[p] = read_string(file);
+    REQUIRE(network->phoneme_labels[p] != NULL, "The search network is truncated\n");
+    REQUIRE(strcmp(network->phoneme_labels[p], hmm->phonemes[p]->label) == 0,
+            "The phoneme %d of the search network is '%s' and the one of the hmm is '%s'\n",
+            p, network->phoneme_labels[p], hmm->phonemes[p]->label);
+  }
+  network->labels = (char **) calloc(network->num_labels + 1, sizeof(char *));
+  MEMTEST(network->labels);
+  for (int l = 0; l < network->num_labels; l++) {
+    network->labels[l] = read_string(file);
+    REQUIRE(network->labels[l] != NULL, "The search network is truncated\n");
+  }
+
+  network->nodes = (search_network_node_t *) malloc(network->num_nodes * sizeof(search_network_node_t));
+  MEMTEST(network->nodes);
+  network->arcs = (search_network_arc_t *) malloc((network->num_arcs + 1) * sizeof(search_network_arc_t));
+  MEMTEST(network->arcs);
+  network->words = (search_network_word_t *) malloc((network->num_words + 1) * sizeof(search_network_word_t));
+  MEMTEST(network->words);
+  network->initial_nodes = (int *) malloc((network->num_initial + 1) * sizeof(int));
+  MEMTEST(network->initial_nodes);
+  network->initial_weights = (float *) malloc((network->num_initial + 1) * sizeof(float));
+  MEMTEST(network->initial_weights);
+  bool ok = fread(network->nodes, sizeof(search_network_node_t), network->num_nodes, file) == (size_t) network->num_nodes;
+  ok = ok && fread(network->arcs, sizeof(search_network_arc_t), network->num_arcs, file) == (size_t) network->num_arcs;
+  ok = ok && fread(network->words, sizeof(search_network_word_t), network->num_words, file) == (size_t) network->num_words;
+  ok = ok && fread(network->initial_nodes, sizeof(int), network->num_initial, file) == (size_t) network->num_initial;
+  ok = ok && fread(network->initial_weights, sizeof(float), network->num_initial, file) == (size_t) network->num_initial;
+  REQUIRE(ok, "The search network is truncated\n");
+
+  for (int n = 0; n < network->num_nodes; n++) {
+    const search_network_node_t *node = &network->nodes[n];
+    REQUIRE(node->first_arc >= 0 && node->num_arcs >= 0 && node->first_arc + node->num_arcs <= network->num_arcs
+            && node->first_word >= 0 && node->num_words >= 0 && node->first_word + node->num_words <= network->num_words,
+            "Invalid node %d in the search network\n", n);
+  }
+  for (int a = 0; a < network->num_arcs; a++) {
+    REQUIRE(network->arcs[a].phoneme >= 0 && network->arcs[a].phoneme < network->num_phonemes
+            && network->arcs[a].destination >= 0 && network->arcs[a].destination < network->num_nodes,
+            "Invalid arc %d in the search network\n", a);
+  }
+  for (int w = 0; w < network->num_words; w++) {
+    REQUIRE(network->words[w].label >= 0 && network->words[w].label < network->num_labels
+            && network->words[w].destination >= 0 && network->words[w].destination < network->num_nodes,
+            "Invalid word %d in the search network\n", w);
+  }
+  for (int i = 0; i < network->num_initial; i++) {
+    REQUIRE(network->initial_nodes[i] >= 0 && network->initial_nodes[i] < network->num_nodes,
+            "Invalid initial node in the search network\n");
+  }
+  return network;
+}
+
+/** Viterbi decoder over a search network.
+ * A hypothesis is an emitting hmm state of a phoneme arc, and it has a slot in the
+ * score arrays. The slots of the current and the next frame are valid when their stamp
+ * is the generation of the frame, so they are never cleared. Word ends are kept
+ * in a table of traces that link to the trace of the previous word. When the table
+ * doubles the traces kept by the last collection, the traces that no active
+ * hypothesis leads to are removed
+ */
+struct search_network_decoder {
+  const search_network_t *network; ///< the network
+  const hmm_t *hmm;                ///< the acoustic model
+  float beam;                      ///< relative beam w.r.t. the best hypothesis of the frame
+
+  int num_slots;        ///< number of slots
+  int *arc_slots;       ///< first slot of each arc. The emitting states of its phoneme follow
+  int *slot_arcs;       ///< arc of each slot
+  float *scores[2];     ///< score of each slot in the current and the next frame
+  int *traces[2];       ///< trace of the last word of each slot
+  int *stamps[2];       ///< generation in which each slot was set
+  int *active[2];       ///< slots set in the current and the next frame
+  int num_active[2];    ///< number of active slots
+  float best[2];        ///< best score in the current and the next frame
+
+  float *node_scores;   ///< best score of the nodes reached in this frame
+  int *node_traces;     ///< trace of that score
+  int *node_stamps;     ///< generation in which each node was reached
+  int *reached;         ///< nodes reached in this frame
+  int num_reached;      ///< number of nodes reached
+
+  float *emissions;     ///< emissions of the hmm states in this frame
+  int *emission_stamps; ///< generation in which each emission was computed
+
+  int *trace_labels;    ///< label of the word of each trace
+  int *trace_prevs;     ///< trace of the previous word or -1
+  int *trace_moves;     ///< new index of each trace when the table is compacted
+  int num_traces;       ///< number of traces
+  int max_traces;       ///< allocated traces
+  int collect_traces;   ///< number of traces that starts a collection
+
+  int generation;       ///< generation of the frame being decoded
+};
+
+/** Creates a decoder for a search network
+ * @param network the network
+ * @param hmm the acoustic model the network was built with
+ * @param beam relative beam w.r.t. the best hypothesis of each frame
+ * @return the decoder
+ */
+search_network_decoder_t *search_network_decoder_create(const search_network_t *network, const hmm_t *hmm, float beam) {
+  REQUIRE(network->num_phonemes == hmm->num_phonemes, "The search network does not match the hmm\n");
+  search_network_decoder_t *decoder = (search_network_decoder_t *) calloc(1, sizeof(search_network_decoder_t));
+  MEMTEST(decoder);
+  decoder->network = network;
+  decoder->hmm = hmm;
+  decoder->beam = beam;
+
+  decoder->arc_slots = (int *) malloc((network->num_arcs + 1) * sizeof(int));
+  MEMTEST(decoder->arc_slots);
+  for (int a = 0; a < network->num_arcs; a++) {
+    decoder->arc_slots[a] = decoder->num_slots;
+    decoder->num_slots += hmm->phonemes[network->arcs[a].phoneme]->num_states - 2;
+  }
+  decoder->arc_slots[network->num_arcs] = decoder->num_slots;
+  decoder->slot_arcs = (int *) malloc((decoder->num_slots + 1) * sizeof(int));
+  MEMTEST(decoder->slot_arcs);
+  for (int a = 0; a < network->num_arcs; a++) {
+    for (int s = decoder->arc_slots[a]; s < decoder->arc_slots[a + 1]; s++) decoder->slot_arcs[s] = a;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    decoder->scores[i] = (float *) malloc((decoder->num_slots + 1) * sizeof(float));
+    MEMTEST(decoder->scores[i]);
+    decoder->traces[i] = (int *) malloc((decoder->num_slots + 1) * sizeof(int));
+    MEMTEST(decoder->traces[i]);
+    decoder->stamps[i] = (int *) malloc((decoder->num_slots + 1) * sizeof(int));
+    MEMTEST(decoder->stamps[i]);
+    decoder->active[i] = (int *) malloc((decoder->num_slots + 1) * sizeof(int));
+    MEMTEST(decoder->active[i]);
+    for (int s = 0; s < decoder->num_slots; s++) decoder->stamps[i][s] = -1;
+  }
+
+  decoder->node_scores = (float *) malloc(network->num_nodes * sizeof(float));
+  MEMTEST(decoder->node_scores);
+  decoder->node_traces = (int *) malloc(network->num_nodes * sizeof(int));
+  MEMTEST(decoder->node_traces);
+  decoder->node_stamps = (int *) malloc(network->num_nodes * sizeof(int));
+  MEMTEST(decoder->node_stamps);
+  decoder->reached = (int *) malloc(network->num_nodes * sizeof(int));
+  MEMTEST(decoder->reached);
+  for (int n = 0; n < network->num_nodes; n++) decoder->node_stamps[n] = -1;
+
+  decoder->emissions = (float *) malloc(hmm->num_states * sizeof(float));
+  MEMTEST(decoder->emissions);
+  decoder->emission_stamps = (int *) malloc(hmm->num_states * sizeof(int));
+  MEMTEST(decoder->emission_stamps);
+  for (int s = 0; s < hmm->num_states; s++) decoder->emission_stamps[s] = -1;
+
+  decoder->max_traces = 1024;
+  decoder->trace_labels = (int *) malloc(decoder->max_traces * sizeof(int));
+  MEMTEST(decoder->trace_labels);
+  decoder->trace_prevs = (int *) malloc(decoder->max_traces * sizeof(int));
+  MEMTEST(decoder->trace_prevs);
+  decoder->trace_moves = (int *) malloc(decoder->max_traces * sizeof(int));
+  MEMTEST(decoder->trace_moves);
+  return decoder;
+}
+
+/** Deletes a decoder of a search network
+ * @param decoder the decoder
+ */
+void search_network_decoder_delete(search_network_decoder_t *decoder) {
+  if (decoder == NULL) return;
+  free(decoder->arc_slots);
+  free(decoder->slot_arcs);
+  for (int i = 0; i < 2; i++) {
+    free(decoder->scores[i]);
+    free(decoder->traces[i]);
+    free(decoder->stamps[i]);
+    free(decoder->active[i]);
+  }
+  free(decoder->node_scores);
+  free(decoder->node_traces);
+  free(decoder->node_stamps);
+  free(decoder->reached);
+  free(decoder->emissions);
+  free(decoder->emission_stamps);
+  free(decoder->trace_labels);
+  free(decoder->trace_prevs);
+  free(decoder->trace_moves);
+  free(decoder);
+}
+
+/** Returns the emission of an hmm state in the frame being decoded
+ * @param decoder the decoder
+ * @param state the hmm state
+ * @param feat_vec the feature vector, or the emissions if they are the features
+ * @param is_emission if the features are emissions
+ * @return the log-emission
+ */
+static float network_emission(search_network_decoder_t *decoder, int state, const float *feat_vec, bool is_emission) {
+  if (is_emission) return feat_vec[state];
+  if (decoder->emission_stamps[state] != decoder->generation) {
+    decoder->emissions[state] = hmm_log_emission(decoder->hmm, state, feat_vec);
+    decoder->emission_stamps[state] = decoder->generation;
+  }
+  return decoder->emissions[state];
+}
+
+/** Moves a hypothesis to an emitting state of a phoneme arc in the next frame
+ * @param decoder the decoder
+ * @param next index of the next frame in the arrays of slots
+ * @param arc the arc
+ * @param state the emitting state of the phoneme of the arc
+ * @param score the score before the emission
+ * @param trace the trace of the last word
+ * @param feat_vec the feature vector
+ * @param is_emission if the features are emissions
+ */
+static void network_relax(search_network_decoder_t *decoder, int next, int arc, int state, float score, int trace,
+                          const float *feat_vec, bool is_emission) {
+  const phoneme_t *phoneme = decoder->hmm->phonemes[decoder->network->arcs[arc].phoneme];
+  score += network_emission(decoder, phoneme->states[state]->id, feat_vec, is_emission);
+  if (score < decoder->best[next] - decoder->beam) return;
+
+  const int slot = decoder->arc_slots[arc] + state;
+  if (decoder->stamps[next][slot] != decoder->generation) {
+    decoder->stamps[next][slot] = decoder->generation;
+    decoder->active[next][decoder->num_active[next]++] = slot;
+  }
+  else if (score <= decoder->scores[next][slot]) {
+    return;
+  }
+  decoder->scores[next][slot] = score;
+  decoder->traces[next][slot] = trace;
+  if (score > decoder->best[next]) decoder->best[next] = score;
+}
+
+/** Reaches a node of the network in the frame being decoded
+ * @param decoder the decoder
+ * @param node the node
+ * @param score the score
+ * @param trace the trace of the last word
+ */
+static void network_reach(search_network_decoder_t *decoder, int node, float score, int trace) {
+  if (decoder->node_stamps[node] != decoder->generation) {
+    decoder->node_stamps[node] = decoder->generation;
+    decoder->reached[decoder->num_reached++] = node;
+  }
+  else if (score <= decoder->node_scores[node]) {
+    return;
+  }
+  decoder->node_scores[node] = score;
+  decoder->node_traces[node] = trace;
+}
+
+/** Adds the trace of a word
+ * @param decoder the decoder
+ * @param label the label of the word
+ * @param prev the trace of the previous word or -1
+ * @return the trace
+ */
+static int network_add_trace(search_network_decoder_t *decoder, int label, int prev) {
+  if (decoder->num_traces == decoder->max_traces) {
+    decoder->max_traces *= 2;
+    decoder->trace_labels = (int *) realloc(decoder->trace_labels, decoder->max_traces * sizeof(int));
+    MEMTEST(decoder->trace_labels);
+    decoder->trace_prevs = (int *) realloc(decoder->trace_prevs, decoder->max_traces * sizeof(int));
+    MEMTEST(decoder->trace_prevs);
+    decoder->trace_moves = (int *) realloc(decoder->trace_moves, decoder->max_traces * sizeof(int));
+    MEMTEST(decoder->trace_moves);
+  }
+  decoder->trace_labels[decoder->num_traces] = label;
+  decoder->trace_prevs[decoder->num_traces] = prev;
+  return decoder->num_traces++;
+}
+
+/** Removes the traces that the active hypotheses of a frame do not lead to.
+ * A trace only links to older ones, so the table is compacted in order and the
+ * links of the moved traces are updated as they are moved
+ * @param decoder the decoder
+ * @param cur index of the frame in the arrays of slots
+ */
+static void network_collect_traces(search_network_decoder_t *decoder, int cur) {
+  int *moves = decoder->trace_moves;
+  for (int t = 0; t < decoder->num_traces; t++) moves[t] = -1;
+  // mark the traces of the active hypotheses and of their previous words
+  for (int i = 0; i < decoder->num_active[cur]; i++) {
+    for (int t = decoder->traces[cur][decoder->active[cur][i]]; t != -1 && moves[t] == -1; t = decoder->trace_prevs[t]) {
+      moves[t] = 0;
+    }
+  }
+
+  int num_traces = 0;
+  for (int t = 0; t < decoder->num_traces; t++) {
+    if (moves[t] == -1) continue;
+    const int prev = decoder->trace_prevs[t];
+    decoder->trace_labels[num_traces] = decoder->trace_labels[t];
+    decoder->trace_prevs[num_traces] = (prev != -1) ? moves[prev] : -1;
+    moves[t] = num_traces++;
+  }
+  decoder->num_traces = num_traces;
+  decoder->collect_traces = (2 * num_traces > 1024) ? 2 * num_traces : 1024;
+
+  for (int i = 0; i < decoder->num_active[cur]; i++) {
+    const int slot = decoder->active[cur][i];
+    if (decoder->traces[cur][slot] != -1) decoder->traces[cur][slot] = moves[decoder->traces[cur][slot]];
+  }
+}
+
+/** Ends a word in the frame being decoded
+ * @param decoder the decoder
+ * @param word the word
+ * @param score the score of the node where the word ends
+ * @param trace the trace of the previous word
+ */
+static void network_end_word(search_network_decoder_t *decoder, const search_network_word_t *word, float score, int trace) {
+  score += word->weight;
+  const int node = word->destination;
+  if (decoder->node_stamps[node] == decoder->generation && score <= decoder->node_scores[node]) return;
+  network_reach(decoder, node, score, network_add_trace(decoder, word->label, trace));
+}
+
+/** Finds the best hypothesis that ends a word after the last frame
+ * @param decoder the decoder
+ * @param cur index of the last frame in the arrays of slots
+ * @param use_final if the word must reach a final node
+ * @param best_trace output trace of the best word
+ * @return the best score or LOG_ZERO if there is none
+ */
+static float network_best_end(search_network_decoder_t *decoder, int cur, bool use_final, int *best_trace) {
+  const search_network_t *network = decoder->network;
+  const hmm_t *hmm = decoder->hmm;
+  float best = LOG_ZERO;
+  for (int i = 0; i < decoder->num_active[cur]; i++) {
+    const int slot = decoder->active[cur][i];
+    const int a = decoder->slot_arcs[slot];
+    const int state = slot - decoder->arc_slots[a];
+    const matrix_transitions_t *matrix = hmm->phonemes[network->arcs[a].phoneme]->matrix;
+    for (int h = matrix->first_arc[state + 1]; h < matrix->first_arc[state + 2]; h++) {
+      if (!matrix->arcs[h].is_exit) continue;
+      const float score = decoder->scores[cur][slot] + matrix->arcs[h].prob;
+      const search_network_node_t *node = &network->nodes[network->arcs[a].destination];
+      for (const search_network_word_t *word = &network->words[node->first_word]; word < &network->words[node->first_word + node->num_words]; word++) {
+        float word_score = score + word->weight;
+        if (use_final) {
+          if (is_logzero(network->nodes[word->destination].final)) continue;
+          word_score += network->nodes[word->destination].final;
+        }
+        if (word_score > best) {
+          best = word_score;
+          *best_trace = network_add_trace(decoder, word->label, decoder->traces[cur][slot]);
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/** Decodes a sample with a search network
+ * @param decoder the decoder
+ * @param features the features of the sample
+ * @param labels output labels of the words of the best hypothesis. They must be freed.
+ *        NULL if there is no hypothesis
+ * @param num_labels output number of labels
+ * @return the score of the best hypothesis or LOG_ZERO if there is none
+ */
+float search_network_decode(search_network_decoder_t *decoder, const features_t *features, int **labels, int *num_labels) {
+  const search_network_t *network = decoder->network;
+  const hmm_t *hmm = decoder->hmm;
+  const bool is_emission = (features->type == FT_EMISSION_PROBABILITIES);
+  CHECK_SYS_ERROR(is_emission ? features->n_features == hmm->num_states : features->n_features == hmm->num_features,
+                  "Mismatch in number of features\n");
+
+  decoder->num_traces = 0;
+  decoder->collect_traces = 1024;
+  int cur = 0;
+  decoder->num_active[cur] = 0;
+  decoder->best[cur] = LOG_ZERO;
+  for (int t = 0; t < features->n_vectors; t++) {
+    const float *feat_vec = features->vector[t];
+    const int next = 1 - cur;
+    if (decoder->num_traces >= decoder->collect_traces) network_collect_traces(decoder, cur);
+    decoder->generation++;
+    decoder->num_active[next] = 0;
+    decoder->best[next] = LOG_ZERO;
+    decoder->num_reached = 0;
+
+    if (t == 0) {
+      for (int i = 0; i < network->num_initial; i++) {
+        network_reach(decoder, network->initial_nodes[i], network->initial_weights[i], -1);
+      }
+    }
+
+    // hmm transitions of the hypotheses of the previous frame
+    const float limit = decoder->best[cur] - decoder->beam;
+    for (int i = 0; i < decoder->num_active[cur]; i++) {
+      const int slot = decoder->active[cur][i];
+      const float score = decoder->scores[cur][slot];
+      if (score < limit) continue;
+      const int trace = decoder->traces[cur][slot];
+      const int a = decoder->slot_arcs[slot];
+      const int state = slot - decoder->arc_slots[a];
+      const matrix_transitions_t *matrix = hmm->phonemes[network->arcs[a].phoneme]->matrix;
+      for (int h = matrix->first_arc[state + 1]; h < matrix->first_arc[state + 2]; h++) {
+        const hmm_arc_t *hmm_arc = &matrix->arcs[h];
+        if (!hmm_arc->is_exit) {
+          network_relax(decoder, next, a, hmm_arc->target - 1, score + hmm_arc->prob, trace, feat_vec, is_emission);
+        }
+        else {
+          network_reach(decoder, network->arcs[a].destination, score + hmm_arc->prob, trace);
+        }
+      }
+    }
+
+    // the words that end in the nodes reached go to the nodes of their grammar states,
+    // which have no words, so a single pass is enough
+    const int num_ends = decoder->num_reached;
+    for (int r = 0; r < num_ends; r++) {
+      const int n = decoder->reached[r];
+      const search_network_node_t *node = &network->nodes[n];
+      for (int w = node->first_word; w < node->first_word + node->num_words; w++) {
+        network_end_word(decoder, &network->words[w], decoder->node_scores[n], decoder->node_traces[n]);
+      }
+    }
+
+    // the nodes reached start the phonemes of their arcs in this frame
+    for (int r = 0; r < decoder->num_reached; r++) {
+      const int n = decoder->reached[r];
+      const search_network_node_t *node = &network->nodes[n];
+      const float score = decoder->node_scores[n];
+      for (int a = node->first_arc; a < node->first_arc + node->num_arcs; a++) {
+        const matrix_transitions_t *matrix = hmm->phonemes[network->arcs[a].phoneme]->matrix;
+        for (int h = matrix->first_arc[0]; h < matrix->first_arc[1]; h++) {
+          const hmm_arc_t *hmm_arc = &matrix->arcs[h];
+          if (hmm_arc->target > 0 && !hmm_arc->is_exit) {
+            network_relax(decoder, next, a, hmm_arc->target - 1, score + network->arcs[a].weight + hmm_arc->prob,
+                          decoder->node_traces[n], feat_vec, is_emission);
+          }
+        }
+      }
+    }
+    cur = next;
+  }
+
+  int best_trace = -1;
+  float best = network_best_end(decoder, cur, true, &best_trace);
+  if (is_logzero(best)) {
+    fprintf(stderr, "WARNING!: A complete decoding is not possible, using partial decoding.\n");
+    best = network_best_end(decoder, cur, false, &best_trace);
+  }
+
+  *labels = NULL;
+  *num_labels = 0;
+  if (is_logzero(best)) return LOG_ZERO;
+  for (int trace = best_trace; trace != -1; trace = decoder->trace_prevs[trace]) (*num_labels)++;
+  *labels = (int *) malloc(*num_labels * sizeof(int));
+  MEMTEST(*labels);
+  int i = *num_labels;
+  for (int trace = best_trace; trace != -1; trace = decoder->trace_prevs[trace]) (*labels)[--i] = decoder->trace_labels[trace];
+  return best;
+}
@@ -0,0 +1,81 @@
+/*
+ * search_network.h
+ *
+ *  Search network compiled offline from the acoustic model, the lexicon and a
+ *  finite-state grammar, and the Viterbi decoder that runs on it
+ */
+
+#ifndef SEARCH_NETWORK_H_
+#define SEARCH_NETWORK_H_
+
+#include <iatros/decoder.h>
+#include <iatros/features.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Phoneme arc of the network. Its hmm is entered from the source node
+typedef struct {
+  int phoneme;     ///< phoneme of the arc
+  float weight;    ///< log-probability pushed to the arc
+  int destination; ///< node reached when the hmm of the phoneme ends
+} search_network_arc_t;
+
+/// Word that ends in a node of the network
+typedef struct {
+  int label;       ///< index of the word in the labels of the network
+  float weight;    ///< log-probability of the word that was not pushed to the arcs
+  int destination; ///< node of the grammar state reached by the word
+} search_network_word_t;
+
+/// Node of the network. Its arcs and words are contiguous in the arrays of the network
+typedef struct {
+  int first_arc;  ///< first arc in arcs
+  int num_arcs;   ///< number of arcs
+  int first_word; ///< first word in words
+  int num_words;  ///< number of words that end in the node
+  float final;    ///< log-probability to finish the sentence in the node or LOG_ZERO
+} search_network_node_t;
+
+/** Search network of a finite-state grammar.
+ * Each state of the grammar gets a prefix tree of the pronunciations of its words,
+ * whose identity is emitted when the pronunciation ends with a transition to the node
+ * of the next grammar state, so there are no empty transitions between words. The
+ * language model, the word insertion penalty and the lexicon probabilities are pushed
+ * towards the start of the words and the nodes with the same future are merged.
+ * Scores already include the grammar scale factor
+ */
+typedef struct {
+  int num_phonemes;                ///< number of phonemes of the hmm the network was built with
+  char **phoneme_labels;           ///< names of those phonemes
+  int num_labels;                  ///< number of words
+  char **labels;                   ///< names of the words
+  int num_nodes;                   ///< number of nodes
+  search_network_node_t *nodes;    ///< nodes
+  int num_arcs;                    ///< number of phoneme arcs
+  search_network_arc_t *arcs;      ///< phoneme arcs of all the nodes
+  int num_words;                   ///< number of word ends
+  search_network_word_t *words;    ///< word ends of all the nodes
+  int num_initial;                 ///< number of initial nodes
+  int *initial_nodes;              ///< initial nodes
+  float *initial_weights;          ///< log-probability to start in each initial node
+} search_network_t;
+
+/// Viterbi decoder over a search network. Its memory is reused across samples
+typedef struct search_network_decoder search_network_decoder_t;
+
+search_network_t *search_network_create(const decoder_t *decoder);
+void search_network_delete(search_network_t *network);
+void search_network_save(const search_network_t *network, FILE *file);
+search_network_t *search_network_load(FILE *file, const hmm_t *hmm);
+
+search_network_decoder_t *search_network_decoder_create(const search_network_t *network, const hmm_t *hmm, float beam);
+void search_network_decoder_delete(search_network_decoder_t *decoder);
+float search_network_decode(search_network_decoder_t *decoder, const features_t *features, int **labels, int *num_labels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SEARCH_NETWORK_H_ */
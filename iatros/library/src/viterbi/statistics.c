@@ -124,6 +124,26 @@ void print_frame_stats(FILE * out, const stats_t * stats) {
          (100.0 * (float)stats->distinct_events[GRAMMAR_BEAM])/(float)stats->total_events[GRAMMAR_BEAM]);
    }
 
+   if (stats->gs_total > 0) {
+     fprintf(out, "gaussian selection: selected = %d, evaluated = %d of %d (%6.2f%%), mean error = %f\n",
+         stats->gs_selected, stats->gs_evaluated, stats->gs_total,
+         (100.0 * (float)stats->gs_evaluated)/(float)stats->gs_total, stats->gs_error/(float)stats->gs_states);
+   }
+
+   if (stats->pd_total > 0) {
+     fprintf(out, "partial distance: abandoned = %d of %d (%6.2f%%)\n",
+         stats->pd_abandoned, stats->pd_total, (100.0 * (float)stats->pd_abandoned)/(float)stats->pd_total);
+   }
+
+   if (stats->fs_frames > 0) {
+     fprintf(out, "frame skipping: computed = %d of %d frames (%6.2f%%)\n",
+         stats->fs_computed, stats->fs_frames, (100.0 * (float)stats->fs_computed)/(float)stats->fs_frames);
+   }
+
+   if (stats->ab_frames > 0) {
+     fprintf(out, "adaptive beam: mean beam = %f in %d frames\n", stats->ab_beam/(float)stats->ab_frames, stats->ab_frames);
+   }
+
    //   fprintf(out, "num table words = %8d\n", stats->num_table_words);
    fprintf(out, "\n");
 }
@@ -145,6 +165,17 @@ void print_sample_stats(FILE * out, stats_t ** const stats, int n_stats) {
       }
       total.heap_capacity += stats[i]->heap_capacity;
       total.heap_size += stats[i]->heap_size;
+      total.gs_selected += stats[i]->gs_selected;
+      total.gs_evaluated += stats[i]->gs_evaluated;
+      total.gs_total += stats[i]->gs_total;
+      total.gs_states += stats[i]->gs_states;
+      total.gs_error += stats[i]->gs_error;
+      total.pd_total += stats[i]->pd_total;
+      total.pd_abandoned += stats[i]->pd_abandoned;
+      total.fs_frames += stats[i]->fs_frames;
+      total.fs_computed += stats[i]->fs_computed;
+      total.ab_frames += stats[i]->ab_frames;
+      total.ab_beam += stats[i]->ab_beam;
     }
   }
   print_frame_stats(out, &total);
@@ -68,6 +68,21 @@ typedef struct {
 
   int n_hyps;      ///< n of hyps to be expanded
   int n_word_hyps; ///< n of word hyps to be expanded
+
+  int gs_selected;   ///< number of gaussians selected by gaussian selection
+  int gs_evaluated;  ///< number of gaussians evaluated in the scored mixtures
+  int gs_total;      ///< number of gaussians in the scored mixtures
+  int gs_states;     ///< number of scored states
+  float gs_error;    ///< sum of absolute differences with the full evaluation of the scored states
+
+  int pd_total;      ///< number of gaussians in the mixtures scored with partial distance
+  int pd_abandoned;  ///< number of gaussians abandoned by partial distance
+
+  int fs_frames;     ///< number of frames decoded with frame skipping
+  int fs_computed;   ///< number of those frames whose emissions were computed instead of reused
+
+  int ab_frames;     ///< number of frames decoded with adaptive beam
+  float ab_beam;     ///< sum of the beams of those frames
 } stats_t;
 
 
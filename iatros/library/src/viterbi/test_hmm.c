@@ -0,0 +1,130 @@
+/*
+ * test_hmm.c
+ *
+ *  Random acoustic models for the tests and benchmarks of the library
+ */
+
+#include <viterbi/test_hmm.h>
+#include <prhlt/trace.h>
+#include <prhlt/constants.h>
+#include <string.h>
+#include <math.h>
+
+/** Builds a prepared hmm of three state left-to-right phonemes with random diagonal gaussians,
+ * as the parser would. The random numbers are drawn with rand()
+ * @param num_phonemes the number of phonemes
+ * @param num_gaussians the number of gaussians of each state
+ * @param num_features the number of features
+ * @param mean_range the means are drawn between -mean_range and mean_range
+ * @param scale_features if true, the means and the variances shrink along each cepstrum of 13
+ * features and from the cepstra to their derivatives, as in real models
+ * @return the hmm, which must be deleted with hmm_delete()
+ */
+hmm_t *test_hmm_create(int num_phonemes, int num_gaussians, int num_features, float mean_range, bool scale_features) {
+  hmm_t *hmm = hmm_create();
+  const int num_states = 3 * num_phonemes;
+  const int total = num_states * num_gaussians;
+  hmm->num_features = num_features;
+  hmm->num_states = num_states;
+  hmm->num_means = hmm->num_variances = hmm->num_distributions = total;
+  hmm->states = (state_t **) calloc(num_states, sizeof(state_t *));
+  hmm->means = (mean_t **) calloc(total, sizeof(mean_t *));
+  hmm->variances = (variance_t **) calloc(total, sizeof(variance_t *));
+  hmm->distributions = (distribution_t **) calloc(total, sizeof(distribution_t *));
+  MEMTEST(hmm->states);
+  MEMTEST(hmm->means);
+  MEMTEST(hmm->variances);
+  MEMTEST(hmm->distributions);
+
+  for (int g = 0; g < total; g++) {
+    mean_t *mean = (mean_t *) calloc(1, sizeof(mean_t));
+    variance_t *variance = (variance_t *) calloc(1, sizeof(variance_t));
+    distribution_t *distribution = (distribution_t *) calloc(1, sizeof(distribution_t));
+    MEMTEST(mean);
+    MEMTEST(variance);
+    MEMTEST(distribution);
+    mean->mean = (float *) malloc(num_features * sizeof(float));
+    variance->variance = (float *) malloc(num_features * sizeof(float));
+    distribution->gaussian = (gaussian_t *) calloc(1, sizeof(gaussian_t));
+    MEMTEST(mean->mean);
+    MEMTEST(variance->variance);
+    MEMTEST(distribution->gaussian);
+    double gconst = num_features * log(2 * M_PI);
+    for (int i = 0; i < num_features; i++) {
+      const float scale = scale_features ? (1.0 + (i % 13)) * (1 + i / 13) : 1.0;
+      mean->mean[i] = (2.0 * rand() / RAND_MAX - 1.0) * mean_range / scale;
+      variance->variance[i] = (0.2 + 0.8 * rand() / RAND_MAX) / scale;
+      gconst += log(variance->variance[i]);
+    }
+    distribution->gaussian->mean = mean;
+    distribution->gaussian->variance = variance;
+    distribution->gaussian->constant = gconst;
+    distribution->prior = -log(num_gaussians);
+    hmm->means[g] = mean;
+    hmm->variances[g] = variance;
+    hmm->distributions[g] = distribution;
+  }
+  for (int s = 0; s < num_states; s++) {
+    state_t *state = (state_t *) calloc(1, sizeof(state_t));
+    MEMTEST(state);
+    state->id = s;
+    state->mixture = (mixture_t *) calloc(1, sizeof(mixture_t));
+    MEMTEST(state->mixture);
+    state->mixture->num_distributions = num_gaussians;
+    state->mixture->distributions = (distribution_t **) malloc(num_gaussians * sizeof(distribution_t *));
+    MEMTEST(state->mixture->distributions);
+    memcpy(state->mixture->distributions, hmm->distributions + s * num_gaussians, num_gaussians * sizeof(distribution_t *));
+    hmm->states[s] = state;
+  }
+
+  // all the phonemes share a left-to-right matrix with entry and exit states
+  matrix_transitions_t *matrix = (matrix_transitions_t *) calloc(1, sizeof(matrix_transitions_t));
+  MEMTEST(matrix);
+  matrix->num_transitions = 5;
+  matrix->matrix_transitions = (float **) malloc(5 * sizeof(float *));
+  MEMTEST(matrix->matrix_transitions);
+  for (int i = 0; i < 5; i++) {
+    matrix->matrix_transitions[i] = (float *) malloc(5 * sizeof(float));
+    MEMTEST(matrix->matrix_transitions[i]);
+    for (int j = 0; j < 5; j++) matrix->matrix_transitions[i][j] = LOG_ZERO;
+  }
+  matrix->matrix_transitions[0][1] = 0;
+  for (int i = 1; i < 4; i++) {
+    matrix->matrix_transitions[i][i] = log(0.6);
+    matrix->matrix_transitions[i][i + 1] = log(0.4);
+  }
+  hmm->num_matrix = 1;
+  hmm->matrix = (matrix_transitions_t **) malloc(sizeof(matrix_transitions_t *));
+  MEMTEST(hmm->matrix);
+  hmm->matrix[0] = matrix;
+
+  hmm->num_phonemes = num_phonemes;
+  hmm->phonemes = (phoneme_t **) calloc(num_phonemes, sizeof(phoneme_t *));
+  hmm->locations = (hmm_location_t *) malloc(num_states * sizeof(hmm_location_t));
+  MEMTEST(hmm->phonemes);
+  MEMTEST(hmm->locations);
+  for (int p = 0; p < num_phonemes; p++) {
+    phoneme_t *phoneme = (phoneme_t *) calloc(1, sizeof(phoneme_t));
+    MEMTEST(phoneme);
+    char label[16];
+    sprintf(label, "p%d", p);
+    phoneme->label = strdup(label);
+    phoneme->num_states = 5;
+    phoneme->matrix = matrix;
+    phoneme->states = (state_t **) malloc(3 * sizeof(state_t *));
+    phoneme->hmm_ids = (hmm_id_t *) malloc(3 * sizeof(hmm_id_t));
+    MEMTEST(phoneme->label);
+    MEMTEST(phoneme->states);
+    MEMTEST(phoneme->hmm_ids);
+    for (int s = 0; s < 3; s++) {
+      phoneme->states[s] = hmm->states[3 * p + s];
+      hmm->locations[hmm->n_hmm_states].phoneme = p;
+      hmm->locations[hmm->n_hmm_states].state = s;
+      hmm->locations[hmm->n_hmm_states].state_id = 3 * p + s;
+      phoneme->hmm_ids[s] = (hmm_id_t) hmm->n_hmm_states++;
+    }
+    hmm->phonemes[p] = phoneme;
+  }
+  hmm_prepare(hmm);
+  return hmm;
+}
@@ -0,0 +1,22 @@
+/*
+ * test_hmm.h
+ *
+ *  Random acoustic models for the tests and benchmarks of the library
+ */
+
+#ifndef TEST_HMM_H_
+#define TEST_HMM_H_
+
+#include <viterbi/hmm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+hmm_t *test_hmm_create(int num_phonemes, int num_gaussians, int num_features, float mean_range, bool scale_features);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TEST_HMM_H_ */
@@ -0,0 +1,163 @@
+/*
+ * thread_pool.c
+ *
+ *  Fixed pool of threads that run the same task on their share of the work
+ *  and wait for each other before returning
+ */
+
+#include <viterbi/thread_pool.h>
+#include <prhlt/trace.h>
+#include <pthread.h>
+
+/** Pool of threads. The workers sleep until a new task is published, run it
+ * and the last one to finish wakes up the thread that published it, which runs
+ * the task as thread 0 in the meantime unless it was published with thread_pool_start()
+ */
+struct thread_pool {
+  int num_threads;           ///< number of threads, including the one that runs the tasks
+  pthread_t *threads;        ///< workers, which are threads 1 to num_threads - 1
+
+  pthread_mutex_t mutex;     ///< protects the fields below
+  pthread_cond_t start;      ///< signals a new task or the end of the pool
+  pthread_cond_t done;       ///< signals that all the workers finished the task
+  thread_pool_task_t task;   ///< current task
+  void *arg;                 ///< argument of the current task
+  unsigned generation;       ///< number of tasks published so far
+  int n_running;             ///< number of workers that have not finished the current task
+  bool stop;                 ///< asks the workers to finish
+};
+
+/// Argument of each worker
+typedef struct {
+  thread_pool_t *pool; ///< the pool
+  int thread;          ///< index of the worker
+} thread_pool_worker_t;
+
+/** Main loop of the workers
+ * @param arg the pool and the index of the worker
+ * @return NULL
+ */
+static void *thread_pool_worker(void *arg) {
+  thread_pool_t *pool = ((thread_pool_worker_t *) arg)->pool;
+  const int thread = ((thread_pool_worker_t *) arg)->thread;
+  free(arg);
+
+  // the pool is created before any task is published
+  unsigned generation = 0;
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->stop) break;
+    generation = pool->generation;
+    thread_pool_task_t task = pool->task;
+    void *task_arg = pool->arg;
+    pthread_mutex_unlock(&pool->mutex);
+
+    task(task_arg, thread);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->n_running == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+/** Creates a thread pool
+ * @param num_threads number of threads that run each task, including the one that calls
+ *        thread_pool_run(), so num_threads - 1 threads are started
+ * @return the pool
+ */
+thread_pool_t *thread_pool_create(int num_threads) {
+  REQUIRE(num_threads > 0, "The thread pool needs at least one thread");
+
+  thread_pool_t *pool = (thread_pool_t *) calloc(1, sizeof(thread_pool_t));
+  MEMTEST(pool);
+  pool->num_threads = num_threads;
+  pool->threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  MEMTEST(pool->threads);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int t = 1; t < num_threads; t++) {
+    thread_pool_worker_t *worker = (thread_pool_worker_t *) malloc(sizeof(thread_pool_worker_t));
+    MEMTEST(worker);
+    worker->pool = pool;
+    worker->thread = t;
+    int error = pthread_create(&pool->threads[t], NULL, thread_pool_worker, worker);
+    CHECK_SYS_ERROR(error == 0, "Couldn't create pool thread\n");
+  }
+  return pool;
+}
+
+/** Deletes a thread pool and waits for its workers
+ * @param pool the pool
+ */
+void thread_pool_delete(thread_pool_t *pool) {
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int t = 1; t < pool->num_threads; t++) {
+    pthread_join(pool->threads[t], NULL);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool);
+}
+
+/** Returns the number of threads of a pool
+ * @param pool the pool
+ * @return the number of threads, including the one that runs the tasks
+ */
+int thread_pool_num_threads(const thread_pool_t *pool) {
+  return pool->num_threads;
+}
+
+/** Runs a task in the workers of a pool and returns without waiting for them.
+ * The calling thread does not run it, so the workers are threads 1 to num_threads - 1.
+ * thread_pool_wait() must be called before publishing another task
+ * @param pool the pool
+ * @param task the task
+ * @param arg the argument of the task
+ */
+void thread_pool_start(thread_pool_t *pool, thread_pool_task_t task, void *arg) {
+  if (pool->num_threads == 1) return;
+  pthread_mutex_lock(&pool->mutex);
+  REQUIRE(pool->n_running == 0, "The thread pool is already running a task");
+  pool->task = task;
+  pool->arg = arg;
+  pool->n_running = pool->num_threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Waits for the workers of a pool to finish the task published with thread_pool_start()
+ * @param pool the pool
+ */
+void thread_pool_wait(thread_pool_t *pool) {
+  if (pool->num_threads == 1) return;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->n_running > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Runs a task in all the threads of a pool and waits for them to finish it.
+ * The calling thread runs the task as thread 0
+ * @param pool the pool
+ * @param task the task
+ * @param arg the argument of the task
+ */
+void thread_pool_run(thread_pool_t *pool, thread_pool_task_t task, void *arg) {
+  thread_pool_start(pool, task, arg);
+  task(arg, 0);
+  thread_pool_wait(pool);
+}
@@ -0,0 +1,37 @@
+/*
+ * thread_pool.h
+ *
+ *  Fixed pool of threads that run the same task on their share of the work
+ *  and wait for each other before returning
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <prhlt/utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Pool of threads. The thread that runs a task is one of them
+typedef struct thread_pool thread_pool_t;
+
+/** Task run by each thread of a pool
+ * @param arg argument given to thread_pool_run()
+ * @param thread index of the thread, from 0 to the number of threads - 1
+ */
+typedef void (*thread_pool_task_t)(void *arg, int thread);
+
+thread_pool_t *thread_pool_create(int num_threads);
+void thread_pool_delete(thread_pool_t *pool);
+int thread_pool_num_threads(const thread_pool_t *pool);
+void thread_pool_run(thread_pool_t *pool, thread_pool_task_t task, void *arg);
+void thread_pool_start(thread_pool_t *pool, thread_pool_task_t task, void *arg);
+void thread_pool_wait(thread_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREAD_POOL_H_ */
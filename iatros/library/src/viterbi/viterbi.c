@@ -22,29 +22,145 @@
 #include <viterbi/heap.h>
 #include <viterbi/grammar.h>
 #include <viterbi/lattice.h>
+#include <viterbi/lex_tree.h>
 #include <viterbi/viterbi.h>
 #include <prhlt/trace.h>
 
 
-///Calculate probability of emission with a ceptral vector and a state
+/** Lowest emission that can keep a hypothesis inside the beam in the current frame
+ * @param search the search
+ * @return the bound, or LOG_ZERO if there is no bound yet
+ *
+ * No hypothesis of the previous frame has a score higher than the maximum of the previous heap,
+ * and transitions and language model scores are not positive, only the word insertion bonuses
+ * and the silence score, as the search adds them, are added as slack. Since the limit of the heap
+ * can only grow during a frame, an emission lower than this bound will be rejected later in the
+ * frame too, so that it can be cached
+ */
+static float emission_lower_bound(const search_t *search) {
+  const float limit = hh_limit(search->heap);
+  const float prev_max = hh_max(search->prev_heap);
+  if (is_logzero(limit) || is_logzero(prev_max)) return LOG_ZERO;
+  const decoder_t *decoder = search->decoder;
+  // the search subtracts wip, so a negative one raises the scores
+  const float slack = fmaxf(-decoder->wip, 0) + fmaxf(decoder->wip_out, 0)
+                    + fmaxf(decoder->grammar->silence_score * decoder->gsf, 0);
+  return limit - prev_max - slack;
+}
+
+/** Computes the emission of a state in the current frame without storing it in the cache
+ * @param search the search
+ * @param vector_cc the feature vector of the frame
+ * @param state the state
+ * @return the emission
+ */
+static float compute_emission(search_t *search, const float *vector_cc, int state) {
+  const hmm_t* hmm = search->decoder->hmm;
+  float emission;
+  // with frame skipping, the emissions are those of the last computed frame
+  if (search->reference_feat_vec != NULL) vector_cc = search->reference_feat_vec;
+  const gaussian_selection_t *gs = search->decoder->gaussian_selection;
+  if (search->quantized_feat_vec != NULL) {
+    emission = quantized_hmm_log_emission(search->decoder->quantized_hmm, hmm->log_add,
+        state, search->quantized_feat_vec);
+  }
+  else if (gs == NULL && search->ordered_feat_vec != NULL && search->emission_cache == NULL) {
+    // cached emissions of other searches must be exact, so partial distance is not used with them
+    int n_abandoned = 0;
+    emission = hmm_log_emission_bounded(hmm, state, search->ordered_feat_vec,
+        emission_lower_bound(search), &n_abandoned);
+    if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
+      stats_t *stats = search->stats[search->n_frames - 1];
+      stats->pd_total += hmm->packed->offsets[state + 1] - hmm->packed->offsets[state];
+      stats->pd_abandoned += n_abandoned;
+    }
+  }
+  else if (gs == NULL) {
+    emission = hmm_log_emission(hmm, state, vector_cc);
+  }
+  else {
+    int n_evaluated = 0;
+    emission = gaussian_selection_log_emission(gs, hmm, state, vector_cc,
+        search->selected_gaussians, search->selection_generation, &n_evaluated);
+    if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
+      stats_t *stats = search->stats[search->n_frames - 1];
+      stats->gs_evaluated += n_evaluated;
+      stats->gs_total += hmm->packed->offsets[state + 1] - hmm->packed->offsets[state];
+      stats->gs_states++;
+      stats->gs_error += fabs(hmm_log_emission(hmm, state, vector_cc) - emission);
+    }
+  }
+  return emission;
+}
+
+///Calculate probability of emission with a ceptral vector and the state of a hypothesis
 /**
+@param search the search, whose cache keeps the emissions of the frame
 @param vector_cc Vector of cepstrals
-@param phoneme Number of phoneme
-@param state_hmm State of hmm
-@param t_probability Vector of probabilities
-@param hmm Structure with hmm
+@param hyp the hypothesis
 @return Probability of emission
 */
 INLINE float prob_emission(search_t *search, const float *vector_cc, const hyp_t * hyp) {
   const hmm_t* hmm = search->decoder->hmm;
   //If probability is not calculate
   int state = hmm->phonemes[hyp->phoneme]->states[hyp->state_hmm]->id;
-  if (is_logzero(search->t_probability[state])) {
-    search->t_probability[state] = log_gaussian_mixture(vector_cc, hmm->states[state]->mixture, hmm->num_features);
+  if (!search_has_emission(search, state)) {
+    // search threads only read the cache, which has the emissions of their hypotheses
+    REQUIRE(search->worker == NULL, "Emission of state %d missing in a search thread", state);
+    search_set_emission(search, state, compute_emission(search, vector_cc, state));
   }
   return search->t_probability[state];
 }
 
+/** Decides whether a frame reuses the emissions of the last computed frame
+ * @param search the search, after starting the frame
+ * @param feat_vec the feature vector of the frame
+ * @return true if the emissions are reused
+ */
+static bool reuse_emissions(const search_t *search, const float *feat_vec) {
+  const decoder_t *decoder = search->decoder;
+  if (search->reference_feat_vec == NULL || search->reference_frame < 0) return false;
+  if (search->feature_type == FT_EMISSION_PROBABILITIES) return false;
+  if (decoder->frame_skip > 0 && search->n_frames - 1 - search->reference_frame >= decoder->frame_skip) return false;
+  if (decoder->frame_skip_threshold > 0) {
+    const int num_features = decoder->hmm->num_features;
+    float sum = 0;
+    for (int i = 0; i < num_features; i++) {
+      float diff = feat_vec[i] - search->reference_feat_vec[i];
+      sum += diff * diff;
+    }
+    if (sqrtf(sum / num_features) > decoder->frame_skip_threshold) return false;
+  }
+  return true;
+}
+
+/** Returns the grammar of the state and the history of a hypothesis or a lattice state
+ * @param decoder the decoder
+ * @param category the category of the hypothesis
+ * @return the grammar of the category or the main grammar if category is CATEGORY_NONE
+ */
+static const grammar_t *get_category_grammar(const decoder_t *decoder, int category) {
+  return (category != CATEGORY_NONE) ? decoder->categories->categories[category] : decoder->grammar;
+}
+
+/** Returns the lexical tree through which the words of the grammar of the search are expanded
+ * @param search the search
+ * @return the tree, or NULL if the words are expanded with their own lexicon models
+ */
+static const lex_tree_t *get_lex_tree(const search_t *search) {
+  const lex_tree_t *tree = search->decoder->lex_tree;
+  return (tree != NULL && tree->grammar == search->decoder->grammar) ? tree : NULL;
+}
+
+/** Returns the language model look-ahead scores of the nodes of the lexical tree for a grammar state
+ * @param search the search
+ * @param state the grammar state in which the hypotheses entered the tree
+ * @return the scores, or NULL if the search has no look-ahead
+ */
+static const float *get_lm_lookahead(search_t *search, int state) {
+  return (search->lm_lookahead != NULL) ? lex_tree_lookahead_get(search->lm_lookahead, state) : NULL;
+}
+
 /** Reset statistics, search caches and other search variables necessary for the next frame
  */
 void start_frame(search_t *search, const float *feat_vec, lattice_t *lattice) {
@@ -53,12 +169,21 @@ void start_frame(search_t *search, const float *feat_vec, lattice_t *lattice) {
   // clear the already expanded heap and swap heaps
   hh_clear(search->prev_heap);
   SWAP(search->heap, search->prev_heap, hyp_heap_t *);
+  if (search_has_adaptive_beam(search)) search_start_adaptive_beam(search);
 
   if (ENABLE_STATISTICS) {
-    search->stats = (stats_t **) realloc(search->stats, search->n_frames * sizeof(stats_t *));
-    MEMTEST(search->stats);
-    search->stats[search->n_frames-1] = (stats_t *)malloc(sizeof(stats_t));
-    MEMTEST(search->stats[search->n_frames-1]);
+    // the statistics of previous samples are reused
+    if (search->n_frames > search->stats_capacity) {
+      const int capacity = (search->stats_capacity > 0) ? 2 * search->stats_capacity : 256;
+      search->stats = (stats_t **) realloc(search->stats, capacity * sizeof(stats_t *));
+      MEMTEST(search->stats);
+      for (int f = search->stats_capacity; f < capacity; f++) {
+        search->stats[f] = (stats_t *)malloc(sizeof(stats_t));
+        MEMTEST(search->stats[f]);
+      }
+      search->stats_capacity = capacity;
+      search->n_allocations++;
+    }
     reset_frame_stats(search->stats[search->n_frames-1]);
 
 
@@ -66,14 +191,22 @@ void start_frame(search_t *search, const float *feat_vec, lattice_t *lattice) {
       const hmm_t* hmm = search->decoder->hmm;
       stats_t *stats = search->stats[search->n_frames - 1];
       stats->n_hmm_counts  = search->decoder->hmm->n_hmm_states;
-      stats->hmm_counts    = (int *) calloc(search->decoder->hmm->n_hmm_states, sizeof(int));
       stats->n_lex_counts  = search->decoder->lex->n_states;
-      stats->lex_counts    = (int *) calloc(search->decoder->lex->n_states, sizeof(int));
       stats->n_word_counts = search->decoder->lex->num_models;
-      stats->word_counts   = (int*) calloc(search->decoder->lex->num_models, sizeof(int));
-
       stats->num_hist = search->decoder->grammar->num_states;
-      if (!search->is_prefix_search) stats->hist_count = (int*) calloc(search->decoder->grammar->num_states, sizeof(int));
+
+      // the counts are only needed until the frame is printed, so all the frames share them
+      const int n_counts = stats->n_hmm_counts + stats->n_lex_counts + stats->n_word_counts + stats->num_hist;
+      if (search->frame_counts == NULL) {
+        search->frame_counts = (int *) malloc(n_counts * sizeof(int));
+        MEMTEST(search->frame_counts);
+        search->n_allocations++;
+      }
+      memset(search->frame_counts, 0, n_counts * sizeof(int));
+      stats->hmm_counts    = search->frame_counts;
+      stats->lex_counts    = stats->hmm_counts + stats->n_hmm_counts;
+      stats->word_counts   = stats->lex_counts + stats->n_lex_counts;
+      if (!search->is_prefix_search) stats->hist_count = stats->word_counts + stats->n_word_counts;
 
       stats->num_states = hmm->num_states;
 
@@ -85,12 +218,29 @@ void start_frame(search_t *search, const float *feat_vec, lattice_t *lattice) {
   // prepare lattice for this frame
   lattice_start_frame(lattice);
 
+  // the emissions of a skipped frame are the ones of the last computed frame. The missing
+  // ones are computed lazily from its features, so the cache stays consistent
+  const bool reuse = reuse_emissions(search, feat_vec);
+  if (ENABLE_STATISTICS && search->reference_feat_vec != NULL) {
+    search->stats[search->n_frames - 1]->fs_frames = 1;
+    search->stats[search->n_frames - 1]->fs_computed = reuse ? 0 : 1;
+  }
+
+  int n_ahead = 0;
+  const float *ahead_emissions = NULL;
+  const int *ahead_states = NULL;
+  if (search->emission_pipeline != NULL && emission_pipeline_is_running(search->emission_pipeline)) {
+    // wait for the emission threads if they are computing this frame
+    n_ahead = emission_pipeline_acquire(search->emission_pipeline, search->n_frames - 1, &ahead_emissions, &ahead_states);
+  }
+
   if (search->emission_cache != NULL) {
     if ((int) search->emission_cache->n_elems < search->n_frames) {
       float *t_probability = (float *) malloc(search->decoder->hmm->num_states * sizeof(float));
       vector_append(search->emission_cache, t_probability);
+      if (reuse) memcpy(t_probability, search->t_probability, search->decoder->hmm->num_states * sizeof(float));
       search->t_probability = t_probability;
-      search_clear_acoustic_probability_cache(search);
+      if (!reuse) search_clear_acoustic_probability_cache(search);
     }
   }
   search->do_acoustic_early_pruning = false;
@@ -100,16 +250,56 @@ void start_frame(search_t *search, const float *feat_vec, lattice_t *lattice) {
   }
   else if (search->emission_cache == NULL) {
     // initialize emission probabilities
-    search_clear_acoustic_probability_cache(search);
+    if (!reuse) search_clear_acoustic_probability_cache(search);
   }
   else {
     search->t_probability = (float *)search->emission_cache->data[search->n_frames - 1];
   }
+
+  // emissions computed by the emission threads, which keep them until the next frame
+  search->n_emission_states = 0;
+  for (int i = 0; i < n_ahead; i++) {
+    const int state = (ahead_states != NULL) ? ahead_states[i] : i;
+    search_set_emission(search, state, ahead_emissions[state]);
+  }
+
+  if (reuse || search->feature_type == FT_EMISSION_PROBABILITIES) return;
+
+  if (search->reference_feat_vec != NULL) {
+    memcpy(search->reference_feat_vec, feat_vec, search->decoder->hmm->num_features * sizeof(float));
+    search->reference_frame = search->n_frames - 1;
+  }
+
+  if (search->quantized_feat_vec != NULL) {
+    quantized_hmm_quantize_features(search->decoder->quantized_hmm, feat_vec, search->quantized_feat_vec);
+  }
+
+  if (search->ordered_feat_vec != NULL) {
+    hmm_order_features(search->decoder->hmm, feat_vec, search->ordered_feat_vec);
+  }
+
+  if (search->decoder->gaussian_selection != NULL) {
+    // select the gaussians that will be evaluated in this frame
+    search->selection_generation++;
+    int n_selected = gaussian_selection_select(search->decoder->gaussian_selection, feat_vec,
+        search->selected_gaussians, search->selection_generation);
+    if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
+      search->stats[search->n_frames - 1]->gs_selected = n_selected;
+    }
+  }
 }
 
 /** Finish gathering statistics for a frame
  */
 void end_frame(search_t *search) {
+  // the hypotheses of this frame are expanded in the next one or finalized
+  hh_prune(search->heap);
+  if (search_has_adaptive_beam(search)) search_adapt_beam(search);
+
+  if (search->emission_pipeline != NULL && emission_pipeline_is_running(search->emission_pipeline)) {
+    emission_pipeline_set_active(search->emission_pipeline, search->emission_states, search->n_emission_states);
+  }
+
   if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
     stats_t *stats = search->stats[search->n_frames - 1];
     stats->heap_size = hh_size(search->heap);
@@ -143,20 +333,53 @@ void end_frame(search_t *search) {
     fprintf(stderr, "frame %8d\n", search->n_frames - 1);
     print_frame_stats(stderr, stats);
 
-    free(stats->hmm_counts);
-    free(stats->lex_counts);
-    free(stats->word_counts);
-    if (!search->is_prefix_search) free(stats->hist_count);
+    // the buffer of the counts is reused by the next frame
+    stats->hmm_counts = stats->lex_counts = stats->word_counts = stats->hist_count = NULL;
+  }
+}
+
+/** Records a hypothesis produced by a search thread
+ * @param worker the state of the thread
+ * @param hyp the hypothesis
+ * @param is_word_end true if the hypothesis goes to the lattice, false if it goes to the heap
+ */
+static void record_event(search_worker_t *worker, const hyp_t *hyp, bool is_word_end) {
+  if (worker->n_events == worker->events_capacity) {
+    worker->events_capacity = (worker->events_capacity > 0) ? 2 * worker->events_capacity : 1024;
+    worker->events = (search_event_t *) realloc(worker->events, worker->events_capacity * sizeof(search_event_t));
+    MEMTEST(worker->events);
+    worker->n_allocations++;
   }
+  worker->events[worker->n_events].hyp = *hyp;
+  worker->events[worker->n_events].is_word_end = is_word_end;
+  worker->n_events++;
+}
+
+/** Inserts a hypothesis of the current frame into the heap
+ * @param search the search
+ * @param hyp the hypothesis
+ * @return a code defined by beam_status_t
+ * In a search thread, the heap is private and the hypothesis is recorded for the search
+ * unless it is rejected by the beam or by a better hypothesis in the same state. The heap
+ * of the search would reject it too, since it gets the hypotheses of the thread in the
+ * same order after those of the previous threads, so its limit is not lower and a state
+ * that leaves it is replaced by better hypotheses
+ */
+static beam_status_t insert_hyp(search_t *search, hyp_t *hyp) {
+  beam_status_t in = hh_insert(search->heap, hyp);
+  if (search->worker != NULL && in != REJECT_BEAM && in != REJECT_NO_REPLACE) {
+    record_event(search->worker, hyp, false);
+  }
+  return in;
 }
 
 /** expands a hmm transition based on the previous hypothesis
  * @param search the search
  * @param feat_vec a feature vector
  * @param prev_hyp the previous hypothesis
- * @param transition the hmm transition index
+ * @param arc the hmm transition
  */
-void expand_hmm_transition(search_t *search, const float *feat_vec, const hyp_t *prev_hyp, int transition) {
+void expand_hmm_transition(search_t *search, const float *feat_vec, const hyp_t *prev_hyp, const hmm_arc_t *arc) {
   const hmm_t* hmm = search->decoder->hmm;
 
   if (ENABLE_STATISTICS >= SV_SHOW_FRAME && search->stats[search->n_frames-1]->hmm_counts != NULL) {
@@ -165,12 +388,11 @@ void expand_hmm_transition(search_t *search, const float *feat_vec, const hyp_t
   }
 
   hyp_t hyp = *prev_hyp;
-  hyp.state_hmm = transition - 1;
-  hyp.probability.acoustic = prob_emission(search, feat_vec, &hyp)
-      + hmm->phonemes[hyp.phoneme]->matrix->matrix_transitions[prev_hyp->state_hmm + 1][transition];
+  hyp.state_hmm = arc->target - 1;
+  hyp.probability.acoustic = prob_emission(search, feat_vec, &hyp) + arc->prob;
   hyp.probability.final += hyp.probability.acoustic;
   hyp.probability.acoustic += prev_hyp->probability.acoustic;
-  beam_status_t in = hh_insert(search->heap, &hyp);
+  beam_status_t in = insert_hyp(search, &hyp);
 
   if (ENABLE_STATISTICS) {
     search->stats[search->n_frames-1]->beam_stats[HMM_BEAM].status[in]++;
@@ -205,11 +427,12 @@ void expand_lex_transition(search_t *search, const float *feat_vec, const hyp_t
 
     //In transition
     const matrix_transitions_t *matrix = hmm->phonemes[hyp.phoneme]->matrix;
-    for (int p = 1; p < matrix->num_transitions - 1; p++) {
+    for (int a = matrix->first_arc[0]; a < matrix->first_arc[1]; a++) {
       //Probability of initial state
-      float hmm_prob = matrix->matrix_transitions[0][p];
-      if (!is_logzero(hmm_prob)) {
-        hyp.state_hmm = p - 1;
+      const hmm_arc_t *arc = &matrix->arcs[a];
+      if (arc->target > 0 && !arc->is_exit) {
+        float hmm_prob = arc->prob;
+        hyp.state_hmm = arc->target - 1;
 
         //Calculate probability
         hyp.probability.acoustic = lex_prob + hmm_prob + prob_emission(search, feat_vec, &hyp);
@@ -218,7 +441,7 @@ void expand_lex_transition(search_t *search, const float *feat_vec, const hyp_t
         hyp.probability.acoustic += prev_hyp->probability.acoustic;
 
         //BEAM
-        beam_status_t in = hh_insert(search->heap, &hyp);
+        beam_status_t in = insert_hyp(search, &hyp);
 
         if (ENABLE_STATISTICS) {
           search->stats[search->n_frames-1]->beam_stats[LEX_BEAM].status[in]++;
@@ -230,6 +453,85 @@ void expand_lex_transition(search_t *search, const float *feat_vec, const hyp_t
   }
 }
 
+/** expands the arcs of a node of the lexical tree based on the previous hypothesis
+ * @param search the search
+ * @param feat_vec a feature vector
+ * @param prev_hyp the previous hypothesis. Its state_lexic is the node of the tree
+ * @param level the beam level in which the expansions are counted
+ * With language model look-ahead, the final probability of the hypotheses of the tree
+ * includes the look-ahead score of their node, which is replaced by the one of the child
+ */
+static void expand_tree_transition(search_t *search, const float *feat_vec, const hyp_t *prev_hyp, beam_level_t level) {
+  const hmm_t* hmm = search->decoder->hmm;
+  const lex_tree_t *tree = search->decoder->lex_tree;
+  const lex_tree_node_t *node = &tree->nodes[prev_hyp->state_lexic];
+  const float *lookahead = get_lm_lookahead(search, prev_hyp->state);
+
+  hyp_t hyp = *prev_hyp;
+  for (const lex_tree_arc_t *tree_arc = &tree->arcs[node->first_arc]; tree_arc < &tree->arcs[node->first_arc + node->num_arcs]; tree_arc++) {
+    hyp.phoneme     = tree_arc->phoneme;
+    hyp.state_lexic = tree_arc->destination;
+
+    float lookahead_diff = 0;
+    if (lookahead != NULL) {
+      // no word below the child can follow the grammar state
+      if (is_logzero(lookahead[tree_arc->destination])) continue;
+      lookahead_diff = lookahead[tree_arc->destination] - lookahead[prev_hyp->state_lexic];
+    }
+
+    // for every transition from the initial state of the phoneme hmm model
+    const matrix_transitions_t *matrix = hmm->phonemes[hyp.phoneme]->matrix;
+    for (int a = matrix->first_arc[0]; a < matrix->first_arc[1]; a++) {
+      const hmm_arc_t *arc = &matrix->arcs[a];
+      if (arc->target > 0 && !arc->is_exit) {
+        hyp.state_hmm = arc->target - 1;
+
+        hyp.probability.acoustic = arc->prob + prob_emission(search, feat_vec, &hyp);
+        hyp.probability.final = prev_hyp->probability.final + lookahead_diff + hyp.probability.acoustic;
+        hyp.probability.acoustic += prev_hyp->probability.acoustic;
+
+        beam_status_t in = insert_hyp(search, &hyp);
+
+        if (ENABLE_STATISTICS) {
+          search->stats[search->n_frames-1]->beam_stats[level].status[in]++;
+        }
+      }
+    }
+  }
+}
+
+/** Gives the identity of one of the words whose pronunciation ends in the node of a hypothesis
+ * of the lexical tree, and adds its language model and pronunciation probabilities
+ * @param search the search
+ * @param hyp the hypothesis of the tree
+ * @param tree_word a word of the node of hyp
+ * @param lookahead the look-ahead score of the node of hyp, which is included in its final probability
+ * @param word_hyp the hypothesis of the word. It is in the final state of the lexicon model of the word
+ * @return false if the word cannot follow the grammar state of hyp
+ */
+static bool resolve_tree_word(const search_t *search, const hyp_t *hyp, const lex_tree_word_t *tree_word, float lookahead, hyp_t *word_hyp) {
+  const decoder_t* decoder = search->decoder;
+  const grammar_t* grammar = decoder->grammar;
+
+  words_state_t ws = { STATE_NONE, tree_word->extended, LOG_ZERO };
+  if (!state_grammar_fill_word_state(grammar_get_state(grammar, hyp->state), &ws)) return false;
+
+  const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, tree_word->extended);
+  *word_hyp = *hyp;
+  word_hyp->extended = word->extended;
+  word_hyp->word_ptr = word->input;
+  word_hyp->word = *word_hyp->word_ptr;
+  word_hyp->state_lexic = decoder->lex->models[word_hyp->word]->end;
+  word_hyp->history = hyp->state;
+  word_hyp->state = state_grammar_get_index(ws.state_next);
+
+  // the word insertion penalty was added when the hypothesis entered the tree
+  word_hyp->probability.lm += ws.prob;
+  word_hyp->probability.acoustic += tree_word->probability;
+  word_hyp->probability.final += tree_word->probability + ws.prob * decoder->gsf + word->combined_score - lookahead;
+  return true;
+}
+
 /** expands a word transition based on a partially completed hypothesis
  * @param search the search
  * @param feat_vec a feature vector
@@ -278,11 +580,12 @@ void expand_word_transition(search_t *search, const float *feat_vec, hyp_t *hyp)
 
     // for every transition from the initial state of the phoneme hmm model
     const matrix_transitions_t *matrix = hmm->phonemes[hyp->phoneme]->matrix;
-    for (int p = 1; p < matrix->num_transitions - 1; p++) {
-      float hmm_prob = matrix->matrix_transitions[0][p];
-      // we can reach the state from the initial hmm state
-      if (!is_logzero(hmm_prob)) {
-        hyp->state_hmm = p - 1;
+    for (int a = matrix->first_arc[0]; a < matrix->first_arc[1]; a++) {
+      const hmm_arc_t *arc = &matrix->arcs[a];
+      // we can reach an emitting state from the initial hmm state
+      if (arc->target > 0 && !arc->is_exit) {
+        float hmm_prob = arc->prob;
+        hyp->state_hmm = arc->target - 1;
 
         // compute acoustic probability
         hyp->probability.acoustic = lex_prob + hmm_prob + prob_emission(search, feat_vec, hyp);
@@ -348,10 +651,10 @@ void expand_phrase_transition(search_t *search, const float *feat_vec, const hyp
 
     if (decoder->input_grammar != NULL) {
       words_state_t ws = { STATE_NONE, hyp.word, LOG_ZERO };
-      state_grammar_t * state_in = hyp.state_in;
+      state_grammar_t * state_in = grammar_get_state(decoder->input_grammar, hyp.state_in);
       state_grammar_fill_word_state(state_in, &ws);
       hyp.probability.in_lm = ws.prob;
-      hyp.state_in = ws.state_next;
+      hyp.state_in = state_grammar_get_index(ws.state_next);
       hyp.probability.final += hyp.probability.in_lm * decoder->gsf_in;
     }
     else hyp.probability.in_lm = 0;
@@ -387,6 +690,106 @@ void expand_phrase_transition(search_t *search, const float *feat_vec, const hyp
 }
 
 
+/** expands a word that follows the best hypothesis of a lattice state
+ * @param search search status
+ * @param feat_vec feature vector in frame t
+ * @param grammar the grammar of the word
+ * @param lat_state the lattice state
+ * @param word the word
+ * @param state_next grammar state reached with the word
+ * @param history grammar state in which the word was found
+ * @param lm language model probability of the word, including the backoff weights
+ * @param is_final if the lattice state is at the end of a category
+ * @param cat_end_prob probability of ending the category
+ * @return false if the word was rejected by early pruning
+ */
+static bool expand_word(search_t *search, const float *feat_vec, const grammar_t *grammar, const lat_state_t *lat_state,
+                        const extended_symbol_t *word, const state_grammar_t *state_next, int history, float lm,
+                        bool is_final, float cat_end_prob) {
+  const decoder_t* decoder = search->decoder;
+  const lat_hyp_t *best_hyp = lat_state->max;
+  hyp_t hyp;
+
+  hyp.extended = word->extended;
+  hyp.word_ptr = word->input;
+  hyp.word = *hyp.word_ptr;
+
+  if (is_final) {
+    hyp.category = CATEGORY_NONE;
+    hyp.history_category = STATE_INDEX_NONE;
+  }
+  else {
+    hyp.category = lat_state->category;
+    hyp.history_category = lat_state->history_category;
+  }
+
+  hyp.index = lat_state->index;
+  hyp.state = state_grammar_get_index(state_next);
+  hyp.history = history;
+
+  hyp.probability.lm = lm;
+  if (is_final) hyp.probability.lm += cat_end_prob;
+
+  hyp.probability.final = best_hyp->probability.final + (hyp.probability.lm * decoder->gsf);
+  hyp.probability.final += word->combined_score;
+
+  if (decoder->input_grammar != NULL) {
+    words_state_t ws = { STATE_NONE, hyp.word, LOG_ZERO};
+    state_grammar_fill_word_state(grammar_get_state(decoder->input_grammar, best_hyp->state_in), &ws);
+    hyp.probability.in_lm = ws.prob;
+    hyp.state_in = state_grammar_get_index(ws.state_next);
+    hyp.probability.final += hyp.probability.in_lm * decoder->gsf_in;
+  }
+  else hyp.probability.in_lm = 0;
+
+  hyp.probability.out_lm = 0;
+  hyp.probability.wip_out = 0;
+  if (word->output != NULL) {
+    //XXX: we add the whole lm_out probability here
+    // this may not be fair and it may harm beam search
+    symbol_t const * out_word = word->output;
+    hyp.state_out = best_hyp->state_out;
+    while (*out_word != VOCAB_NONE) {
+      // add lm out probability
+      if (decoder->output_grammar != NULL) {
+        words_state_t ws = { STATE_NONE, *out_word, LOG_ZERO};
+        state_grammar_fill_word_state(grammar_get_state(decoder->output_grammar, hyp.state_out), &ws);
+        hyp.probability.out_lm += ws.prob;
+        hyp.state_out = state_grammar_get_index(ws.state_next);
+      }
+      // add wip out probability
+      if (decoder->output_grammar == NULL || *out_word != decoder->output_grammar->end) {
+        hyp.probability.wip_out -= decoder->wip_out;
+      }
+      out_word++;
+    }
+    // we distribute uniformly among the input words
+    #if defined(DISTRIBUTE_UNIFORMLY_PHRASE_PROBABILITY)
+      float input_length = symlen(word->input);
+      hyp.probability.out_lm /= input_length;
+      hyp.probability.wip_out /= input_length;
+    #endif
+    hyp.probability.final += hyp.probability.out_lm * decoder->gsf_out;
+    hyp.probability.final -= hyp.probability.wip_out;
+  }
+
+  if (hyp.extended != grammar->end) {
+    hyp.probability.final -= decoder->wip;
+  }
+
+  // do early pruning assuming the best_achievable_ac is the best
+  // score we can get in the expansion
+  if (!search->do_acoustic_early_pruning || hyp.probability.final + search->best_achievable_ac > hh_limit(search->heap)) {
+    expand_word_transition(search, feat_vec, &hyp);
+    return true;
+  }
+
+  if (ENABLE_STATISTICS >= SV_SHOW_WORD_EXPANSION)
+    fprintf(stderr, "exiting language at %d(%6.2f%%) out of %d\n", search->stats[search->n_frames - 1]->total_expanded, 100.0
+        * search->stats[search->n_frames - 1]->total_expanded / (float) decoder->lex->num_models, decoder->lex->num_models);
+  return false;
+}
+
 /** expands word transtions from the grammar states
  * @param search search status
  * @param feat_vec feature vector in frame t
@@ -396,9 +799,9 @@ void expand_phrase_transition(search_t *search, const float *feat_vec, const hyp
 void expand_words_from_lat_state(search_t *search, const float *feat_vec, const lat_state_t *lat_state, float initial_prob) {
   const decoder_t* decoder = search->decoder;
   const grammar_t* grammar = decoder->grammar;
-  const lex_t* lex = decoder->lex;
+  const lex_tree_t *tree = get_lex_tree(search);
 
-  state_grammar_t *state_current = lat_state->state;
+  state_grammar_t *state_current = grammar_get_state(get_category_grammar(decoder, lat_state->category), lat_state->state);
 
   // since we are doing viterbi, we are just interested in expanding
   // the most probable hypothesis from this state
@@ -421,7 +824,7 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
       cat_end_prob = grammar->list_end->vector[final_idx].prob;
       // we are at the end of a category
       grammar = decoder->grammar;
-      state_current = lat_state->history_category;
+      state_current = grammar_get_state(grammar, lat_state->history_category);
       is_final = true;
     }
   }
@@ -446,13 +849,13 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
       float best_achievable_lm = state_current->words[0].prob * decoder->gsf - decoder->wip;
 
       if (decoder->input_grammar != NULL) {
-        state_grammar_t * state_in = best_hyp->state_in;
+        state_grammar_t * state_in = grammar_get_state(decoder->input_grammar, best_hyp->state_in);
         if (state_in && state_in->num_words > 0) {
           best_achievable_lm += state_in->words[0].prob * decoder->gsf_in;
         }
       }
       if (decoder->output_grammar != NULL) {
-        state_grammar_t * state_out = best_hyp->state_out;
+        state_grammar_t * state_out = grammar_get_state(decoder->output_grammar, best_hyp->state_out);
         if (state_out && state_out->num_words > 0) {
           best_achievable_lm += state_out->words[0].prob * decoder->gsf_out;
         }
@@ -481,6 +884,39 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
   // since it is only allowed one expansion per word
   if (grammar->is_ngram) search_clear_visited_words(search);
 
+  // all the words are expanded through the lexical tree
+  if (tree != NULL && tree->num_other_words == 0) state_current = STATE_NONE;
+
+  // the words of the state and of its backoff states are expanded in a single pass.
+  // Since they are sorted by probability, the first word rejected by early pruning
+  // also rejects the words of the backoff states that are less probable. The walk
+  // through the backoff states below stops at the first rejected word instead, so it
+  // never reaches the backoff words that are more probable than that word, which the
+  // merged words expand. Unless the heap limit rises in between, the merged words
+  // expand the same words and some more
+  int num_words = 0;
+  const successor_t *successors = NULL;
+  if (state_current != STATE_NONE && search->successors != NULL && grammar == search->successors->grammar) {
+    successors = grammar_successors_get(search->successors, state_current->num_state, &num_words);
+  }
+  if (successors != NULL) {
+    if (ENABLE_STATISTICS >= SV_SHOW_FRAME && !search->is_prefix_search) search->stats[search->n_frames-1]->hist_count[state_current->num_state]++;
+
+    for (int m = 0; m < num_words; m++) {
+      const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, successors[m].word);
+
+      //XXX: now, start and end words do not eat up silences so do not allow expansion
+      if (word->extended == grammar->start || word->extended == grammar->end) continue;
+
+      // the word is expanded through the lexical tree
+      if (tree != NULL && tree->is_tree_word[word->extended]) continue;
+
+      if (!expand_word(search, feat_vec, grammar, lat_state, word, successors[m].state_next,
+                       successors[m].history, successors[m].prob + backoff, is_final, cat_end_prob)) break;
+    }
+    state_current = STATE_NONE;
+  }
+
   // we iterate from the current state through backoff up to the unigram state
   while (state_current != STATE_NONE) {
     if (ENABLE_STATISTICS >= SV_SHOW_FRAME && !search->is_prefix_search) search->stats[search->n_frames-1]->hist_count[state_current->num_state]++;
@@ -499,8 +935,8 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
           lat_state_dummy = *lat_state;
 
           lat_state_dummy.category = category;
-          lat_state_dummy.history_category = state_current->words[m].state_next;
-          lat_state_dummy.state = cat_grammar->list_initial->vector[s].state;
+          lat_state_dummy.history_category = state_grammar_get_index(state_current->words[m].state_next);
+          lat_state_dummy.state = state_grammar_get_index(cat_grammar->list_initial->vector[s].state);
           expand_words_from_lat_state(search, feat_vec, &lat_state_dummy, state_current->words[m].prob+cat_grammar->list_initial->vector[s].prob);
         }
       }
@@ -511,9 +947,9 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
         // if we are in a ngram, update the visit vector and
         // check if expansion is allowed
         if (grammar->is_ngram) {
-          if (search->visit[word->extended] == 0) {
+          if (search->visit[word->extended] != search->visit_generation) {
             if (!is_logzero(state_current->bo)) {
-              search->visit[word->extended] = 1;
+              search->visit[word->extended] = search->visit_generation;
             }
           } else expansion_allowed = false;
         }
@@ -521,93 +957,17 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
         //XXX: now, start and end words do not eat up silences so do not allow expansion
         if (word->extended == grammar->start || word->extended == grammar->end) expansion_allowed = false;
 
-        if (expansion_allowed) {
-          hyp_t hyp;
-
-          hyp.extended = word->extended;
-          hyp.word_ptr = word->input;
-          hyp.word = *hyp.word_ptr;
-
-          if (is_final) {
-            hyp.category = CATEGORY_NONE;
-            hyp.history_category = STATE_NONE;
-          }
-          else {
-            hyp.category = lat_state->category;
-            hyp.history_category = lat_state->history_category;
-          }
-
-          hyp.index = lat_state->index;
-          hyp.state = state_current->words[m].state_next;
-          hyp.history = state_current;
-
-          hyp.probability.lm = state_current->words[m].prob + backoff;
-          if (is_final) hyp.probability.lm += cat_end_prob;
-
-          hyp.probability.final = best_hyp->probability.final + (hyp.probability.lm * decoder->gsf);
-          hyp.probability.final += word->combined_score;
-
-          if (decoder->input_grammar != NULL) {
-            words_state_t ws = { STATE_NONE, hyp.word, LOG_ZERO};
-            state_grammar_fill_word_state(best_hyp->state_in, &ws);
-            hyp.probability.in_lm = ws.prob;
-            hyp.state_in = ws.state_next;
-            hyp.probability.final += hyp.probability.in_lm * decoder->gsf_in;
-          }
-          else hyp.probability.in_lm = 0;
-
-          hyp.probability.out_lm = 0;
-          hyp.probability.wip_out = 0;
-          if (word->output != NULL) {
-            //XXX: we add the whole lm_out probability here
-            // this may not be fair and it may harm beam search
-            symbol_t const * out_word = word->output;
-            hyp.state_out = best_hyp->state_out;
-            while (*out_word != VOCAB_NONE) {
-              // add lm out probability
-              if (decoder->output_grammar != NULL) {
-                words_state_t ws = { STATE_NONE, *out_word, LOG_ZERO};
-                state_grammar_fill_word_state(hyp.state_out, &ws);
-                hyp.probability.out_lm += ws.prob;
-                hyp.state_out = ws.state_next;
-              }
-              // add wip out probability
-              if (decoder->output_grammar == NULL || *out_word != decoder->output_grammar->end) {
-                hyp.probability.wip_out -= decoder->wip_out;
-              }
-              out_word++;
-            }
-            // we distribute uniformly among the input words
-            #if defined(DISTRIBUTE_UNIFORMLY_PHRASE_PROBABILITY)
-              float input_length = symlen(word->input);
-              hyp.probability.out_lm /= input_length;
-              hyp.probability.wip_out /= input_length;
-            #endif
-            hyp.probability.final += hyp.probability.out_lm * decoder->gsf_out;
-            hyp.probability.final -= hyp.probability.wip_out;
-          }
-
-          if (hyp.extended != grammar->end) {
-            hyp.probability.final -= decoder->wip;
-          }
-
-          // do early pruning assuming the best_achievable_ac is the best
-          // score we can get in the expansion
-          if (!search->do_acoustic_early_pruning || hyp.probability.final + search->best_achievable_ac > hh_limit(search->heap)) {
-            expand_word_transition(search, feat_vec, &hyp);
-          }
+        // the word is expanded through the lexical tree
+        if (tree != NULL && tree->is_tree_word[word->extended]) expansion_allowed = false;
 
-          // words in states are sorted by probability so if previous
-          // word didn't pass the current limit, following words won't either
-          // then exit expanding from this state
-          else {
-            if (ENABLE_STATISTICS >= SV_SHOW_WORD_EXPANSION)
-              fprintf(stderr, "exiting language at %d(%6.2f%%) out of %d\n", search->stats[search->n_frames - 1]->total_expanded, 100.0
-                  * search->stats[search->n_frames - 1]->total_expanded / (float) lex->num_models, lex->num_models);
-            state_current = STATE_NONE;
-            break;
-          }
-        } // expansion is allowed
+        // words in states are sorted by probability so if previous
+        // word didn't pass the current limit, following words won't either
+        // then exit expanding from this state
+        if (expansion_allowed && !expand_word(search, feat_vec, grammar, lat_state, word, state_current->words[m].state_next,
+                                              state_current->num_state, state_current->words[m].prob + backoff, is_final, cat_end_prob)) {
+          state_current = STATE_NONE;
+          break;
+        }
       }
     }// iterate over words in the state
 
@@ -624,12 +984,41 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
       search->stats[search->n_frames-1]->num_visited_words = 0;
       search->stats[search->n_frames-1]->total_words = search->decoder->lex->vocab->last;
       for (int i = 0; i < search->decoder->vocab->extended->last; i++ ) {
-        if (search->visit[i] > 0) search->stats[search->n_frames-1]->num_visited_words++;
+        if (search->visit[i] == search->visit_generation) search->stats[search->n_frames-1]->num_visited_words++;
       }
     }
     print_word_expand_stats(stderr, search->stats[search->n_frames - 1]);
   }
 
+  // the words of the lexical tree share their hypotheses from the root. Their identity and
+  // their language model probability are known when their pronunciation ends
+  if (tree != NULL) {
+    hyp_t hyp;
+    hyp.extended = VOCAB_NONE;
+    hyp.word_ptr = NULL;
+    hyp.word = VOCAB_NONE;
+    hyp.state_lexic = LEX_TREE_ROOT;
+    hyp.index = lat_state->index;
+    hyp.state = lat_state->state;
+    hyp.history = lat_state->state;
+    hyp.category = CATEGORY_NONE;
+    hyp.history_category = STATE_INDEX_NONE;
+    hyp.state_in = best_hyp->state_in;
+    hyp.state_out = best_hyp->state_out;
+    hyp.probability = one_probability;
+    hyp.probability.lm = initial_prob;
+    hyp.probability.final = best_hyp->probability.final + (initial_prob * decoder->gsf) - decoder->wip;
+
+    // the look-ahead score of the root is the best score of any word from this state
+    const float *lookahead = get_lm_lookahead(search, hyp.state);
+    if (lookahead != NULL) hyp.probability.final += lookahead[LEX_TREE_ROOT];
+
+    if ((lookahead == NULL || !is_logzero(lookahead[LEX_TREE_ROOT]))
+        && (!search->do_acoustic_early_pruning || hyp.probability.final + search->best_achievable_ac > hh_limit(search->heap))) {
+      expand_tree_transition(search, feat_vec, &hyp, GRAMMAR_BEAM);
+    }
+  }
+
   // expand silence if possible
   if (grammar->silence != VOCAB_NONE) {
     const extended_symbol_t *word = extended_vocab_get_extended_symbol(grammar->vocab, grammar->silence);
@@ -640,7 +1029,7 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
     hyp.index = lat_state->index;
     hyp.state = lat_state->state;
     //XXX: we should clean this up
-    hyp.history = (best_hyp->index == -1)?NULL:lat_state->state;
+    hyp.history = (best_hyp->index == -1)?STATE_INDEX_NONE:lat_state->state;
     hyp.category = lat_state->category;
     hyp.history_category = lat_state->history_category;
     hyp.probability.lm = decoder->grammar->silence_score;
@@ -662,7 +1051,7 @@ void expand_words_from_lat_state(search_t *search, const float *feat_vec, const
     hyp.index = lat_state->index;
     hyp.state = lat_state->state;
     //XXX: we should clean this up
-    hyp.history = (best_hyp->index == -1)?NULL:lat_state->state;
+    hyp.history = (best_hyp->index == -1)?STATE_INDEX_NONE:lat_state->state;
     hyp.category = lat_state->category;
     hyp.history_category = lat_state->history_category;
     hyp.probability.lm = decoder->grammar->silence_score;
@@ -716,7 +1105,7 @@ void expand_words_from_lattice(search_t *search, const float *feat_vec, lattice_
       hyp.state = lattice->vector[index_table]->state;
       hyp.state_in = best_hyp->state_in;
       hyp.state_out = best_hyp->state_out;
-      hyp.history = (best_hyp->index == -1)?NULL:lattice->vector[best_hyp->index]->state;
+      hyp.history = (best_hyp->index == -1)?STATE_INDEX_NONE:lattice->vector[best_hyp->index]->state;
       hyp.category = lattice->vector[index_table]->category;
       hyp.history_category = lattice->vector[index_table]->history_category;
       hyp.probability = best_hyp->probability;
@@ -760,8 +1149,8 @@ void initial_stage(search_t *search, const float *feat_vec, lattice_t *lattice)
     best_hyp.word = VOCAB_NONE;
     best_hyp.word_ptr = NULL;
     best_hyp.extended = VOCAB_NONE;
-    best_hyp.state_in = initial_state_in;
-    best_hyp.state_out = initial_state_out;
+    best_hyp.state_in = state_grammar_get_index(initial_state_in);
+    best_hyp.state_out = state_grammar_get_index(initial_state_out);
     best_hyp.probability = one_probability;
     best_hyp.index = -1;
 
@@ -769,9 +1158,9 @@ void initial_stage(search_t *search, const float *feat_vec, lattice_t *lattice)
     lat_state.words = NULL;
     lat_state.max = &best_hyp;
     lat_state.num_words = 0;
-    lat_state.state = grammar->list_initial->vector[l].state;
+    lat_state.state = state_grammar_get_index(grammar->list_initial->vector[l].state);
     lat_state.category = CATEGORY_NONE;
-    lat_state.history_category = NULL;
+    lat_state.history_category = STATE_INDEX_NONE;
     lat_state.word_ptr = NULL;
     lat_state.t = -1;
     lat_state.nbest = 0;
@@ -797,7 +1186,7 @@ void add_probability_to_final_grammar_state(const search_t *search, hyp_t *hyp)
 
   float bo = 0.0;
   //Current state to expansion
-  state_grammar_t * state_current = hyp->state;
+  state_grammar_t * state_current = grammar_get_state(get_category_grammar(decoder, hyp->category), hyp->state);
 
   // we iterate from the current state through backoff up to the unigram state
   while (state_current != STATE_NONE) {
@@ -840,14 +1229,43 @@ void end_stage(search_t *search, lattice_t *lattice) {
   const lex_t* lex = decoder->lex;
   const hmm_t* hmm = decoder->hmm;
   int final = 0;
-  vector_t *states = vector_create();
+  vector_t *states = search->final_candidates;
+  const size_t capacity = states->capacity;
+  vector_clear(states);
 
   lattice_reset_frame(lattice);
 
+  // the words of the lexical tree that can end in this frame compete with the rest
+  // of the hypotheses in the other heap, which is free after the last frame
+  hyp_heap_t *heap = search->heap;
+  if (get_lex_tree(search) != NULL) {
+    const lex_tree_t *tree = decoder->lex_tree;
+    hh_clear(search->prev_heap);
+    hh_set_beam(search->prev_heap, hh_beam(search->heap));
+    while (!hh_is_empty(search->heap)) {
+      hyp_t *hyp = hh_pop(search->heap);
+      if (hyp->word_ptr != NULL) {
+        hh_insert(search->prev_heap, hyp);
+      }
+      else if (!is_logzero(hmm->phonemes[hyp->phoneme]->matrix->matrix_transitions[hyp->state_hmm+1][hmm->phonemes[hyp->phoneme]->num_states-1])) {
+        const lex_tree_node_t *node = &tree->nodes[hyp->state_lexic];
+        const float *lookahead = get_lm_lookahead(search, hyp->state);
+        for (int w = node->first_word; w < node->first_word + node->num_words; w++) {
+          hyp_t word_hyp;
+          if (resolve_tree_word(search, hyp, &tree->words[w], (lookahead != NULL) ? lookahead[hyp->state_lexic] : 0, &word_hyp)) {
+            hh_insert(search->prev_heap, &word_hyp);
+          }
+        }
+      }
+    }
+    hh_prune(search->prev_heap);
+    heap = search->prev_heap;
+  }
+
 //  size_t n_finalizable_hmms = 0;
 //  size_t n_final_lexics = 0;
-  while (!hh_is_empty(search->heap)) {
-    hyp_t *hyp = hh_pop(search->heap);
+  while (!hh_is_empty(heap)) {
+    hyp_t *hyp = hh_pop(heap);
 
     bool is_finalizable_hmm_state = !is_logzero(hmm->phonemes[hyp->phoneme]->matrix->matrix_transitions[hyp->state_hmm+1][hmm->phonemes[hyp->phoneme]->num_states-1]);
     bool is_final_lexic_state = lex->models[hyp->word]->end == hyp->state_lexic;
@@ -882,8 +1300,8 @@ void end_stage(search_t *search, lattice_t *lattice) {
           hyp->probability.lm = 0;
         }
       } else {
-        state_grammar_t *state = hyp->state;
-        if (hyp->category != CATEGORY_NONE) state = hyp->history_category;
+        state_grammar_t *state = grammar_get_state(grammar, hyp->state);
+        if (hyp->category != CATEGORY_NONE) state = grammar_get_state(decoder->grammar, hyp->history_category);
         index = grammar_is_final_state(grammar, state);
         is_final = (index != -1);
       }
@@ -892,7 +1310,7 @@ void end_stage(search_t *search, lattice_t *lattice) {
         // we are in the middle of a category
         grammar_t *cat_grammar = decoder->categories->categories[hyp->category];
 
-        int final_idx = grammar_is_final_state(grammar, hyp->state);
+        int final_idx = grammar_is_final_state(grammar, grammar_get_state(cat_grammar, hyp->state));
         if (final_idx != -1) {
           // we are at the end of a category
           hyp->probability.lm += cat_grammar->list_end->vector[final_idx].prob;
@@ -920,9 +1338,9 @@ void end_stage(search_t *search, lattice_t *lattice) {
           && hyp->extended != decoder->input_grammar->end)
       {
         words_state_t ws = { STATE_NONE, decoder->input_grammar->end, LOG_ZERO };
-        state_grammar_fill_word_state(hyp->state_in, &ws);
+        state_grammar_fill_word_state(grammar_get_state(decoder->input_grammar, hyp->state_in), &ws);
         hyp->probability.in_lm += ws.prob;
-        hyp->state_in = ws.state_next;
+        hyp->state_in = state_grammar_get_index(ws.state_next);
         hyp->probability.final += ws.prob * decoder->gsf_in;
       }
 
@@ -931,9 +1349,9 @@ void end_stage(search_t *search, lattice_t *lattice) {
           && hyp->extended != decoder->output_grammar->end)
       {
         words_state_t ws = { STATE_NONE, decoder->output_grammar->end, LOG_ZERO };
-        state_grammar_fill_word_state(hyp->state_out, &ws);
+        state_grammar_fill_word_state(grammar_get_state(decoder->output_grammar, hyp->state_out), &ws);
         hyp->probability.out_lm += ws.prob;
-        hyp->state_out = ws.state_next;
+        hyp->state_out = state_grammar_get_index(ws.state_next);
         hyp->probability.final += ws.prob * decoder->gsf_out;
       }
 
@@ -962,7 +1380,8 @@ void end_stage(search_t *search, lattice_t *lattice) {
       lattice_insert(lattice, (hyp_t *) states->data[i]);
     }
   }
-  vector_delete(states);
+  if (states->capacity != capacity) search->n_allocations++;
+  vector_clear(states);
 
   // we create a fake final node in the lattice
   lattice_add_final_node(lattice);
@@ -982,19 +1401,269 @@ int cmp_lattice_state(const void *a, const void *b) {
     return 0;
 }
 
-/** analizes feature vector t and expands it to the next hypothesis heap
+/** inserts a hypothesis that has reached the end of its word into the lattice,
+ * which is a language model transition
+ * @param search a search status
+ * @param hyp the hypothesis
+ * @param lattice output lattice
+ */
+static void insert_word_end(search_t *search, hyp_t *hyp, lattice_t *lattice) {
+  // search threads leave the lattice to the search
+  if (search->worker != NULL) {
+    record_event(search->worker, hyp, true);
+    return;
+  }
+
+  // keep number of elements for statistics
+  int prev_num_elements = lattice->num_elements;
+
+  // language model transition
+  lattice_insert(lattice, hyp);
+
+  if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
+    if (prev_num_elements != lattice->num_elements)
+      search->stats[search->n_frames - 1]->num_table_words++;
+    search->stats[search->n_frames - 1]->n_word_hyps++;
+  }
+}
+
+/** expands the transition of a hypothesis to the final state of its phoneme, which
+ * is either a lexic transition or a language model transition
  * @param search a search status
  * @param feat_vec feature vector
- * @param t current frame
+ * @param prev_hyp the hypothesis. Its probability is updated with the transition
+ * @param arc the transition to the final state
  * @param lattice output lattice
  */
-void viterbi_frm(search_t *search, const float *feat_vec, lattice_t *lattice) {
+static void expand_phoneme_end(search_t *search, const float *feat_vec, hyp_t *prev_hyp, const hmm_arc_t *arc, lattice_t *lattice) {
+  const lex_t* lex = search->decoder->lex;
+
+  //add transition probability from current hmm state to hmm final hmm state
+  prev_hyp->probability.acoustic += arc->prob;
+  prev_hyp->probability.final    += arc->prob;
+
+  //If this is a node of the lexical tree, its words end and its arcs are lex transitions
+  if (prev_hyp->word_ptr == NULL) {
+    const lex_tree_t *tree = search->decoder->lex_tree;
+    const lex_tree_node_t *node = &tree->nodes[prev_hyp->state_lexic];
+    const float *lookahead = get_lm_lookahead(search, prev_hyp->state);
+    for (int w = node->first_word; w < node->first_word + node->num_words; w++) {
+      hyp_t word_hyp;
+      if (resolve_tree_word(search, prev_hyp, &tree->words[w], (lookahead != NULL) ? lookahead[prev_hyp->state_lexic] : 0, &word_hyp)) {
+        insert_word_end(search, &word_hyp, lattice);
+      }
+    }
+    if (node->num_arcs > 0) expand_tree_transition(search, feat_vec, prev_hyp, LEX_BEAM);
+  }
+
+  //If lex state is not the final state, then this is a lex transition
+  else if (lex->models[prev_hyp->word]->end != prev_hyp->state_lexic) {
+    expand_lex_transition(search, feat_vec, prev_hyp);
+  }//Lexic transition
+
+  //Else this is language model transition
+  else {
+    insert_word_end(search, prev_hyp, lattice);
+  }
+}
+
+/// Minimum number of hypotheses per search thread to expand a frame with several threads
+#define MIN_HYPS_PER_THREAD 16
+
+/** expands a hypothesis of the previous frame to the current one
+ * @param search a search status
+ * @param feat_vec feature vector
+ * @param prev_hyp the hypothesis. It is modified by the expansion
+ * @param lattice output lattice
+ */
+static void expand_hyp(search_t *search, const float *feat_vec, hyp_t *prev_hyp, lattice_t *lattice) {
+  const hmm_t* hmm = search->decoder->hmm;
+
+  //Matrix transitions
+  const matrix_transitions_t *matrix = hmm->phonemes[prev_hyp->phoneme]->matrix;
+  if (matrix->topology == HT_LEFT_TO_RIGHT) {
+    // self loop and transition to the next state, which can be the final one
+    const hmm_arc_t *arc = &matrix->arcs[1 + 2 * prev_hyp->state_hmm];
+    expand_hmm_transition(search, feat_vec, prev_hyp, &arc[0]);
+    if (!arc[1].is_exit) {
+      expand_hmm_transition(search, feat_vec, prev_hyp, &arc[1]);
+    }
+    else {
+      expand_phoneme_end(search, feat_vec, prev_hyp, &arc[1], lattice);
+    }
+  }
+  else {
+    const hmm_arc_t *last_arc = &matrix->arcs[matrix->first_arc[prev_hyp->state_hmm + 2]];
+    for (const hmm_arc_t *arc = &matrix->arcs[matrix->first_arc[prev_hyp->state_hmm + 1]]; arc < last_arc; arc++) {
+      //If state is not a final state then this is a hmm transition
+      if (!arc->is_exit) {
+        expand_hmm_transition(search, feat_vec, prev_hyp, arc);
+      }
+      //Else it must be either a lexic transition or language model transition
+      else {
+        expand_phoneme_end(search, feat_vec, prev_hyp, arc, lattice);
+      }
+    }//Matrix transitions
+  }
+}
+
+/** Starts a new generation of stamps
+ * @param stamps the stamps
+ * @param generation the current generation, which is updated
+ * @param n number of stamps
+ */
+static void next_generation(unsigned *stamps, unsigned *generation, int n) {
+  (*generation)++;
+  if (*generation == 0) {
+    memset(stamps, 0, n * sizeof(unsigned));
+    *generation = 1;
+  }
+}
+
+/** Adds a state to the states whose emissions are missing in the range of a search thread
+ * @param search the copy of the search of the thread
+ * @param state the state
+ */
+static void collect_state(const search_t *search, int state) {
+  search_worker_t *worker = search->worker;
+  if (search_has_emission(search, state) || worker->state_stamps[state] == worker->state_generation) return;
+  worker->state_stamps[state] = worker->state_generation;
+  worker->states[worker->n_states++] = state;
+}
+
+/** Adds the states entered from the initial state of a phoneme to the missing emissions
+ * @param search the copy of the search of the thread
+ * @param phoneme the phoneme
+ */
+static void collect_phoneme_start(const search_t *search, int phoneme) {
+  const phoneme_t *ph = search->decoder->hmm->phonemes[phoneme];
+  for (int a = ph->matrix->first_arc[0]; a < ph->matrix->first_arc[1]; a++) {
+    const hmm_arc_t *arc = &ph->matrix->arcs[a];
+    if (arc->target > 0 && !arc->is_exit) collect_state(search, ph->states[arc->target - 1]->id);
+  }
+}
+
+/** Adds the states whose emissions are needed to expand a hypothesis to the missing emissions.
+ * It follows the transitions of expand_hyp(), so that it asks for the same emissions
+ * @param search the copy of the search of the thread
+ * @param prev_hyp the hypothesis of the previous frame
+ */
+static void collect_hyp_emissions(search_t *search, const hyp_t *prev_hyp) {
   const decoder_t* decoder = search->decoder;
-  const lex_t* lex = decoder->lex;
-  const hmm_t* hmm = decoder->hmm;
+  const phoneme_t *ph = decoder->hmm->phonemes[prev_hyp->phoneme];
+  const matrix_transitions_t *matrix = ph->matrix;
+  const hmm_arc_t *last_arc = &matrix->arcs[matrix->first_arc[prev_hyp->state_hmm + 2]];
+  for (const hmm_arc_t *arc = &matrix->arcs[matrix->first_arc[prev_hyp->state_hmm + 1]]; arc < last_arc; arc++) {
+    if (!arc->is_exit) {
+      collect_state(search, ph->states[arc->target - 1]->id);
+    }
+    else if (prev_hyp->word_ptr == NULL) {
+      const lex_tree_t *tree = decoder->lex_tree;
+      const lex_tree_node_t *node = &tree->nodes[prev_hyp->state_lexic];
+      const float *lookahead = get_lm_lookahead(search, prev_hyp->state);
+      for (int n = node->first_arc; n < node->first_arc + node->num_arcs; n++) {
+        if (lookahead != NULL && is_logzero(lookahead[tree->arcs[n].destination])) continue;
+        collect_phoneme_start(search, tree->arcs[n].phoneme);
+      }
+    }
+    else if (decoder->lex->models[prev_hyp->word]->end != prev_hyp->state_lexic) {
+      const state_lex_t *state_lex = decoder->lex->models[prev_hyp->word]->states[prev_hyp->state_lexic];
+      for (int o = 0; o < state_lex->num_edges; o++) {
+        collect_phoneme_start(search, state_lex->edges[o]->phoneme);
+      }
+    }
+  }
+}
 
-  start_frame(search, feat_vec, lattice);
+/// Argument of the tasks of the search threads
+typedef struct {
+  search_t *search;      ///< the search
+  const float *feat_vec; ///< feature vector of the current frame
+} frame_task_t;
+
+/** Makes the copy of the search used by a search thread
+ * @param search the search
+ * @param worker the state of the thread
+ * @return the copy, which uses the private heap and look-ahead scores of the thread
+ */
+static search_t worker_search(const search_t *search, search_worker_t *worker) {
+  search_t copy = *search;
+  copy.heap = worker->heap;
+  copy.lm_lookahead = worker->lm_lookahead;
+  copy.worker = worker;
+  return copy;
+}
+
+/** Task that collects the missing emissions of the range of hypotheses of a thread
+ * @param arg the frame_task_t
+ * @param thread the thread
+ */
+static void collect_emissions_task(void *arg, int thread) {
+  const frame_task_t *task = (const frame_task_t *) arg;
+  search_threads_t *threads = task->search->threads;
+  search_worker_t *worker = &threads->workers[thread];
+  search_t search = worker_search(task->search, worker);
+
+  worker->n_states = 0;
+  next_generation(worker->state_stamps, &worker->state_generation, search.decoder->hmm->num_states);
+  for (int h = worker->first_hyp; h < worker->last_hyp; h++) {
+    collect_hyp_emissions(&search, &threads->hyps[h]);
+  }
+}
+
+/** Task that computes a range of the missing emissions
+ * @param arg the frame_task_t
+ * @param thread the thread
+ */
+static void compute_emissions_task(void *arg, int thread) {
+  const frame_task_t *task = (const frame_task_t *) arg;
+  search_threads_t *threads = task->search->threads;
+  const int num_threads = thread_pool_num_threads(threads->pool);
+  const int first = (int) ((long) threads->n_states * thread / num_threads);
+  const int last = (int) ((long) threads->n_states * (thread + 1) / num_threads);
+  for (int i = first; i < last; i++) {
+    threads->emissions[i] = compute_emission(task->search, task->feat_vec, threads->states[i]);
+  }
+}
+
+/** Task that expands the range of hypotheses of a thread into its private heap
+ * @param arg the frame_task_t
+ * @param thread the thread
+ */
+static void expand_hyps_task(void *arg, int thread) {
+  const frame_task_t *task = (const frame_task_t *) arg;
+  search_threads_t *threads = task->search->threads;
+  search_worker_t *worker = &threads->workers[thread];
+  search_t search = worker_search(task->search, worker);
+
+  worker->n_events = 0;
+  hh_clear(worker->heap);
+  hh_set_beam(worker->heap, hh_beam(task->search->heap));
+  for (int h = worker->first_hyp; h < worker->last_hyp; h++) {
+    expand_hyp(&search, task->feat_vec, &threads->hyps[h], NULL);
+  }
+}
 
+/** expands the hypotheses of the previous frame with several threads. The result is the same
+ * as with a single thread: each thread expands a consecutive range of the hypotheses in the
+ * order of a single thread and records what it would insert in the heap and the lattice,
+ * then the search inserts the records of the threads one after the other
+ * @param search a search status
+ * @param feat_vec feature vector
+ * @param lattice output lattice
+ */
+static void expand_hyps_in_threads(search_t *search, const float *feat_vec, lattice_t *lattice) {
+  search_threads_t *threads = search->threads;
+  const int num_threads = thread_pool_num_threads(threads->pool);
+  frame_task_t task = { search, feat_vec };
+
+  if (hh_size(search->prev_heap) > threads->hyps_capacity) {
+    threads->hyps_capacity = hh_size(search->prev_heap);
+    threads->hyps = (hyp_t *) realloc(threads->hyps, threads->hyps_capacity * sizeof(hyp_t));
+    MEMTEST(threads->hyps);
+    search->n_allocations++;
+  }
+  threads->n_hyps = 0;
   while (!hh_is_empty(search->prev_heap)) {
     hyp_t *prev_hyp = hh_pop(search->prev_heap);
 
@@ -1002,47 +1671,76 @@ void viterbi_frm(search_t *search, const float *feat_vec, lattice_t *lattice) {
     if (hh_limit(search->prev_heap) > prev_hyp->probability.final)
       continue;
 
-    //Matrix transitions
-    const matrix_transitions_t *matrix = hmm->phonemes[prev_hyp->phoneme]->matrix;
-    for (int transition = 0; transition < matrix->num_transitions; transition++) {
-      //If the transition has a probability greater than 0
-      if (!is_logzero(matrix->matrix_transitions[prev_hyp->state_hmm+1][transition])) {
+    threads->hyps[threads->n_hyps++] = *prev_hyp;
+  }
+  for (int t = 0; t < num_threads; t++) {
+    threads->workers[t].first_hyp = (int) ((long) threads->n_hyps * t / num_threads);
+    threads->workers[t].last_hyp = (int) ((long) threads->n_hyps * (t + 1) / num_threads);
+  }
 
-        //If state is not a final state then this is a hmm transition
-        if (transition != matrix->num_transitions - 1) {
-          expand_hmm_transition(search, feat_vec, prev_hyp, transition);
-        }
-        //Else it must be either a lexic transition or language model transition
-        else {
-          //add transition probability from current hmm state to hmm final hmm state
-          prev_hyp->probability.acoustic += matrix->matrix_transitions[prev_hyp->state_hmm + 1][transition];
-          prev_hyp->probability.final    += matrix->matrix_transitions[prev_hyp->state_hmm + 1][transition];
-
-          //If lex state is not the final state, then this is a lex transition
-          if (lex->models[prev_hyp->word]->end != prev_hyp->state_lexic) {
-            expand_lex_transition(search, feat_vec, prev_hyp);
-          }//Lexic transition
-
-          //Else this is language model transition
-          else {
-            // keep number of elements for statistics
-            int prev_num_elements = lattice->num_elements;
-
-            // language model transition
-            lattice_insert(lattice, prev_hyp);
-
-            if (ENABLE_STATISTICS >= SV_SHOW_FRAME) {
-              if (prev_num_elements != lattice->num_elements)
-                search->stats[search->n_frames - 1]->num_table_words++;
-              search->stats[search->n_frames - 1]->n_word_hyps++;
-            }
-          }
+  // the threads compute the missing emissions but only this one stores them,
+  // so that the maximum emission of the frame is the same as with a single thread
+  thread_pool_run(threads->pool, collect_emissions_task, &task);
+  threads->n_states = 0;
+  next_generation(threads->state_stamps, &threads->state_generation, search->decoder->hmm->num_states);
+  for (int t = 0; t < num_threads; t++) {
+    const search_worker_t *worker = &threads->workers[t];
+    for (int i = 0; i < worker->n_states; i++) {
+      const int state = worker->states[i];
+      if (threads->state_stamps[state] == threads->state_generation) continue;
+      threads->state_stamps[state] = threads->state_generation;
+      threads->states[threads->n_states++] = state;
+    }
+  }
+  if (threads->n_states > 0) thread_pool_run(threads->pool, compute_emissions_task, &task);
+  for (int i = 0; i < threads->n_states; i++) {
+    search_set_emission(search, threads->states[i], threads->emissions[i]);
+  }
 
-        }//Lexic transition
+  thread_pool_run(threads->pool, expand_hyps_task, &task);
 
-      }//If
-    }//Matrix transitions
+  for (int t = 0; t < num_threads; t++) {
+    search_worker_t *worker = &threads->workers[t];
+    for (int e = 0; e < worker->n_events; e++) {
+      search_event_t *event = &worker->events[e];
+      if (event->is_word_end) {
+        insert_word_end(search, &event->hyp, lattice);
+      }
+      else {
+        hh_insert(search->heap, &event->hyp);
+      }
+    }
+    search->n_allocations += worker->n_allocations;
+    worker->n_allocations = 0;
+  }
+}
 
+/** analizes feature vector t and expands it to the next hypothesis heap
+ * @param search a search status
+ * @param feat_vec feature vector
+ * @param t current frame
+ * @param lattice output lattice
+ * The hypotheses of the previous frame are expanded with several threads when the search has
+ * them, except with statistics. The expansion of the words in the lattice uses a single thread,
+ * since its early pruning depends on the hypotheses that the previous words have inserted
+ */
+void viterbi_frm(search_t *search, const float *feat_vec, lattice_t *lattice) {
+  start_frame(search, feat_vec, lattice);
+
+  if (search->threads != NULL && !ENABLE_STATISTICS
+      && hh_size(search->prev_heap) >= MIN_HYPS_PER_THREAD * thread_pool_num_threads(search->threads->pool)) {
+    expand_hyps_in_threads(search, feat_vec, lattice);
+  }
+  else {
+    while (!hh_is_empty(search->prev_heap)) {
+      hyp_t *prev_hyp = hh_pop(search->prev_heap);
+
+      // ignore hyps that do not pass the threshold
+      if (hh_limit(search->prev_heap) > prev_hyp->probability.final)
+        continue;
+
+      expand_hyp(search, feat_vec, prev_hyp, lattice);
+    }
   }
 
   expand_words_from_lattice(search, feat_vec, lattice);
@@ -1052,6 +1750,22 @@ void viterbi_frm(search_t *search, const float *feat_vec, lattice_t *lattice) {
 
 
 
+/** Returns the number of entries of the look-ahead caches of a search and its threads.
+ * Each new entry is an allocation
+ * @param search the search
+ * @return the number of entries
+ */
+static int lookahead_entries(const search_t *search) {
+  int n_entries = (search->lm_lookahead != NULL) ? search->lm_lookahead->num_entries : 0;
+  if (search->threads != NULL) {
+    for (int t = 0; t < thread_pool_num_threads(search->threads->pool); t++) {
+      const lex_tree_lookahead_t *lookahead = search->threads->workers[t].lm_lookahead;
+      if (lookahead != NULL) n_entries += lookahead->num_entries;
+    }
+  }
+  return n_entries;
+}
+
 /// Obtains a lattice resulting from a decoding of list of feature vectors
 /**
 @param search Search status
@@ -1060,6 +1774,11 @@ void viterbi_frm(search_t *search, const float *feat_vec, lattice_t *lattice) {
 @param lattice Output lattice
 */
 void decode(search_t *search, const features_t *features, lattice_t *lattice) {
+  search->n_samples++;
+  lattice->n_samples++;
+  search->n_allocations = 0;
+  const int lattice_allocations = lattice->n_allocations;
+  const int lookahead_allocations = lookahead_entries(search);
 
   if (ENABLE_STATISTICS >= SV_SHOW_SAMPLE) {
     fprintf(stderr, "start sample stats:\n");
@@ -1070,6 +1789,22 @@ void decode(search_t *search, const features_t *features, lattice_t *lattice) {
     CHECK_SYS_ERROR(search->decoder->hmm->num_states == features->n_features, "Mismatch in number of features\n");
   }
 
+  // with emission threads, a shared emission cache gets an entry per frame before the threads start.
+  // Otherwise the threads keep the emissions of the frames ahead of the search
+  if (search->emission_pipeline != NULL && features->type != FT_EMISSION_PROBABILITIES) {
+    int first_new_frame = 0;
+    if (search->emission_cache != NULL) {
+      first_new_frame = search->emission_cache->n_elems;
+      for (int f = first_new_frame; f < features->n_vectors; f++) {
+        float *t_probability = (float *) malloc(search->decoder->hmm->num_states * sizeof(float));
+        MEMTEST(t_probability);
+        for (int s = 0; s < search->decoder->hmm->num_states; s++) t_probability[s] = LOG_ZERO;
+        vector_append(search->emission_cache, t_probability);
+      }
+    }
+    emission_pipeline_start(search->emission_pipeline, features, search->emission_cache, first_new_frame);
+  }
+
   //fprintf(stderr, "frame %d:\n", search->n_frames);
   initial_stage(search, features->vector[search->n_frames], lattice);
   //hh_print(stderr, search->heap, search->decoder->grammar);
@@ -1082,6 +1817,18 @@ void decode(search_t *search, const features_t *features, lattice_t *lattice) {
 
   end_stage(search, lattice);
 
+  // once the search and the lattice have decoded a sample, their memory is reused by the next
+  // ones, which only allocate when they are longer. An emission cache is allocated for every sample
+  search->n_allocations += lookahead_entries(search) - lookahead_allocations;
+  const int n_allocations = search->n_allocations + lattice->n_allocations - lattice_allocations;
+  if (search->n_samples > 1 && lattice->n_samples > 1 && search->emission_cache == NULL && n_allocations > 0) {
+    TRACE(1, "Sample %d allocated memory %d times during the search\n", search->n_samples, n_allocations);
+  }
+
+  if (search->emission_pipeline != NULL) {
+    emission_pipeline_stop(search->emission_pipeline);
+  }
+
   if (ENABLE_STATISTICS >= SV_SHOW_SAMPLE) {
     fprintf(stderr, "summary of sample stats:\n");
     print_sample_stats(stderr, search->stats, search->n_frames);
@@ -50,10 +50,7 @@ void arg_max(float *vector, int num_elems, float *max_value, int *arg) {
 }
 
 float log_normalize(float *vector, int num_elems) {
-  float norm = LOG_ZERO;
-  for (int c = 0; c < num_elems; c++) {
-    norm = add_log(norm, vector[c]);
-  }
+  float norm = log_add_reduce(vector, num_elems, LA_EXACT);
   for (int c = 0; c < num_elems; c++) {
     vector[c] -= norm;
     vector[c] = exp(vector[c]);
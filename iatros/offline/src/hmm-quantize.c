@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <float.h>
+#include <getopt.h>
+
+#include <config.h>
+#include <iatros/hmm.h>
+#include <iatros/quantized_hmm.h>
+#include <prhlt/trace.h>
+#include <prhlt/gzip.h>
+#include <prhlt/constants.h>
+#include <prhlt/utils.h>
+
+/// emissions further than this from the best one are not taken into account to measure the error
+#define ERROR_BEAM 30.0
+
+void help(int UNUSED(argc), char *argv[]){
+  printf("Usage: %s\n", argv[0]);
+  printf("This software quantizes the gaussians of HMM models and saves them in binary format\n"
+         "-h\t This help\n"
+         "-g <file>\t HMM models in HTK format\n"
+         "-t <type>\t Quantization type: INT16 or INT8 (default INT8)\n"
+         "-o <file>\t Output quantized gaussians\n"
+         "-n <int> \t Number of frames drawn from the model to measure the error (default 100)\n"
+         );
+}
+
+int main (int argc, char *argv[]) {
+  char *hmm_fn = NULL, *output_fn = NULL, *type_str = "INT8";
+  int n_frames = 100;
+  int option;
+
+  while ((option=getopt(argc,argv,"g:t:o:n:h"))!=-1){
+    switch (option){
+    case 'g':
+      hmm_fn = optarg;
+      break;
+    case 't':
+      type_str = optarg;
+      break;
+    case 'o':
+      output_fn = optarg;
+      break;
+    case 'n':
+      n_frames = atoi(optarg);
+      break;
+    case 'h':
+      help(argc, argv);
+      exit(0);
+      break;
+    default:
+      help(argc, argv);
+      exit(1);
+      break;
+    }
+  }
+
+  INIT_TRACE(0);
+
+  REQUIRE(hmm_fn != NULL && output_fn != NULL, "HMM models and output file needed\n");
+  quantization_t type = get_quantization_type(type_str);
+  REQUIRE(type == QT_INT16 || type == QT_INT8, "Unknown quantization type '%s'\n", type_str);
+
+  hmm_t *hmm = hmm_create();
+  FILE *file = smart_fopen(hmm_fn, "r");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open hmm file '%s'\n", hmm_fn);
+  hmm_load(hmm, file);
+  smart_fclose(file);
+  const packed_hmm_t *packed = hmm->packed;
+
+  quantized_hmm_t *qhmm = quantized_hmm_create(packed, type);
+  file = smart_fopen(output_fn, "w");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open output file '%s'\n", output_fn);
+  quantized_hmm_save(qhmm, file);
+  smart_fclose(file);
+
+  const size_t float_size = (size_t) packed->num_gaussians * (2 * packed->stride + 3) * sizeof(float);
+  printf("gaussians: %d, features: %d\n", packed->num_gaussians, packed->num_features);
+  printf("size: %zu bytes (float %zu bytes, %.2f times smaller)\n", quantized_hmm_size(qhmm),
+         float_size, (double) float_size / quantized_hmm_size(qhmm));
+
+  // error of the emissions near the best one on frames drawn from the model
+  float *frame = (float *) malloc(packed->num_features * sizeof(float));
+  MEMTEST(frame);
+  int16_t *qframe = (int16_t *) malloc(qhmm->stride * sizeof(int16_t));
+  MEMTEST(qframe);
+  float *exact = (float *) malloc(packed->num_states * sizeof(float));
+  MEMTEST(exact);
+  float *quantized = (float *) malloc(packed->num_states * sizeof(float));
+  MEMTEST(quantized);
+  double sum_error = 0, max_error = 0;
+  long n_errors = 0;
+  int best_changes = 0;
+  srand(1234);
+  for (int t = 0; t < n_frames; t++) {
+    hmm_sample_frame(hmm, frame);
+    quantized_hmm_quantize_features(qhmm, frame, qframe);
+    int best = 0, best_quantized = 0;
+    for (int s = 0; s < packed->num_states; s++) {
+      exact[s] = hmm_log_emission(hmm, s, frame);
+      quantized[s] = quantized_hmm_log_emission(qhmm, hmm->log_add, s, qframe);
+      if (exact[s] > exact[best]) best = s;
+      if (quantized[s] > quantized[best_quantized]) best_quantized = s;
+    }
+    if (best != best_quantized) best_changes++;
+    for (int s = 0; s < packed->num_states; s++) {
+      if (exact[s] < exact[best] - ERROR_BEAM) continue;
+      const double error = fabs(quantized[s] - exact[s]);
+      sum_error += error;
+      if (error > max_error) max_error = error;
+      n_errors++;
+    }
+  }
+  if (n_frames > 0) {
+    printf("emission error within %g of the best: mean %f, max %f\n", ERROR_BEAM,
+           n_errors > 0 ? sum_error / n_errors : 0.0, max_error);
+    printf("frames whose best state changed: %d of %d\n", best_changes, n_frames);
+  }
+
+  free(frame);
+  free(qframe);
+  free(exact);
+  free(quantized);
+  quantized_hmm_delete(qhmm);
+  hmm_delete(hmm);
+  return 0;
+}
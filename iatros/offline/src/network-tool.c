@@ -0,0 +1,170 @@
+/*
+ * network-tool.c
+ *
+ *  Compiles the search network of a finite-state grammar and decodes with it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include <iatros/version.h>
+#include <iatros/search_network.h>
+#include <prhlt/trace.h>
+#include <prhlt/gzip.h>
+#include <prhlt/utils.h>
+#include <prhlt/constants.h>
+
+
+static const arg_module_t network_tool_module = {NULL, "General options",
+    {
+      {"output", ARG_FILE, NULL, 0, "Compiles the search network of the decoder into this file"},
+      {"network", ARG_FILE, NULL, 0, "Decodes the samples with this search network. Only the hmm, log-add and beam options of the decoder are used"},
+      {"samples", ARG_FILE, NULL, 0, "List of files to process"},
+      {"print-score", ARG_BOOL, "false", 0, "Print hypothesis score"},
+      {"print-time", ARG_BOOL, "false", 0, "Print decoding time"},
+      {"verbosity", ARG_INT, "0", 0, "Set verbosity level"},
+      {"print-default", ARG_BOOL, "false", 0, "Print default config file"},
+      {NULL, ARG_END_MODULE, NULL, 0, NULL}
+    }
+};
+
+static const arg_shortcut_t shortcuts[] = {
+    {"c", "config"},
+    {"v", "verbosity"},
+    {"o", "output"},
+    {"n", "network"},
+    {"p", "print-score"},
+    {"t", "print-time"},
+    {"d", "print-default"},
+    {"b", "decoder.beam"},
+    {NULL, NULL}
+};
+
+/** Compiles the search network of the decoder given in the arguments and saves it
+ * @param args the arguments
+ * @param output_fn the output file
+ */
+static void compile_network(const args_t *args, const char *output_fn) {
+  decoder_t *decoder = decoder_create_from_args(args);
+  search_network_t *network = search_network_create(decoder);
+
+  FILE *file = smart_fopen(output_fn, "w");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open output file '%s'\n", output_fn);
+  search_network_save(network, file);
+  smart_fclose(file);
+
+  printf("nodes: %d, arcs: %d, words: %d, labels: %d\n", network->num_nodes, network->num_arcs,
+         network->num_words, network->num_labels);
+
+  search_network_delete(network);
+  decoder_delete(decoder);
+}
+
+/** Decodes the samples given in the arguments with a search network
+ * @param args the arguments
+ * @param network_fn the file of the network
+ */
+static void decode_samples(const args_t *args, const char *network_fn) {
+  arg_error_t error = ARG_OK;
+
+  hmm_t *hmm = hmm_create();
+  const char *hmm_fn = args_get_string(args, DECODER_MODULE_NAME".hmm", &error);
+  REQUIRE(error == ARG_OK && hmm_fn != NULL, "The HMM models are missing");
+  FILE *file = smart_fopen(hmm_fn, "r");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open hmm file '%s'\n", hmm_fn);
+  hmm_load(hmm, file);
+  smart_fclose(file);
+
+  const char *log_add_str = args_get_string(args, DECODER_MODULE_NAME".log-add", &error);
+  log_add_t log_add = get_log_add_type(log_add_str);
+  REQUIRE(error == ARG_OK && log_add != MAX_LOG_ADD_TYPE, "Unknown log-add type '%s'", log_add_str);
+  hmm_set_log_add(hmm, log_add);
+
+  file = smart_fopen(network_fn, "r");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open search network file '%s'\n", network_fn);
+  search_network_t *network = search_network_load(file, hmm);
+  smart_fclose(file);
+
+  const float beam = args_get_float(args, DECODER_MODULE_NAME".beam", &error);
+  search_network_decoder_t *decoder = search_network_decoder_create(network, hmm, beam);
+
+  const char *samples_fn = args_get_string(args, "samples", &error);
+  REQUIRE(samples_fn != NULL, "Missing samples");
+  FILE *samples_file = smart_fopen(samples_fn, "r");
+  CHECK_SYS_ERROR(samples_file != NULL, "Couldn't open file of feature vectors '%s'\n", samples_fn);
+
+  const bool print_score = args_get_bool(args, "print-score", NULL);
+  const bool print_time = args_get_bool(args, "print-time", NULL);
+  char line[MAX_LINE];
+  while (fgets(line, MAX_LINE, samples_file) != NULL) {
+    strip(line);
+    if (strlen(line) == 0) continue;
+
+    TRACE(0, "Feature file: '%s'\n", line);
+    features_t *feas = features_create_from_file(line);
+
+    clock_t start = clock();
+    int *labels = NULL, num_labels = 0;
+    float score = search_network_decode(decoder, feas, &labels, &num_labels);
+    double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    if (labels != NULL) {
+      if (print_score) printf("%g ", score);
+      for (int i = 0; i < num_labels; i++) printf("%s%s", (i > 0) ? " " : "", network->labels[labels[i]]);
+      printf("\n");
+      free(labels);
+    }
+    else {
+      printf("Sentence not recognized\n");
+    }
+    if (print_time) fprintf(stderr, "time: %g seconds, %d frames\n", elapsed, feas->n_vectors);
+    fflush(stdout);
+    features_delete(feas);
+  }
+  smart_fclose(samples_file);
+
+  search_network_decoder_delete(decoder);
+  search_network_delete(network);
+  hmm_delete(hmm);
+}
+
+int main(int argc, char *argv[]) {
+  arg_error_t error = ARG_OK;
+
+  args_t *args = args_create();
+  args_set_summary(args, "Compiles the acoustic models, the lexicon and a finite-state grammar "
+                         "into a search network and decodes with it");
+  args_set_doc(args, "For more info see http://prhlt.iti.es");
+  args_set_version(args, IATROS_OFFLINE_PROJECT_STRING"\n"IATROS_OFFLINE_BUILD_INFO"\n\n"
+                         IATROS_PROJECT_STRING"\n"IATROS_BUILD_INFO);
+  args_set_bug_report(args, "Report bugs to "IATROS_OFFLINE_PROJECT_BUGREPORT".");
+  args_add_module(args, &network_tool_module);
+  args_add_module(args, &decoder_module);
+  args_add_shortcuts(args, shortcuts);
+  args_parse_command_line(args, argc, argv);
+
+  if (args_get_bool(args, "print-default", &error)) {
+    args_write_default_config_file(args, stdout);
+    args_delete(args);
+    return EXIT_SUCCESS;
+  }
+
+  INIT_TRACE(args_get_int(args, "verbosity", &error));
+
+  const char *output_fn = args_get_string(args, "output", &error);
+  const char *network_fn = args_get_string(args, "network", &error);
+  REQUIRE((output_fn != NULL) != (network_fn != NULL), "Either an output file or a search network is needed\n");
+
+  if (output_fn != NULL) {
+    compile_network(args, output_fn);
+  }
+  else {
+    decode_samples(args, network_fn);
+  }
+
+  args_delete(args);
+  return EXIT_SUCCESS;
+}
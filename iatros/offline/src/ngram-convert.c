@@ -0,0 +1,135 @@
+/*
+ * ngram-convert.c
+ *
+ *  Converts an n-gram in ARPA format to the binary format that the decoder
+ *  loads without parsing it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <config.h>
+#include <iatros/grammar.h>
+#include <prhlt/constants.h>
+#include <prhlt/trace.h>
+#include <prhlt/gzip.h>
+#include <prhlt/utils.h>
+
+void help(int UNUSED(argc), char *argv[]){
+  printf("Usage: %s\n", argv[0]);
+  printf("This software converts an n-gram in ARPA format to binary format.\n"
+         "Load it with the grammar type BINARY_NGRAM and the same start and end words\n"
+         "-h\t This help\n"
+         "-g <file>\t N-gram in ARPA format\n"
+         "-o <file>\t Output binary n-gram\n"
+         "-s <word>\t Start word. None by default\n"
+         "-e <word>\t End word. None by default\n"
+         "-b <bits>\t Bits of the probabilities and backoff weights in the file: 8 or 16 to quantize them, 32 to keep them.\n"
+         "\t\t They are loaded back as floats, so this only changes the size of the file. 32 by default\n"
+         );
+}
+
+int main (int argc, char *argv[]) {
+  char *ngram_fn = NULL, *output_fn = NULL, *start = NULL, *end = NULL;
+  int option, bits = 32;
+
+  while ((option=getopt(argc,argv,"g:o:s:e:b:h"))!=-1){
+    switch (option){
+    case 'g':
+      ngram_fn = optarg;
+      break;
+    case 'o':
+      output_fn = optarg;
+      break;
+    case 's':
+      start = optarg;
+      break;
+    case 'e':
+      end = optarg;
+      break;
+    case 'b':
+      bits = atoi(optarg);
+      break;
+    case 'h':
+      help(argc, argv);
+      exit(0);
+      break;
+    default:
+      help(argc, argv);
+      exit(1);
+      break;
+    }
+  }
+
+  INIT_TRACE(0);
+
+  REQUIRE(ngram_fn != NULL && output_fn != NULL, "N-gram and output file needed\n");
+
+  // the vocabulary is built as the decoder builds it for n-grams
+  vocab_t *input_vocab = vocab_create(541, NULL);
+  extended_vocab_t *vocab = extended_vocab_create(input_vocab, NULL, NULL, NULL);
+  grammar_t *grammar = grammar_create(NULL, vocab);
+  if (start != NULL) grammar->start = extended_vocab_insert_symbol(vocab, start, CATEGORY_NONE);
+  if (end != NULL) grammar->end = extended_vocab_insert_symbol(vocab, end, CATEGORY_NONE);
+
+  FILE *file = smart_fopen(ngram_fn, "r");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open n-gram file '%s'\n", ngram_fn);
+  grammar_load(grammar, file, NGRAM_GRAMMAR);
+  smart_fclose(file);
+
+  file = smart_fopen(output_fn, "w");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open output file '%s'\n", output_fn);
+  grammar_write_binary_ngram(grammar, file, bits);
+  long size = ftell(file);
+  smart_fclose(file);
+
+  int num_words = 0;
+  for (int i = 0; i < grammar->num_states; i++) num_words += grammar->vector[i]->num_words;
+  printf("order: %d, states: %d, words: %d, vocabulary: %d\n", grammar->n, grammar->num_states,
+         num_words, vocab->extended->last);
+  if (size > 0 && num_words > 0) {
+    printf("size: %ld bytes, %.2f bytes per word\n", size, (double) size / num_words);
+  }
+
+  // the memory and the error of the quantization, which is what changes the search, are measured on the loaded n-gram
+  grammar_t *binary = grammar_create(NULL, vocab);
+  binary->start = grammar->start;
+  binary->end = grammar->end;
+  file = smart_fopen(output_fn, "r");
+  CHECK_SYS_ERROR(file != NULL, "Couldn't open output file '%s'\n", output_fn);
+  grammar_load(binary, file, BINARY_NGRAM_GRAMMAR);
+  smart_fclose(file);
+  if (num_words > 0) {
+    printf("resident after loading: %zu bytes, %.2f bytes per word\n", grammar_size(binary), (double) grammar_size(binary) / num_words);
+  }
+
+  if (bits < 32) {
+    double prob_error = 0, max_prob_error = 0, bo_error = 0, max_bo_error = 0;
+    int num_bos = 0;
+    for (int i = 0; i < grammar->num_states; i++) {
+      const state_grammar_t *state = grammar->vector[i], *loaded = binary->vector[i];
+      for (int w = 0; w < state->num_words; w++) {
+        if (is_logzero(state->words[w].prob)) continue;
+        const double error = fabs(state->words[w].prob - loaded->words[w].prob);
+        prob_error += error;
+        if (error > max_prob_error) max_prob_error = error;
+      }
+      if (!is_logzero(state->bo)) {
+        const double error = fabs(state->bo - loaded->bo);
+        bo_error += error;
+        if (error > max_bo_error) max_bo_error = error;
+        num_bos++;
+      }
+    }
+    printf("probability error: mean %g, max %g\n", prob_error / num_words, max_prob_error);
+    if (num_bos > 0) printf("backoff error: mean %g, max %g\n", bo_error / num_bos, max_bo_error);
+  }
+  grammar_delete(binary);
+
+  grammar_delete(grammar);
+  extended_vocab_delete(vocab);
+  return 0;
+}
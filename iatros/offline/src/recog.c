@@ -263,6 +263,11 @@ int main(int argc, char *argv[]) {
   }
   fflush(stdout);
 
+  // the search and the lattice are reused by all the samples, so that they do not
+  // allocate memory once they have decoded the longest sample
+  search_t *search = search_create(decoder);
+  lattice_t *lattice = lattice_create_from_args(args, decoder);
+
   //for each and every sample
   char line[MAX_LINE];
   int line_number = 1;
@@ -280,8 +285,8 @@ int main(int argc, char *argv[]) {
           || (feas->type == FT_EMISSION_PROBABILITIES && decoder->hmm->num_states == feas->n_features),
           "Invalid number of features in file '%s'\n", line);
 
-      search_t *search = search_create(decoder);
-      lattice_t *lattice = lattice_create_from_args(args, decoder);
+      search_clear(search);
+      lattice_clear(lattice);
 
       // if there are references, perform a cat decoding
       if (ref_type != REF_NONE && refs_f != NULL) {
@@ -394,6 +399,8 @@ int main(int argc, char *argv[]) {
           }
         }
         free(ref);
+        // go back to a search without emission cache for the next sample
+        if (search->emission_cache != NULL) search_delete_emission_cache(search);
       }
       // if there are no references, perform a normal decoding
       else {
@@ -410,13 +417,14 @@ int main(int argc, char *argv[]) {
         outputs(line, args, lattice);
       }
       fflush(stdout);
-      lattice_delete(lattice);
-      search_delete(search);
       features_delete(feas);
     }
     line_number++;
   }//while
 
+  lattice_delete(lattice);
+  search_delete(search);
+
   decoder_delete(decoder);
   args_delete(args);
 
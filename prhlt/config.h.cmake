@@ -15,6 +15,7 @@
 #cmakedefine HAVE_STRTOK_R
 #cmakedefine HAVE_STRCASECMP
 #cmakedefine HAVE_FILENO
+#cmakedefine HAVE_MALLOC_TRIM
 #cmakedefine HAVE_BACKTRACE
 #cmakedefine HAVE_ADDR2LINE
 